@@ -0,0 +1,1021 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Grid/Grid.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+#ifndef AMR_HIERARCHY_HPP
+#define AMR_HIERARCHY_HPP
+
+// density, energy and one momentum component per dimension
+#define AMR_N_CONSERVED (2 + MAX_DIMENSION)
+// noise filter of the refinement criterion, see get_refinement_criterion
+#define AMR_FILTER 0.01
+
+// One leaf of the block tree: a Grid of block_size^dimension cells of level
+// `level`, where the box is N_cells_1D * 2^level cells across.
+struct AmrBlock
+{
+    uint8_t level;
+    // block coordinates at its level, the first cell is at position * block_size
+    std::array<uint32_t, MAX_DIMENSION> position;
+    std::unique_ptr<Grid> grid;
+    std::unique_ptr<SimdUpdate> update;
+    // the prev arrays before the last step, so finer neighbors can interpolate in time
+    std::vector<real> old;
+    // +1 to refine, -1 to merge with its siblings at the next regrid
+    int8_t flag;
+    // per face, 2 * d for the lower one along d and 2 * d + 1 for the upper
+    // one: the level of the leaf across it relative to this one, -1, 0 or +1
+    std::array<int8_t, 2 * MAX_DIMENSION> face_neighbor;
+    // Flux registers of the faces on a level boundary, AMR_N_CONSERVED fluxes
+    // for each of the block_size^(dimension - 1) cells on the face: next to a
+    // coarser leaf the sum over both substeps, next to a finer one the flux of
+    // the last step. See reflux.
+    std::array<std::vector<real>, 2 * MAX_DIMENSION> flux_register;
+};
+
+// Block-structured adaptive mesh refinement over the periodic box. The box is
+// covered by leaf blocks of equal cell count; refining a block replaces it by
+// 2^dimension blocks of half the cell size, merging them restores the parent.
+// Neighboring leaves (across faces, edges and corners) differ by at most one
+// level, so every ghost cell is a copy of a cell on the same level, a cell of
+// the coarser neighbor or the average of 2^dimension cells of the finer one.
+//
+// Level l steps with dt / 2^l (dx halves too, so dt_dx is the same on every
+// level): each step of level l is followed by two steps of level l + 1, whose
+// ghosts from level l are interpolated between its state before and after its
+// step. Refinement is driven by the curvature of density and velocity;
+// prolongation (minmod-limited linear) and restriction (averaging) act on the
+// conserved density, momentum and energy, so both keep their totals. The
+// update is in flux form, and at a face between levels the coarse cell is
+// refluxed after the two substeps of its finer neighbor (Berger and Colella):
+// its own flux through the face is replaced by the average of the fine ones
+// kept in the flux registers, so the hierarchy conserves as a uniform grid does.
+class AmrHierarchy
+{
+private:
+    uint8_t dimension;
+    // cells across the box on level 0
+    uint32_t N_cells_1D;
+    uint32_t block_size;
+    uint8_t max_level;
+    double refine_threshold;
+    double derefine_threshold;
+    InitialConditions initial_conditions;
+    double gamma;
+    uint8_t isa;
+    // pages of the block fields and face buffers, one of HUGE_PAGES_*; blocks
+    // below a huge page keep the base pages, see NumaArena::allocate
+    uint8_t huge_pages;
+
+    // every leaf by level and position, see get_key
+    std::map<uint64_t, std::unique_ptr<AmrBlock>> leaves;
+    // the leaves of every level up to the finest one present
+    std::vector<std::vector<AmrBlock *>> levels;
+
+    // level 0 copy of the whole box for the snapshots
+    std::unique_ptr<FieldStore> composite;
+    SnapshotWriter snapshot_writer;
+    uint32_t dump_type = DUMP_TYPE;
+
+    static uint64_t get_key(const uint8_t level, const std::array<uint32_t, MAX_DIMENSION> &position) {
+        return ((uint64_t)level << 60) | ((uint64_t)position[2] << 40) | ((uint64_t)position[1] << 20) | (uint64_t)position[0];
+    }
+
+    uint32_t get_N_blocks_1D(const uint8_t level) const {
+        return (N_cells_1D / block_size) << level;
+    }
+
+    AmrBlock *find(const uint8_t level, const std::array<uint32_t, MAX_DIMENSION> &position) const {
+        const auto leaf = leaves.find(get_key(level, position));
+        return (leaf == leaves.end()) ? nullptr : leaf->second.get();
+    }
+
+    std::unique_ptr<AmrBlock> make_block(const uint8_t level, const std::array<uint32_t, MAX_DIMENSION> &position) const {
+        auto block = std::make_unique<AmrBlock>();
+        block->level = level;
+        block->position = position;
+        block->flag = 0;
+
+        std::array<uint32_t, MAX_DIMENSION> extent = {1, 1, 1};
+        std::array<uint32_t, MAX_DIMENSION> offset = {0, 0, 0};
+        for (uint8_t d = 0; d < dimension; d++) {
+            extent[d] = block_size;
+            offset[d] = position[d] * block_size;
+        }
+        block->grid = std::make_unique<Grid>(dimension, N_cells_1D << level, extent, offset, initial_conditions, gamma, N_GHOST, 0,
+                                             nullptr, huge_pages);
+        block->update = std::make_unique<SimdUpdate>(block->grid->get_fields(), isa, gamma, huge_pages);
+        const FieldStore &fields = block->grid->get_fields();
+        block->old.assign(fields.get_prev(0), fields.get_prev(0) + fields.get_N_fields() * FieldStore::get_N_padded(fields.get_stencil()));
+        return block;
+    }
+
+    // the values at storage index s as density, energy and momentum
+    void get_conserved(const FieldStore &fields, const uint64_t s, real *conserved) const {
+        conserved[0] = fields.get_prev_density()[s];
+        conserved[1] = fields.get_prev_energy()[s];
+        for (uint8_t d = 0; d < dimension; d++) {
+            conserved[2 + d] = fields.get_prev_density()[s] * fields.get_prev_velocity(d)[s];
+        }
+    }
+
+    // the inverse of get_conserved into both the prev and next arrays, with the pressure from the equation of state
+    void set_conserved(FieldStore &fields, const uint64_t s, const real *conserved) const {
+        real specific_kinetic_energy = 0.;
+        for (uint8_t d = 0; d < dimension; d++) {
+            const real velocity = conserved[2 + d] / conserved[0];
+            fields.get_prev_velocity(d)[s] = velocity;
+            fields.get_next_velocity(d)[s] = velocity;
+            specific_kinetic_energy += 0.5 * velocity * velocity;
+        }
+        const real pressure = (gamma - 1.0) * (conserved[1] - conserved[0] * specific_kinetic_energy);
+        fields.get_prev_density()[s] = conserved[0];
+        fields.get_next_density()[s] = conserved[0];
+        fields.get_prev_energy()[s] = conserved[1];
+        fields.get_next_energy()[s] = conserved[1];
+        fields.get_prev_pressure()[s] = pressure;
+        fields.get_next_pressure()[s] = pressure;
+    }
+
+    // storage index of the cell with global coordinates cell (on the level of block) inside block
+    static uint64_t get_storage_index(const AmrBlock &block, const std::array<uint64_t, MAX_DIMENSION> &cell) {
+        const Stencil &stencil = block.grid->get_stencil();
+        uint64_t s = 0;
+        for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+            s += (cell[d] - stencil.get_offset(d) + stencil.get_N_ghost()) * stencil.get_stride(d);
+        }
+        return s;
+    }
+
+    // All fields of the cell with global coordinates cell on level, from the leaf
+    // that holds it. Coarser leaves are interpolated in time: fraction 0 is their
+    // state before their last step and 1 the current one.
+    void sample(const uint8_t level, const std::array<uint64_t, MAX_DIMENSION> &cell, const real fraction, real *values) const {
+        std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+        for (uint8_t d = 0; d < dimension; d++) {
+            position[d] = (uint32_t)(cell[d] / block_size);
+        }
+        const AmrBlock *block = find(level, position);
+        if (block != nullptr) {
+            const FieldStore &fields = block->grid->get_fields();
+            const uint64_t s = get_storage_index(*block, cell);
+            for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+                values[f] = fields.get_prev(f)[s];
+            }
+            return;
+        }
+
+        if (level > 0) {
+            std::array<uint64_t, MAX_DIMENSION> coarse_cell = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                coarse_cell[d] = cell[d] / 2;
+                position[d] = (uint32_t)(coarse_cell[d] / block_size);
+            }
+            block = find(level - 1, position);
+            if (block != nullptr) {
+                const FieldStore &fields = block->grid->get_fields();
+                const uint64_t s = get_storage_index(*block, coarse_cell);
+                const uint64_t N_padded = FieldStore::get_N_padded(fields.get_stencil());
+                for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+                    values[f] = (1. - fraction) * block->old[f * N_padded + s] + fraction * fields.get_prev(f)[s];
+                }
+                return;
+            }
+        }
+
+        // the 2^dimension cells of the finer leaf, all in the same block as block_size is even
+        for (uint8_t d = 0; d < dimension; d++) {
+            position[d] = (uint32_t)(2 * cell[d] / block_size);
+        }
+        block = find(level + 1, position);
+        if (block == nullptr) {
+            throw std::logic_error("No leaf next to a cell, the block tree is not balanced.");
+        }
+        real conserved[AMR_N_CONSERVED] = {};
+        const uint32_t N_children = 1u << dimension;
+        for (uint32_t child = 0; child < N_children; child++) {
+            std::array<uint64_t, MAX_DIMENSION> fine_cell = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                fine_cell[d] = 2 * cell[d] + ((child >> d) & 1);
+            }
+            real child_conserved[AMR_N_CONSERVED];
+            get_conserved(block->grid->get_fields(), get_storage_index(*block, fine_cell), child_conserved);
+            for (uint8_t c = 0; c < 2 + dimension; c++) {
+                conserved[c] += child_conserved[c] / (real)N_children;
+            }
+        }
+        real specific_kinetic_energy = 0.;
+        values[FIELD_DENSITY] = conserved[0];
+        values[FIELD_ENERGY] = conserved[1];
+        for (uint8_t d = 0; d < dimension; d++) {
+            values[FIELD_VELOCITY + d] = conserved[2 + d] / conserved[0];
+            specific_kinetic_energy += 0.5 * values[FIELD_VELOCITY + d] * values[FIELD_VELOCITY + d];
+        }
+        values[FIELD_PRESSURE] = (gamma - 1.0) * (conserved[1] - conserved[0] * specific_kinetic_energy);
+    }
+
+    // the cells on a face of the blocks, see AmrBlock::face_neighbor
+    uint64_t get_N_face_cells() const {
+        uint64_t N_face_cells = 1;
+        for (uint8_t d = 1; d < dimension; d++) {
+            N_face_cells *= block_size;
+        }
+        return N_face_cells;
+    }
+
+    // index in a flux register along d of the cell with global coordinates
+    // cell inside block
+    uint64_t get_face_cell_index(const AmrBlock &block, const uint8_t d, const std::array<uint64_t, MAX_DIMENSION> &cell) const {
+        const Stencil &stencil = block.grid->get_stencil();
+        uint64_t j = 0;
+        uint64_t scale = 1;
+        for (uint8_t t = 0; t < dimension; t++) {
+            if (t != d) {
+                j += (cell[t] - stencil.get_offset(t)) * scale;
+                scale *= block_size;
+            }
+        }
+        return j;
+    }
+
+    // call face_cell(j, cell) for the interior cells of block on face, j as in
+    // get_face_cell_index and cell their global coordinates
+    template <typename Function>
+    void for_each_face_cell(const AmrBlock &block, const uint8_t face, Function face_cell) const {
+        const Stencil &stencil = block.grid->get_stencil();
+        const uint8_t d = face / 2;
+        for (uint64_t j = 0; j < get_N_face_cells(); j++) {
+            std::array<uint64_t, MAX_DIMENSION> cell = {0, 0, 0};
+            uint64_t scaled_j = j;
+            for (uint8_t t = 0; t < dimension; t++) {
+                uint64_t local = (face % 2) ? block_size - 1 : 0;
+                if (t != d) {
+                    local = scaled_j % block_size;
+                    scaled_j /= block_size;
+                }
+                cell[t] = stencil.get_offset(t) + local;
+            }
+            face_cell(j, cell);
+        }
+    }
+
+    // The fluxes of the last update of block through its faces on a level
+    // boundary into their registers. The flux slots of FusedUpdate are in the
+    // order of get_conserved.
+    void record_fluxes(AmrBlock &block) const {
+        const Stencil &stencil = block.grid->get_stencil();
+        for (uint8_t face = 0; face < 2 * dimension; face++) {
+            if (block.face_neighbor[face] == 0) {
+                continue;
+            }
+            const uint8_t d = face / 2;
+            // the flux through the upper face of a cell is stored at the cell above
+            const uint64_t shift = (face % 2) ? stencil.get_stride(d) : 0;
+            const bool sum = block.face_neighbor[face] < 0;
+            real *fluxes = block.flux_register[face].data();
+            for_each_face_cell(block, face, [&](const uint64_t j, const std::array<uint64_t, MAX_DIMENSION> &cell) {
+                const uint64_t s = get_storage_index(block, cell) + shift;
+                for (uint8_t k = 0; k < 2 + dimension; k++) {
+                    const real flux = block.update->get_face_flux(d, k)[s];
+                    fluxes[j * AMR_N_CONSERVED + k] = sum ? fluxes[j * AMR_N_CONSERVED + k] + flux : flux;
+                }
+            });
+        }
+    }
+
+    // After the two substeps of the finer leaves next to block, correct its
+    // cells on their faces: each was updated with its own flux through the
+    // face, which is replaced by the average of the 2^(dimension - 1) fine
+    // fluxes across it over both substeps (dt and dx halve, dt_dx is the same).
+    void reflux(AmrBlock &block, const real dt_dx) const {
+        FieldStore &fields = block.grid->get_fields();
+        const compute_real dt_over_dx = 2. * dt_dx;
+        const uint64_t N_cells_fine = (uint64_t)N_cells_1D << (block.level + 1);
+        const uint32_t N_fine_faces = 1u << (dimension - 1);
+        for (uint8_t face = 0; face < 2 * dimension; face++) {
+            if (block.face_neighbor[face] <= 0) {
+                continue;
+            }
+            const uint8_t d = face / 2;
+            const bool upper = face % 2;
+            const real *coarse_fluxes = block.flux_register[face].data();
+            for_each_face_cell(block, face, [&](const uint64_t j, const std::array<uint64_t, MAX_DIMENSION> &cell) {
+                real fine_flux[AMR_N_CONSERVED] = {};
+                for (uint32_t sub = 0; sub < N_fine_faces; sub++) {
+                    std::array<uint64_t, MAX_DIMENSION> fine_cell = {0, 0, 0};
+                    std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+                    uint8_t bit = 0;
+                    for (uint8_t t = 0; t < dimension; t++) {
+                        if (t == d) {
+                            fine_cell[t] = (2 * cell[t] + (upper ? 2 : N_cells_fine - 1)) % N_cells_fine;
+                        } else {
+                            fine_cell[t] = 2 * cell[t] + ((sub >> bit++) & 1);
+                        }
+                        position[t] = (uint32_t)(fine_cell[t] / block_size);
+                    }
+                    const AmrBlock &fine = *find(block.level + 1, position);
+                    const real *fine_fluxes = fine.flux_register[2 * d + !upper].data();
+                    const uint64_t fine_j = get_face_cell_index(fine, d, fine_cell);
+                    for (uint8_t k = 0; k < 2 + dimension; k++) {
+                        fine_flux[k] += fine_fluxes[fine_j * AMR_N_CONSERVED + k];
+                    }
+                }
+
+                // an upper face flux leaves the cell, a lower one enters it
+                const uint64_t s = get_storage_index(block, cell);
+                real conserved[AMR_N_CONSERVED];
+                get_conserved(fields, s, conserved);
+                for (uint8_t k = 0; k < 2 + dimension; k++) {
+                    const compute_real correction = dt_over_dx * ((compute_real)coarse_fluxes[j * AMR_N_CONSERVED + k]
+                                                                  - fine_flux[k] / (compute_real)(2 * N_fine_faces));
+                    conserved[k] += upper ? correction : -correction;
+                }
+                set_conserved(fields, s, conserved);
+            });
+        }
+    }
+
+    // the ghost layer of block from its neighbors, periodic around the box
+    void fill_ghosts(AmrBlock &block, const real fraction) const {
+        FieldStore &fields = block.grid->get_fields();
+        const Stencil &stencil = fields.get_stencil();
+        const uint64_t N_cells_level = (uint64_t)N_cells_1D << block.level;
+
+        for (uint64_t s = 0; s < stencil.get_N_storage(); s++) {
+            bool ghost = false;
+            std::array<uint64_t, MAX_DIMENSION> cell = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                const box_int coordinate = stencil.get_coordinate(s, d);
+                ghost = ghost || coordinate < 0 || coordinate >= (box_int)stencil.get_extent(d);
+                cell[d] = (uint64_t)(((int64_t)stencil.get_offset(d) + coordinate + (int64_t)N_cells_level) % (int64_t)N_cells_level);
+            }
+            if (!ghost) {
+                continue;
+            }
+
+            real values[MAX_N_FIELDS];
+            sample(block.level, cell, fraction, values);
+            for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+                fields.get_prev(f)[s] = values[f];
+            }
+        }
+    }
+
+    // Largest Loehner error estimate of the density and velocity components: the
+    // second difference over the sum of the first differences, which is close to
+    // 1 at kinks and discontinuities and small where the flow is smooth, at any
+    // resolution. The AMR_FILTER term keeps small wiggles from counting; for the
+    // velocities it includes the sound speed, as they may be zero up to roundoff.
+    real get_refinement_criterion(const AmrBlock &block) const {
+        const FieldStore &fields = block.grid->get_fields();
+        const Stencil &stencil = fields.get_stencil();
+        const real *rho = fields.get_prev_density();
+        const real *P = fields.get_prev_pressure();
+
+        auto estimate = [](const real below, const real centre, const real above, const real scale) {
+            const real second = fabs(above - 2. * centre + below);
+            const real first = fabs(above - centre) + fabs(centre - below) +
+                               AMR_FILTER * (fabs(above) + 2. * fabs(centre) + fabs(below) + scale);
+            return (first > 0.) ? second / first : 0.;
+        };
+
+        real criterion = 0.;
+        for (uint64_t row = 0; row < stencil.get_N_rows(); row++) {
+            const uint64_t start = stencil.row_start(row);
+            for (uint64_t s = start; s < start + stencil.get_extent(0); s++) {
+                const real sound_speed = sqrt(gamma * P[s] / rho[s]);
+                for (uint8_t d = 0; d < dimension; d++) {
+                    const uint64_t stride = stencil.get_stride(d);
+                    criterion = fmax(criterion, estimate(rho[s - stride], rho[s], rho[s + stride], 0.));
+                    for (uint8_t component = 0; component < dimension; component++) {
+                        const real *u = fields.get_prev_velocity(component);
+                        criterion = fmax(criterion, estimate(u[s - stride], u[s], u[s + stride], 4. * sound_speed));
+                    }
+                }
+            }
+        }
+        return criterion;
+    }
+
+    // the leaf that covers block position on level, or nullptr if that region is refined further
+    AmrBlock *find_covering(const uint8_t level, const std::array<uint32_t, MAX_DIMENSION> &position) const {
+        std::array<uint32_t, MAX_DIMENSION> ancestor = position;
+        for (int l = level; l >= 0; l--) {
+            AmrBlock *block = find((uint8_t)l, ancestor);
+            if (block != nullptr) {
+                return block;
+            }
+            for (uint8_t d = 0; d < dimension; d++) {
+                ancestor[d] /= 2;
+            }
+        }
+        return nullptr;
+    }
+
+    // call neighbor(position) for the 3^dimension - 1 blocks around position on level
+    template <typename Function>
+    void for_each_neighbor(const uint8_t level, const std::array<uint32_t, MAX_DIMENSION> &position, Function neighbor) const {
+        const uint32_t N_blocks = get_N_blocks_1D(level);
+        uint32_t N_neighbors = 1;
+        for (uint8_t d = 0; d < dimension; d++) {
+            N_neighbors *= 3;
+        }
+        for (uint32_t n = 0; n < N_neighbors; n++) {
+            std::array<uint32_t, MAX_DIMENSION> neighbor_position = position;
+            uint32_t scaled_n = n;
+            bool self = true;
+            for (uint8_t d = 0; d < dimension; d++) {
+                const uint32_t shift = scaled_n % 3;
+                scaled_n /= 3;
+                self = self && shift == 1;
+                neighbor_position[d] = (position[d] + N_blocks + shift - 1) % N_blocks;
+            }
+            if (!self) {
+                neighbor(neighbor_position);
+            }
+        }
+    }
+
+    // Replace block by its 2^dimension children. With initial, the children
+    // keep their own initial conditions; otherwise they are prolonged from
+    // block, whose ghosts must be up to date.
+    void refine(AmrBlock &block, const bool initial) {
+        const uint8_t level = block.level + 1;
+        const uint32_t N_children = 1u << dimension;
+        std::vector<std::unique_ptr<AmrBlock>> children;
+        for (uint32_t child = 0; child < N_children; child++) {
+            std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                position[d] = 2 * block.position[d] + ((child >> d) & 1);
+            }
+            children.push_back(make_block(level, position));
+        }
+
+        if (!initial) {
+            const FieldStore &fields = block.grid->get_fields();
+            const Stencil &stencil = fields.get_stencil();
+            for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+                const uint64_t s = stencil.interior_to_storage(i);
+                real conserved[AMR_N_CONSERVED];
+                real slope[MAX_DIMENSION][AMR_N_CONSERVED];
+                get_conserved(fields, s, conserved);
+                for (uint8_t d = 0; d < dimension; d++) {
+                    real above[AMR_N_CONSERVED];
+                    real below[AMR_N_CONSERVED];
+                    get_conserved(fields, s + stencil.get_stride(d), above);
+                    get_conserved(fields, s - stencil.get_stride(d), below);
+                    for (uint8_t c = 0; c < 2 + dimension; c++) {
+                        const real up = above[c] - conserved[c];
+                        const real down = conserved[c] - below[c];
+                        slope[d][c] = (up * down <= 0.) ? 0. : ((fabs(up) < fabs(down)) ? up : down);
+                    }
+                }
+
+                // the fine cells at -1/4 and +1/4 of a coarse cell along each dimension
+                std::vector<std::array<real, AMR_N_CONSERVED>> fine(N_children);
+                bool positive = true;
+                for (uint32_t sub = 0; sub < N_children; sub++) {
+                    for (uint8_t c = 0; c < 2 + dimension; c++) {
+                        fine[sub][c] = conserved[c];
+                        for (uint8_t d = 0; d < dimension; d++) {
+                            fine[sub][c] += (((sub >> d) & 1) ? 0.25 : -0.25) * slope[d][c];
+                        }
+                    }
+                    real kinetic_energy = 0.;
+                    for (uint8_t d = 0; d < dimension; d++) {
+                        kinetic_energy += 0.5 * fine[sub][2 + d] * fine[sub][2 + d] / fine[sub][0];
+                    }
+                    positive = positive && fine[sub][0] > 0. && fine[sub][1] - kinetic_energy > 0.;
+                }
+
+                for (uint32_t sub = 0; sub < N_children; sub++) {
+                    std::array<uint64_t, MAX_DIMENSION> fine_cell = {0, 0, 0};
+                    uint32_t child = 0;
+                    for (uint8_t d = 0; d < dimension; d++) {
+                        fine_cell[d] = 2 * (uint64_t)stencil.get_global_coordinate(s, d) + ((sub >> d) & 1);
+                        child |= (uint32_t)((fine_cell[d] / block_size) % 2) << d;
+                    }
+                    AmrBlock &child_block = *children[child];
+                    // fall back to a plain copy where the slopes would make a negative density or pressure
+                    set_conserved(child_block.grid->get_fields(), get_storage_index(child_block, fine_cell),
+                                  positive ? fine[sub].data() : conserved);
+                }
+            }
+            for (auto &child : children) {
+                const FieldStore &child_fields = child->grid->get_fields();
+                std::memcpy(child->old.data(), child_fields.get_prev(0), child->old.size() * sizeof(real));
+            }
+        }
+
+        leaves.erase(get_key(block.level, block.position));
+        for (auto &child : children) {
+            const uint64_t key = get_key(child->level, child->position);
+            leaves[key] = std::move(child);
+        }
+    }
+
+    // Merge the 2^dimension leaves of parent_position on parent_level into one
+    // block holding the average of each group of 2^dimension cells.
+    void derefine(const uint8_t parent_level, const std::array<uint32_t, MAX_DIMENSION> &parent_position) {
+        auto parent = make_block(parent_level, parent_position);
+        FieldStore &fields = parent->grid->get_fields();
+        const Stencil &stencil = fields.get_stencil();
+        const uint32_t N_children = 1u << dimension;
+
+        for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+            const uint64_t s = stencil.interior_to_storage(i);
+            real conserved[AMR_N_CONSERVED] = {};
+            for (uint32_t sub = 0; sub < N_children; sub++) {
+                std::array<uint64_t, MAX_DIMENSION> fine_cell = {0, 0, 0};
+                std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+                for (uint8_t d = 0; d < dimension; d++) {
+                    fine_cell[d] = 2 * (uint64_t)stencil.get_global_coordinate(s, d) + ((sub >> d) & 1);
+                    position[d] = (uint32_t)(fine_cell[d] / block_size);
+                }
+                const AmrBlock &child = *find(parent_level + 1, position);
+                real child_conserved[AMR_N_CONSERVED];
+                get_conserved(child.grid->get_fields(), get_storage_index(child, fine_cell), child_conserved);
+                for (uint8_t c = 0; c < 2 + dimension; c++) {
+                    conserved[c] += child_conserved[c] / (real)N_children;
+                }
+            }
+            set_conserved(fields, s, conserved);
+        }
+        std::memcpy(parent->old.data(), fields.get_prev(0), parent->old.size() * sizeof(real));
+
+        for (uint32_t child = 0; child < N_children; child++) {
+            std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                position[d] = 2 * parent_position[d] + ((child >> d) & 1);
+            }
+            leaves.erase(get_key(parent_level + 1, position));
+        }
+        leaves[get_key(parent_level, parent_position)] = std::move(parent);
+    }
+
+    // true if merging the children of parent_position keeps every neighbor within one level
+    bool can_derefine(const uint8_t parent_level, const std::array<uint32_t, MAX_DIMENSION> &parent_position) const {
+        const uint32_t N_children = 1u << dimension;
+        for (uint32_t child = 0; child < N_children; child++) {
+            std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                position[d] = 2 * parent_position[d] + ((child >> d) & 1);
+            }
+            const AmrBlock *block = find(parent_level + 1, position);
+            if (block == nullptr || block->flag >= 0) {
+                return false;
+            }
+        }
+
+        bool balanced = true;
+        for_each_neighbor(parent_level, parent_position, [&](const std::array<uint32_t, MAX_DIMENSION> &neighbor) {
+            if (find_covering(parent_level, neighbor) != nullptr) {
+                return;
+            }
+            // the neighbor is refined, but no deeper than parent_level + 1
+            for (uint32_t child = 0; child < N_children; child++) {
+                std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+                for (uint8_t d = 0; d < dimension; d++) {
+                    position[d] = 2 * neighbor[d] + ((child >> d) & 1);
+                }
+                balanced = balanced && find(parent_level + 1, position) != nullptr;
+            }
+        });
+        return balanced;
+    }
+
+    // Flag the neighbors that would end up two levels coarser than a block
+    // flagged for refinement, until no more are needed.
+    void balance_refinement_flags() {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto &leaf : leaves) {
+                const AmrBlock &block = *leaf.second;
+                if (block.flag <= 0) {
+                    continue;
+                }
+                for_each_neighbor(block.level, block.position, [&](const std::array<uint32_t, MAX_DIMENSION> &neighbor) {
+                    AmrBlock *covering = find_covering(block.level, neighbor);
+                    if (covering != nullptr && covering->level < block.level && covering->flag <= 0) {
+                        covering->flag = 1;
+                        changed = true;
+                    }
+                });
+            }
+        }
+    }
+
+    void refine_flagged(const bool initial) {
+        balance_refinement_flags();
+        std::vector<AmrBlock *> flagged;
+        for (auto &leaf : leaves) {
+            if (leaf.second->flag > 0) {
+                flagged.push_back(leaf.second.get());
+            }
+        }
+        if (!initial) {
+            // prolongation reads the ghosts, fill them all before the tree changes
+            for (AmrBlock *block : flagged) {
+                fill_ghosts(*block, 1.);
+            }
+        }
+        for (AmrBlock *block : flagged) {
+            refine(*block, initial);
+        }
+    }
+
+    void update_levels() {
+        levels.clear();
+        for (auto &leaf : leaves) {
+            AmrBlock *block = leaf.second.get();
+            block->flag = 0;
+            if (block->level >= levels.size()) {
+                levels.resize(block->level + 1);
+            }
+            levels[block->level].push_back(block);
+
+            const uint32_t N_blocks = get_N_blocks_1D(block->level);
+            for (uint8_t face = 0; face < 2 * dimension; face++) {
+                std::array<uint32_t, MAX_DIMENSION> neighbor = block->position;
+                neighbor[face / 2] = (neighbor[face / 2] + ((face % 2) ? 1 : N_blocks - 1)) % N_blocks;
+                if (find(block->level, neighbor) != nullptr) {
+                    block->face_neighbor[face] = 0;
+                } else {
+                    block->face_neighbor[face] = (find_covering(block->level, neighbor) != nullptr) ? -1 : 1;
+                }
+                block->flux_register[face].assign((block->face_neighbor[face] == 0) ? 0 : get_N_face_cells() * AMR_N_CONSERVED, 0.);
+            }
+        }
+    }
+
+    void fill_level_ghosts(SweepEngine &engine, const uint8_t level, const real fraction) {
+        engine.parallel_for(levels[level].size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t b = begin; b < end; b++) {
+                fill_ghosts(*levels[level][b], fraction);
+            }
+        });
+    }
+
+    // one step of level, followed by two steps of every finer level; fraction as in sample
+    void advance_level(SweepEngine &engine, const uint8_t level, const real fraction, const real dt_dx) {
+        fill_level_ghosts(engine, level, fraction);
+        engine.parallel_for(levels[level].size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t b = begin; b < end; b++) {
+                AmrBlock &block = *levels[level][b];
+                FieldStore &fields = block.grid->get_fields();
+                block.update->update(dt_dx);
+                record_fluxes(block);
+                std::memcpy(block.old.data(), fields.get_prev(0), block.old.size() * sizeof(real));
+                fields.evolve();
+            }
+        });
+
+        if (level + 1 < (int)levels.size()) {
+            for (AmrBlock *fine : levels[level + 1]) {
+                for (uint8_t face = 0; face < 2 * dimension; face++) {
+                    if (fine->face_neighbor[face] < 0) {
+                        std::fill(fine->flux_register[face].begin(), fine->flux_register[face].end(), 0.);
+                    }
+                }
+            }
+            advance_level(engine, level + 1, 0., dt_dx);
+            advance_level(engine, level + 1, 0.5, dt_dx);
+            engine.parallel_for(levels[level].size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+                for (uint64_t b = begin; b < end; b++) {
+                    reflux(*levels[level][b], dt_dx);
+                }
+            });
+        }
+    }
+
+public:
+    AmrHierarchy(const uint8_t input_dimension, const uint32_t input_N_cells_1D, const uint32_t input_block_size,
+                 const uint8_t input_max_level, const double input_refine_threshold, const double input_derefine_threshold,
+                 const InitialConditions &input_initial_conditions, const double input_gamma, const uint8_t input_isa,
+                 const uint8_t input_huge_pages = HUGE_PAGES)
+    {
+        dimension = input_dimension;
+        N_cells_1D = input_N_cells_1D;
+        block_size = input_block_size;
+        max_level = input_max_level;
+        refine_threshold = input_refine_threshold;
+        derefine_threshold = input_derefine_threshold;
+        initial_conditions = input_initial_conditions;
+        gamma = input_gamma;
+        isa = input_isa;
+        huge_pages = input_huge_pages;
+
+        if (block_size < 2 || block_size % 2 != 0 || N_cells_1D % block_size != 0) {
+            throw std::invalid_argument("The AMR block size must be even and divide N_cells_1D.");
+        }
+        // 20 bits per block coordinate in get_key
+        if (((uint64_t)get_N_blocks_1D(max_level)) >= (1u << 20)) {
+            throw std::invalid_argument("Too many AMR blocks across the box.");
+        }
+
+        const uint32_t N_blocks = get_N_blocks_1D(0);
+        const uint64_t N_root_blocks = (dimension == 1) ? N_blocks : (dimension == 2) ? (uint64_t)N_blocks * N_blocks
+                                                                                     : (uint64_t)N_blocks * N_blocks * N_blocks;
+        for (uint64_t b = 0; b < N_root_blocks; b++) {
+            std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+            uint64_t scaled_b = b;
+            for (uint8_t d = 0; d < dimension; d++) {
+                position[d] = (uint32_t)(scaled_b % N_blocks);
+                scaled_b /= N_blocks;
+            }
+            leaves[get_key(0, position)] = make_block(0, position);
+        }
+
+        // refine where the initial conditions call for it, level by level
+        for (uint8_t level = 0; level < max_level; level++) {
+            update_levels();
+            if (level >= levels.size()) {
+                break;
+            }
+            for (AmrBlock *block : levels[level]) {
+                fill_ghosts(*block, 1.);
+                if (get_refinement_criterion(*block) > refine_threshold) {
+                    block->flag = 1;
+                }
+            }
+            refine_flagged(true);
+        }
+        update_levels();
+
+        std::array<uint32_t, MAX_DIMENSION> extent = {1, 1, 1};
+        for (uint8_t d = 0; d < dimension; d++) {
+            extent[d] = N_cells_1D;
+        }
+        composite = std::make_unique<FieldStore>(Stencil(dimension, extent));
+    }
+
+    // one step of dt on level 0, 2^l steps of dt / 2^l on level l
+    void advance(SweepEngine &engine, const real dt_dx) {
+        advance_level(engine, 0, 1., dt_dx);
+    }
+
+    // refine the leaves whose criterion is above refine_threshold and merge the
+    // sibling leaves that are all below derefine_threshold
+    void regrid(SweepEngine &engine) {
+        for (uint8_t level = 0; level < levels.size(); level++) {
+            fill_level_ghosts(engine, level, 1.);
+        }
+        std::vector<real> criterion(leaves.size());
+        std::vector<AmrBlock *> blocks;
+        for (auto &leaf : leaves) {
+            blocks.push_back(leaf.second.get());
+        }
+        engine.parallel_for(blocks.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t b = begin; b < end; b++) {
+                criterion[b] = get_refinement_criterion(*blocks[b]);
+            }
+        });
+        for (uint64_t b = 0; b < blocks.size(); b++) {
+            if (criterion[b] > refine_threshold && blocks[b]->level < max_level) {
+                blocks[b]->flag = 1;
+            } else if (criterion[b] < derefine_threshold && blocks[b]->level > 0) {
+                blocks[b]->flag = -1;
+            }
+        }
+
+        // merge first, the balance of the refinement below is checked against the merged tree
+        std::vector<std::pair<uint8_t, std::array<uint32_t, MAX_DIMENSION>>> parents;
+        for (AmrBlock *block : blocks) {
+            bool first_child = block->level > 0 && block->flag < 0;
+            std::array<uint32_t, MAX_DIMENSION> parent_position = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                first_child = first_child && block->position[d] % 2 == 0;
+                parent_position[d] = block->position[d] / 2;
+            }
+            if (first_child) {
+                parents.push_back({(uint8_t)(block->level - 1), parent_position});
+            }
+        }
+        for (const auto &parent : parents) {
+            if (can_derefine(parent.first, parent.second)) {
+                derefine(parent.first, parent.second);
+            }
+        }
+        refine_flagged(false);
+        update_levels();
+    }
+
+    // largest |u| + c_s over the leaves, see Grid::get_max_signal_speed
+    real get_max_signal_speed(SweepEngine &engine) const {
+        std::vector<AmrBlock *> blocks;
+        for (auto &leaf : leaves) {
+            blocks.push_back(leaf.second.get());
+        }
+        return engine.parallel_max(blocks.size(), 1, [&](const uint64_t begin, const uint64_t end) {
+            real block_max_signal_speed = 0.;
+            for (uint64_t b = begin; b < end; b++) {
+                const Stencil &stencil = blocks[b]->grid->get_stencil();
+                for (uint64_t row = 0; row < stencil.get_N_rows(); row++) {
+                    block_max_signal_speed = std::max(block_max_signal_speed,
+                        blocks[b]->update->get_max_signal_speed(stencil.row_start(row), stencil.get_extent(0)));
+                }
+            }
+            return block_max_signal_speed;
+        });
+    }
+
+    uint64_t get_N_blocks(const uint8_t level) const {
+        return (level < levels.size()) ? levels[level].size() : 0;
+    }
+
+    uint64_t get_N_cells() const {
+        uint64_t N_cells_block = 1;
+        for (uint8_t d = 0; d < dimension; d++) {
+            N_cells_block *= block_size;
+        }
+        return leaves.size() * N_cells_block;
+    }
+
+    // the leaves of level l are stepped 2^l times by advance
+    uint64_t get_N_cell_updates_per_step() const {
+        uint64_t N_cells_block = 1;
+        for (uint8_t d = 0; d < dimension; d++) {
+            N_cells_block *= block_size;
+        }
+        uint64_t N_cell_updates = 0;
+        for (uint8_t level = 0; level < levels.size(); level++) {
+            N_cell_updates += (levels[level].size() * N_cells_block) << level;
+        }
+        return N_cell_updates;
+    }
+
+    // volume integrals of density, energy and momentum over the box, and of
+    // their magnitudes, which set the size of the rounding
+    void get_conserved_totals(double *totals, double *magnitudes) const {
+        std::fill(totals, totals + AMR_N_CONSERVED, 0.);
+        std::fill(magnitudes, magnitudes + AMR_N_CONSERVED, 0.);
+        for (auto &leaf : leaves) {
+            const AmrBlock &block = *leaf.second;
+            const FieldStore &fields = block.grid->get_fields();
+            const Stencil &stencil = fields.get_stencil();
+            double volume = 1.;
+            for (uint8_t d = 0; d < dimension; d++) {
+                volume /= (double)(N_cells_1D << block.level);
+            }
+            for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+                real conserved[AMR_N_CONSERVED];
+                get_conserved(fields, stencil.interior_to_storage(i), conserved);
+                for (uint8_t c = 0; c < 2 + dimension; c++) {
+                    totals[c] += conserved[c] * volume;
+                    magnitudes[c] += fabs(conserved[c]) * volume;
+                }
+            }
+        }
+    }
+
+    void describe() const {
+        std::cout << "AMR blocks per level:";
+        for (uint8_t level = 0; level < levels.size(); level++) {
+            std::cout << " " << levels[level].size();
+        }
+        std::cout << " (" << get_N_cells() << " cells)\n";
+    }
+
+    // snapshot_N.bin of the whole box on level 0, the finer leaves averaged
+    // down, and the leaves themselves in amr_snapshot_N.bin
+    void save_cells(const uint64_t dump_counter, const real time, const Domain &domain) {
+        const Stencil &stencil = composite->get_stencil();
+        for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+            const uint64_t s = stencil.interior_to_storage(i);
+            std::array<uint64_t, MAX_DIMENSION> cell = {0, 0, 0};
+            std::array<uint32_t, MAX_DIMENSION> position = {0, 0, 0};
+            for (uint8_t d = 0; d < dimension; d++) {
+                cell[d] = (uint64_t)stencil.get_global_coordinate(s, d);
+                position[d] = (uint32_t)(cell[d] / block_size);
+            }
+
+            // average over the cells of the covering leaves, one level at a time
+            const AmrBlock *block = find_covering(0, position);
+            real conserved[AMR_N_CONSERVED] = {};
+            if (block != nullptr) {
+                get_conserved(block->grid->get_fields(), get_storage_index(*block, cell), conserved);
+            } else {
+                uint8_t level = 1;
+                uint64_t N_fine = 2;
+                while (true) {
+                    uint64_t N_fine_cells = 1;
+                    for (uint8_t d = 0; d < dimension; d++) {
+                        N_fine_cells *= N_fine;
+                    }
+                    bool complete = true;
+                    std::fill(conserved, conserved + AMR_N_CONSERVED, 0.);
+                    for (uint64_t f = 0; f < N_fine_cells && complete; f++) {
+                        std::array<uint64_t, MAX_DIMENSION> fine_cell = {0, 0, 0};
+                        uint64_t scaled_f = f;
+                        for (uint8_t d = 0; d < dimension; d++) {
+                            fine_cell[d] = cell[d] * N_fine + scaled_f % N_fine;
+                            scaled_f /= N_fine;
+                            position[d] = (uint32_t)(fine_cell[d] / block_size);
+                        }
+                        const AmrBlock *fine_block = find_covering(level, position);
+                        if (fine_block == nullptr) {
+                            complete = false;
+                            break;
+                        }
+                        // a coarser leaf covers N_fine_cells / 2^(dimension * (level - fine level)) of them with one value
+                        std::array<uint64_t, MAX_DIMENSION> leaf_cell = fine_cell;
+                        for (uint8_t d = 0; d < dimension; d++) {
+                            leaf_cell[d] >>= (level - fine_block->level);
+                        }
+                        real fine_conserved[AMR_N_CONSERVED];
+                        get_conserved(fine_block->grid->get_fields(), get_storage_index(*fine_block, leaf_cell), fine_conserved);
+                        for (uint8_t c = 0; c < 2 + dimension; c++) {
+                            conserved[c] += fine_conserved[c] / (real)N_fine_cells;
+                        }
+                    }
+                    if (complete) {
+                        break;
+                    }
+                    level++;
+                    N_fine *= 2;
+                }
+            }
+            set_conserved(*composite, s, conserved);
+        }
+
+        const std::string file_name = "snapshot_" + std::to_string(dump_counter) + ".bin";
+        snapshot_writer.write(*composite, N_cells_1D, domain, file_name, time, dump_counter, dump_type);
+        save_leaves(dump_counter, time);
+    }
+
+    // amr_snapshot_N.bin of every leaf at its own level, see AmrSnapshotHeader
+    void save_leaves(const uint64_t dump_counter, const real time) const {
+        AmrSnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.snapshot = SnapshotWriter::make_header(*composite, N_cells_1D, time, dump_counter, dump_type);
+        std::memcpy(header.snapshot.magic, AMR_SNAPSHOT_MAGIC, sizeof(header.snapshot.magic));
+        header.block_size = block_size;
+        header.N_levels = (uint32_t)levels.size();
+        header.N_blocks = leaves.size();
+        header.block_table_offset = sizeof(AmrSnapshotHeader);
+        const uint64_t table_end = header.block_table_offset + header.N_blocks * sizeof(AmrSnapshotBlock);
+        header.snapshot.data_offset = ((table_end + SNAPSHOT_DATA_ALIGNMENT - 1) / SNAPSHOT_DATA_ALIGNMENT) * SNAPSHOT_DATA_ALIGNMENT;
+
+        std::vector<AmrSnapshotBlock> table;
+        for (auto &leaf : leaves) {
+            AmrSnapshotBlock entry;
+            std::memset(&entry, 0, sizeof(entry));
+            entry.level = leaf.second->level;
+            for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+                entry.position[d] = leaf.second->position[d];
+            }
+            table.push_back(entry);
+        }
+
+        const std::string file_name = "amr_snapshot_" + std::to_string(dump_counter) + ".bin";
+        const int file = open(file_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (file < 0) {
+            throw std::runtime_error("Could not open snapshot " + file_name + ".");
+        }
+        SnapshotWriter::write_all(file, &header, sizeof(header), 0, file_name);
+        SnapshotWriter::write_all(file, table.data(), table.size() * sizeof(AmrSnapshotBlock), header.block_table_offset, file_name);
+
+        std::vector<real> values(header.get_N_block_cells());
+        std::vector<char> encoded(values.size() * header.snapshot.real_bytes);
+        uint64_t b = 0;
+        for (auto &leaf : leaves) {
+            const FieldStore &fields = leaf.second->grid->get_fields();
+            const Stencil &stencil = fields.get_stencil();
+            for (uint32_t f = 0; f < header.snapshot.N_fields; f++) {
+                for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+                    values[i] = fields.get_prev(f)[stencil.interior_to_storage(i)];
+                }
+                SnapshotValues::encode(values.data(), values.size(), header.snapshot.real_type, encoded.data());
+                SnapshotWriter::write_all(file, encoded.data(), encoded.size(), header.get_field_offset(b, f), file_name);
+            }
+            b++;
+        }
+        close(file);
+    }
+
+    // value type of the snapshots, see Grid::set_dump_type
+    void set_dump_type(const uint32_t input_dump_type) {
+        if (input_dump_type > SNAPSHOT_BFLOAT16) {
+            throw std::invalid_argument("Unknown snapshot dump type.");
+        }
+        dump_type = input_dump_type;
+    }
+};
+
+#endif /* AMR_HIERARCHY_HPP */
@@ -0,0 +1,220 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+#ifndef ASYNC_SNAPSHOT_WRITER_HPP
+#define ASYNC_SNAPSHOT_WRITER_HPP
+
+// Writes snapshots on a background thread so the solver does not wait for the
+// disk. save() copies the prev state of every field into one of N_buffers
+// preallocated blocks and queues it; when all of them are still waiting to be
+// written, save() blocks until the writer frees one, which bounds the memory
+// and throttles the solver to the disk. Every rank writes its own block of the
+// file with pwrite, so the writer thread never calls MPI. The blocks hold real;
+// the writer thread converts them to the dump type of the file.
+class AsyncSnapshotWriter
+{
+private:
+    struct PendingSnapshot
+    {
+        SnapshotHeader header;
+        std::string file_name;
+        real *block;
+    };
+
+    const FieldStore *fields;
+    const Stencil *stencil;
+    const Domain *domain;
+    uint32_t N_cells_1D;
+    uint32_t dump_type;
+
+    std::vector<real *> buffers;
+    std::vector<real *> free_buffers;
+    // a snapshot stays at the front while it is written, so flush() waits for it
+    std::deque<PendingSnapshot> queue;
+    std::mutex mutex;
+    std::condition_variable queue_condition;
+    std::condition_variable buffer_condition;
+    bool stopping;
+    std::exception_ptr error;
+    std::thread writer;
+
+    uint64_t N_stalls;
+    double stall_seconds;
+
+    void write_snapshot(const PendingSnapshot &snapshot) const {
+        const int file = open(snapshot.file_name.c_str(), O_WRONLY);
+        if (file < 0) {
+            throw std::runtime_error("Could not open snapshot " + snapshot.file_name + ".");
+        }
+        if (domain->is_root()) {
+            SnapshotWriter::write_all(file, &snapshot.header, sizeof(snapshot.header), 0, snapshot.file_name);
+        }
+        SnapshotWriter::write_block(file, snapshot.header, *stencil, snapshot.block, snapshot.file_name);
+        close(file);
+    }
+
+    void writer_loop() {
+        while (true) {
+            PendingSnapshot snapshot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queue_condition.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                snapshot = queue.front();
+            }
+
+            try {
+                write_snapshot(snapshot);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.pop_front();
+                free_buffers.push_back(snapshot.block);
+            }
+            buffer_condition.notify_all();
+        }
+    }
+
+    // a failed write is reported on the solver thread at the next save or flush
+    void rethrow_error() {
+        if (error) {
+            std::exception_ptr pending = error;
+            error = nullptr;
+            std::rethrow_exception(pending);
+        }
+    }
+
+public:
+    AsyncSnapshotWriter(const FieldStore &input_fields, const uint32_t input_N_cells_1D, const Domain &input_domain,
+                        const uint32_t N_buffers, const uint32_t input_dump_type = SNAPSHOT_REAL)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), domain(&input_domain),
+          N_cells_1D(input_N_cells_1D), dump_type(input_dump_type), stopping(false), N_stalls(0), stall_seconds(0.)
+    {
+        if (N_buffers == 0) {
+            throw std::invalid_argument("AsyncSnapshotWriter needs at least one buffer.");
+        }
+        if (dump_type > SNAPSHOT_BFLOAT16) {
+            throw std::invalid_argument("Unknown snapshot dump type.");
+        }
+
+        const uint64_t reals_per_line = FIELD_ALIGNMENT / sizeof(real);
+        const uint64_t N_block = fields->get_N_fields() * stencil->get_N_interior();
+        const uint64_t N_allocated = ((N_block + reals_per_line - 1) / reals_per_line) * reals_per_line;
+        for (uint32_t b = 0; b < N_buffers; b++) {
+            real *block = static_cast<real *>(std::aligned_alloc(FIELD_ALIGNMENT, N_allocated * sizeof(real)));
+            if (block == nullptr) {
+                throw std::bad_alloc();
+            }
+            buffers.push_back(block);
+            free_buffers.push_back(block);
+        }
+
+        writer = std::thread(&AsyncSnapshotWriter::writer_loop, this);
+    }
+
+    ~AsyncSnapshotWriter() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            buffer_condition.wait(lock, [&]() { return queue.empty(); });
+            stopping = true;
+        }
+        queue_condition.notify_all();
+        writer.join();
+
+        for (real *block : buffers) {
+            std::free(block);
+        }
+    }
+
+    AsyncSnapshotWriter(const AsyncSnapshotWriter &) = delete;
+    AsyncSnapshotWriter &operator=(const AsyncSnapshotWriter &) = delete;
+
+    // Collective over the ranks: the root creates the file at its full size
+    // before anyone writes into it.
+    void save(const std::string &file_name, const real time, const uint64_t dump_counter) {
+        const SnapshotHeader header = SnapshotWriter::make_header(*fields, N_cells_1D, time, dump_counter, dump_type);
+        if (domain->is_root()) {
+            const int file = open(file_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+            const bool sized = (file >= 0) && ftruncate(file, header.get_field_offset(header.N_fields)) == 0;
+            if (file >= 0) {
+                close(file);
+            }
+            if (!sized) {
+                throw std::runtime_error("Could not create snapshot " + file_name + ".");
+            }
+        }
+        domain->barrier();
+
+        real *block;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            rethrow_error();
+            if (free_buffers.empty()) {
+                N_stalls++;
+                const auto start = std::chrono::steady_clock::now();
+                buffer_condition.wait(lock, [&]() { return !free_buffers.empty(); });
+                stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            block = free_buffers.back();
+            free_buffers.pop_back();
+        }
+
+        const uint64_t N_cells_row = stencil->get_extent(0);
+        for (uint8_t f = 0; f < header.N_fields; f++) {
+            const real *field = fields->get_prev(f);
+            real *values = block + f * stencil->get_N_interior();
+            for (uint64_t row = 0; row < stencil->get_N_rows(); row++) {
+                std::memcpy(values + row * N_cells_row, field + stencil->row_start(row), N_cells_row * sizeof(real));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back({header, file_name, block});
+        }
+        queue_condition.notify_one();
+    }
+
+    // wait until every queued snapshot is on disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        buffer_condition.wait(lock, [&]() { return queue.empty(); });
+        rethrow_error();
+    }
+
+    // number of saves that had to wait for a free buffer, and for how long
+    uint64_t get_N_stalls() const {
+        return N_stalls;
+    }
+
+    double get_stall_seconds() const {
+        return stall_seconds;
+    }
+};
+
+#endif /* ASYNC_SNAPSHOT_WRITER_HPP */
@@ -1,145 +1,134 @@
+#include <iostream>
 #include <vector>
 #include <string>
 #include <memory>
 #include "../main.hpp"
+#include "../FieldStore/FieldStore.hpp"
 
 #ifndef CELL_HPP
 #define CELL_HPP
 
+// Thin view of one cell inside a FieldStore. Holds no data of its own, so it is
+// cheap to copy and meant for debugging and the reference (per-cell) update path.
 class Cell
 {
 private:
-    std::shared_ptr<std::vector<box_int>> prev_coordinates;
-    std::shared_ptr<std::vector<real>> prev_velocity;
-    real prev_density;
-    real prev_energy;
-    real prev_pressure;
-
-    std::shared_ptr<std::vector<box_int>> next_coordinates;
-    std::shared_ptr<std::vector<real>> next_velocity;
-    real next_density;
-    real next_energy;
-    real next_pressure;
+    FieldStore *fields;
+    uint64_t index;
 
 public:
-    Cell(const std::vector<box_int> &init_coordinates, 
-         const std::vector<real> &init_velocity, 
-         const real init_density,
-         const real init_energy,
-         const real init_pressure)
-    {
-        prev_coordinates = std::make_shared<std::vector<box_int>>(init_coordinates);
-        prev_velocity = std::make_shared<std::vector<real>>(init_velocity);
-        prev_density = init_density;
-        prev_energy = init_energy;
-        prev_pressure = init_pressure;
-
-        next_coordinates = std::make_shared<std::vector<box_int>>();
-        next_velocity = std::make_shared<std::vector<real>>();
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            next_coordinates->push_back(init_coordinates[d]);
-            next_velocity->push_back(init_velocity[d]);
-        }
-        next_density = init_density;
-        next_energy = init_energy;
-        next_pressure = init_pressure;
-    };
+    Cell() : fields(nullptr), index(0) {}
+
+    Cell(FieldStore *input_fields, const uint64_t input_index) : fields(input_fields), index(input_index) {}
 
-    // don't bother zero-ing the next values, as they will be reset
-    void evolve() {
-        *prev_coordinates = *next_coordinates;
-        *prev_velocity = *next_velocity;
-        prev_density = next_density;
-        prev_energy = next_energy;
-        prev_pressure = next_pressure;
+    // copy this cell's next values into the previous values, see FieldStore::evolve
+    // for the whole grid
+    void evolve() const {
+        for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+            fields->get_prev(f)[index] = fields->get_next(f)[index];
+        }
     }
 
-    void describe() {
+    void describe() const {
+        const Stencil &stencil = fields->get_stencil();
         std::cout << std::scientific;
         std::cout << "\n";
         std::cout <<"(x_0, x_1, ..., x_N) = (";
-        for (auto &coordinate : *prev_coordinates) {
-            std::cout << (real)coordinate / (real)N_CELLS_1D << ",";
+        for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+            std::cout << (real)get_coordinates(d) / (real)stencil.get_N_cells_1D() << ",";
         }
         std::cout << ")\n";
 
         std::cout << "(v_0, v_1, ..., v_N) = (";
-        for (auto velocity : *prev_velocity) {
-            std::cout << (real)velocity << ",";
+        for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+            std::cout << (real)get_velocity(d) << ",";
         }
         std::cout << ")\n";
-        std::cout << "density = " << prev_density << "\n";
-        std::cout << "energy = " << prev_energy << "\n";
-        std::cout << "pressure = " << prev_pressure << "\n\n";
+        std::cout << "density = " << get_density() << "\n";
+        std::cout << "energy = " << get_energy() << "\n";
+        std::cout << "pressure = " << get_pressure() << "\n\n";
     }
 
-    std::shared_ptr<std::vector<box_int>> get_coordinates() const {
-        return prev_coordinates;
-    }
-
-    void set_coordinates(const std::vector<box_int> &new_coordinates) {
-        next_coordinates = std::make_shared<std::vector<box_int>>(new_coordinates);
+    uint64_t get_index() const {
+        return index;
     }
 
+    // cells never move, so the coordinates follow from the (storage) index
     box_int get_coordinates(const uint8_t dimension) const {
-        return (*prev_coordinates)[dimension];
+        return fields->get_stencil().get_global_coordinate(index, dimension);
     }
 
-    void set_coordinates(const uint8_t dimension, box_int new_coordinate) {
-        (*next_coordinates)[dimension] = new_coordinate;
+    uint8_t get_dimension() const {
+        return fields->get_stencil().get_dimension();
     }
 
-    std::shared_ptr<std::vector<real>> get_velocity() const {
-        return prev_velocity;
+    std::vector<box_int> get_coordinates() const {
+        std::vector<box_int> coordinates(get_dimension());
+        for (uint8_t d = 0; d < get_dimension(); d++) {
+            coordinates[d] = get_coordinates(d);
+        }
+        return coordinates;
     }
 
-    void set_velocity(const std::vector<real> &new_velocity) {
-        next_velocity = std::make_shared<std::vector<real>>(new_velocity);
+    std::vector<real> get_velocity() const {
+        std::vector<real> velocity(get_dimension());
+        for (uint8_t d = 0; d < get_dimension(); d++) {
+            velocity[d] = get_velocity(d);
+        }
+        return velocity;
     }
 
     real get_velocity(const uint8_t dimension) const {
-        return (*prev_velocity)[dimension];
+        return fields->get_prev_velocity(dimension)[index];
     }
 
     real get_next_velocity(const uint8_t dimension) const {
-        return (*next_velocity)[dimension];
+        return fields->get_next_velocity(dimension)[index];
     }
 
-    void set_velocity(const uint8_t dimension, real new_velocity) {
-        (*next_velocity)[dimension] = new_velocity;
+    void set_velocity(const uint8_t dimension, real new_velocity) const {
+        fields->get_next_velocity(dimension)[index] = new_velocity;
     }
 
-    void set_density(const real new_density) {
-        next_density = new_density;
+    void set_density(const real new_density) const {
+        fields->get_next_density()[index] = new_density;
     }
 
     real get_density() const {
-        return prev_density;
+        return fields->get_prev_density()[index];
     }
 
     real get_next_density() const {
-        return next_density;
+        return fields->get_next_density()[index];
     }
-    
+
     real get_energy() const {
-        return prev_energy;
+        return fields->get_prev_energy()[index];
     }
 
     real get_next_energy() const {
-        return next_energy;
+        return fields->get_next_energy()[index];
     }
-    
-    void set_energy(const real new_energy) {
-        next_energy = new_energy;
+
+    void set_energy(const real new_energy) const {
+        fields->get_next_energy()[index] = new_energy;
     }
 
     real get_pressure() const {
-        return prev_pressure;
+        return fields->get_prev_pressure()[index];
+    }
+
+    void set_pressure(const real new_pressure) const {
+        fields->get_next_pressure()[index] = new_pressure;
+    }
+
+    real get_scalar(const uint8_t scalar) const {
+        return fields->get_prev_scalar(scalar)[index];
     }
 
-    void set_pressure(const real new_pressure) {
-        next_pressure = new_pressure;
+    void set_scalar(const uint8_t scalar, const real new_scalar) const {
+        fields->get_next_scalar(scalar)[index] = new_scalar;
     }
 };
 
-#endif /* GRID_HPP*/
+#endif /* CELL_HPP */
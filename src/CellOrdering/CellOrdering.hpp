@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+
+#ifndef CELL_ORDERING_HPP
+#define CELL_ORDERING_HPP
+
+#define ORDERING_ROW_MAJOR 0
+#define ORDERING_TILED 1
+#define ORDERING_MORTON 2
+#define ORDERING_HILBERT 3
+
+// spread the low bits of x so that there are (ways - 1) zero bits between them
+static inline uint64_t morton_spread(const uint64_t x, const uint8_t ways) {
+    uint64_t v = x;
+    if (ways == 2) {
+        v &= 0xffffffffULL;
+        v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+    } else if (ways == 3) {
+        v &= 0x1fffffULL;
+        v = (v | (v << 32)) & 0x001f00000000ffffULL;
+        v = (v | (v << 16)) & 0x001f0000ff0000ffULL;
+        v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+        v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+        v = (v | (v << 2)) & 0x1249249249249249ULL;
+    }
+    return v;
+}
+
+// inverse of morton_spread
+static inline uint64_t morton_compact(const uint64_t x, const uint8_t ways) {
+    uint64_t v = x;
+    if (ways == 2) {
+        v &= 0x5555555555555555ULL;
+        v = (v | (v >> 1)) & 0x3333333333333333ULL;
+        v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+        v = (v | (v >> 4)) & 0x00ff00ff00ff00ffULL;
+        v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+        v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+    } else if (ways == 3) {
+        v &= 0x1249249249249249ULL;
+        v = (v | (v >> 2)) & 0x10c30c30c30c30c3ULL;
+        v = (v | (v >> 4)) & 0x100f00f00f00f00fULL;
+        v = (v | (v >> 8)) & 0x001f0000ff0000ffULL;
+        v = (v | (v >> 16)) & 0x001f00000000ffffULL;
+        v = (v | (v >> 32)) & 0x1fffffULL;
+    }
+    return v;
+}
+
+// Z-order key of a point with up to 3 coordinates: bit b of coordinate d goes
+// to bit b * dimension + d
+static inline uint64_t morton_encode(const uint64_t *coordinates, const uint8_t dimension) {
+    if (dimension == 1) {
+        return coordinates[0];
+    }
+    uint64_t key = 0;
+    for (uint8_t d = 0; d < dimension; d++) {
+        key |= morton_spread(coordinates[d], dimension) << d;
+    }
+    return key;
+}
+
+static inline void morton_decode(const uint64_t key, const uint8_t dimension, uint64_t *coordinates) {
+    if (dimension == 1) {
+        coordinates[0] = key;
+        return;
+    }
+    for (uint8_t d = 0; d < dimension; d++) {
+        coordinates[d] = morton_compact(key >> d, dimension);
+    }
+}
+
+// Key of the point (x, y) along the Hilbert curve over an n x n square, n a
+// power of two: each quadrant is visited in turn, rotated and reflected so the
+// curve runs on without jumps, unlike the Z-curve
+static inline uint64_t hilbert_encode_2d(const uint64_t n, uint64_t x, uint64_t y) {
+    uint64_t key = 0;
+    for (uint64_t s = n / 2; s > 0; s /= 2) {
+        const uint64_t rx = (x & s) ? 1 : 0;
+        const uint64_t ry = (y & s) ? 1 : 0;
+        key += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return key;
+}
+
+// Linear index of the cells of an N_cells_1D^dimension box, row-major (dimension
+// 0 fastest) or along the Morton curve. Morton indices are dense only when
+// N_cells_1D is a power of two; otherwise they still map one to one onto the
+// cells but leave gaps, so an array indexed by them needs get_N_indices slots.
+// There is no Hilbert numbering of the cells: the field arrays stay row-major,
+// and the curve is only used to order the rows, see RowTraversal.
+class CellOrdering
+{
+private:
+    uint8_t type;
+    uint8_t dimension;
+    uint32_t N_cells_1D;
+
+public:
+    CellOrdering(const uint8_t input_type, const uint8_t input_dimension, const uint32_t input_N_cells_1D)
+    {
+        if (input_type != ORDERING_ROW_MAJOR && input_type != ORDERING_MORTON) {
+            throw std::invalid_argument("Cells can only be indexed row-major or along the Morton curve.");
+        }
+        // morton_spread keeps 21 bits per coordinate in 3D
+        if (input_type == ORDERING_MORTON && input_dimension == 3 && input_N_cells_1D > (1u << 21)) {
+            throw std::invalid_argument("Too many cells per dimension for a 64-bit Morton index.");
+        }
+        type = input_type;
+        dimension = input_dimension;
+        N_cells_1D = input_N_cells_1D;
+    }
+
+    uint8_t get_type() const {
+        return type;
+    }
+
+    uint64_t get_N_indices() const {
+        uint64_t N_per_dimension = N_cells_1D;
+        if (type == ORDERING_MORTON) {
+            N_per_dimension = 1;
+            while (N_per_dimension < N_cells_1D) {
+                N_per_dimension *= 2;
+            }
+        }
+        uint64_t N_indices = 1;
+        for (uint8_t d = 0; d < dimension; d++) {
+            N_indices *= N_per_dimension;
+        }
+        return N_indices;
+    }
+
+    void index_to_coordinates(const uint64_t index, std::vector<box_int> &coordinates) const {
+        if (type == ORDERING_MORTON) {
+            uint64_t decoded[MAX_DIMENSION];
+            morton_decode(index, dimension, decoded);
+            for (uint8_t d = 0; d < dimension; d++) {
+                coordinates[d] = (box_int)decoded[d];
+            }
+            return;
+        }
+
+        uint64_t next = index;
+        for (uint8_t d = 0; d < dimension; d++) {
+            if (d < dimension - 1) {
+                coordinates[d] = (box_int)(next % N_cells_1D);
+                next /= N_cells_1D;
+            } else {
+                coordinates[d] = (box_int)next;
+            }
+        }
+    }
+
+    uint64_t coordinates_to_index(const std::vector<box_int> &coordinates) const {
+        if (type == ORDERING_MORTON) {
+            uint64_t encoded[MAX_DIMENSION];
+            for (uint8_t d = 0; d < dimension; d++) {
+                encoded[d] = (uint64_t)coordinates[d];
+            }
+            return morton_encode(encoded, dimension);
+        }
+
+        uint64_t index = 0;
+        uint64_t dimension_factor = 1;
+        for (uint8_t d = 0; d < dimension; d++) {
+            index += (uint64_t)coordinates[d] * dimension_factor;
+            dimension_factor *= (uint64_t)N_cells_1D;
+        }
+        return index;
+    }
+};
+
+// The order in which the sweeps visit the interior rows of a Stencil. The field
+// arrays stay row-major, so every row is still a unit-stride run for the SIMD
+// kernels; what changes is which rows are in cache together. Row-major visits
+// all of dimension 1 before moving along dimension 2, so in 3D the rows at
+// z +/- 1 are a whole plane away. Tiled sweeps dimension 2 for a band of
+// tile_size rows along dimension 1 at a time, so three planes of the band stay
+// in cache, and Morton and Hilbert order the rows along the Z-curve or the
+// Hilbert curve over dimensions 1 and 2; the Hilbert curve has no long jumps
+// between quadrants, so consecutive rows are always neighbors. In 1D and 2D
+// every order is row-major.
+class RowTraversal
+{
+private:
+    uint8_t type;
+    std::vector<uint64_t> rows;
+
+public:
+    RowTraversal(const Stencil &stencil, const uint8_t input_type, const uint32_t tile_size)
+    {
+        if (input_type > ORDERING_HILBERT) {
+            throw std::invalid_argument("Unknown row traversal.");
+        }
+        if (input_type == ORDERING_TILED && tile_size == 0) {
+            throw std::invalid_argument("The tile size must be at least 1.");
+        }
+        type = input_type;
+
+        const uint64_t N_rows = stencil.get_N_rows();
+        rows.resize(N_rows);
+        for (uint64_t row = 0; row < N_rows; row++) {
+            rows[row] = row;
+        }
+        if (stencil.get_dimension() < 3 || type == ORDERING_ROW_MAJOR) {
+            return;
+        }
+
+        // row = y + z * N_y, with y and z the coordinates along dimensions 1 and 2
+        const uint64_t N_y = stencil.get_extent(1);
+        const uint64_t N_z = stencil.get_extent(2);
+        if (type == ORDERING_TILED) {
+            uint64_t k = 0;
+            for (uint64_t y_tile = 0; y_tile < N_y; y_tile += tile_size) {
+                const uint64_t y_end = std::min(y_tile + tile_size, N_y);
+                for (uint64_t z = 0; z < N_z; z++) {
+                    for (uint64_t y = y_tile; y < y_end; y++) {
+                        rows[k++] = y + z * N_y;
+                    }
+                }
+            }
+        } else {
+            // the Hilbert curve over the smallest power of two square around the plane
+            uint64_t N_square = 1;
+            while (N_square < std::max(N_y, N_z)) {
+                N_square *= 2;
+            }
+            std::vector<uint64_t> keys(N_rows);
+            for (uint64_t row = 0; row < N_rows; row++) {
+                const uint64_t coordinates[2] = {row % N_y, row / N_y};
+                keys[row] = (type == ORDERING_HILBERT) ? hilbert_encode_2d(N_square, coordinates[0], coordinates[1])
+                                                       : morton_encode(coordinates, 2);
+            }
+            std::sort(rows.begin(), rows.end(), [&](const uint64_t a, const uint64_t b) { return keys[a] < keys[b]; });
+        }
+    }
+
+    uint8_t get_type() const {
+        return type;
+    }
+
+    uint64_t get_N_rows() const {
+        return rows.size();
+    }
+
+    // the k-th row to visit
+    uint64_t get_row(const uint64_t k) const {
+        return rows[k];
+    }
+};
+
+#endif /* CELL_ORDERING_HPP */
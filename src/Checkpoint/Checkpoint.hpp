@@ -0,0 +1,165 @@
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#define CHECKPOINT_MAGIC "HYDROCHK"
+#define CHECKPOINT_VERSION 1
+// the prev arrays start on a page boundary so they can be mapped in place
+#define CHECKPOINT_DATA_OFFSET 4096
+
+// what main needs besides the fields to carry on where a run stopped
+struct IntegrationState
+{
+    real current_time;
+    real dt;
+    uint64_t dump_counter;
+    real dump_timer;
+    uint64_t step;
+};
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dimension;
+    uint32_t N_cells_1D;
+    uint32_t real_bytes;
+    uint32_t N_fields;
+    int32_t rank;
+    int32_t N_ranks;
+    uint32_t extent[MAX_DIMENSION];
+    uint32_t offset[MAX_DIMENSION];
+    uint64_t N_padded;
+    IntegrationState state;
+};
+
+// Full-state checkpoints, one file per rank. The file is the header followed by
+// the prev arrays of every field exactly as they sit in the FieldStore, ghost
+// layers included, so a restart maps the file and uses it as the prev storage
+// without reading or converting anything up front.
+class Checkpoint
+{
+private:
+    static CheckpointHeader make_header(const FieldStore &fields, const uint32_t N_cells_1D, const Domain &domain,
+                                        const IntegrationState &state) {
+        const Stencil &stencil = fields.get_stencil();
+        CheckpointHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.dimension = stencil.get_dimension();
+        header.N_cells_1D = N_cells_1D;
+        header.real_bytes = sizeof(real);
+        header.N_fields = fields.get_N_fields();
+        header.rank = domain.get_rank();
+        header.N_ranks = domain.get_N_ranks();
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            header.extent[d] = stencil.get_extent(d);
+            header.offset[d] = stencil.get_offset(d);
+        }
+        header.N_padded = FieldStore::get_N_padded(stencil);
+        header.state = state;
+        return header;
+    }
+
+public:
+    static std::string get_file_name(const std::string &base_name, const int rank) {
+        return base_name + "_" + std::to_string(rank) + ".chk";
+    }
+
+    // Collective. Every rank writes a temporary file, and only once all of them
+    // are on disk are they renamed over the previous checkpoint, so a job killed
+    // midway leaves the last complete set behind.
+    static void write(const std::string &base_name, const FieldStore &fields, const uint32_t N_cells_1D,
+                      const Domain &domain, const IntegrationState &state) {
+        const CheckpointHeader header = make_header(fields, N_cells_1D, domain, state);
+        const std::string file_name = get_file_name(base_name, domain.get_rank());
+        const std::string temporary_name = file_name + ".tmp";
+
+        const int file = open(temporary_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (file < 0) {
+            throw std::runtime_error("Could not open checkpoint " + temporary_name + ".");
+        }
+        SnapshotWriter::write_all(file, &header, sizeof(header), 0, temporary_name);
+        SnapshotWriter::write_all(file, fields.get_prev(0), header.N_fields * header.N_padded * sizeof(real),
+                                  CHECKPOINT_DATA_OFFSET, temporary_name);
+        if (fsync(file) != 0) {
+            close(file);
+            throw std::runtime_error("Could not sync checkpoint " + temporary_name + ".");
+        }
+        close(file);
+
+        domain.barrier();
+        if (rename(temporary_name.c_str(), file_name.c_str()) != 0) {
+            throw std::runtime_error("Could not replace checkpoint " + file_name + ".");
+        }
+    }
+
+    // Map this rank's checkpoint as the prev storage of a FieldStore for the
+    // given stencil and return it, with the integration state in state. The
+    // mapping is private, so the run never writes back into the file; the next
+    // arrays are allocated with huge_pages.
+    static std::unique_ptr<FieldStore> restore(const std::string &base_name, const Stencil &stencil, const uint8_t N_scalars,
+                                               const uint32_t N_cells_1D, const Domain &domain, IntegrationState &state,
+                                               const uint8_t huge_pages = HUGE_PAGES) {
+        const std::string file_name = get_file_name(base_name, domain.get_rank());
+        const int file = open(file_name.c_str(), O_RDONLY);
+        if (file < 0) {
+            throw std::runtime_error("Could not open checkpoint " + file_name + ".");
+        }
+
+        struct stat file_status;
+        CheckpointHeader header;
+        if (fstat(file, &file_status) != 0 || pread(file, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION) {
+            close(file);
+            throw std::runtime_error(file_name + " is not a checkpoint file.");
+        }
+
+        bool matches = header.dimension == stencil.get_dimension() && header.N_cells_1D == N_cells_1D &&
+                       header.real_bytes == sizeof(real) && header.N_fields == FieldStore::get_N_fields(stencil, N_scalars) &&
+                       header.rank == domain.get_rank() && header.N_ranks == domain.get_N_ranks() &&
+                       header.N_padded == FieldStore::get_N_padded(stencil);
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            matches = matches && header.extent[d] == stencil.get_extent(d) && header.offset[d] == stencil.get_offset(d);
+        }
+        if (!matches) {
+            close(file);
+            throw std::invalid_argument(file_name + " was written by a run with a different grid, rank count, scalar count or real type.");
+        }
+
+        const size_t mapping_bytes = file_status.st_size;
+        void *mapping = mmap(nullptr, mapping_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        close(file);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Could not map checkpoint " + file_name + ".");
+        }
+        // start reading the pages in before the first sweep touches them
+        madvise(mapping, mapping_bytes, MADV_WILLNEED);
+
+        state = header.state;
+        try {
+            return std::make_unique<FieldStore>(stencil, N_scalars, mapping, mapping_bytes, CHECKPOINT_DATA_OFFSET,
+                                                huge_pages);
+        } catch (...) {
+            munmap(mapping, mapping_bytes);
+            throw;
+        }
+    }
+};
+
+#endif /* CHECKPOINT_HPP */
@@ -0,0 +1,472 @@
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../InitialConditions/InitialConditions.hpp"
+
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+// Run parameters. They start at the compile-time defaults in main.hpp, then a
+// parameter file (--config file) and the command line override them, in the
+// order they appear on the command line. Both use the same names:
+//
+//     # parameter file
+//     dimension = 3
+//     N_cells_1D = 256
+//
+//     ./hydro --config run.par --max_time 2.0 --N_threads=8
+//
+// --restart [name] resumes from a checkpoint, see Checkpoint.
+class Config
+{
+public:
+    uint8_t dimension;
+    uint32_t N_cells_1D;
+    double max_time;
+    double dump_interval;
+    uint8_t initial_conditions;
+    double ic_amplitude;
+    std::string ic_file;
+    double gamma;
+    uint8_t scheme;
+    uint8_t integrator;
+    uint8_t slope_limiter;
+    uint8_t riemann_solver;
+    double cfl_number;
+    uint8_t N_scalars;
+
+    uint32_t N_threads;
+    uint8_t schedule;
+    uint64_t chunk_size;
+    uint8_t thread_pinning;
+    uint8_t huge_pages;
+    uint8_t simd_isa;
+    uint8_t traversal;
+    uint32_t tile_size;
+    uint32_t time_block_depth;
+    uint32_t time_block_width;
+    uint8_t local_dt_levels;
+    uint32_t local_dt_block;
+    uint8_t amr_max_level;
+    uint32_t amr_block_size;
+    double amr_refine_threshold;
+    double amr_derefine_threshold;
+    uint64_t amr_regrid_steps;
+    uint32_t N_dump_buffers;
+    uint8_t dump_type;
+    uint64_t checkpoint_steps;
+    std::string checkpoint_name;
+    bool restart;
+    bool quiet;
+    std::string report_name;
+    bool hardware_counters;
+    uint64_t diagnostics_steps;
+    uint64_t analysis_steps;
+    uint32_t histogram_bins;
+    std::string diagnostics_name;
+    std::string ensemble_file;
+    bool ensemble_interleave;
+
+private:
+    // a non-negative integer that fits in T, checked before it is narrowed
+    template <typename T = uint64_t>
+    static T parse_unsigned(const std::string &key, const std::string &value) {
+        size_t parsed = 0;
+        unsigned long long result = 0;
+        try {
+            result = std::stoull(value, &parsed);
+        } catch (const std::exception &) {
+            parsed = 0;
+        }
+        if (parsed == 0 || parsed != value.size() || value[0] == '-') {
+            throw std::invalid_argument("Parameter " + key + " needs a non-negative integer, got '" + value + "'.");
+        }
+        if (result > (unsigned long long)std::numeric_limits<T>::max()) {
+            throw std::invalid_argument("Parameter " + key + " is at most " +
+                                        std::to_string((unsigned long long)std::numeric_limits<T>::max()) +
+                                        ", got '" + value + "'.");
+        }
+        return (T)result;
+    }
+
+    static double parse_real(const std::string &key, const std::string &value) {
+        size_t parsed = 0;
+        double result = 0.;
+        try {
+            result = std::stod(value, &parsed);
+        } catch (const std::exception &) {
+            parsed = 0;
+        }
+        if (parsed == 0 || parsed != value.size()) {
+            throw std::invalid_argument("Parameter " + key + " needs a number, got '" + value + "'.");
+        }
+        return result;
+    }
+
+    static std::string trim(const std::string &text) {
+        const size_t first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos) {
+            return "";
+        }
+        const size_t last = text.find_last_not_of(" \t\r");
+        return text.substr(first, last - first + 1);
+    }
+
+    void read_file(const std::string &file_name) {
+        std::ifstream file(file_name);
+        if (!file) {
+            throw std::invalid_argument("Could not open parameter file " + file_name + ".");
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty()) {
+                continue;
+            }
+            const size_t equals = line.find('=');
+            if (equals == std::string::npos) {
+                throw std::invalid_argument("Expected 'name = value' in " + file_name + ", got '" + line + "'.");
+            }
+            set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+        }
+    }
+
+public:
+    // throws for values or combinations the run can't do; the command-line
+    // constructor calls it, see Ensemble for the other configurations
+    void validate() const {
+        if (dimension < 1 || dimension > MAX_DIMENSION) {
+            throw std::invalid_argument("dimension must be 1, 2 or 3.");
+        }
+        if (N_cells_1D < 2) {
+            throw std::invalid_argument("N_cells_1D must be at least 2.");
+        }
+        if (max_time <= 0. || dump_interval <= 0.) {
+            throw std::invalid_argument("max_time and dump_interval must be positive.");
+        }
+        if (initial_conditions >= InitialConditions::get_N_types()) {
+            throw std::invalid_argument("initial_conditions must be below " + std::to_string(InitialConditions::get_N_types()) + ".");
+        }
+        if (!restart && dimension < InitialConditions::get_min_dimension(initial_conditions)) {
+            throw std::invalid_argument("The " + InitialConditions::get_name(initial_conditions) + " initial conditions need at least "
+                                        + std::to_string(InitialConditions::get_min_dimension(initial_conditions)) + " dimensions.");
+        }
+        if (initial_conditions == IC_SNAPSHOT && ic_file.empty()) {
+            throw std::invalid_argument("The snapshot initial conditions need ic_file.");
+        }
+        if (gamma <= 1.) {
+            throw std::invalid_argument("gamma must be larger than 1.");
+        }
+        if (scheme > 1 || integrator > 1 || slope_limiter > 2 || riemann_solver > 1) {
+            throw std::invalid_argument("scheme, integrator and riemann_solver must be 0 or 1, slope_limiter 0, 1 or 2.");
+        }
+        if (cfl_number < 0.) {
+            throw std::invalid_argument("cfl_number must not be negative.");
+        }
+        // the blocked, local and refined steppers apply the centered update
+        if (scheme != 0 && (time_block_depth > 1 || local_dt_levels > 0 || amr_max_level > 0)) {
+            throw std::invalid_argument("The Godunov scheme can't be combined with temporal blocking, local time steps or AMR.");
+        }
+        // the Godunov, local and refined steppers carry no scalars
+        if (N_scalars > MAX_N_SCALARS) {
+            throw std::invalid_argument("N_scalars must be at most " + std::to_string(MAX_N_SCALARS) + ".");
+        }
+        if (N_scalars > 0 && (scheme != 0 || local_dt_levels > 0 || amr_max_level > 0)) {
+            throw std::invalid_argument("Passive scalars can't be combined with the Godunov scheme, local time steps or AMR.");
+        }
+        if (traversal > 3 || tile_size == 0) {
+            throw std::invalid_argument("traversal must be 0, 1, 2 or 3 and tile_size at least 1.");
+        }
+        if (time_block_depth == 0 || time_block_width == 0) {
+            throw std::invalid_argument("time_block_depth and time_block_width must be at least 1.");
+        }
+        if (local_dt_levels > 16 || local_dt_block == 0) {
+            throw std::invalid_argument("local_dt_levels must be at most 16 and local_dt_block at least 1.");
+        }
+        if (local_dt_levels > 0 && (time_block_depth > 1 || amr_max_level > 0)) {
+            throw std::invalid_argument("Local time steps can't be combined with temporal blocking or AMR.");
+        }
+        if (amr_max_level > 0) {
+            if (amr_block_size < 2 || amr_block_size % 2 != 0 || N_cells_1D % amr_block_size != 0) {
+                throw std::invalid_argument("amr_block_size must be even and divide N_cells_1D.");
+            }
+            if (amr_derefine_threshold >= amr_refine_threshold || amr_regrid_steps == 0) {
+                throw std::invalid_argument("amr_derefine_threshold must be below amr_refine_threshold and amr_regrid_steps at least 1.");
+            }
+            if (restart || checkpoint_steps > 0) {
+                throw std::invalid_argument("Checkpoints are not supported with AMR.");
+            }
+            // the refined levels sample the initial conditions finer than the snapshot
+            if (initial_conditions == IC_SNAPSHOT) {
+                throw std::invalid_argument("AMR can't start from a snapshot.");
+            }
+        }
+        if (chunk_size == 0) {
+            throw std::invalid_argument("chunk_size must be at least 1.");
+        }
+        if (thread_pinning > PINNING_SPREAD) {
+            throw std::invalid_argument("thread_pinning must be 0 (none), 1 (compact) or 2 (spread).");
+        }
+        if (huge_pages > HUGE_PAGES_EXPLICIT) {
+            throw std::invalid_argument("huge_pages must be 0 (none), 1 (transparent) or 2 (explicit).");
+        }
+        if (dump_type > SNAPSHOT_BFLOAT16) {
+            throw std::invalid_argument("dump_type must be 0 (float32), 1 (float64), 2 (float16) or 3 (bfloat16).");
+        }
+        if (histogram_bins == 0) {
+            throw std::invalid_argument("histogram_bins must be at least 1.");
+        }
+        if ((diagnostics_steps > 0 || analysis_steps > 0) && (amr_max_level > 0 || !ensemble_file.empty())) {
+            throw std::invalid_argument("The in-situ diagnostics can't be combined with AMR or ensembles.");
+        }
+        // the members of an ensemble step one at a time on a thread each
+        if (!ensemble_file.empty()) {
+#if defined(WITH_MPI) || defined(WITH_SEPARATE_SWEEPS)
+            throw std::invalid_argument("Ensembles need a build without WITH_MPI and WITH_SEPARATE_SWEEPS.");
+#endif
+            if (time_block_depth > 1 || local_dt_levels > 0 || amr_max_level > 0 || restart || checkpoint_steps > 0) {
+                throw std::invalid_argument("Ensembles can't be combined with temporal blocking, local time steps, AMR or checkpoints.");
+            }
+        }
+    }
+
+    Config()
+    {
+        dimension = DIMENSION;
+        N_cells_1D = N_CELLS_1D;
+        max_time = MAX_TIME;
+        dump_interval = DUMP_INTERVAL;
+        initial_conditions = ICS;
+        ic_amplitude = IC_AMPLITUDE;
+        ic_file = IC_FILE;
+        gamma = GAMMA;
+        scheme = SCHEME;
+        integrator = INTEGRATOR;
+        slope_limiter = SLOPE_LIMITER;
+        riemann_solver = RIEMANN_SOLVER;
+        cfl_number = CFL_NUMBER;
+        N_scalars = N_SCALARS;
+        N_threads = N_THREADS;
+        schedule = SCHEDULE;
+        chunk_size = CHUNK_SIZE;
+        thread_pinning = THREAD_PINNING;
+        huge_pages = HUGE_PAGES;
+        simd_isa = SIMD_ISA;
+        traversal = TRAVERSAL;
+        tile_size = TILE_SIZE;
+        time_block_depth = TIME_BLOCK_DEPTH;
+        time_block_width = TIME_BLOCK_WIDTH;
+        local_dt_levels = LOCAL_DT_LEVELS;
+        local_dt_block = LOCAL_DT_BLOCK;
+        amr_max_level = AMR_MAX_LEVEL;
+        amr_block_size = AMR_BLOCK_SIZE;
+        amr_refine_threshold = AMR_REFINE_THRESHOLD;
+        amr_derefine_threshold = AMR_DEREFINE_THRESHOLD;
+        amr_regrid_steps = AMR_REGRID_STEPS;
+        N_dump_buffers = N_DUMP_BUFFERS;
+        dump_type = DUMP_TYPE;
+        checkpoint_steps = CHECKPOINT_STEPS;
+        checkpoint_name = CHECKPOINT_NAME;
+        restart = false;
+        quiet = QUIET != 0;
+        report_name = REPORT_NAME;
+        hardware_counters = HARDWARE_COUNTERS != 0;
+        diagnostics_steps = DIAGNOSTICS_STEPS;
+        analysis_steps = ANALYSIS_STEPS;
+        histogram_bins = HISTOGRAM_BINS;
+        diagnostics_name = DIAGNOSTICS_NAME;
+        ensemble_file = ENSEMBLE_FILE;
+        ensemble_interleave = ENSEMBLE_INTERLEAVE != 0;
+    }
+
+    Config(const int argc, char **argv) : Config()
+    {
+        for (int a = 1; a < argc; a++) {
+            std::string argument = argv[a];
+            if (argument.rfind("--", 0) != 0) {
+                throw std::invalid_argument("Unexpected argument " + argument + ".");
+            }
+            argument = argument.substr(2);
+
+            if (argument == "restart") {
+                restart = true;
+                if (a + 1 < argc && std::string(argv[a + 1]).rfind("--", 0) != 0) {
+                    checkpoint_name = argv[++a];
+                }
+                continue;
+            }
+
+            std::string key = argument;
+            std::string value;
+            const size_t equals = argument.find('=');
+            if (equals != std::string::npos) {
+                key = argument.substr(0, equals);
+                value = argument.substr(equals + 1);
+            } else if (a + 1 < argc) {
+                value = argv[++a];
+            } else {
+                throw std::invalid_argument("Parameter --" + key + " needs a value.");
+            }
+
+            if (key == "config") {
+                read_file(value);
+            } else {
+                set(key, value);
+            }
+        }
+
+        validate();
+    }
+
+    void set(const std::string &key, const std::string &value) {
+        if (key == "dimension") {
+            dimension = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "N_cells_1D") {
+            N_cells_1D = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "max_time") {
+            max_time = parse_real(key, value);
+        } else if (key == "dump_interval") {
+            dump_interval = parse_real(key, value);
+        } else if (key == "initial_conditions") {
+            // a name of InitialConditions or its number
+            const int type = InitialConditions::find(value);
+            initial_conditions = (type >= 0) ? (uint8_t)type : parse_unsigned<uint8_t>(key, value);
+        } else if (key == "ic_amplitude") {
+            ic_amplitude = parse_real(key, value);
+        } else if (key == "ic_file") {
+            ic_file = value;
+        } else if (key == "gamma") {
+            gamma = parse_real(key, value);
+        } else if (key == "scheme") {
+            scheme = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "integrator") {
+            integrator = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "slope_limiter") {
+            slope_limiter = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "riemann_solver") {
+            riemann_solver = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "cfl_number") {
+            cfl_number = parse_real(key, value);
+        } else if (key == "N_scalars") {
+            N_scalars = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "N_threads") {
+            N_threads = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "schedule") {
+            schedule = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "chunk_size") {
+            chunk_size = parse_unsigned(key, value);
+        } else if (key == "thread_pinning") {
+            thread_pinning = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "huge_pages") {
+            huge_pages = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "simd_isa") {
+            simd_isa = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "traversal") {
+            traversal = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "tile_size") {
+            tile_size = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "time_block_depth") {
+            time_block_depth = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "time_block_width") {
+            time_block_width = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "local_dt_levels") {
+            local_dt_levels = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "local_dt_block") {
+            local_dt_block = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "amr_max_level") {
+            amr_max_level = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "amr_block_size") {
+            amr_block_size = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "amr_refine_threshold") {
+            amr_refine_threshold = parse_real(key, value);
+        } else if (key == "amr_derefine_threshold") {
+            amr_derefine_threshold = parse_real(key, value);
+        } else if (key == "amr_regrid_steps") {
+            amr_regrid_steps = parse_unsigned(key, value);
+        } else if (key == "N_dump_buffers") {
+            N_dump_buffers = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "dump_type") {
+            dump_type = parse_unsigned<uint8_t>(key, value);
+        } else if (key == "checkpoint_steps") {
+            checkpoint_steps = parse_unsigned(key, value);
+        } else if (key == "checkpoint_name") {
+            checkpoint_name = value;
+        } else if (key == "quiet") {
+            quiet = parse_unsigned(key, value) != 0;
+        } else if (key == "report_name") {
+            report_name = value;
+        } else if (key == "hardware_counters") {
+            hardware_counters = parse_unsigned(key, value) != 0;
+        } else if (key == "diagnostics_steps") {
+            diagnostics_steps = parse_unsigned(key, value);
+        } else if (key == "analysis_steps") {
+            analysis_steps = parse_unsigned(key, value);
+        } else if (key == "histogram_bins") {
+            histogram_bins = parse_unsigned<uint32_t>(key, value);
+        } else if (key == "diagnostics_name") {
+            diagnostics_name = value;
+        } else if (key == "ensemble_file") {
+            ensemble_file = value;
+        } else if (key == "ensemble_interleave") {
+            ensemble_interleave = parse_unsigned(key, value) != 0;
+        } else {
+            throw std::invalid_argument("Unknown parameter " + key + ".");
+        }
+    }
+
+    // one line per parameter in the format of the parameter files
+    void describe(std::ostream &out = std::cout) const {
+        out << "dimension = " << (int)dimension << "\n";
+        out << "N_cells_1D = " << N_cells_1D << "\n";
+        out << "max_time = " << max_time << "\n";
+        out << "dump_interval = " << dump_interval << "\n";
+        out << "initial_conditions = " << InitialConditions::get_name(initial_conditions) << "\n";
+        out << "ic_amplitude = " << ic_amplitude << "\n";
+        out << "ic_file = " << ic_file << "\n";
+        out << "gamma = " << gamma << "\n";
+        out << "scheme = " << (int)scheme << "\n";
+        out << "integrator = " << (int)integrator << "\n";
+        out << "slope_limiter = " << (int)slope_limiter << "\n";
+        out << "riemann_solver = " << (int)riemann_solver << "\n";
+        out << "cfl_number = " << cfl_number << "\n";
+        out << "N_scalars = " << (int)N_scalars << "\n";
+        out << "N_threads = " << N_threads << "\n";
+        out << "schedule = " << (int)schedule << "\n";
+        out << "chunk_size = " << chunk_size << "\n";
+        out << "thread_pinning = " << (int)thread_pinning << "\n";
+        out << "huge_pages = " << (int)huge_pages << "\n";
+        out << "simd_isa = " << (int)simd_isa << "\n";
+        out << "traversal = " << (int)traversal << "\n";
+        out << "tile_size = " << tile_size << "\n";
+        out << "time_block_depth = " << time_block_depth << "\n";
+        out << "time_block_width = " << time_block_width << "\n";
+        out << "local_dt_levels = " << (int)local_dt_levels << "\n";
+        out << "local_dt_block = " << local_dt_block << "\n";
+        out << "amr_max_level = " << (int)amr_max_level << "\n";
+        out << "amr_block_size = " << amr_block_size << "\n";
+        out << "amr_refine_threshold = " << amr_refine_threshold << "\n";
+        out << "amr_derefine_threshold = " << amr_derefine_threshold << "\n";
+        out << "amr_regrid_steps = " << amr_regrid_steps << "\n";
+        out << "N_dump_buffers = " << N_dump_buffers << "\n";
+        out << "dump_type = " << (int)dump_type << "\n";
+        out << "checkpoint_steps = " << checkpoint_steps << "\n";
+        out << "checkpoint_name = " << checkpoint_name << "\n";
+        out << "quiet = " << (int)quiet << "\n";
+        out << "report_name = " << report_name << "\n";
+        out << "hardware_counters = " << (int)hardware_counters << "\n";
+        out << "diagnostics_steps = " << diagnostics_steps << "\n";
+        out << "analysis_steps = " << analysis_steps << "\n";
+        out << "histogram_bins = " << histogram_bins << "\n";
+        out << "diagnostics_name = " << diagnostics_name << "\n";
+        out << "ensemble_file = " << ensemble_file << "\n";
+        out << "ensemble_interleave = " << (int)ensemble_interleave << "\n";
+    }
+};
+
+#endif /* CONFIG_HPP */
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <math.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Domain/Domain.hpp"
+
+#ifndef CONSERVATION_CHECK_HPP
+#define CONSERVATION_CHECK_HPP
+
+// Check that the flux form keeps the mass, momentum and energy of the box.
+// Every face flux is added to one cell and taken from the other, so on the
+// periodic box the totals only change by the rounding of the next values to
+// real: at most about eps(real) times the sum of the magnitudes per step and
+// stored value. Every interval steps the totals are compared with those of the
+// last check, and a drift beyond a few times that bound fails it, see
+// benchmarks/conservation.cpp. The
+// totals are compensated sums, so with double fields the error of the sum
+// itself stays below that of the step.
+class ConservationCheck
+{
+private:
+    // mass, the momentum components and energy
+    static constexpr uint8_t N_TOTALS = MAX_DIMENSION + 2;
+    // the rounded stored values per step, with room for the stages of the
+    // Godunov integrators
+    static constexpr double ROUNDING_FACTOR = 16.;
+
+    const Domain *domain;
+    uint8_t dimension;
+    uint64_t interval;
+    uint64_t last_step;
+    // the totals at last_step, followed by the sums of their magnitudes
+    std::array<double, 2 * N_TOTALS> last_sums;
+    // per thread, the sums and their compensations
+    std::vector<std::array<double, 4 * N_TOTALS>> thread_sums;
+
+    // Neumaier's compensated sum of sums[k], the lost low part kept in
+    // sums[2 * N_TOTALS + k]
+    static void add(std::array<double, 4 * N_TOTALS> &sums, const uint8_t k, const double value) {
+        const double total = sums[k] + value;
+        sums[2 * N_TOTALS + k] += (fabs(sums[k]) >= fabs(value)) ? (sums[k] - total) + value : (value - total) + sums[k];
+        sums[k] = total;
+    }
+
+    static const char *get_name(const uint8_t k) {
+        static const char *names[N_TOTALS] = {"mass", "momentum x", "momentum y", "momentum z", "energy"};
+        return names[k];
+    }
+
+    // the totals and magnitudes of the prev values over the ranks
+    std::array<double, 2 * N_TOTALS> sum(const FieldStore &fields, SweepEngine &engine) {
+        const Stencil &stencil = fields.get_stencil();
+        for (std::array<double, 4 * N_TOTALS> &sums : thread_sums) {
+            sums.fill(0.);
+        }
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            std::array<double, 4 * N_TOTALS> &sums = thread_sums[thread];
+            const real *rho = fields.get_prev_density();
+            const real *E = fields.get_prev_energy();
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                for (uint64_t i = start; i < start + stencil.get_extent(0); i++) {
+                    add(sums, 0, rho[i]);
+                    add(sums, N_TOTALS, fabs((double)rho[i]));
+                    for (uint8_t d = 0; d < dimension; d++) {
+                        const double momentum = (double)rho[i] * fields.get_prev_velocity(d)[i];
+                        add(sums, 1 + d, momentum);
+                        add(sums, N_TOTALS + 1 + d, fabs(momentum));
+                    }
+                    add(sums, N_TOTALS - 1, E[i]);
+                    add(sums, 2 * N_TOTALS - 1, fabs((double)E[i]));
+                }
+            }
+        });
+
+        std::array<double, 4 * N_TOTALS> merged{};
+        for (const std::array<double, 4 * N_TOTALS> &thread : thread_sums) {
+            for (uint8_t k = 0; k < 2 * N_TOTALS; k++) {
+                add(merged, k, thread[k]);
+                add(merged, k, thread[2 * N_TOTALS + k]);
+            }
+        }
+        std::array<double, 2 * N_TOTALS> sums;
+        for (uint8_t k = 0; k < 2 * N_TOTALS; k++) {
+            sums[k] = merged[k] + merged[2 * N_TOTALS + k];
+        }
+        domain->global_sum(sums.data(), 2 * N_TOTALS);
+        return sums;
+    }
+
+public:
+    // the totals of the state at step in the prev values; collective
+    ConservationCheck(const Domain &input_domain, const FieldStore &fields, SweepEngine &engine, const uint64_t input_interval,
+                      const uint64_t step)
+        : domain(&input_domain), dimension(fields.get_stencil().get_dimension()), interval(input_interval), last_step(step),
+          thread_sums(engine.get_N_threads())
+    {
+        last_sums = sum(fields, engine);
+    }
+
+    // After the evolve of step. False when a total drifted by more than
+    // rounding since the last check, which the root rank reports. Collective
+    // over the ranks.
+    bool check(const FieldStore &fields, SweepEngine &engine, const uint64_t step) {
+        if (step / interval <= last_step / interval) {
+            return true;
+        }
+        const std::array<double, 2 * N_TOTALS> sums = sum(fields, engine);
+        const double N_steps = (double)(step - last_step);
+        bool conserved = true;
+        for (uint8_t k = 0; k < N_TOTALS; k++) {
+            if (k > dimension && k < N_TOTALS - 1) {
+                continue;
+            }
+            const double drift = fabs(sums[k] - last_sums[k]);
+            const double bound = ROUNDING_FACTOR * std::numeric_limits<real>::epsilon() * N_steps
+                                 * std::max(sums[N_TOTALS + k], last_sums[N_TOTALS + k]);
+            if (drift > bound) {
+                if (domain->is_root()) {
+                    std::cout << "The " << get_name(k) << " of the box drifted by " << drift << " in " << (uint64_t)N_steps
+                              << " steps up to step " << step << ", more than the rounding bound of " << bound << ".\n";
+                }
+                conserved = false;
+            }
+        }
+        last_sums = sums;
+        last_step = step;
+        return conserved;
+    }
+};
+
+#endif /* CONSERVATION_CHECK_HPP */
@@ -1,213 +1,377 @@
-#include <memory>
-#include <exception>
+#include <array>
+#include <iostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <math.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
 #include "../Cell/Cell.hpp"
-#include "../Grid/Grid.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Profiler/Profiler.hpp"
 
 #ifndef CONSERVED_QUANTITY_HPP
 #define CONSERVED_QUANTITY_HPP
 
+// Per-cell update of one conserved quantity, dispatched at compile time: each
+// Quantity derives from ConservedQuantity<Quantity, D> and provides
+//     static constexpr uint8_t N_fluxes;
+//     void get_flux(const Cell &cell, uint8_t d, compute_real *flux) const;
+//     void set_initial_state(const Cell &cell);
+//     void update(const Cell &cell, const compute_real *net_flux, compute_real dt_dx);
+//     void set_final_state(const Cell &cell) const;
+// A quantity in flux form has N_fluxes components, get_flux gives their flux
+// along d out of the prev values of a cell and net_flux is the flux out
+// through the upper faces of the cell minus the flux in through its lower
+// ones, see EquationSet. A quantity with N_fluxes of 0 instead provides
+//     void update(const Cell &cell, const std::array<Cell, 2 * D> &neighbor_cells, compute_real dt_dx);
+// with neighbor_cells[2 * d] the neighbor above the cell along d and
+// neighbor_cells[2 * d + 1] the one below. D is the dimension of the run, so
+// the loops over dimensions have constant trip counts. The quantities are
+// accumulated in compute_real and rounded to real when set.
+template <typename Quantity, uint8_t D>
 class ConservedQuantity
 {
 public:
-    ConservedQuantity() {}
+    static constexpr uint8_t dimension = D;
+
+    // Input is the net flux or the neighbor cells, as the quantity updates
+    template <typename Input>
+    void apply(const Cell &cell, const Input &input, const real dt_dx) {
+        Quantity &quantity = static_cast<Quantity &>(*this);
+        quantity.set_initial_state(cell);
+        quantity.update(cell, input, dt_dx);
+        quantity.set_final_state(cell);
+    }
 
-    virtual void update(const std::shared_ptr<Cell> cell, const std::vector<std::shared_ptr<Cell>> &neighbor_cells, const real dt) = 0;
-    virtual void set_initial_state(const std::shared_ptr<Cell> cell) = 0;
-    virtual void set_final_state(const std::shared_ptr<Cell> cell) const = 0;
+    // a quantity without any values to update is skipped by EquationSet
+    bool is_active() const {
+        return true;
+    }
 };
 
-class ConservedCoordinates : public ConservedQuantity
+template <uint8_t D>
+class ConservedDensity : public ConservedQuantity<ConservedDensity<D>, D>
 {
 private:
-    std::vector<box_int> coordinates;
+    compute_real density;
 
 public:
-    explicit ConservedCoordinates() {}
+    static constexpr uint8_t N_fluxes = 1;
+
+    ConservedDensity() {}
+
+    static const char *get_name() {
+        return "density";
+    }
 
-    void update(const std::shared_ptr<Cell> cell, const std::vector<std::shared_ptr<Cell>> &neighbor_cells, const real dt_dx) override {
-        
+    // the mass flux rho * u_j
+    void get_flux(const Cell &cell, const uint8_t d, compute_real *flux) const {
+        flux[0] = (compute_real)cell.get_density() * cell.get_velocity(d);
     }
 
-    void set_initial_state(std::shared_ptr<Cell> cell) {
-        coordinates = *cell->get_coordinates();
+    void update(const Cell &cell, const compute_real *net_flux, const compute_real dt_dx) {
+        // dt_dx is dt / (2 dx), the update is dt / dx times the flux differences
+        const compute_real dt_over_dx = 2. * dt_dx;
+        density -= dt_over_dx * net_flux[0];
     }
 
-    // must be called after update
-    void set_final_state(const std::shared_ptr<Cell> cell) const override {
-        cell->set_coordinates(coordinates);
+    void set_initial_state(const Cell &cell) {
+        density = cell.get_density();
+    }
+
+    void set_final_state(const Cell &cell) const {
+#ifdef DEBUG
+        if (isnan(density)) {
+            std::cout << "Density is NaN.\n";
+            cell.describe();
+            exit(1);
+        }
+#endif
+        cell.set_density(density);
     }
 };
 
-class ConservedDensity : public ConservedQuantity
+// reads the next density, so it runs after ConservedDensity
+template <uint8_t D>
+class ConservedMomentum : public ConservedQuantity<ConservedMomentum<D>, D>
 {
 private:
-    real density;
+    std::array<compute_real, D> momentum;
 
 public:
-    explicit ConservedDensity() {}
+    static constexpr uint8_t N_fluxes = D;
 
-    void update(const std::shared_ptr<Cell> cell, const std::vector<std::shared_ptr<Cell>> &neighbor_cells, const real dt_dx) override {
-        // (drho/dx_j) * u_j + rho * (du_j / dx_j)
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            const real next_neighbor_rho = neighbor_cells[2 * d]->get_density();
-            const real prev_neighbor_rho = neighbor_cells[2 * d + 1]->get_density();
-            const real drho = next_neighbor_rho - prev_neighbor_rho;
+    ConservedMomentum() {}
 
-            const real next_neighbor_uj = neighbor_cells[2 * d]->get_velocity(d);
-            const real prev_neighbor_uj = neighbor_cells[2 * d + 1]->get_velocity(d);
-            const real du_j = next_neighbor_uj - prev_neighbor_uj;
+    static const char *get_name() {
+        return "momentum";
+    }
 
-            density -= dt_dx * (cell->get_velocity(d) * (next_neighbor_rho - prev_neighbor_rho) + cell->get_density() * (next_neighbor_uj - prev_neighbor_uj));
+    // rho * u_i * u_j + P delta_ij for every component i
+    void get_flux(const Cell &cell, const uint8_t d, compute_real *flux) const {
+        const compute_real mass_flux = (compute_real)cell.get_density() * cell.get_velocity(d);
+        for (uint8_t component = 0; component < D; component++) {
+            flux[component] = mass_flux * cell.get_velocity(component);
+            if (component == d) {
+                flux[component] += cell.get_pressure();
+            }
         }
     }
 
-    void set_initial_state(std::shared_ptr<Cell> cell) override {
-        density = cell->get_density();
+    void update(const Cell &cell, const compute_real *net_flux, const compute_real dt_dx) {
+        const compute_real dt_over_dx = 2. * dt_dx;
+        for (uint8_t component = 0; component < D; component++) {
+            momentum[component] -= dt_over_dx * net_flux[component];
+        }
     }
 
-    void set_final_state(const std::shared_ptr<Cell> cell) const override {
-#ifdef DEBUG
-        if (isnan(density)) {
-            std::cout << "Density is NaN.\n";
-            cell->describe();
-            exit(1);
+    void set_initial_state(const Cell &cell) {
+        for (uint8_t d = 0; d < D; d++) {
+            momentum[d] = cell.get_velocity(d);
+            momentum[d] *= cell.get_density();
         }
+    }
+
+    void set_final_state(const Cell &cell) const {
+        for (uint8_t d = 0; d < D; d++) {
+#ifdef DEBUG
+            if (isnan(momentum[d])) {
+                std::cout << "Momentum in " << (int)d << " dimension is NaN.\n";
+                cell.describe();
+                exit(1);
+            }
 #endif
-        cell->set_density(density);
+            cell.set_velocity(d, momentum[d] / cell.get_next_density());
+        }
     }
 };
 
-class ConservedEnergy : public ConservedQuantity
+// reads the next density and velocity, so it runs after ConservedMomentum
+template <uint8_t D>
+class ConservedEnergy : public ConservedQuantity<ConservedEnergy<D>, D>
 {
 private:
-    real energy;
+    compute_real energy;
+    double gamma;
+
 public:
-    explicit ConservedEnergy() {}
-
-
-    void update(const std::shared_ptr<Cell> cell, const std::vector<std::shared_ptr<Cell>> &neighbor_cells, const real dt_dx) override {
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            // du_j/dx_j * (E + P); P = p / rho
-            const real next_neighbor_uj = neighbor_cells[2 * d]->get_velocity(d);
-            const real prev_neighbor_uj = neighbor_cells[2 * d + 1]->get_velocity(d);
-            const real du_j = next_neighbor_uj - prev_neighbor_uj;
-            energy -= dt_dx * du_j * (cell->get_energy() + cell->get_pressure());
-
-            // u_j * dE/dx_j
-            const real next_neighbor_E = neighbor_cells[2 * d]->get_energy();
-            const real prev_neighbor_E = neighbor_cells[2 * d + 1]->get_energy();
-            const real dE = next_neighbor_E - prev_neighbor_E;
-            energy -= dt_dx * cell->get_velocity(d) * dE;
-
-            // u_j * dP/dx_j
-            const real next_neighbor_P = neighbor_cells[2 * d]->get_pressure();
-            const real prev_neighbor_P = neighbor_cells[2 * d + 1]->get_pressure();
-            const real dP = next_neighbor_P - prev_neighbor_P;
-            energy -= dt_dx * cell->get_velocity(d) * dP;
-        }
+    static constexpr uint8_t N_fluxes = 1;
+
+    explicit ConservedEnergy(const double input_gamma) : gamma(input_gamma) {}
+
+    static const char *get_name() {
+        return "energy and pressure";
+    }
+
+    // (E + P) * u_j
+    void get_flux(const Cell &cell, const uint8_t d, compute_real *flux) const {
+        flux[0] = ((compute_real)cell.get_energy() + cell.get_pressure()) * cell.get_velocity(d);
     }
 
-    void set_initial_state(std::shared_ptr<Cell> cell) override {
-        energy = cell->get_energy();
+    void update(const Cell &cell, const compute_real *net_flux, const compute_real dt_dx) {
+        const compute_real dt_over_dx = 2. * dt_dx;
+        energy -= dt_over_dx * net_flux[0];
     }
 
-    void set_final_state(const std::shared_ptr<Cell> cell) const override {
+    void set_initial_state(const Cell &cell) {
+        energy = cell.get_energy();
+    }
+
+    void set_final_state(const Cell &cell) const {
 #ifdef DEBUG
         if (isnan(energy)) {
             std::cout << "Energy is NaN.\n";
-            cell->describe();
+            cell.describe();
             exit(1);
         }
 #endif
-        cell->set_energy(energy);
-        real next_specific_kinetic_energy = 0.;
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            next_specific_kinetic_energy += 0.5 * cell->get_next_velocity(d) * cell->get_next_velocity(d);
+        cell.set_energy(energy);
+        compute_real next_specific_kinetic_energy = 0.;
+        for (uint8_t d = 0; d < D; d++) {
+            next_specific_kinetic_energy += 0.5 * cell.get_next_velocity(d) * cell.get_next_velocity(d);
         }
 
         // next_pressure is P = (gamma - 1) * rho * e = (gamma - 1) * (E - 0.5 * rho * u^2)
-        const real next_pressure = (GAMMA-1.0) * (cell->get_next_energy() - cell->get_next_density() * next_specific_kinetic_energy);
+        const compute_real next_pressure = (gamma-1.0) * (cell.get_next_energy() - cell.get_next_density() * next_specific_kinetic_energy);
 #ifdef DEBUG
         if (next_pressure <= 0.) {
             std::cout << "Pressure is zero or negative.\n";
-            cell->describe();
+            cell.describe();
             exit(1);
         }
 #endif
-        cell->set_pressure(next_pressure);
+        cell.set_pressure(next_pressure);
     }
 };
 
-class ConservedMomentum : public ConservedQuantity
+// Scalars carried along with the flow, ds/dt + u_j * ds/dx_j = 0, such as the
+// fraction of a tracer, in advective rather than flux form. Only the prev
+// values are read, so they can go anywhere in the set.
+// FusedUpdate::update_scalars_row does the same for whole rows.
+template <uint8_t D>
+class PassiveScalars : public ConservedQuantity<PassiveScalars<D>, D>
 {
 private:
-    std::vector<real> momentum;
-public:
-    explicit ConservedMomentum() {}
-
-    void update(const std::shared_ptr<Cell> cell, const std::vector<std::shared_ptr<Cell>> &neighbor_cells, const real dt_dx) override {
-        // (dt / dx)) * ( (drho/dx_j * u_i * u_j) + (rho * u_j * du_i/dx_j) + (rho * u_i * du_j/dx_j))
-        for (uint8_t component = 0; component < DIMENSION; component++) {
+    uint8_t N_scalars;
+    std::array<compute_real, MAX_N_SCALARS> scalars;
 
-            // d signifies the derivative direction, here labelled j in the comments. i indicates direction of equation
-            for (uint8_t d = 0; d < DIMENSION; d++) {
+public:
+    static constexpr uint8_t N_fluxes = 0;
 
-                // drho/dx_j
-                const real next_neighbor_rho = neighbor_cells[2 * d]->get_density();
-                const real prev_neighbor_rho = neighbor_cells[2 * d + 1]->get_density();
-                const real drho = next_neighbor_rho - prev_neighbor_rho;
+    explicit PassiveScalars(const uint8_t input_N_scalars) : N_scalars(input_N_scalars) {}
 
-                // drho/dx_j * u_i * u_j
-                momentum[component] -= dt_dx * drho * cell->get_velocity(component) * cell->get_velocity(d);
+    static const char *get_name() {
+        return "passive scalar";
+    }
 
-                // du_i/dx_j
-                const real next_neighbor_ui = neighbor_cells[2 * d]->get_velocity(component);
-                const real prev_neighbor_ui = neighbor_cells[2 * d + 1]->get_velocity(component);
-                const real du_i = next_neighbor_ui - prev_neighbor_ui;
+    bool is_active() const {
+        return N_scalars > 0;
+    }
 
-                // rho * u_j * du_i/dx_j
-                momentum[component] -= dt_dx * cell->get_density() * cell->get_velocity(d) * du_i;
+    void update(const Cell &cell, const std::array<Cell, 2 * D> &neighbor_cells, const compute_real dt_dx) {
+        for (uint8_t k = 0; k < N_scalars; k++) {
+            // u_j * ds/dx_j
+            for (uint8_t d = 0; d < D; d++) {
+                const compute_real ds = (compute_real)neighbor_cells[2 * d].get_scalar(k) - neighbor_cells[2 * d + 1].get_scalar(k);
+                scalars[k] -= dt_dx * cell.get_velocity(d) * ds;
+            }
+        }
+    }
 
-                // du_j / dx_j
-                const real next_neighbor_uj = neighbor_cells[2 * d]->get_velocity(d);
-                const real prev_neighbor_uj = neighbor_cells[2 * d + 1]->get_velocity(d);
-                const real du_j = next_neighbor_uj - prev_neighbor_uj;
+    void set_initial_state(const Cell &cell) {
+        for (uint8_t k = 0; k < N_scalars; k++) {
+            scalars[k] = cell.get_scalar(k);
+        }
+    }
 
-                // rho * u_i * du_j / dx_j
-                momentum[component] -= dt_dx * cell->get_density() * cell->get_velocity(component) * du_j;
+    void set_final_state(const Cell &cell) const {
+        for (uint8_t k = 0; k < N_scalars; k++) {
+            cell.set_scalar(k, scalars[k]);
+        }
+    }
+};
 
-                // add on the divergence term
-                if (d == component) {
-                    // dP / dx_j
-                    const real next_neighbor_P = neighbor_cells[2 * d]->get_pressure();
-                    const real prev_neighbor_P = neighbor_cells[2 * d + 1]->get_pressure();
-                    const real dP = next_neighbor_P - prev_neighbor_P;
+// A system of equations as a fixed list of quantities, updated one sweep per
+// quantity in the order given. Every call in a sweep is resolved at compile
+// time, so adding a quantity adds no indirect call per cell. The quantities
+// carry per-cell scratch state, so every thread gets its own copy of them.
+// A quantity in flux form is swept twice: the first pass puts the flux through
+// every face, the mean of the fluxes of its two cells, into the face buffer,
+// and the second updates every cell from the differences of the fluxes
+// through its faces, so the totals are conserved to rounding. The arithmetic
+// follows FusedUpdate, so the results are bit-identical to it.
+template <uint8_t D, typename... Quantities>
+class EquationSet
+{
+private:
+    std::vector<std::tuple<Quantities...>> thread_quantities;
+    // flux through the lower face along d of every cell, stored at the cell
+    // above the face, D arrays of N_padded values per dimension
+    std::vector<real> face_fluxes;
+    uint64_t N_padded = 0;
+
+    real *get_face_flux(const uint8_t d, const uint8_t k) {
+        return face_fluxes.data() + (d * D + k) * N_padded;
+    }
 
-                    // dP / dx_j delta_ij
-                    momentum[component] -= dt_dx * dP;
+    template <std::size_t Q>
+    void sweep(FieldStore &fields, SweepEngine &engine, const real dt_dx, Profiler &profiler) {
+        using Quantity = typename std::tuple_element<Q, std::tuple<Quantities...>>::type;
+        if (!std::get<Q>(thread_quantities[0]).is_active()) {
+            return;
+        }
+        if (!profiler.is_quiet()) {
+            std::cout << "\t" << Quantity::get_name() << " computation\n";
+        }
+        ScopedTimer timer(profiler, std::string(Quantity::get_name()) + " update");
+
+        const Stencil &stencil = fields.get_stencil();
+        if constexpr (Quantity::N_fluxes > 0) {
+            engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+                const Quantity &quantity = std::get<Q>(thread_quantities[thread]);
+                for (uint64_t row = row_begin; row < row_end; row++) {
+                    for (const bool inner : {true, false}) {
+                        stencil.for_each_row_faces(row, inner, [&](const uint64_t start, const uint64_t count, const uint8_t d) {
+                            const uint64_t stride = stencil.get_stride(d);
+                            for (uint64_t i = start; i < start + count; i++) {
+                                compute_real lower[Quantity::N_fluxes];
+                                compute_real upper[Quantity::N_fluxes];
+                                quantity.get_flux(Cell(&fields, i - stride), d, lower);
+                                quantity.get_flux(Cell(&fields, i), d, upper);
+                                for (uint8_t k = 0; k < Quantity::N_fluxes; k++) {
+                                    get_face_flux(d, k)[i] = 0.5 * (lower[k] + upper[k]);
+                                }
+                            }
+                        });
+                    }
                 }
-            }
+            });
+
+            engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+                Quantity &quantity = std::get<Q>(thread_quantities[thread]);
+                for (uint64_t row = row_begin; row < row_end; row++) {
+                    const uint64_t start = stencil.row_start(row);
+                    for (uint64_t i = start; i < start + stencil.get_extent(0); i++) {
+                        // outflow through the upper faces minus inflow through the lower ones
+                        compute_real net_flux[Quantity::N_fluxes] = {};
+                        for (uint8_t d = 0; d < D; d++) {
+                            const uint64_t stride = stencil.get_stride(d);
+                            for (uint8_t k = 0; k < Quantity::N_fluxes; k++) {
+                                net_flux[k] += (compute_real)get_face_flux(d, k)[i + stride] - get_face_flux(d, k)[i];
+                            }
+                        }
+                        quantity.apply(Cell(&fields, i), net_flux, dt_dx);
+                    }
+                }
+            });
+        } else {
+            engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+                Quantity &quantity = std::get<Q>(thread_quantities[thread]);
+                std::array<Cell, 2 * D> neighbor_cells;
+                for (uint64_t row = row_begin; row < row_end; row++) {
+                    const uint64_t start = stencil.row_start(row);
+                    for (uint64_t i = start; i < start + stencil.get_extent(0); i++) {
+                        for (uint8_t d = 0; d < D; d++) {
+                            neighbor_cells[2 * d] = Cell(&fields, i + stencil.get_stride(d));
+                            neighbor_cells[2 * d + 1] = Cell(&fields, i - stencil.get_stride(d));
+                        }
+                        quantity.apply(Cell(&fields, i), neighbor_cells, dt_dx);
+                    }
+                }
+            });
         }
     }
 
-    void set_initial_state(std::shared_ptr<Cell> cell) override {
-        momentum = *cell->get_velocity();
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            momentum[d] *= cell->get_density();
-        }
+    template <std::size_t... Q>
+    void sweep_all(FieldStore &fields, SweepEngine &engine, const real dt_dx, Profiler &profiler, std::index_sequence<Q...>) {
+        (sweep<Q>(fields, engine, dt_dx, profiler), ...);
     }
 
-    void set_final_state(const std::shared_ptr<Cell> cell) const override {
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-#ifdef DEBUG
-            if (isnan(momentum[d])) {
-                std::cout << "Momentum in " << (int)d << " dimension is NaN.\n";
-                cell->describe();
-                exit(1);
-            }
-#endif
-            cell->set_velocity(d, momentum[d] / cell->get_next_density());
+public:
+    EquationSet(const uint32_t N_threads, const Quantities &... quantities)
+        : thread_quantities(N_threads, std::tuple<Quantities...>(quantities...)) {}
+
+    // fill the next values of every interior cell from the prev values, whose
+    // ghost layers must be up to date; every sweep is a phase of the profiler
+    void update(FieldStore &fields, SweepEngine &engine, const real dt_dx, Profiler &profiler) {
+        if (N_padded != FieldStore::get_N_padded(fields.get_stencil())) {
+            N_padded = FieldStore::get_N_padded(fields.get_stencil());
+            face_fluxes.assign(D * D * N_padded, 0.);
         }
+        sweep_all(fields, engine, dt_dx, profiler, std::index_sequence_for<Quantities...>{});
     }
 };
-#endif
+
+// the Euler equations with passive scalars
+template <uint8_t D>
+using HydroEquations = EquationSet<D, ConservedDensity<D>, ConservedMomentum<D>, ConservedEnergy<D>, PassiveScalars<D>>;
+
+template <uint8_t D>
+HydroEquations<D> make_hydro_equations(const uint32_t N_threads, const double gamma, const uint8_t N_scalars) {
+    return HydroEquations<D>(N_threads, ConservedDensity<D>(), ConservedMomentum<D>(), ConservedEnergy<D>(gamma),
+                             PassiveScalars<D>(N_scalars));
+}
+
+#endif /* CONSERVED_QUANTITY_HPP */
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <array>
+#include <complex>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <math.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Domain/Domain.hpp"
+
+#ifndef DIAGNOSTICS_HPP
+#define DIAGNOSTICS_HPP
+
+// Conservation totals and extrema of a state, summed over its cells. A sweep
+// keeps one per thread and adds each row right after writing it, while the
+// row is still in cache; Diagnostics merges them.
+struct DiagnosticTotals
+{
+    uint64_t N_cells;
+    double mass;
+    std::array<double, MAX_DIMENSION> momentum;
+    double energy;
+    double kinetic_energy;
+    double min_density;
+    double max_density;
+    double min_pressure;
+    double max_pressure;
+
+    DiagnosticTotals() {
+        reset();
+    }
+
+    void reset() {
+        N_cells = 0;
+        mass = 0.;
+        momentum = {0., 0., 0.};
+        energy = 0.;
+        kinetic_energy = 0.;
+        min_density = std::numeric_limits<double>::max();
+        max_density = -std::numeric_limits<double>::max();
+        min_pressure = std::numeric_limits<double>::max();
+        max_pressure = -std::numeric_limits<double>::max();
+    }
+
+    // count cells from storage index start, of the next values or the prev ones
+    void add_cells(const FieldStore &fields, const bool next, const uint64_t start, const uint64_t count) {
+        const real *rho = next ? fields.get_next_density() : fields.get_prev_density();
+        const real *E = next ? fields.get_next_energy() : fields.get_prev_energy();
+        const real *P = next ? fields.get_next_pressure() : fields.get_prev_pressure();
+        double row_mass = 0.;
+        double row_energy = 0.;
+        real row_min_density = rho[start];
+        real row_max_density = rho[start];
+        real row_min_pressure = P[start];
+        real row_max_pressure = P[start];
+        for (uint64_t i = start; i < start + count; i++) {
+            row_mass += rho[i];
+            row_energy += E[i];
+            row_min_density = std::min(row_min_density, rho[i]);
+            row_max_density = std::max(row_max_density, rho[i]);
+            row_min_pressure = std::min(row_min_pressure, P[i]);
+            row_max_pressure = std::max(row_max_pressure, P[i]);
+        }
+        for (uint8_t d = 0; d < fields.get_stencil().get_dimension(); d++) {
+            const real *u = next ? fields.get_next_velocity(d) : fields.get_prev_velocity(d);
+            double row_momentum = 0.;
+            double row_kinetic_energy = 0.;
+            for (uint64_t i = start; i < start + count; i++) {
+                const double rho_u = (double)rho[i] * u[i];
+                row_momentum += rho_u;
+                row_kinetic_energy += 0.5 * rho_u * u[i];
+            }
+            momentum[d] += row_momentum;
+            kinetic_energy += row_kinetic_energy;
+        }
+
+        N_cells += count;
+        mass += row_mass;
+        energy += row_energy;
+        min_density = std::min(min_density, (double)row_min_density);
+        max_density = std::max(max_density, (double)row_max_density);
+        min_pressure = std::min(min_pressure, (double)row_min_pressure);
+        max_pressure = std::max(max_pressure, (double)row_max_pressure);
+    }
+
+    void merge(const DiagnosticTotals &other) {
+        N_cells += other.N_cells;
+        mass += other.mass;
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            momentum[d] += other.momentum[d];
+        }
+        energy += other.energy;
+        kinetic_energy += other.kinetic_energy;
+        min_density = std::min(min_density, other.min_density);
+        max_density = std::max(max_density, other.max_density);
+        min_pressure = std::min(min_pressure, other.min_pressure);
+        max_pressure = std::max(max_pressure, other.max_pressure);
+    }
+};
+
+// In-situ diagnostics of the run, streamed to one text file in place of
+// reducing the snapshots afterwards. Every diagnostics_steps steps a line of
+// the totals of the box: mass, momentum, total and kinetic energy, each the
+// sum over the cells times the cell volume, and the density and pressure
+// extrema. Every analysis_steps steps the heavier analyses: the kinetic
+// energy spectrum along dimension 0 and a density histogram. The lines start
+// with their kind and step so the file can be split with grep:
+//
+//     totals 100 7.289e-03 1.000e+00 ...
+//     spectrum 100 7.289e-03 ...
+//
+// The fused and Godunov sweeps fill in the totals as they write the next
+// values, see begin_step; the other steppers get them from an extra pass over
+// the prev values after the step.
+class Diagnostics
+{
+private:
+    const Domain *domain;
+    uint8_t dimension;
+    uint32_t N_cells_1D;
+    uint64_t totals_steps;
+    uint64_t analysis_steps;
+    uint32_t N_histogram_bins;
+    std::vector<DiagnosticTotals> thread_totals;
+    // the steps of the last lines, a time block or a restart may step past
+    // a multiple of the cadence
+    uint64_t last_totals_step;
+    uint64_t last_analysis_step;
+    bool warned_spectrum;
+    // written by the root rank only
+    std::ofstream file;
+
+    static bool is_due(const uint64_t step, const uint64_t interval, const uint64_t last_step) {
+        return interval > 0 && step / interval > last_step / interval;
+    }
+
+    bool is_totals_step(const uint64_t step) const {
+        return is_due(step, totals_steps, last_totals_step) || is_due(step, analysis_steps, last_analysis_step);
+    }
+
+    // the totals of the prev values, when no sweep added them
+    void accumulate(const FieldStore &fields, SweepEngine &engine) {
+        const Stencil &stencil = fields.get_stencil();
+        for (DiagnosticTotals &totals : thread_totals) {
+            totals.reset();
+        }
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                thread_totals[thread].add_cells(fields, false, stencil.row_start(row), stencil.get_extent(0));
+            }
+        });
+    }
+
+    // the thread totals merged over the threads and the ranks
+    DiagnosticTotals reduce() const {
+        DiagnosticTotals totals;
+        for (const DiagnosticTotals &thread : thread_totals) {
+            totals.merge(thread);
+        }
+        double sums[7] = {(double)totals.N_cells, totals.mass, totals.momentum[0], totals.momentum[1],
+                          totals.momentum[2], totals.energy, totals.kinetic_energy};
+        // the minima as the maxima of the negated values
+        double extrema[4] = {-totals.min_density, totals.max_density, -totals.min_pressure, totals.max_pressure};
+        domain->global_sum(sums, 7);
+        domain->global_max(extrema, 4);
+        totals.N_cells = (uint64_t)sums[0];
+        totals.mass = sums[1];
+        totals.momentum = {sums[2], sums[3], sums[4]};
+        totals.energy = sums[5];
+        totals.kinetic_energy = sums[6];
+        totals.min_density = -extrema[0];
+        totals.max_density = extrema[1];
+        totals.min_pressure = -extrema[2];
+        totals.max_pressure = extrema[3];
+        return totals;
+    }
+
+    void write_totals(const uint64_t step, const double time, const DiagnosticTotals &totals) {
+        if (!domain->is_root()) {
+            return;
+        }
+        double cell_volume = 1.;
+        for (uint8_t d = 0; d < dimension; d++) {
+            cell_volume /= (double)N_cells_1D;
+        }
+        file << "totals " << step << " " << time << " " << totals.mass * cell_volume;
+        for (uint8_t d = 0; d < dimension; d++) {
+            file << " " << totals.momentum[d] * cell_volume;
+        }
+        file << " " << totals.energy * cell_volume << " " << totals.kinetic_energy * cell_volume << " " << totals.min_density
+             << " " << totals.max_density << " " << totals.min_pressure << " " << totals.max_pressure << "\n";
+    }
+
+    // In place; radix 2 when the length is a power of two, otherwise the
+    // direct sum, which takes N^2 operations.
+    static void fft(std::vector<std::complex<double>> &values, std::vector<std::complex<double>> &scratch) {
+        const uint64_t N = values.size();
+        if ((N & (N - 1)) != 0) {
+            scratch.assign(N, 0.);
+            for (uint64_t k = 0; k < N; k++) {
+                for (uint64_t j = 0; j < N; j++) {
+                    scratch[k] += values[j] * std::polar(1., -2. * M_PI * (double)((k * j) % N) / (double)N);
+                }
+            }
+            values.swap(scratch);
+            return;
+        }
+
+        for (uint64_t i = 1, j = 0; i < N; i++) {
+            uint64_t bit = N >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(values[i], values[j]);
+            }
+        }
+        for (uint64_t length = 2; length <= N; length <<= 1) {
+            const std::complex<double> rotation = std::polar(1., -2. * M_PI / (double)length);
+            for (uint64_t i = 0; i < N; i += length) {
+                std::complex<double> twiddle = 1.;
+                for (uint64_t j = 0; j < length / 2; j++) {
+                    const std::complex<double> lower = values[i + j];
+                    const std::complex<double> upper = values[i + j + length / 2] * twiddle;
+                    values[i + j] = lower + upper;
+                    values[i + j + length / 2] = lower - upper;
+                    twiddle *= rotation;
+                }
+            }
+        }
+    }
+
+    // One-sided spectrum of the velocity along dimension 0, averaged over the
+    // rows: E(k) = sum_d |u_d(k)|^2, halved at k = 0 and N / 2, with u_d(k) the
+    // DFT of the row divided by N, so the E(k) add up to the mean of u^2 / 2.
+    // The rows have to be whole on every rank.
+    void write_spectrum(const FieldStore &fields, SweepEngine &engine, const uint64_t step, const double time) {
+        if (domain->get_ranks_per_dimension(0) > 1) {
+            if (domain->is_root() && !warned_spectrum) {
+                std::cout << "The spectrum needs whole rows along dimension 0 on every rank, leaving it out\n";
+            }
+            warned_spectrum = true;
+            return;
+        }
+
+        const Stencil &stencil = fields.get_stencil();
+        const uint64_t N = stencil.get_extent(0);
+        const uint64_t N_modes = N / 2 + 1;
+        std::vector<std::vector<double>> thread_spectra(engine.get_N_threads(), std::vector<double>(N_modes, 0.));
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            std::vector<std::complex<double>> values(N);
+            std::vector<std::complex<double>> scratch;
+            std::vector<double> &spectrum = thread_spectra[thread];
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                for (uint8_t d = 0; d < dimension; d++) {
+                    const real *u = fields.get_prev_velocity(d);
+                    for (uint64_t i = 0; i < N; i++) {
+                        values[i] = u[start + i];
+                    }
+                    fft(values, scratch);
+                    for (uint64_t k = 0; k < N_modes; k++) {
+                        const double weight = (k == 0 || 2 * k == N) ? 0.5 : 1.;
+                        spectrum[k] += weight * std::norm(values[k]) / (double)(N * N);
+                    }
+                }
+            }
+        });
+
+        std::vector<double> spectrum(N_modes, 0.);
+        for (const std::vector<double> &thread_spectrum : thread_spectra) {
+            for (uint64_t k = 0; k < N_modes; k++) {
+                spectrum[k] += thread_spectrum[k];
+            }
+        }
+        domain->global_sum(spectrum.data(), (int)N_modes);
+        if (domain->is_root()) {
+            double N_rows = 1.;
+            for (uint8_t d = 1; d < dimension; d++) {
+                N_rows *= (double)N_cells_1D;
+            }
+            file << "spectrum " << step << " " << time;
+            for (uint64_t k = 0; k < N_modes; k++) {
+                file << " " << spectrum[k] / N_rows;
+            }
+            file << "\n";
+        }
+    }
+
+    // counts of the density in N_histogram_bins equal bins from the smallest
+    // to the largest density of the box
+    void write_histogram(const FieldStore &fields, SweepEngine &engine, const uint64_t step, const double time,
+                         const DiagnosticTotals &totals) {
+        const Stencil &stencil = fields.get_stencil();
+        const double lower = totals.min_density;
+        const double bin_width = (totals.max_density - totals.min_density) / (double)N_histogram_bins;
+        std::vector<std::vector<double>> thread_counts(engine.get_N_threads(), std::vector<double>(N_histogram_bins, 0.));
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            const real *rho = fields.get_prev_density();
+            std::vector<double> &counts = thread_counts[thread];
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                for (uint64_t i = start; i < start + stencil.get_extent(0); i++) {
+                    uint32_t bin = 0;
+                    if (bin_width > 0.) {
+                        bin = (uint32_t)std::min((double)(N_histogram_bins - 1), ((double)rho[i] - lower) / bin_width);
+                    }
+                    counts[bin] += 1.;
+                }
+            }
+        });
+
+        std::vector<double> counts(N_histogram_bins, 0.);
+        for (const std::vector<double> &thread_count : thread_counts) {
+            for (uint32_t bin = 0; bin < N_histogram_bins; bin++) {
+                counts[bin] += thread_count[bin];
+            }
+        }
+        domain->global_sum(counts.data(), (int)N_histogram_bins);
+        if (domain->is_root()) {
+            file << "histogram " << step << " " << time << " " << totals.min_density << " " << totals.max_density;
+            for (uint32_t bin = 0; bin < N_histogram_bins; bin++) {
+                file << " " << (uint64_t)counts[bin];
+            }
+            file << "\n";
+        }
+    }
+
+public:
+    // first_step is the step the run starts from; after a restart the lines
+    // are appended to the file
+    Diagnostics(const Domain &input_domain, const uint32_t N_threads, const uint8_t input_dimension,
+                const uint32_t input_N_cells_1D, const std::string &file_name, const uint64_t input_totals_steps,
+                const uint64_t input_analysis_steps, const uint32_t input_N_histogram_bins, const uint64_t first_step = 0)
+        : domain(&input_domain), dimension(input_dimension), N_cells_1D(input_N_cells_1D), totals_steps(input_totals_steps),
+          analysis_steps(input_analysis_steps), N_histogram_bins(input_N_histogram_bins), thread_totals(N_threads),
+          last_totals_step(first_step), last_analysis_step(first_step), warned_spectrum(false)
+    {
+        if (N_histogram_bins == 0) {
+            throw std::invalid_argument("The density histogram needs at least one bin.");
+        }
+        if (!domain->is_root()) {
+            return;
+        }
+        file.open(file_name, first_step > 0 ? std::ios::app : std::ios::trunc);
+        if (!file) {
+            throw std::runtime_error("Could not open the diagnostics file " + file_name + ".");
+        }
+        file << std::scientific;
+        file.precision(10);
+        if (first_step == 0) {
+            const char *axes[MAX_DIMENSION] = {"x", "y", "z"};
+            file << "# totals step time mass";
+            for (uint8_t d = 0; d < dimension; d++) {
+                file << " momentum_" << axes[d];
+            }
+            file << " energy kinetic_energy min_density max_density min_pressure max_pressure\n";
+            file << "# spectrum step time E(k) for k = 0 to N_cells_1D / 2 along x\n";
+            file << "# histogram step time min_density max_density then " << N_histogram_bins << " density counts\n";
+        }
+    }
+
+    Diagnostics(const Diagnostics &) = delete;
+    Diagnostics &operator=(const Diagnostics &) = delete;
+
+    // The totals of the threads for a sweep that ends step, to pass to
+    // the sweep with the thread index added; nullptr when step writes none.
+    DiagnosticTotals *begin_step(const uint64_t step) {
+        if (!is_totals_step(step)) {
+            return nullptr;
+        }
+        for (DiagnosticTotals &totals : thread_totals) {
+            totals.reset();
+        }
+        return thread_totals.data();
+    }
+
+    // After the evolve of step, with the state at time in the prev values.
+    // swept tells whether the sweep added the totals of begin_step. Collective
+    // over the ranks.
+    void end_step(const FieldStore &fields, SweepEngine &engine, const uint64_t step, const double time, const bool swept) {
+        if (!is_totals_step(step)) {
+            return;
+        }
+        if (!swept) {
+            accumulate(fields, engine);
+        }
+        const DiagnosticTotals totals = reduce();
+        write_totals(step, time, totals);
+        last_totals_step = step;
+
+        if (is_due(step, analysis_steps, last_analysis_step)) {
+            write_spectrum(fields, engine, step, time);
+            write_histogram(fields, engine, step, time, totals);
+            last_analysis_step = step;
+        }
+    }
+};
+
+#endif /* DIAGNOSTICS_HPP */
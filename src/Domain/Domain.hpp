@@ -0,0 +1,316 @@
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+
+#ifndef DOMAIN_HPP
+#define DOMAIN_HPP
+
+#ifdef WITH_MPI
+#ifdef WITH_DOUBLE
+#define MPI_REAL_TYPE MPI_DOUBLE
+#else
+#define MPI_REAL_TYPE MPI_FLOAT
+#endif
+#endif
+
+// Cartesian decomposition of the periodic box over the ranks. Every rank owns a
+// block of the global grid (its Stencil extent and offset) and the ghost layers
+// around it are filled from the neighboring ranks; the periodic wrap is the
+// periodic topology of the communicator. Without WITH_MPI there is a single
+// rank and the halo exchange is the local periodic ghost fill.
+class Domain
+{
+private:
+    uint8_t dimension;
+    uint32_t N_cells_1D;
+    int rank;
+    int N_ranks;
+    std::array<int, MAX_DIMENSION> ranks_per_dimension;
+    std::array<int, MAX_DIMENSION> rank_coordinates;
+    std::array<uint32_t, MAX_DIMENSION> local_extent;
+    std::array<uint32_t, MAX_DIMENSION> offset;
+    // fill the edge and corner ghosts too, for stencils that read diagonal neighbors
+    bool exchange_corners = false;
+
+#ifdef WITH_MPI
+    MPI_Comm cartesian_comm;
+    // [d][0] is the neighbor below along d, [d][1] the one above
+    std::array<std::array<int, 2>, MAX_DIMENSION> neighbor_ranks;
+    // [d][side] face datatypes over one padded field array
+    std::array<std::array<MPI_Datatype, 2>, MAX_DIMENSION> send_face;
+    std::array<std::array<MPI_Datatype, 2>, MAX_DIMENSION> receive_face;
+    std::vector<MPI_Request> requests;
+    bool face_types_committed;
+
+    // One face of ghosts (ghost = true) or of the interior cells next to it. With
+    // the edge and corner ghosts exchanged, the faces along d span the ghost
+    // layers of the dimensions before d, which are filled first.
+    MPI_Datatype make_face_type(const Stencil &stencil, const uint8_t d, const int side, const bool ghost) const {
+        const int N_ghost = (int)stencil.get_N_ghost();
+        int sizes[MAX_DIMENSION];
+        int subsizes[MAX_DIMENSION];
+        int starts[MAX_DIMENSION];
+        // MPI wants the slowest-varying dimension first
+        for (uint8_t k = 0; k < dimension; k++) {
+            const int m = dimension - 1 - k;
+            sizes[m] = (int)stencil.get_padded_extent(k);
+            subsizes[m] = (k == d) ? N_ghost : (int)stencil.get_extent(k);
+            starts[m] = (k == d) ? 0 : N_ghost;
+            if (k == d) {
+                if (ghost) {
+                    starts[m] = (side == 0) ? 0 : (int)stencil.get_extent(k) + N_ghost;
+                } else {
+                    starts[m] = (side == 0) ? N_ghost : (int)stencil.get_extent(k);
+                }
+            } else if (exchange_corners && k < d) {
+                subsizes[m] = (int)stencil.get_padded_extent(k);
+                starts[m] = 0;
+            }
+        }
+
+        MPI_Datatype face_type;
+        MPI_Type_create_subarray(dimension, sizes, subsizes, starts, MPI_ORDER_C, MPI_REAL_TYPE, &face_type);
+        MPI_Type_commit(&face_type);
+        return face_type;
+    }
+
+    void post_halo_exchange(FieldStore &fields, const uint8_t d) {
+        for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+            real *field = fields.get_prev(f);
+            for (int side = 0; side < 2; side++) {
+                // the message for our ghost on this side was sent from the other side
+                const int receive_tag = (f * MAX_DIMENSION + d) * 2 + (1 - side);
+                const int send_tag = (f * MAX_DIMENSION + d) * 2 + side;
+                requests.emplace_back();
+                MPI_Irecv(field, 1, receive_face[d][side], neighbor_ranks[d][side], receive_tag,
+                          cartesian_comm, &requests.back());
+                requests.emplace_back();
+                MPI_Isend(field, 1, send_face[d][side], neighbor_ranks[d][side], send_tag,
+                          cartesian_comm, &requests.back());
+            }
+        }
+    }
+#endif
+
+public:
+    Domain(int *argc, char ***argv, const uint8_t input_dimension, const uint32_t input_N_cells_1D)
+    {
+        dimension = input_dimension;
+        N_cells_1D = input_N_cells_1D;
+        rank = 0;
+        N_ranks = 1;
+        ranks_per_dimension = {1, 1, 1};
+        rank_coordinates = {0, 0, 0};
+
+#ifdef WITH_MPI
+        int provided;
+        // only the main thread talks to MPI, the sweep engine threads never do
+        MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+        MPI_Comm_size(MPI_COMM_WORLD, &N_ranks);
+
+        int dims[MAX_DIMENSION] = {0, 0, 0};
+        int periods[MAX_DIMENSION] = {1, 1, 1};
+        MPI_Dims_create(N_ranks, dimension, dims);
+        MPI_Cart_create(MPI_COMM_WORLD, dimension, dims, periods, 1, &cartesian_comm);
+        MPI_Comm_rank(cartesian_comm, &rank);
+
+        int coords[MAX_DIMENSION] = {0, 0, 0};
+        MPI_Cart_coords(cartesian_comm, rank, dimension, coords);
+        // MPI orders dims slowest first; dimension 0 here is the fastest-varying one
+        for (uint8_t d = 0; d < dimension; d++) {
+            ranks_per_dimension[d] = dims[dimension - 1 - d];
+            rank_coordinates[d] = coords[dimension - 1 - d];
+            MPI_Cart_shift(cartesian_comm, dimension - 1 - d, 1, &neighbor_ranks[d][0], &neighbor_ranks[d][1]);
+        }
+        face_types_committed = false;
+#endif
+
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            if (d >= dimension) {
+                local_extent[d] = 1;
+                offset[d] = 0;
+                continue;
+            }
+            if ((uint32_t)ranks_per_dimension[d] > N_cells_1D) {
+                throw std::invalid_argument("More ranks than cells along dimension " + std::to_string(d) + ".");
+            }
+
+            // the first N % p ranks along d get one extra cell
+            const uint32_t base = N_cells_1D / ranks_per_dimension[d];
+            const uint32_t remainder = N_cells_1D % ranks_per_dimension[d];
+            const uint32_t c = rank_coordinates[d];
+            local_extent[d] = base + (c < remainder ? 1 : 0);
+            offset[d] = c * base + std::min(c, remainder);
+        }
+    }
+
+    ~Domain() {
+#ifdef WITH_MPI
+        if (face_types_committed) {
+            for (uint8_t d = 0; d < dimension; d++) {
+                for (int side = 0; side < 2; side++) {
+                    MPI_Type_free(&send_face[d][side]);
+                    MPI_Type_free(&receive_face[d][side]);
+                }
+            }
+        }
+        MPI_Comm_free(&cartesian_comm);
+        MPI_Finalize();
+#endif
+    }
+
+    Domain(const Domain &) = delete;
+    Domain &operator=(const Domain &) = delete;
+
+    int get_rank() const {
+        return rank;
+    }
+
+    int get_N_ranks() const {
+        return N_ranks;
+    }
+
+    bool is_root() const {
+        return rank == 0;
+    }
+
+    int get_ranks_per_dimension(const uint8_t d) const {
+        return ranks_per_dimension[d];
+    }
+
+    const std::array<uint32_t, MAX_DIMENSION> &get_local_extent() const {
+        return local_extent;
+    }
+
+    const std::array<uint32_t, MAX_DIMENSION> &get_offset() const {
+        return offset;
+    }
+
+#ifdef WITH_MPI
+    MPI_Comm get_comm() const {
+        return cartesian_comm;
+    }
+#endif
+
+    // With corners, the faces along each dimension are sent once those of the
+    // dimensions before it have arrived, so only dimension 0 overlaps with the
+    // inner update. Has to be set before the first exchange.
+    void set_exchange_corners(const bool input_exchange_corners) {
+#ifdef WITH_MPI
+        if (face_types_committed && input_exchange_corners != exchange_corners) {
+            throw std::invalid_argument("The corner exchange cannot change after the first halo exchange.");
+        }
+#endif
+        exchange_corners = input_exchange_corners;
+    }
+
+    // Start filling the prev-state ghost layers; only cells that read no ghosts
+    // (Stencil::for_each_row_segment with inner = true) may be updated before
+    // finish_halo_exchange.
+    void begin_halo_exchange(FieldStore &fields) {
+#ifdef WITH_MPI
+        const Stencil &stencil = fields.get_stencil();
+        if (!face_types_committed) {
+            for (uint8_t d = 0; d < dimension; d++) {
+                for (int side = 0; side < 2; side++) {
+                    send_face[d][side] = make_face_type(stencil, d, side, false);
+                    receive_face[d][side] = make_face_type(stencil, d, side, true);
+                }
+            }
+            face_types_committed = true;
+        }
+
+        requests.clear();
+        for (uint8_t d = 0; d < (exchange_corners ? 1 : dimension); d++) {
+            post_halo_exchange(fields, d);
+        }
+#else
+        fields.fill_ghosts();
+#endif
+    }
+
+    void finish_halo_exchange(FieldStore &fields) {
+#ifdef WITH_MPI
+        MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+        requests.clear();
+        for (uint8_t d = 1; d < dimension && exchange_corners; d++) {
+            post_halo_exchange(fields, d);
+            MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+            requests.clear();
+        }
+#endif
+    }
+
+    void exchange_halos(FieldStore &fields) {
+        begin_halo_exchange(fields);
+        finish_halo_exchange(fields);
+    }
+
+    real global_max(const real value) const {
+#ifdef WITH_MPI
+        real result;
+        MPI_Allreduce(&value, &result, 1, MPI_REAL_TYPE, MPI_MAX, cartesian_comm);
+        return result;
+#else
+        return value;
+#endif
+    }
+
+    // element by element over the ranks, in place
+    void global_sum(double *values, const int N_values) const {
+#ifdef WITH_MPI
+        MPI_Allreduce(MPI_IN_PLACE, values, N_values, MPI_DOUBLE, MPI_SUM, cartesian_comm);
+#endif
+    }
+
+    void global_max(double *values, const int N_values) const {
+#ifdef WITH_MPI
+        MPI_Allreduce(MPI_IN_PLACE, values, N_values, MPI_DOUBLE, MPI_MAX, cartesian_comm);
+#endif
+    }
+
+    // Write each rank's text into one file, in rank order. Under MPI this is a
+    // collective MPI_File_write_ordered, so the ranks write in parallel.
+    void write_ordered(const std::string &file_name, const std::string &text) const {
+#ifdef WITH_MPI
+        MPI_File file;
+        MPI_File_open(cartesian_comm, file_name.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+        MPI_File_set_size(file, 0);
+        MPI_File_write_ordered(file, text.data(), (int)text.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+        MPI_File_close(&file);
+#else
+        std::ofstream file(file_name);
+        file << text;
+        file.close();
+#endif
+    }
+
+    // true on every rank if it is true on any
+    bool any(const bool value) const {
+#ifdef WITH_MPI
+        int local = value ? 1 : 0;
+        int result;
+        MPI_Allreduce(&local, &result, 1, MPI_INT, MPI_LOR, cartesian_comm);
+        return result != 0;
+#else
+        return value;
+#endif
+    }
+
+    void barrier() const {
+#ifdef WITH_MPI
+        MPI_Barrier(cartesian_comm);
+#endif
+    }
+};
+
+#endif /* DOMAIN_HPP */
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+#include "../main.hpp"
+#include "../Config/Config.hpp"
+#include "../Grid/Grid.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../InterleavedUpdate/InterleavedUpdate.hpp"
+#include "../GodunovUpdate/GodunovUpdate.hpp"
+#include "../CellOrdering/CellOrdering.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Profiler/Profiler.hpp"
+
+#ifndef ENSEMBLE_HPP
+#define ENSEMBLE_HPP
+
+// Independent runs advanced together in one process, e.g. a sweep over gamma,
+// the initial amplitude and the resolution. Every line of the ensemble file is
+// a member, given by the name=value pairs it changes in the run parameters:
+//
+//     # ensemble file
+//     gamma=1.4 ic_amplitude=0.5
+//     gamma=1.4 ic_amplitude=1.0 N_cells_1D=128
+//
+// A small grid can't keep the threads busy on its own, so the members are
+// shared out over the SweepEngine instead, largest first, and each one is
+// stepped to the end on the thread that took it. Centered members on grids of
+// the same shape, e.g. a sweep over gamma or the amplitude, go together as
+// many as a vector has lanes: their fields are interleaved so the kernels
+// vectorize across the members, see InterleavedUpdate. The others, those too
+// few to fill the lanes, and all with ensemble_interleave = 0, go one per
+// thread. A member steps exactly as a run of its own parameters would and
+// writes its snapshots and parameters to member_<m>/.
+class Ensemble
+{
+private:
+    struct Member
+    {
+        Config config;
+        // the name=value pairs of its line
+        std::string changes;
+        std::unique_ptr<Domain> domain;
+        std::unique_ptr<Grid> grid;
+        // a pool of one thread runs inline, on the thread that took the member
+        std::unique_ptr<SweepEngine> engine;
+        std::unique_ptr<SimdUpdate> fused_update;
+        std::unique_ptr<RowTraversal> traversal;
+        std::unique_ptr<GodunovUpdate> godunov_update;
+
+        // the time step state of main
+        real dt_max;
+        real CFL_prefactor;
+        real dt_minimum;
+        real dt;
+        real dt_dx;
+        real current_time;
+        real dump_timer;
+        uint64_t dump_counter;
+        uint64_t step;
+        bool unstable;
+        bool stopped;
+
+        // cell updates per step, every stage counted, and the work to the end
+        uint64_t N_step_cell_updates;
+        double cost;
+        uint64_t N_cell_updates;
+        double seconds;
+    };
+
+    std::vector<Member> members;
+    // see Config::ensemble_interleave
+    bool interleave;
+    // the finish lines of the members come from the worker threads
+    std::mutex print_mutex;
+
+    // what a member may change; the rest is shared by the whole process
+    static bool is_member_parameter(const std::string &key) {
+        static const char *keys[] = {"dimension", "N_cells_1D", "max_time", "dump_interval", "initial_conditions",
+                                     "ic_amplitude", "ic_file", "gamma", "scheme", "integrator", "slope_limiter", "riemann_solver",
+                                     "cfl_number", "N_scalars", "simd_isa", "traversal", "tile_size"};
+        for (const char *member_key : keys) {
+            if (key == member_key) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void make_directory(const std::string &name) {
+        if (mkdir(name.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Could not create the directory " + name + ".");
+        }
+    }
+
+    void add_member(const Config &base, const std::string &changes, SweepEngine &engine) {
+        members.emplace_back();
+        Member &member = members.back();
+        const std::string name = "member_" + std::to_string(members.size() - 1);
+
+        member.config = base;
+        member.config.ensemble_file.clear();
+        member.changes = changes;
+        std::istringstream pairs(changes);
+        std::string pair;
+        try {
+            while (pairs >> pair) {
+                const size_t equals = pair.find('=');
+                if (equals == std::string::npos || equals == 0 || equals + 1 == pair.size()) {
+                    throw std::invalid_argument("Expected name=value, got '" + pair + "'.");
+                }
+                const std::string key = pair.substr(0, equals);
+                if (!is_member_parameter(key)) {
+                    throw std::invalid_argument("An ensemble member can't change " + key + ".");
+                }
+                member.config.set(key, pair.substr(equals + 1));
+            }
+            member.config.validate();
+        } catch (const std::invalid_argument &error) {
+            throw std::invalid_argument(name + ": " + error.what());
+        }
+        const Config &config = member.config;
+
+        make_directory(name);
+        std::ofstream parameters(name + "/parameters.txt");
+        parameters << std::setprecision(17);
+        config.describe(parameters);
+
+        const uint32_t N_ghost = (config.scheme == SCHEME_GODUNOV) ? N_GHOST_GODUNOV : N_GHOST;
+        member.domain = std::make_unique<Domain>(nullptr, nullptr, config.dimension, config.N_cells_1D);
+        member.grid = std::make_unique<Grid>(config.dimension, config.N_cells_1D, member.domain->get_local_extent(),
+                                             member.domain->get_offset(),
+                                             InitialConditions(config.initial_conditions, config.ic_amplitude, config.ic_file),
+                                             config.gamma, N_ghost, config.N_scalars, &engine, config.huge_pages);
+        // written by the thread stepping the member, without a writer thread each
+        member.grid->set_N_dump_buffers(0);
+        member.grid->set_dump_type(config.dump_type);
+        member.grid->set_output_prefix(name + "/");
+        member.engine = std::make_unique<SweepEngine>(1, SCHEDULE_STATIC, 1);
+        member.fused_update = std::make_unique<SimdUpdate>(member.grid->get_fields(), config.simd_isa, config.gamma,
+                                                           config.huge_pages);
+        member.traversal = std::make_unique<RowTraversal>(member.grid->get_stencil(), config.traversal, config.tile_size);
+        if (config.scheme == SCHEME_GODUNOV) {
+            member.godunov_update = std::make_unique<GodunovUpdate>(member.grid->get_fields(), config.gamma, config.integrator,
+                                                                    config.slope_limiter, config.riemann_solver);
+            member.domain->set_exchange_corners(member.godunov_update->needs_corners());
+        }
+
+        member.dt_max = (real)config.dump_interval / 2.;
+        const real dx = 1. / (real)config.N_cells_1D;
+        real CFL_number = config.cfl_number;
+        if (CFL_number == 0.) {
+            CFL_number = (config.scheme == SCHEME_GODUNOV) ? 0.8 / (real)config.dimension : 0.01;
+        }
+        member.CFL_prefactor = CFL_number * dx;
+        member.dt_minimum = member.CFL_prefactor / 100.;
+        member.dt = member.CFL_prefactor / member.grid->get_max_signal_speed(engine);
+        if (member.dt > member.dt_max) {
+            member.dt = member.dt_max;
+        }
+        member.dt_dx = member.dt / (2.0 * dx);
+        member.current_time = 0.;
+        member.dump_timer = 0.;
+        member.dump_counter = 0;
+        member.step = 0;
+        member.unstable = !(member.dt >= member.dt_minimum);
+        member.stopped = false;
+
+        const uint8_t N_stages = member.godunov_update ? member.godunov_update->get_N_stages() : 1;
+        member.N_step_cell_updates = N_stages * member.grid->get_stencil().get_N_interior();
+        member.cost = (double)member.N_step_cell_updates * config.max_time / member.dt;
+        member.N_cell_updates = 0;
+        member.seconds = 0.;
+    }
+
+    // The plain loop of main for member after its update and evolve, given
+    // the largest next signal speed; false once its run is done. Before a dump
+    // sync_fields() brings the fields of its grid up to date.
+    template <typename SyncFields>
+    static bool end_step(Member &member, const real max_signal_speed, const volatile std::sig_atomic_t &stop_requested,
+                         SyncFields sync_fields) {
+        const Config &config = member.config;
+        member.N_cell_updates += member.N_step_cell_updates;
+
+        member.current_time += member.dt;
+        if (member.current_time > config.max_time) {
+            return false;
+        }
+
+        member.dump_timer += member.dt;
+        if (member.dump_timer > config.dump_interval) {
+            sync_fields();
+            member.grid->save_cells(member.dump_counter, member.current_time, *member.domain);
+            member.dump_timer = 0.;
+            member.dump_counter++;
+        }
+
+        member.dt = member.CFL_prefactor / max_signal_speed;
+        if (member.dt > member.dt_max) {
+            member.dt = member.dt_max;
+        }
+        if (!(member.dt >= member.dt_minimum)) {
+            member.unstable = true;
+            return false;
+        }
+        member.dt_dx = member.dt * (real)config.N_cells_1D / 2.0;
+        member.step++;
+
+        if (stop_requested != 0) {
+            member.stopped = true;
+            return false;
+        }
+        return true;
+    }
+
+    void finish(Member &member, const std::chrono::steady_clock::time_point start) {
+        member.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(print_mutex);
+        print_member(member);
+    }
+
+    // one member on its own, to the end of its run
+    void advance(Member &member, const volatile std::sig_atomic_t &stop_requested) {
+        const auto start = std::chrono::steady_clock::now();
+        FieldStore &fields = member.grid->get_fields();
+        const uint64_t N_rows = member.grid->get_stencil().get_N_rows();
+
+        while (!member.unstable) {
+            real max_signal_speed;
+            if (member.godunov_update) {
+                for (uint8_t stage = 0; stage < member.godunov_update->get_N_stages(); stage++) {
+                    if (stage > 0) {
+                        member.grid->evolve();
+                    }
+                    member.godunov_update->set_stage(stage);
+                    member.domain->exchange_halos(fields);
+                    max_signal_speed = member.godunov_update->update(*member.engine, *member.traversal, member.dt_dx);
+                }
+            } else {
+                member.domain->begin_halo_exchange(fields);
+                member.fused_update->flux_rows(*member.traversal, 0, N_rows, true);
+                member.domain->finish_halo_exchange(fields);
+                member.fused_update->flux_rows(*member.traversal, 0, N_rows, false);
+                max_signal_speed = member.fused_update->update_rows(*member.traversal, 0, N_rows, member.dt_dx);
+            }
+            member.grid->evolve();
+            if (!end_step(member, max_signal_speed, stop_requested, []() {})) {
+                break;
+            }
+        }
+        finish(member, start);
+    }
+
+    // A centered member without passive scalars whose SimdUpdate has vectors.
+    static bool can_interleave(const Member &member) {
+        return !member.godunov_update && member.config.N_scalars == 0
+               && SimdUpdate::get_N_lanes(member.fused_update->get_isa()) > 1;
+    }
+
+    // whether a and b, both can_interleave, fit the same InterleavedUpdate
+    static bool same_shape(const Member &a, const Member &b) {
+        return a.config.dimension == b.config.dimension && a.config.N_cells_1D == b.config.N_cells_1D
+               && a.fused_update->get_isa() == b.fused_update->get_isa();
+    }
+
+    // The members of group, one per lane, stepped together each with its own
+    // time step until the last is done. A lane that is done is cleared, so the
+    // others step on bit for bit as they would alone.
+    void advance_group(const std::vector<uint64_t> &group, const volatile std::sig_atomic_t &stop_requested) {
+        const auto start = std::chrono::steady_clock::now();
+        const Member &first = members[group[0]];
+        InterleavedUpdate interleaved(first.grid->get_stencil(), first.fused_update->get_isa(), first.config.huge_pages);
+        std::vector<real> max_signal_speeds(interleaved.get_N_lanes());
+        std::vector<bool> running(group.size());
+        uint64_t N_running = 0;
+        for (uint32_t lane = 0; lane < group.size(); lane++) {
+            Member &member = members[group[lane]];
+            running[lane] = !member.unstable;
+            if (running[lane]) {
+                interleaved.set_lane(lane, member.grid->get_fields(), member.config.gamma, member.dt_dx);
+                N_running++;
+            } else {
+                finish(member, start);
+            }
+        }
+
+        while (N_running > 0) {
+            interleaved.update(max_signal_speeds.data());
+            interleaved.evolve();
+            for (uint32_t lane = 0; lane < group.size(); lane++) {
+                if (!running[lane]) {
+                    continue;
+                }
+                Member &member = members[group[lane]];
+                auto sync_fields = [&]() {
+                    interleaved.get_lane(lane, member.grid->get_fields());
+                };
+                if (end_step(member, max_signal_speeds[lane], stop_requested, sync_fields)) {
+                    interleaved.set_dt_dx(lane, member.dt_dx);
+                } else {
+                    // its grid is left with its last state, as by advance
+                    sync_fields();
+                    interleaved.clear_lane(lane);
+                    running[lane] = false;
+                    N_running--;
+                    finish(member, start);
+                }
+            }
+        }
+    }
+
+    void print_member(const Member &member) const {
+        const uint64_t m = &member - members.data();
+        std::cout << "member " << m << " (" << member.changes << "): " << get_status(member) << " at time "
+                  << member.current_time << " after " << get_N_steps(member) << " steps in " << member.seconds << " s\n";
+    }
+
+    static uint64_t get_N_steps(const Member &member) {
+        return member.N_cell_updates / member.N_step_cell_updates;
+    }
+
+    static std::string get_status(const Member &member) {
+        if (member.unstable) {
+            return "unstable";
+        }
+        return member.stopped ? "stopped" : "finished";
+    }
+
+public:
+    // the members of base.ensemble_file; engine finds their first time steps
+    Ensemble(const Config &base, SweepEngine &engine) : interleave(base.ensemble_interleave)
+    {
+        std::ifstream file(base.ensemble_file);
+        if (!file) {
+            throw std::invalid_argument("Could not open ensemble file " + base.ensemble_file + ".");
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            line = line.substr(0, line.find('#'));
+            const size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos) {
+                continue;
+            }
+            add_member(base, line.substr(first, line.find_last_not_of(" \t\r") - first + 1), engine);
+        }
+        if (members.empty()) {
+            throw std::invalid_argument("The ensemble file " + base.ensemble_file + " has no members.");
+        }
+    }
+
+    Ensemble(const Ensemble &) = delete;
+    Ensemble &operator=(const Ensemble &) = delete;
+
+    uint64_t get_N_members() const {
+        return members.size();
+    }
+
+    // Every member to the end of its run, or to the step where stop_requested
+    // was seen; true if all of them stayed stable. engine should hand out one
+    // member or group at a time, as they differ in size.
+    bool run(SweepEngine &engine, Profiler &profiler, const volatile std::sig_atomic_t &stop_requested) {
+        std::vector<uint64_t> order(members.size());
+        for (uint64_t m = 0; m < members.size(); m++) {
+            order[m] = m;
+        }
+        // the longest ones first, so none is left to run alone at the end
+        std::stable_sort(order.begin(), order.end(), [&](const uint64_t a, const uint64_t b) {
+            return members[a].cost > members[b].cost;
+        });
+
+        // what a thread takes: a group of members for InterleavedUpdate, or
+        // one member; in the order of their largest members
+        std::vector<std::vector<uint64_t>> items;
+        for (const uint64_t m : order) {
+            std::vector<uint64_t> *group = nullptr;
+            if (interleave && can_interleave(members[m])) {
+                const uint32_t N_lanes = SimdUpdate::get_N_lanes(members[m].fused_update->get_isa());
+                for (std::vector<uint64_t> &item : items) {
+                    if (item.size() < N_lanes && can_interleave(members[item[0]]) && same_shape(members[item[0]], members[m])) {
+                        group = &item;
+                        break;
+                    }
+                }
+            }
+            if (group != nullptr) {
+                group->push_back(m);
+            } else {
+                items.push_back({m});
+            }
+        }
+        // A group steps all its lanes, so one that doesn't fill them is slower
+        // than its members one per thread, each vectorized along its rows.
+        for (uint64_t k = 0; k < items.size(); k++) {
+            if (items[k].size() > 1 && items[k].size() < SimdUpdate::get_N_lanes(members[items[k][0]].fused_update->get_isa())) {
+                for (uint64_t g = 1; g < items[k].size(); g++) {
+                    items.push_back({items[k][g]});
+                }
+                items[k].resize(1);
+            }
+        }
+        std::stable_sort(items.begin(), items.end(), [&](const std::vector<uint64_t> &a, const std::vector<uint64_t> &b) {
+            return members[a[0]].cost > members[b[0]].cost;
+        });
+        uint64_t N_groups = 0;
+        uint64_t N_interleaved = 0;
+        for (const std::vector<uint64_t> &item : items) {
+            if (item.size() > 1) {
+                N_groups++;
+                N_interleaved += item.size();
+            }
+        }
+
+        {
+            ScopedTimer timer(profiler, "ensemble");
+            engine.parallel_for(items.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+                for (uint64_t k = begin; k < end; k++) {
+                    if (items[k].size() > 1) {
+                        advance_group(items[k], stop_requested);
+                    } else {
+                        advance(members[items[k][0]], stop_requested);
+                    }
+                }
+            });
+        }
+
+        // the whole ensemble as one step of the report
+        uint64_t N_steps = 0;
+        real max_time = 0.;
+        bool stable = true;
+        for (uint64_t m = 0; m < members.size(); m++) {
+            const Member &member = members[m];
+            // the centered members also pass through the face buffers of FusedUpdate
+            const uint64_t face_flux_bytes =
+                member.godunov_update ? 0 : FusedUpdate::get_face_flux_bytes_per_cell(member.config.dimension);
+            profiler.count(member.N_cell_updates,
+                           member.N_cell_updates * (member.grid->get_fields().get_bytes_per_cell() + face_flux_bytes));
+            profiler.add_info("member_" + std::to_string(m), member.changes + ": " + get_status(member) + " after "
+                              + std::to_string(get_N_steps(member)) + " steps");
+            N_steps += get_N_steps(member);
+            max_time = std::max(max_time, member.current_time);
+            stable = stable && !member.unstable;
+        }
+        profiler.end_step(N_steps, max_time, 0.);
+
+        const double elapsed = profiler.get_elapsed();
+        const double members_per_hour = elapsed > 0. ? 3600. * (double)members.size() / elapsed : 0.;
+        profiler.add_info("N_members", std::to_string(members.size()));
+        profiler.add_info("N_interleaved_members", std::to_string(N_interleaved));
+        profiler.add_info("N_interleaved_groups", std::to_string(N_groups));
+        profiler.add_info("members_per_hour", std::to_string(members_per_hour));
+        std::cout << members.size() << " members (" << N_interleaved << " interleaved in " << N_groups << " groups) on "
+                  << engine.get_N_threads() << " threads in " << elapsed << " s, " << members_per_hour << " members per hour\n";
+        return stable;
+    }
+};
+
+#endif /* ENSEMBLE_HPP */
@@ -0,0 +1,251 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../NumaArena/NumaArena.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+
+#ifndef FIELD_STORE_HPP
+#define FIELD_STORE_HPP
+
+// every field array starts on a cache line (and AVX-512 register) boundary
+#define FIELD_ALIGNMENT 64
+
+// field slots, velocity components follow PRESSURE, one per dimension, and
+// the passive scalars follow the velocity components
+#define FIELD_DENSITY 0
+#define FIELD_ENERGY 1
+#define FIELD_PRESSURE 2
+#define FIELD_VELOCITY 3
+#define MAX_N_SCALARS 8
+#define MAX_N_FIELDS (FIELD_VELOCITY + MAX_DIMENSION + MAX_N_SCALARS)
+
+// Structure-of-arrays storage for the prev and next state of every cell. All
+// arrays live in a single block from NumaArena, one contiguous array per
+// variable, laid out (ghost layers included) as described by the stencil.
+class FieldStore
+{
+private:
+    Stencil stencil;
+    uint64_t N_cells;
+    uint8_t N_fields;
+    uint8_t N_scalars;
+    // length of each array, rounded up so every array stays aligned
+    uint64_t N_padded;
+
+    real *block;
+    size_t block_bytes;
+    // a restored checkpoint that holds the prev arrays, see Checkpoint
+    void *mapping;
+    size_t mapping_bytes;
+    real *prev[MAX_N_FIELDS];
+    real *next[MAX_N_FIELDS];
+
+public:
+    explicit FieldStore(const Stencil &input_stencil, const uint8_t input_N_scalars = 0, const uint8_t huge_pages = HUGE_PAGES)
+    {
+        stencil = input_stencil;
+        N_cells = stencil.get_N_storage();
+        N_scalars = input_N_scalars;
+        N_fields = get_N_fields(stencil, N_scalars);
+        N_padded = get_N_padded(stencil);
+        mapping = nullptr;
+        mapping_bytes = 0;
+
+        block = static_cast<real *>(NumaArena::allocate(2 * N_fields * N_padded * sizeof(real), huge_pages, block_bytes));
+
+        for (uint8_t f = 0; f < N_fields; f++) {
+            prev[f] = block + f * N_padded;
+            next[f] = block + (N_fields + f) * N_padded;
+        }
+    }
+
+    // Take over an mmap'ed region whose bytes from prev_offset on are the prev
+    // arrays laid out as get_prev(0) would be. The region is unmapped on
+    // destruction; only the next arrays are allocated.
+    FieldStore(const Stencil &input_stencil, const uint8_t input_N_scalars, void *input_mapping, const size_t input_mapping_bytes,
+               const uint64_t prev_offset, const uint8_t huge_pages = HUGE_PAGES)
+    {
+        stencil = input_stencil;
+        N_cells = stencil.get_N_storage();
+        N_scalars = input_N_scalars;
+        N_fields = get_N_fields(stencil, N_scalars);
+        N_padded = get_N_padded(stencil);
+        mapping = input_mapping;
+        mapping_bytes = input_mapping_bytes;
+
+        if (prev_offset % FIELD_ALIGNMENT != 0 || prev_offset + N_fields * N_padded * sizeof(real) > mapping_bytes) {
+            throw std::invalid_argument("Mapped fields are misaligned or too short.");
+        }
+
+        block = static_cast<real *>(NumaArena::allocate(N_fields * N_padded * sizeof(real), huge_pages, block_bytes));
+
+        real *mapped_prev = reinterpret_cast<real *>(static_cast<char *>(mapping) + prev_offset);
+        for (uint8_t f = 0; f < N_fields; f++) {
+            prev[f] = mapped_prev + f * N_padded;
+            next[f] = block + f * N_padded;
+        }
+    }
+
+    ~FieldStore() {
+        NumaArena::release(block, block_bytes);
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_bytes);
+        }
+    }
+
+    FieldStore(const FieldStore &) = delete;
+    FieldStore &operator=(const FieldStore &) = delete;
+
+    // The next values become the prev values by swapping the two sides, so an
+    // evolve moves no data. The next arrays then hold the old prev values, which
+    // every update overwrites, see GodunovUpdate for a stage that reads them
+    // first. Each side stays contiguous from field 0.
+    void evolve() {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            std::swap(prev[f], next[f]);
+        }
+    }
+
+    // Write zeros to the arrays of every field in the static partition of the
+    // rows over the threads of engine, see SweepEngine, so each page is first
+    // touched, and placed, on the NUMA node of the thread that sweeps it. The
+    // prev arrays of a restored checkpoint already hold the state and are kept.
+    void first_touch(SweepEngine &engine) {
+        const uint64_t N_rows = stencil.get_N_rows();
+        const uint32_t N_threads = engine.get_N_threads();
+        engine.parallel_for_static(N_threads, [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t t = begin; t < end; t++) {
+                const uint64_t first = (t == 0) ? 0 : stencil.row_start(N_rows * t / N_threads);
+                const uint64_t last = (t + 1 == N_threads) ? N_padded : stencil.row_start(N_rows * (t + 1) / N_threads);
+                if (first >= last) {
+                    continue;
+                }
+                for (uint8_t f = 0; f < N_fields; f++) {
+                    if (mapping == nullptr) {
+                        std::memset(prev[f] + first, 0, (last - first) * sizeof(real));
+                    }
+                    std::memset(next[f] + first, 0, (last - first) * sizeof(real));
+                }
+            }
+        });
+    }
+
+    // bytes of the field block on each NUMA node, see NumaTopology::get_node_bytes
+    std::vector<uint64_t> get_node_bytes() const {
+        return NumaTopology::get_node_bytes(block, block_bytes);
+    }
+
+    // refresh the periodic ghost layers of the prev state
+    void fill_ghosts() {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            stencil.fill_periodic_ghosts(prev[f]);
+        }
+    }
+
+    const Stencil &get_stencil() const {
+        return stencil;
+    }
+
+    uint64_t get_N_cells() const {
+        return N_cells;
+    }
+
+    uint8_t get_N_fields() const {
+        return N_fields;
+    }
+
+    uint8_t get_N_scalars() const {
+        return N_scalars;
+    }
+
+    static uint8_t get_N_fields(const Stencil &stencil, const uint8_t N_scalars = 0) {
+        if (N_scalars > MAX_N_SCALARS) {
+            throw std::invalid_argument("At most " + std::to_string(MAX_N_SCALARS) + " passive scalars are supported.");
+        }
+        return FIELD_VELOCITY + stencil.get_dimension() + N_scalars;
+    }
+
+    // length of each field array, the prev (or next) arrays of all fields are
+    // N_fields * N_padded contiguous values starting at get_prev(0)
+    static uint64_t get_N_padded(const Stencil &stencil) {
+        const uint64_t reals_per_line = FIELD_ALIGNMENT / sizeof(real);
+        return ((stencil.get_N_storage() + reals_per_line - 1) / reals_per_line) * reals_per_line;
+    }
+
+    // per interior cell, not counting the ghost layers
+    uint64_t get_bytes_per_cell() const {
+        return 2 * N_fields * sizeof(real);
+    }
+
+    std::string get_field_name(const uint8_t field) const {
+        const char *velocity_names[3] = {"velocity_x", "velocity_y", "velocity_z"};
+        switch (field) {
+            case FIELD_DENSITY: return "density";
+            case FIELD_ENERGY: return "energy";
+            case FIELD_PRESSURE: return "pressure";
+        }
+        if (field >= get_scalar_field(0)) {
+            return "scalar_" + std::to_string(field - get_scalar_field(0));
+        }
+        return velocity_names[field - FIELD_VELOCITY];
+    }
+
+    uint8_t get_scalar_field(const uint8_t scalar) const {
+        return FIELD_VELOCITY + stencil.get_dimension() + scalar;
+    }
+
+    real *get_prev(const uint8_t field) const {
+        return prev[field];
+    }
+
+    real *get_next(const uint8_t field) const {
+        return next[field];
+    }
+
+    real *get_prev_density() const {
+        return prev[FIELD_DENSITY];
+    }
+
+    real *get_next_density() const {
+        return next[FIELD_DENSITY];
+    }
+
+    real *get_prev_energy() const {
+        return prev[FIELD_ENERGY];
+    }
+
+    real *get_next_energy() const {
+        return next[FIELD_ENERGY];
+    }
+
+    real *get_prev_pressure() const {
+        return prev[FIELD_PRESSURE];
+    }
+
+    real *get_next_pressure() const {
+        return next[FIELD_PRESSURE];
+    }
+
+    real *get_prev_velocity(const uint8_t d) const {
+        return prev[FIELD_VELOCITY + d];
+    }
+
+    real *get_next_velocity(const uint8_t d) const {
+        return next[FIELD_VELOCITY + d];
+    }
+
+    real *get_prev_scalar(const uint8_t scalar) const {
+        return prev[get_scalar_field(scalar)];
+    }
+
+    real *get_next_scalar(const uint8_t scalar) const {
+        return next[get_scalar_field(scalar)];
+    }
+};
+
+#endif /* FIELD_STORE_HPP */
@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Cell/Cell.hpp"
+
+#ifndef FUSED_UPDATE_HPP
+#define FUSED_UPDATE_HPP
+
+// fastest signal |u| + c_s of a cell with c_s = sqrt(gamma * P / rho), the
+// speed the CFL condition limits dt by. u_squared sums u_d * u_d in order of d.
+static inline real get_signal_speed(const real rho, const real P, const real u_squared, const real gamma) {
+    return sqrt(u_squared) + sqrt(gamma * P / rho);
+}
+
+// slots of the face fluxes, one array per slot and dimension
+#define FLUX_DENSITY 0
+#define FLUX_ENERGY 1
+#define FLUX_MOMENTUM 2
+
+// Flux along DIRECTION of a cell with density rho, energy E, pressure P and
+// velocity u, into the FLUX_ slots: rho u_d, (E + P) u_d and
+// rho u_c u_d + P delta_cd. The mass flux is reused for the momentum.
+template <uint8_t D, uint8_t DIRECTION>
+static inline void get_centered_flux(const compute_real rho, const compute_real E, const compute_real P,
+                                     const compute_real *u, compute_real *flux) {
+    const compute_real mass_flux = rho * u[DIRECTION];
+    flux[FLUX_DENSITY] = mass_flux;
+    flux[FLUX_ENERGY] = (E + P) * u[DIRECTION];
+    for (uint8_t c = 0; c < D; c++) {
+        flux[FLUX_MOMENTUM + c] = mass_flux * u[c];
+    }
+    flux[FLUX_MOMENTUM + DIRECTION] += P;
+}
+
+// Fused update of ConservedDensity, ConservedMomentum and ConservedEnergy in
+// flux form, in two passes. The flux pass puts the flux through every face
+// into the face buffer of its dimension, once: the mean of the fluxes of the
+// two cells of the face, stored at the cell above it. The update pass then
+// changes the density, momentum and energy of every cell by the flux out
+// through its upper faces minus the flux in through its lower ones, so what
+// leaves a cell enters its neighbor and the totals are conserved to rounding.
+// The arithmetic is done in the same order as in the separate classes, so the
+// results are bit-identical to the three-sweep update. The row loops are
+// compiled once per dimension D, so the loops over dimensions have constant
+// trip counts whatever the dimension of the run. The update pass also returns
+// the largest signal speed of the cells it wrote, so the next dt needs no pass
+// of its own. The arithmetic is done in compute_real, the face buffers hold
+// real; the velocity and pressure are derived from the next values as stored,
+// which the separate classes read.
+class FusedUpdate
+{
+private:
+    FieldStore *fields;
+    const Stencil *stencil;
+    double gamma;
+    // FLUX_MOMENTUM + dimension
+    uint8_t N_slots;
+    // values per slot, as in the FieldStore
+    uint64_t N_padded;
+    // flux through the lower face along d of every cell, stored at the cell
+    // above the face, N_slots arrays per dimension; from NumaArena, so the
+    // pages land where the flux pass first writes them
+    real *face_fluxes;
+    size_t face_flux_bytes;
+
+    template <uint8_t D, uint8_t DIRECTION>
+    void flux_faces_direction(const uint64_t start, const uint64_t count) const {
+        const real *rho = fields->get_prev_density();
+        const real *E = fields->get_prev_energy();
+        const real *P = fields->get_prev_pressure();
+        const real *u[D];
+        for (uint8_t c = 0; c < D; c++) {
+            u[c] = fields->get_prev_velocity(c);
+        }
+        real *face_flux[FLUX_MOMENTUM + D];
+        for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+            face_flux[k] = get_face_flux(DIRECTION, k);
+        }
+        const uint64_t stride = stencil->get_stride(DIRECTION);
+
+        for (uint64_t i = start; i < start + count; i++) {
+            compute_real lower_u[D];
+            compute_real upper_u[D];
+            for (uint8_t c = 0; c < D; c++) {
+                lower_u[c] = u[c][i - stride];
+                upper_u[c] = u[c][i];
+            }
+            compute_real lower[FLUX_MOMENTUM + D];
+            compute_real upper[FLUX_MOMENTUM + D];
+            get_centered_flux<D, DIRECTION>(rho[i - stride], E[i - stride], P[i - stride], lower_u, lower);
+            get_centered_flux<D, DIRECTION>(rho[i], E[i], P[i], upper_u, upper);
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+                face_flux[k][i] = 0.5 * (lower[k] + upper[k]);
+            }
+        }
+    }
+
+    // the direction fixed, so the flux has constant indices; d < D
+    template <uint8_t D>
+    void flux_faces_dimension(const uint64_t start, const uint64_t count, const uint8_t d) const {
+        switch (d) {
+            case 0: flux_faces_direction<D, 0>(start, count); break;
+            case 1: flux_faces_direction<D, std::min(1, D - 1)>(start, count); break;
+            case 2: flux_faces_direction<D, std::min(2, D - 1)>(start, count); break;
+        }
+    }
+
+    template <uint8_t D>
+    real update_row_dimension(const uint64_t start, const uint64_t count, const real dt_dx) const {
+        const real *rho = fields->get_prev_density();
+        const real *E = fields->get_prev_energy();
+        const real *u[D];
+        real *next_u[D];
+        const real *face_flux[D][FLUX_MOMENTUM + D];
+        uint64_t stride[D];
+        for (uint8_t d = 0; d < D; d++) {
+            u[d] = fields->get_prev_velocity(d);
+            next_u[d] = fields->get_next_velocity(d);
+            stride[d] = stencil->get_stride(d);
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+                face_flux[d][k] = get_face_flux(d, k);
+            }
+        }
+        real *next_rho = fields->get_next_density();
+        real *next_E = fields->get_next_energy();
+        real *next_P = fields->get_next_pressure();
+        const real gamma_real = gamma;
+        // dt_dx is dt / (2 dx), the update is dt / dx times the flux differences
+        const compute_real dt_over_dx = 2. * dt_dx;
+        real max_signal_speed = 0.;
+
+        for (uint64_t i = start; i < start + count; i++) {
+            // outflow through the upper faces minus inflow through the lower ones
+            compute_real net_flux[FLUX_MOMENTUM + D] = {};
+            for (uint8_t d = 0; d < D; d++) {
+                for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+                    net_flux[k] += (compute_real)face_flux[d][k][i + stride[d]] - face_flux[d][k][i];
+                }
+            }
+
+            const compute_real rho_i = rho[i];
+            compute_real density = rho_i;
+            density -= dt_over_dx * net_flux[FLUX_DENSITY];
+
+            compute_real momentum[D];
+            for (uint8_t c = 0; c < D; c++) {
+                momentum[c] = u[c][i];
+                momentum[c] *= rho_i;
+                momentum[c] -= dt_over_dx * net_flux[FLUX_MOMENTUM + c];
+            }
+
+            compute_real energy = E[i];
+            energy -= dt_over_dx * net_flux[FLUX_ENERGY];
+
+#ifdef DEBUG
+            if (isnan(density)) {
+                std::cout << "Density is NaN.\n";
+                Cell(fields, i).describe();
+                exit(1);
+            }
+#endif
+            next_rho[i] = density;
+            const compute_real next_density = as_stored(density);
+
+            compute_real next_velocity[D];
+            for (uint8_t d = 0; d < D; d++) {
+#ifdef DEBUG
+                if (isnan(momentum[d])) {
+                    std::cout << "Momentum in " << (int)d << " dimension is NaN.\n";
+                    Cell(fields, i).describe();
+                    exit(1);
+                }
+#endif
+                next_velocity[d] = as_stored(momentum[d] / next_density);
+                next_u[d][i] = next_velocity[d];
+            }
+
+#ifdef DEBUG
+            if (isnan(energy)) {
+                std::cout << "Energy is NaN.\n";
+                Cell(fields, i).describe();
+                exit(1);
+            }
+#endif
+            next_E[i] = energy;
+
+            compute_real next_specific_kinetic_energy = 0.;
+            for (uint8_t d = 0; d < D; d++) {
+                next_specific_kinetic_energy += 0.5 * next_velocity[d] * next_velocity[d];
+            }
+
+            // next_pressure is P = (gamma - 1) * rho * e = (gamma - 1) * (E - 0.5 * rho * u^2)
+            const compute_real next_pressure = (gamma-1.0) * (as_stored(energy) - next_density * next_specific_kinetic_energy);
+#ifdef DEBUG
+            if (next_pressure <= 0.) {
+                std::cout << "Pressure is zero or negative.\n";
+                Cell(fields, i).describe();
+                exit(1);
+            }
+#endif
+            next_P[i] = next_pressure;
+
+            // in real, from the stored values, as get_max_signal_speed
+            real next_u_squared = 0.;
+            for (uint8_t d = 0; d < D; d++) {
+                const real stored_velocity = next_velocity[d];
+                next_u_squared += stored_velocity * stored_velocity;
+            }
+            const real signal_speed = get_signal_speed(next_density, (real)next_pressure, next_u_squared, gamma_real);
+            if (signal_speed > max_signal_speed) {
+                max_signal_speed = signal_speed;
+            }
+        }
+        return max_signal_speed;
+    }
+
+    // ds/dt + u_j * ds/dx_j = 0 for every passive scalar s, in the same order as PassiveScalars
+    template <uint8_t D>
+    void update_scalars_row_dimension(const uint64_t start, const uint64_t count, const real dt_dx) const {
+        const real *u[D];
+        uint64_t stride[D];
+        for (uint8_t d = 0; d < D; d++) {
+            u[d] = fields->get_prev_velocity(d);
+            stride[d] = stencil->get_stride(d);
+        }
+
+        const compute_real dt_dx_compute = dt_dx;
+        for (uint8_t k = 0; k < fields->get_N_scalars(); k++) {
+            const real *scalar = fields->get_prev_scalar(k);
+            real *next_scalar = fields->get_next_scalar(k);
+            for (uint64_t i = start; i < start + count; i++) {
+                compute_real value = scalar[i];
+                for (uint8_t d = 0; d < D; d++) {
+                    value -= dt_dx_compute * u[d][i] * ((compute_real)scalar[i + stride[d]] - scalar[i - stride[d]]);
+                }
+                next_scalar[i] = value;
+            }
+        }
+    }
+
+public:
+    // the face buffers on pages of huge_pages, one of HUGE_PAGES_*
+    FusedUpdate(FieldStore &input_fields, const double input_gamma, const uint8_t huge_pages = HUGE_PAGES)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), gamma(input_gamma),
+          N_slots(FLUX_MOMENTUM + input_fields.get_stencil().get_dimension()),
+          N_padded(FieldStore::get_N_padded(input_fields.get_stencil()))
+    {
+        face_fluxes = static_cast<real *>(NumaArena::allocate(stencil->get_dimension() * N_slots * N_padded * sizeof(real),
+                                                              huge_pages, face_flux_bytes));
+    }
+
+    ~FusedUpdate() {
+        NumaArena::release(face_fluxes, face_flux_bytes);
+    }
+
+    FusedUpdate(const FusedUpdate &) = delete;
+    FusedUpdate &operator=(const FusedUpdate &) = delete;
+
+    real *get_face_flux(const uint8_t d, const uint8_t k) const {
+        return face_fluxes + (d * N_slots + k) * N_padded;
+    }
+
+    // modelled traffic of the face buffers per cell update: the flux pass
+    // writes every slot of every dimension and the update pass reads it back
+    static uint64_t get_face_flux_bytes_per_cell(const uint8_t dimension) {
+        return 2 * dimension * (FLUX_MOMENTUM + dimension) * sizeof(real);
+    }
+
+    // Fluxes along d through the lower faces of count cells from storage index
+    // start, each stored at the cell above its face; they read the prev values
+    // of the cells and of their neighbors below.
+    void flux_faces(const uint64_t start, const uint64_t count, const uint8_t d) const {
+        switch (stencil->get_dimension()) {
+            case 1: flux_faces_dimension<1>(start, count, d); break;
+            case 2: flux_faces_dimension<2>(start, count, d); break;
+            case 3: flux_faces_dimension<3>(start, count, d); break;
+        }
+    }
+
+    // the faces of an interior row that read no ghosts (inner) or the others,
+    // see Stencil::for_each_row_faces
+    void flux_row(const uint64_t row, const bool inner) const {
+        stencil->for_each_row_faces(row, inner, [&](const uint64_t start, const uint64_t count, const uint8_t d) {
+            flux_faces(start, count, d);
+        });
+    }
+
+    // every face of the rows, the cells of which the update pass can then update
+    void flux_rows(const uint64_t row_begin, const uint64_t row_end) const {
+        for (uint64_t row = row_begin; row < row_end; row++) {
+            flux_row(row, true);
+            flux_row(row, false);
+        }
+    }
+
+    // Update count cells along dimension 0, starting at storage index start,
+    // from the fluxes through their faces; returns their largest next signal
+    // speed, 0 for no cells.
+    real update_row(const uint64_t start, const uint64_t count, const real dt_dx) const {
+        switch (stencil->get_dimension()) {
+            case 1: return update_row_dimension<1>(start, count, dt_dx);
+            case 2: return update_row_dimension<2>(start, count, dt_dx);
+            case 3: return update_row_dimension<3>(start, count, dt_dx);
+        }
+        return 0.;
+    }
+
+    // the passive scalars of the same cells, nothing without any
+    void update_scalars_row(const uint64_t start, const uint64_t count, const real dt_dx) const {
+        if (fields->get_N_scalars() == 0) {
+            return;
+        }
+        switch (stencil->get_dimension()) {
+            case 1: update_scalars_row_dimension<1>(start, count, dt_dx); break;
+            case 2: update_scalars_row_dimension<2>(start, count, dt_dx); break;
+            case 3: update_scalars_row_dimension<3>(start, count, dt_dx); break;
+        }
+    }
+
+    // the cells of the rows, once flux_rows has been through all of their faces
+    real update_rows(const uint64_t row_begin, const uint64_t row_end, const real dt_dx) const {
+        real max_signal_speed = 0.;
+        for (uint64_t row = row_begin; row < row_end; row++) {
+            max_signal_speed = std::max(max_signal_speed, update_row(stencil->row_start(row), stencil->get_extent(0), dt_dx));
+            update_scalars_row(stencil->row_start(row), stencil->get_extent(0), dt_dx);
+        }
+        return max_signal_speed;
+    }
+
+    // both passes over the whole grid on the calling thread
+    real update(const real dt_dx) const {
+        flux_rows(0, stencil->get_N_rows());
+        return update_rows(0, stencil->get_N_rows(), dt_dx);
+    }
+
+    // largest signal speed of the prev values of count cells from storage index start
+    real get_max_signal_speed(const uint64_t start, const uint64_t count) const {
+        const real gamma_real = gamma;
+        real max_signal_speed = 0.;
+        for (uint64_t i = start; i < start + count; i++) {
+            real u_squared = 0.;
+            for (uint8_t d = 0; d < stencil->get_dimension(); d++) {
+                const real u = fields->get_prev_velocity(d)[i];
+                u_squared += u * u;
+            }
+            const real signal_speed = get_signal_speed(fields->get_prev_density()[i], fields->get_prev_pressure()[i],
+                                                       u_squared, gamma_real);
+            if (signal_speed > max_signal_speed) {
+                max_signal_speed = signal_speed;
+            }
+        }
+        return max_signal_speed;
+    }
+};
+
+#endif /* FUSED_UPDATE_HPP */
@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <math.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Cell/Cell.hpp"
+#include "../CellOrdering/CellOrdering.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../FusedUpdate/FusedUpdate.hpp"
+#include "../Diagnostics/Diagnostics.hpp"
+
+#ifndef GODUNOV_UPDATE_HPP
+#define GODUNOV_UPDATE_HPP
+
+// the centered differences of SimdUpdate, or the finite-volume update below
+#define SCHEME_CENTERED 0
+#define SCHEME_GODUNOV 1
+
+// the slopes of a neighbor read the cell two away from the updated one
+#define N_GHOST_GODUNOV 2
+
+#define INTEGRATOR_MUSCL_HANCOCK 0
+#define INTEGRATOR_SSP_RK2 1
+
+#define LIMITER_MINMOD 0
+#define LIMITER_MC 1
+#define LIMITER_VAN_LEER 2
+
+#define RIEMANN_HLL 0
+#define RIEMANN_HLLC 1
+
+// Second-order finite-volume update. The primitive variables are reconstructed
+// linearly in every cell with limited slopes, and the fluxes through the faces
+// come from an HLL or HLLC Riemann solver; the conserved density, momentum and
+// energy change by the difference of the fluxes through opposite faces, so
+// whatever leaves a cell enters its neighbor.
+//
+// Two integrators: MUSCL-Hancock advances the center state by half a step from
+// the slopes before the faces are read, one update per step. Its predictor uses
+// the slopes along every dimension, so the neighbors read edge and corner
+// ghosts, see Domain::set_exchange_corners. SSP-RK2 (Heun) takes two updates
+// without the predictor and averages the start of the step with the result.
+//
+// An update is a sweep per stage over the rows: the MUSCL-Hancock center
+// states, then the flux through every face, each solved once into the face
+// buffer of its dimension, then the cells from the fluxes through their faces.
+// The stages are separated by the end of the parallel_for, so each sweep
+// reads what the one before wrote for the neighboring rows. The states and
+// fluxes are computed in compute_real, the buffers hold real.
+class GodunovUpdate
+{
+private:
+    // slots of the primitive states, the conserved variables and the fluxes
+    // use the same ones for density, energy and momentum
+    static constexpr uint8_t W_DENSITY = 0;
+    static constexpr uint8_t W_PRESSURE = 1;
+    static constexpr uint8_t W_VELOCITY = 2;
+
+    FieldStore *fields;
+    const Stencil *stencil;
+    double gamma;
+    uint8_t integrator;
+    uint8_t limiter;
+    uint8_t riemann_solver;
+    uint8_t stage;
+    // W_VELOCITY + dimension
+    uint8_t N_slots;
+    // values per field or slot, as in the FieldStore
+    uint64_t N_padded;
+    // MUSCL-Hancock center states half a step on, and the cells that fell
+    // back to a constant state
+    std::vector<real> predicted;
+    std::vector<uint8_t> constant_state;
+    // flux through the lower face along d of every cell, stored at the cell
+    // above the face, N_slots arrays per dimension
+    std::vector<real> face_fluxes;
+
+    real *get_predicted(const uint8_t k) {
+        return predicted.data() + k * N_padded;
+    }
+
+    const real *get_predicted(const uint8_t k) const {
+        return predicted.data() + k * N_padded;
+    }
+
+    real *get_face_flux(const uint8_t d, const uint8_t k) {
+        return face_fluxes.data() + (d * N_slots + k) * N_padded;
+    }
+
+    template <uint8_t D>
+    void load(const uint64_t j, compute_real *w) const {
+        w[W_DENSITY] = fields->get_prev_density()[j];
+        w[W_PRESSURE] = fields->get_prev_pressure()[j];
+        for (uint8_t c = 0; c < D; c++) {
+            w[W_VELOCITY + c] = fields->get_prev_velocity(c)[j];
+        }
+    }
+
+    // slope from the differences to the lower and upper neighbor, 0 at an extremum
+    compute_real limit(const compute_real lower, const compute_real upper) const {
+        if (lower * upper <= 0.) {
+            return 0.;
+        }
+        switch (limiter) {
+            case LIMITER_MC:
+                return copysign(std::min(std::min(2. * fabs(lower), 2. * fabs(upper)), 0.5 * fabs(lower + upper)), lower);
+            case LIMITER_VAN_LEER:
+                return 2. * lower * upper / (lower + upper);
+        }
+        return (fabs(lower) < fabs(upper)) ? lower : upper;
+    }
+
+    // slopes along d of cell j, whose prev state is w
+    template <uint8_t D>
+    void get_slopes(const uint64_t j, const uint8_t d, const compute_real *w, compute_real *slope) const {
+        const uint64_t stride = stencil->get_stride(d);
+        compute_real lower[W_VELOCITY + D];
+        compute_real upper[W_VELOCITY + D];
+        load<D>(j - stride, lower);
+        load<D>(j + stride, upper);
+        for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+            slope[k] = limit(w[k] - lower[k], upper[k] - w[k]);
+        }
+    }
+
+    // MUSCL-Hancock center states of count cells from storage index start. A
+    // cell whose face states would not be positive keeps a constant state.
+    template <uint8_t D>
+    void predict_row(const uint64_t start, const uint64_t count, const compute_real dt_dx) {
+        const compute_real gamma_compute = gamma;
+        real *w_predicted[W_VELOCITY + D];
+        for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+            w_predicted[k] = get_predicted(k);
+        }
+
+        for (uint64_t j = start; j < start + count; j++) {
+            compute_real w[W_VELOCITY + D];
+            compute_real slope[D][W_VELOCITY + D];
+            load<D>(j, w);
+            for (uint8_t d = 0; d < D; d++) {
+                get_slopes<D>(j, d, w, slope[d]);
+            }
+
+            // primitive Euler equations, dw/dt = -sum_d A_d(w) dw/dx_d; dt_dx is
+            // dt / (2 dx), the half step
+            compute_real change[W_VELOCITY + D] = {};
+            for (uint8_t d = 0; d < D; d++) {
+                const compute_real u_d = w[W_VELOCITY + d];
+                change[W_DENSITY] += u_d * slope[d][W_DENSITY] + w[W_DENSITY] * slope[d][W_VELOCITY + d];
+                change[W_PRESSURE] += u_d * slope[d][W_PRESSURE] + gamma_compute * w[W_PRESSURE] * slope[d][W_VELOCITY + d];
+                for (uint8_t c = 0; c < D; c++) {
+                    change[W_VELOCITY + c] += u_d * slope[d][W_VELOCITY + c];
+                }
+                change[W_VELOCITY + d] += slope[d][W_PRESSURE] / w[W_DENSITY];
+            }
+            compute_real w_half[W_VELOCITY + D];
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                w_half[k] = w[k] - dt_dx * change[k];
+            }
+
+            bool positive = w_half[W_DENSITY] > 0. && w_half[W_PRESSURE] > 0.;
+            for (uint8_t d = 0; d < D && positive; d++) {
+                for (const uint8_t k : {W_DENSITY, W_PRESSURE}) {
+                    positive = positive && w_half[k] - 0.5 * fabs(slope[d][k]) > 0.;
+                }
+            }
+            constant_state[j] = positive ? 0 : 1;
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                w_predicted[k][j] = positive ? w_half[k] : w[k];
+            }
+        }
+    }
+
+    // the reconstructed state of cell j on its lower (side 0) or upper (side 1) face along d
+    template <uint8_t D, bool HANCOCK>
+    void get_face_state(const uint64_t j, const uint8_t d, const int side, compute_real *w) const {
+        if (HANCOCK && constant_state[j] != 0) {
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                w[k] = get_predicted(k)[j];
+            }
+            return;
+        }
+
+        compute_real center[W_VELOCITY + D];
+        compute_real slope[W_VELOCITY + D];
+        load<D>(j, center);
+        get_slopes<D>(j, d, center, slope);
+        if (HANCOCK) {
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                center[k] = get_predicted(k)[j];
+            }
+        }
+        const compute_real half = side == 0 ? -0.5 : 0.5;
+        for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+            w[k] = center[k] + half * slope[k];
+        }
+    }
+
+    // conserved variables and their flux along d for primitive state w
+    template <uint8_t D>
+    void get_conserved_flux(const uint8_t d, const compute_real *w, compute_real *U, compute_real *F) const {
+        const compute_real u_d = w[W_VELOCITY + d];
+        compute_real u_squared = 0.;
+        for (uint8_t c = 0; c < D; c++) {
+            u_squared += w[W_VELOCITY + c] * w[W_VELOCITY + c];
+        }
+        U[W_DENSITY] = w[W_DENSITY];
+        U[W_PRESSURE] = w[W_PRESSURE] / (gamma - 1.0) + 0.5 * w[W_DENSITY] * u_squared;
+        F[W_DENSITY] = w[W_DENSITY] * u_d;
+        F[W_PRESSURE] = (U[W_PRESSURE] + w[W_PRESSURE]) * u_d;
+        for (uint8_t c = 0; c < D; c++) {
+            U[W_VELOCITY + c] = w[W_DENSITY] * w[W_VELOCITY + c];
+            F[W_VELOCITY + c] = U[W_VELOCITY + c] * u_d;
+        }
+        F[W_VELOCITY + d] += w[W_PRESSURE];
+    }
+
+    // Flux along d through the face between the states left (lower) and right
+    // (upper), with the wave speed estimates of Davis.
+    template <uint8_t D>
+    void get_flux(const uint8_t d, const compute_real *left, const compute_real *right, compute_real *flux) const {
+        compute_real U_left[W_VELOCITY + D];
+        compute_real U_right[W_VELOCITY + D];
+        compute_real F_left[W_VELOCITY + D];
+        compute_real F_right[W_VELOCITY + D];
+        get_conserved_flux<D>(d, left, U_left, F_left);
+        get_conserved_flux<D>(d, right, U_right, F_right);
+
+        const compute_real gamma_compute = gamma;
+        const compute_real u_left = left[W_VELOCITY + d];
+        const compute_real u_right = right[W_VELOCITY + d];
+        const compute_real c_left = sqrt(gamma_compute * left[W_PRESSURE] / left[W_DENSITY]);
+        const compute_real c_right = sqrt(gamma_compute * right[W_PRESSURE] / right[W_DENSITY]);
+        const compute_real S_left = std::min(u_left - c_left, u_right - c_right);
+        const compute_real S_right = std::max(u_left + c_left, u_right + c_right);
+
+        if (S_left >= 0.) {
+            std::memcpy(flux, F_left, sizeof(F_left));
+            return;
+        }
+        if (S_right <= 0.) {
+            std::memcpy(flux, F_right, sizeof(F_right));
+            return;
+        }
+
+        if (riemann_solver == RIEMANN_HLL) {
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                flux[k] = (S_right * F_left[k] - S_left * F_right[k] + S_left * S_right * (U_right[k] - U_left[k])) /
+                          (S_right - S_left);
+            }
+            return;
+        }
+
+        // HLLC restores the contact wave at speed S_star between the two
+        const compute_real mass_left = left[W_DENSITY] * (S_left - u_left);
+        const compute_real mass_right = right[W_DENSITY] * (S_right - u_right);
+        const compute_real S_star = (right[W_PRESSURE] - left[W_PRESSURE] + mass_left * u_left - mass_right * u_right) /
+                            (mass_left - mass_right);
+        const bool use_left = S_star >= 0.;
+        const compute_real *w = use_left ? left : right;
+        const compute_real *U = use_left ? U_left : U_right;
+        const compute_real *F = use_left ? F_left : F_right;
+        const compute_real S = use_left ? S_left : S_right;
+        const compute_real u = w[W_VELOCITY + d];
+
+        compute_real U_star[W_VELOCITY + D];
+        const compute_real factor = w[W_DENSITY] * (S - u) / (S - S_star);
+        U_star[W_DENSITY] = factor;
+        U_star[W_PRESSURE] = factor * (U[W_PRESSURE] / w[W_DENSITY] +
+                                       (S_star - u) * (S_star + w[W_PRESSURE] / (w[W_DENSITY] * (S - u))));
+        for (uint8_t c = 0; c < D; c++) {
+            U_star[W_VELOCITY + c] = factor * w[W_VELOCITY + c];
+        }
+        U_star[W_VELOCITY + d] = factor * S_star;
+        for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+            flux[k] = F[k] + S * (U_star[k] - U[k]);
+        }
+    }
+
+    // fluxes through the lower faces along d of count cells from storage index start
+    template <uint8_t D, bool HANCOCK>
+    void flux_row(const uint64_t start, const uint64_t count, const uint8_t d) {
+        const uint64_t stride = stencil->get_stride(d);
+        real *face_flux[W_VELOCITY + D];
+        for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+            face_flux[k] = get_face_flux(d, k);
+        }
+
+        compute_real left[W_VELOCITY + D];
+        compute_real right[W_VELOCITY + D];
+        compute_real flux[W_VELOCITY + D];
+        for (uint64_t i = start; i < start + count; i++) {
+            get_face_state<D, HANCOCK>(i - stride, d, 1, left);
+            get_face_state<D, HANCOCK>(i, d, 0, right);
+            get_flux<D>(d, left, right, flux);
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                face_flux[k][i] = flux[k];
+            }
+        }
+    }
+
+    // next values of count cells from storage index start; returns their largest signal speed
+    template <uint8_t D>
+    real update_row(const uint64_t start, const uint64_t count, const real dt_dx) {
+        real *next_rho = fields->get_next_density();
+        real *next_E = fields->get_next_energy();
+        real *next_P = fields->get_next_pressure();
+        real *next_u[D];
+        const real *face_flux[D][W_VELOCITY + D];
+        uint64_t stride[D];
+        for (uint8_t d = 0; d < D; d++) {
+            next_u[d] = fields->get_next_velocity(d);
+            stride[d] = stencil->get_stride(d);
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                face_flux[d][k] = get_face_flux(d, k);
+            }
+        }
+        const bool second_stage = integrator == INTEGRATOR_SSP_RK2 && stage == 1;
+        // the update is dt / dx times the flux differences
+        const compute_real dt_over_dx = 2. * dt_dx;
+        const real gamma_real = gamma;
+        real max_signal_speed = 0.;
+
+        for (uint64_t i = start; i < start + count; i++) {
+            // outflow through the upper faces minus inflow through the lower ones
+            compute_real net_flux[W_VELOCITY + D] = {};
+            for (uint8_t d = 0; d < D; d++) {
+                for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                    net_flux[k] -= face_flux[d][k][i];
+                }
+                for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                    net_flux[k] += face_flux[d][k][i + stride[d]];
+                }
+            }
+
+            compute_real U[W_VELOCITY + D];
+            U[W_DENSITY] = fields->get_prev_density()[i];
+            U[W_PRESSURE] = fields->get_prev_energy()[i];
+            for (uint8_t c = 0; c < D; c++) {
+                U[W_VELOCITY + c] = U[W_DENSITY] * fields->get_prev_velocity(c)[i];
+            }
+            for (uint8_t k = 0; k < W_VELOCITY + D; k++) {
+                U[k] -= dt_over_dx * net_flux[k];
+            }
+            if (second_stage) {
+                // average with the state at the start of the step, still in the
+                // next arrays of this cell until it is written below
+                const compute_real start_rho = next_rho[i];
+                U[W_DENSITY] = 0.5 * (start_rho + U[W_DENSITY]);
+                U[W_PRESSURE] = 0.5 * (next_E[i] + U[W_PRESSURE]);
+                for (uint8_t c = 0; c < D; c++) {
+                    U[W_VELOCITY + c] = 0.5 * (start_rho * next_u[c][i] + U[W_VELOCITY + c]);
+                }
+            }
+
+            const compute_real density = U[W_DENSITY];
+#ifdef DEBUG
+            if (isnan(density) || density <= 0.) {
+                std::cout << "Density is NaN, zero or negative.\n";
+                Cell(fields, i).describe();
+                exit(1);
+            }
+#endif
+            next_rho[i] = density;
+            next_E[i] = U[W_PRESSURE];
+            compute_real next_u_squared = 0.;
+            for (uint8_t d = 0; d < D; d++) {
+                next_u[d][i] = U[W_VELOCITY + d] / density;
+                next_u_squared += next_u[d][i] * next_u[d][i];
+            }
+
+            const compute_real next_pressure = (gamma - 1.0) * (U[W_PRESSURE] - 0.5 * density * next_u_squared);
+#ifdef DEBUG
+            if (next_pressure <= 0.) {
+                std::cout << "Pressure is zero or negative.\n";
+                Cell(fields, i).describe();
+                exit(1);
+            }
+#endif
+            next_P[i] = next_pressure;
+
+            const real signal_speed = get_signal_speed((real)density, (real)next_pressure, (real)next_u_squared, gamma_real);
+            if (signal_speed > max_signal_speed) {
+                max_signal_speed = signal_speed;
+            }
+        }
+        return max_signal_speed;
+    }
+
+    // function(start, thread) for the storage index start of every interior
+    // row, in the order of traversal
+    template <typename Function>
+    void for_each_row(SweepEngine &engine, const RowTraversal &traversal, Function function) {
+        engine.parallel_for(stencil->get_N_rows(), [&](const uint64_t k_begin, const uint64_t k_end, const uint32_t thread) {
+            for (uint64_t k = k_begin; k < k_end; k++) {
+                function(stencil->row_start(traversal.get_row(k)), thread);
+            }
+        });
+    }
+
+    template <uint8_t D, bool HANCOCK>
+    real update_dimension(SweepEngine &engine, const RowTraversal &traversal, const real dt_dx, DiagnosticTotals *thread_totals) {
+        const uint64_t count = stencil->get_extent(0);
+        auto on_lower_face = [&](const uint64_t start, const uint8_t d) {
+            return stencil->get_coordinate(start, d) == 0;
+        };
+        auto on_upper_face = [&](const uint64_t start, const uint8_t d) {
+            return stencil->get_coordinate(start, d) + 1 == (box_int)stencil->get_extent(d);
+        };
+
+        // the interior cells and the ghosts across their faces
+        if (HANCOCK) {
+            for_each_row(engine, traversal, [&](const uint64_t start, const uint32_t thread) {
+                predict_row<D>(start - 1, count + 2, dt_dx);
+                for (uint8_t d = 1; d < D; d++) {
+                    if (on_lower_face(start, d)) {
+                        predict_row<D>(start - stencil->get_stride(d), count, dt_dx);
+                    }
+                    if (on_upper_face(start, d)) {
+                        predict_row<D>(start + stencil->get_stride(d), count, dt_dx);
+                    }
+                }
+            });
+        }
+
+        // the faces of the interior cells, those on the upper faces of the box
+        // stored in the ghosts above
+        for_each_row(engine, traversal, [&](const uint64_t start, const uint32_t thread) {
+            flux_row<D, HANCOCK>(start, count + 1, 0);
+            for (uint8_t d = 1; d < D; d++) {
+                flux_row<D, HANCOCK>(start, count, d);
+                if (on_upper_face(start, d)) {
+                    flux_row<D, HANCOCK>(start + stencil->get_stride(d), count, d);
+                }
+            }
+        });
+
+        std::vector<real> thread_max_signal_speeds(engine.get_N_threads(), 0.);
+        for_each_row(engine, traversal, [&](const uint64_t start, const uint32_t thread) {
+            thread_max_signal_speeds[thread] = std::max(thread_max_signal_speeds[thread], update_row<D>(start, count, dt_dx));
+            if (thread_totals != nullptr) {
+                thread_totals[thread].add_cells(*fields, true, start, count);
+            }
+        });
+        return *std::max_element(thread_max_signal_speeds.begin(), thread_max_signal_speeds.end());
+    }
+
+    template <bool HANCOCK>
+    real update_integrator(SweepEngine &engine, const RowTraversal &traversal, const real dt_dx, DiagnosticTotals *thread_totals) {
+        switch (stencil->get_dimension()) {
+            case 1: return update_dimension<1, HANCOCK>(engine, traversal, dt_dx, thread_totals);
+            case 2: return update_dimension<2, HANCOCK>(engine, traversal, dt_dx, thread_totals);
+            case 3: return update_dimension<3, HANCOCK>(engine, traversal, dt_dx, thread_totals);
+        }
+        return 0.;
+    }
+
+public:
+    GodunovUpdate(FieldStore &input_fields, const double input_gamma, const uint8_t input_integrator,
+                  const uint8_t input_limiter, const uint8_t input_riemann_solver)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), gamma(input_gamma), integrator(input_integrator),
+          limiter(input_limiter), riemann_solver(input_riemann_solver), stage(0),
+          N_padded(FieldStore::get_N_padded(input_fields.get_stencil()))
+    {
+        if (stencil->get_N_ghost() < N_GHOST_GODUNOV) {
+            throw std::invalid_argument("The Godunov scheme needs " + std::to_string(N_GHOST_GODUNOV) + " ghost layers.");
+        }
+        if (integrator > INTEGRATOR_SSP_RK2 || limiter > LIMITER_VAN_LEER || riemann_solver > RIEMANN_HLLC) {
+            throw std::invalid_argument("Unknown integrator, slope limiter or Riemann solver.");
+        }
+        N_slots = W_VELOCITY + stencil->get_dimension();
+        face_fluxes.resize(stencil->get_dimension() * N_slots * N_padded);
+        if (integrator == INTEGRATOR_MUSCL_HANCOCK) {
+            predicted.resize(N_slots * N_padded);
+            constant_state.resize(N_padded);
+        }
+    }
+
+    // updates per step, each one after a halo exchange of the previous one's result
+    uint8_t get_N_stages() const {
+        return integrator == INTEGRATOR_SSP_RK2 ? 2 : 1;
+    }
+
+    // MUSCL-Hancock reads the edge and corner ghosts
+    bool needs_corners() const {
+        return integrator == INTEGRATOR_MUSCL_HANCOCK;
+    }
+
+    // Called before the update of every stage, with the prev values the stage
+    // starts from. The evolve between the SSP-RK2 stages swaps the start of
+    // the step into the next arrays, where the second stage reads it.
+    void set_stage(const uint8_t input_stage) {
+        stage = input_stage;
+    }
+
+    std::string get_name() const {
+        static const char *integrator_names[] = {"MUSCL-Hancock", "SSP-RK2"};
+        static const char *limiter_names[] = {"minmod", "MC", "van Leer"};
+        static const char *riemann_names[] = {"HLL", "HLLC"};
+        return std::string(integrator_names[integrator]) + ", " + limiter_names[limiter] + " slopes, " +
+               riemann_names[riemann_solver] + " fluxes";
+    }
+
+    // Next values of every interior cell from prev values with up to date
+    // ghosts, in the row order of traversal; dt_dx is dt / (2 dx) as for the
+    // centered scheme. Returns the largest next signal speed. With
+    // thread_totals, one per thread, the next values are added to them, see
+    // Diagnostics.
+    real update(SweepEngine &engine, const RowTraversal &traversal, const real dt_dx,
+                DiagnosticTotals *thread_totals = nullptr) {
+        if (integrator == INTEGRATOR_MUSCL_HANCOCK) {
+            return update_integrator<true>(engine, traversal, dt_dx, thread_totals);
+        }
+        return update_integrator<false>(engine, traversal, dt_dx, thread_totals);
+    }
+};
+
+#endif /* GODUNOV_UPDATE_HPP */
@@ -1,13 +1,24 @@
 #include <array>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <math.h>
 #include <vector>
 #include <memory>
 #include <stdexcept>
 #include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
 #include "../Cell/Cell.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Snapshot/Snapshot.hpp"
+#include "../AsyncSnapshotWriter/AsyncSnapshotWriter.hpp"
+#include "../Checkpoint/Checkpoint.hpp"
+#include "../CellOrdering/CellOrdering.hpp"
+#include "../FusedUpdate/FusedUpdate.hpp"
+#include "../InitialConditions/InitialConditions.hpp"
 
 #ifndef GRID_HPP
 #define GRID_HPP
@@ -18,13 +29,67 @@ private:
     uint8_t dimension;
     uint32_t N_cells_1D;
     uint64_t N_cells_ND;
-
-    // all of the Cell objects in the grid
-    std::vector<std::shared_ptr<Cell>> cells;
+    double gamma;
+    // global cell index <-> coordinates, row-major like get_cell; the sweeps
+    // pick their order of the rows with a RowTraversal instead
+    CellOrdering ordering = CellOrdering(ORDERING_ROW_MAJOR, 1, 1);
+
+    // ghost-padded layout of the field arrays and the neighbor strides
+    Stencil stencil;
+    // contiguous prev/next arrays for every field of every cell
+    std::unique_ptr<FieldStore> fields;
+    SnapshotWriter snapshot_writer;
+    // created at the first dump, see save_cells
+    std::unique_ptr<AsyncSnapshotWriter> async_writer;
+    uint32_t N_dump_buffers = N_DUMP_BUFFERS;
+    // value type of the snapshots, see set_dump_type
+    uint32_t dump_type = DUMP_TYPE;
+    // see set_output_prefix
+    std::string output_prefix;
 
 public:
-    Grid(const uint8_t input_dimension, const uint32_t input_N_cells_1D)
+    Grid(const uint8_t input_dimension, const uint32_t input_N_cells_1D,
+         const InitialConditions &initial_conditions = InitialConditions(), const double input_gamma = GAMMA)
+        : Grid(input_dimension, input_N_cells_1D, {input_N_cells_1D, input_N_cells_1D, input_N_cells_1D}, {0, 0, 0},
+               initial_conditions, input_gamma) {}
+
+    // the block of local_extent cells starting at global coordinate offset of an
+    // N_cells_1D^dimension box, see Domain; N_ghost ghost layers on every face
+    // and N_scalars passive scalars carried along with the flow. The pages of
+    // the fields are placed and the initial conditions set on the threads of
+    // engine, or on this one without; huge_pages is one of HUGE_PAGES_*.
+    Grid(const uint8_t input_dimension, const uint32_t input_N_cells_1D,
+         const std::array<uint32_t, MAX_DIMENSION> &local_extent, const std::array<uint32_t, MAX_DIMENSION> &offset,
+         const InitialConditions &initial_conditions, const double input_gamma, const uint32_t N_ghost = N_GHOST,
+         const uint8_t N_scalars = 0, SweepEngine *engine = nullptr, const uint8_t huge_pages = HUGE_PAGES)
     {
+        set_geometry(input_dimension, input_N_cells_1D, local_extent, offset, N_ghost);
+        gamma = input_gamma;
+        fields = std::make_unique<FieldStore>(stencil, N_scalars, huge_pages);
+        if (engine == nullptr) {
+            SweepEngine inline_engine(1, SCHEDULE_STATIC, 1);
+            initial_conditions.apply(*fields, N_cells_1D, gamma, inline_engine);
+        } else {
+            fields->first_touch(*engine);
+            initial_conditions.apply(*fields, N_cells_1D, gamma, *engine);
+        }
+    }
+
+    // Resume from a checkpoint instead of the initial conditions, see Checkpoint::restore
+    Grid(const uint8_t input_dimension, const uint32_t input_N_cells_1D,
+         const std::array<uint32_t, MAX_DIMENSION> &local_extent, const std::array<uint32_t, MAX_DIMENSION> &offset,
+         const std::string &checkpoint_name, const Domain &domain, IntegrationState &state, const double input_gamma,
+         const uint32_t N_ghost = N_GHOST, const uint8_t N_scalars = 0, const uint8_t huge_pages = HUGE_PAGES)
+    {
+        set_geometry(input_dimension, input_N_cells_1D, local_extent, offset, N_ghost);
+        gamma = input_gamma;
+        fields = Checkpoint::restore(checkpoint_name, stencil, N_scalars, N_cells_1D, domain, state, huge_pages);
+    }
+
+private:
+    void set_geometry(const uint8_t input_dimension, const uint32_t input_N_cells_1D,
+                      const std::array<uint32_t, MAX_DIMENSION> &local_extent, const std::array<uint32_t, MAX_DIMENSION> &offset,
+                      const uint32_t N_ghost) {
         if (input_dimension <= 0) {
             throw std::invalid_argument("Negative/zero input dimension.");
         }
@@ -35,193 +100,201 @@ public:
 
         dimension = input_dimension;
         N_cells_1D = input_N_cells_1D;
-        N_cells_ND = (uint64_t)pow((long double)N_cells_1D, input_dimension);
-
-        const box_int quarter_box = (box_int)(0.25 * (real)N_CELLS_1D);
-
-        std::vector<box_int> coordinates;
-        for (uint64_t i = 0; i < N_cells_ND; i++) {
-            std::vector<box_int> coordinate(DIMENSION);
-            std::vector<real> velocity(DIMENSION);
-            real density = 1.;
-            real energy = 1.;
-            real pressure = 1.;
-
-            uint64_t scaled_index = i;
-
-            for (uint8_t d = 0; d < DIMENSION; d++) {
-                coordinate[d] = (box_int)(scaled_index % N_CELLS_1D);
-                scaled_index /= N_CELLS_1D;
-                velocity[d] = 0.;
-            }
-
-#if (ICS == 0)
-            if (coordinate[1] <= 2 * quarter_box) {
-                velocity[1] = 0.3;
-                density = 1. + (double)coordinate[1] / (double)N_CELLS_1D;
-            }
-
-            if (coordinate[1] > 2 * quarter_box) {
-                velocity[1] = 0.3;
-                density = 2. - (double)coordinate[1] / (double)N_CELLS_1D;
-            }
-#else
-            velocity[1] = 3. * sin(2. * M_PI * (double)coordinate[0] / (double)(N_CELLS_1D - 1));
-            if (coordinate[1] <= 2 * quarter_box) {
-                density = 1. + (double)coordinate[1] / (double)N_CELLS_1D;
-            }
+        stencil = Stencil(dimension, local_extent, offset, N_cells_1D, N_ghost);
+        N_cells_ND = stencil.get_N_interior();
+        ordering = CellOrdering(ORDERING_ROW_MAJOR, dimension, N_cells_1D);
+    }
 
-            if (coordinate[1] > 2 * quarter_box) {
-                density = 2. - (double)coordinate[1] / (double)N_CELLS_1D;
+public:
+    // largest |u| + c_s of the prev values, see get_signal_speed; the sweeps of
+    // SimdUpdate return the same for the values they write
+    real get_max_signal_speed(SweepEngine &engine) {
+        // rows per reduction block, fixed so the reduction is the same for any thread count
+        const uint64_t rows_per_block = 16;
+        const real gamma_real = gamma;
+        return engine.parallel_max(stencil.get_N_rows(), rows_per_block,
+                                   [&](const uint64_t row_begin, const uint64_t row_end) {
+            real block_max_signal_speed = 0.;
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                for (uint64_t s = start; s < start + stencil.get_extent(0); s++) {
+                    real u_squared = 0.;
+                    for (uint8_t d = 0; d < dimension; d++) {
+                        const real velocity = fields->get_prev_velocity(d)[s];
+                        u_squared += velocity * velocity;
+                    }
+                    const real signal_speed = get_signal_speed(fields->get_prev_density()[s], fields->get_prev_pressure()[s],
+                                                               u_squared, gamma_real);
+                    if (signal_speed > block_max_signal_speed) {
+                        block_max_signal_speed = signal_speed;
+                    }
+                }
             }
-#endif
+            return block_max_signal_speed;
+        });
+    }
 
-            real specific_kinetic_energy = 0.;
-            for (uint8_t d = 0; d < DIMENSION; d++) {
-                specific_kinetic_energy += 0.5 * velocity[d] * velocity[d];
-            }
+    uint64_t get_N_cells_Nd() {
+        return N_cells_ND;
+    }
 
-            // rho * e = P / (gamma - 1), E = rho * e + 0.5 * rho * u^2; E is TOTAL energy
-            energy = pressure / (GAMMA-1.0) + density * specific_kinetic_energy;
+    uint8_t get_dimension() const {
+        return dimension;
+    }
 
-            cells.push_back(std::make_shared<Cell>(coordinate, velocity, density, energy, pressure));
-        }
+    uint32_t get_N_cells_1D() const {
+        return N_cells_1D;
     }
 
-    real get_max_velocity() {
-        real max_velocity = 0.;
-        for (auto &cell : cells) {
-            real velocity_norm = 0.;
-            for (uint8_t d = 0; d < DIMENSION; d++) {
-                velocity_norm += cell->get_velocity(d) * cell->get_velocity(d);
-            }
-            velocity_norm = sqrt(velocity_norm);
-            if (velocity_norm > max_velocity) {
-                max_velocity = velocity_norm;
-            }
-        }
+    Cell get_cell(const uint64_t cell_index) {
+        return Cell(fields.get(), stencil.interior_to_storage(cell_index));
+    }
 
-        if (max_velocity < 0.1) {
-            max_velocity = 0.1;
-        }
-        return max_velocity;
+    const Stencil &get_stencil() const {
+        return stencil;
     }
 
-    uint64_t get_N_cells_Nd() {
-        return N_cells_ND;
+    FieldStore &get_fields() {
+        return *fields;
     }
 
-    std::shared_ptr<Cell> get_cell(const uint64_t cell_index) {
-        return cells[cell_index];
+    // the ghost layers are stale afterwards, see Domain::begin_halo_exchange
+    void evolve() {
+        fields->evolve();
     }
 
     void print_cells() {
         std::cout << std::scientific;
-        for (auto &cell : cells) {
+        for (uint64_t i = 0; i < N_cells_ND; i++) {
+            const uint64_t s = stencil.interior_to_storage(i);
+
             std::cout << "\n";
             std::cout <<"(x_0, x_1, ..., x_N) = (";
-            for (auto coordinate : *cell->get_coordinates()) {
-                std::cout << (real)coordinate / (real)N_CELLS_1D << ",";
+            for (uint8_t d = 0; d < dimension; d++) {
+                std::cout << (real)stencil.get_global_coordinate(s, d) / (real)N_cells_1D << ",";
             }
             std::cout << ")\n";
 
             std::cout << "(v_0, v_1, ..., v_N) = (";
-            for (auto velocity : *cell->get_velocity()) {
-                std::cout << (real)velocity << ",";
+            for (uint8_t d = 0; d < dimension; d++) {
+                std::cout << fields->get_prev_velocity(d)[s] << ",";
             }
             std::cout << ")\n";
-            std::cout << "density = " << cell->get_density() << "\n";
-            std::cout << "energy = " << cell->get_energy() << "\n";
-            std::cout << "pressure = " << cell->get_pressure() << "\n\n";
+            std::cout << "density = " << fields->get_prev_density()[s] << "\n";
+            std::cout << "energy = " << fields->get_prev_energy()[s] << "\n";
+            std::cout << "pressure = " << fields->get_prev_pressure()[s] << "\n\n";
         }
     }
 
-    void save_cells(uint64_t dump_counter) {
-        std::ofstream density_file("density_grid_" + std::to_string(dump_counter) + ".dat");
-        // save x,y,density
-        for (auto &cell : cells) {
-            for (auto coordinate : *cell->get_coordinates()) {
-                density_file << (real)coordinate / (real)N_CELLS_1D << ",";
+    // snapshot_N.bin with every field, see Snapshot; the old text dumps with
+    // WITH_TEXT_DUMPS, or convert with tools/snapshot_to_text.cpp. With
+    // N_dump_buffers > 0 the snapshot is written in the background and may
+    // still be in flight on return, see flush_cells.
+    void save_cells(uint64_t dump_counter, const real time, const Domain &domain) {
+        const std::string file_name = output_prefix + "snapshot_" + std::to_string(dump_counter) + ".bin";
+        if (N_dump_buffers > 0) {
+            if (!async_writer) {
+                async_writer = std::make_unique<AsyncSnapshotWriter>(*fields, N_cells_1D, domain, N_dump_buffers, dump_type);
             }
-
-            density_file << cell->get_density() << "\n";
+            async_writer->save(file_name, time, dump_counter);
+        } else {
+            snapshot_writer.write(*fields, N_cells_1D, domain, file_name, time, dump_counter, dump_type);
         }
+#ifdef WITH_HDF5
+        snapshot_writer.write_hdf5(*fields, N_cells_1D, output_prefix + "snapshot_" + std::to_string(dump_counter) + ".h5", time,
+                                   dump_counter, dump_type);
+#endif
+#ifdef WITH_TEXT_DUMPS
+        save_text_cells(dump_counter, domain);
+#endif
+    }
 
-        density_file.close();
+    void save_checkpoint(const std::string &checkpoint_name, const Domain &domain, const IntegrationState &state) {
+        Checkpoint::write(checkpoint_name, *fields, N_cells_1D, domain, state);
+    }
 
-        std::ofstream velocity_x_file("velocity_x_grid_" + std::to_string(dump_counter) + ".dat");
-        // save x,y,density
-        for (auto &cell : cells) {
-            for (auto coordinate : *cell->get_coordinates()) {
-                velocity_x_file << (real)coordinate / (real)N_CELLS_1D << ",";
-            }
+    // snapshots held for the background writer, 0 to write them in save_cells
+    void set_N_dump_buffers(const uint32_t input_N_dump_buffers) {
+        flush_cells();
+        async_writer.reset();
+        N_dump_buffers = input_N_dump_buffers;
+    }
 
-            velocity_x_file << cell->get_velocity(0) << "\n";
+    // SNAPSHOT_FLOAT32, SNAPSHOT_FLOAT64, SNAPSHOT_FLOAT16 or SNAPSHOT_BFLOAT16;
+    // the fields stay real, only the files are converted
+    void set_dump_type(const uint32_t input_dump_type) {
+        if (input_dump_type > SNAPSHOT_BFLOAT16) {
+            throw std::invalid_argument("Unknown snapshot dump type.");
         }
-
-        velocity_x_file.close();
+        flush_cells();
+        async_writer.reset();
+        dump_type = input_dump_type;
     }
 
-    void index_to_coordinates(const uint64_t index, std::vector<box_int> &coordinates) {
-        uint64_t next = index;
+    // in front of the file names of the dumps, e.g. the directory of an
+    // ensemble member, see Ensemble
+    void set_output_prefix(const std::string &input_output_prefix) {
+        output_prefix = input_output_prefix;
+    }
 
-        for (uint64_t d = 0; d < DIMENSION; d++) {
-            if (d < (DIMENSION-1)) {
-                coordinates[d] = (box_int)(next % N_CELLS_1D);
-                next /= N_CELLS_1D;
-            } else {
-                coordinates[d] = (box_int)next;
-            }
+    void flush_cells() {
+        if (async_writer) {
+            async_writer->flush();
         }
     }
 
-    uint64_t coordinates_to_index(const std::vector<box_int> &coordinates) {
-        uint64_t index = 0;
-        uint64_t dimension_factor = 1;
+    // every rank appends its own cells, see Domain::write_ordered
+    void save_text_cells(uint64_t dump_counter, const Domain &domain) {
+        save_field(fields->get_prev_density(), output_prefix + "density_grid_" + std::to_string(dump_counter) + ".dat", domain);
+        save_field(fields->get_prev_velocity(0), output_prefix + "velocity_x_grid_" + std::to_string(dump_counter) + ".dat", domain);
+    }
 
-        for (uint64_t d = 0; d < DIMENSION; d++) {
-            index += (uint64_t)coordinates[d] * dimension_factor;
-            dimension_factor *= (uint64_t)N_CELLS_1D;
+    // save x,y,...,value
+    void save_field(const real *values, const std::string &file_name, const Domain &domain) {
+        std::ostringstream field_text;
+        for (uint64_t i = 0; i < N_cells_ND; i++) {
+            const uint64_t s = stencil.interior_to_storage(i);
+            for (uint8_t d = 0; d < dimension; d++) {
+                field_text << (real)stencil.get_global_coordinate(s, d) / (real)N_cells_1D << ",";
+            }
+
+            field_text << values[s] << "\n";
         }
 
-        return index;
+        domain.write_ordered(file_name, field_text.str());
     }
 
-    void get_neighbors(const std::shared_ptr<Cell> cell, std::vector<std::vector<box_int>> &neighbor_coordinates, 
-                       std::vector<std::shared_ptr<Cell>> &neighbor_cells) {
-        for (uint8_t n = 0; n < (uint8_t)(2 * DIMENSION); n++) {
-            neighbor_coordinates[n] = *(cell->get_coordinates());
-        }
-        
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            neighbor_coordinates[2 * d][d] = (cell->get_coordinates(d) + 1) % N_CELLS_1D;
-            neighbor_coordinates[2 * d + 1][d] = (cell->get_coordinates(d) - 1 + N_CELLS_1D) % N_CELLS_1D;
-        }
+    void index_to_coordinates(const uint64_t index, std::vector<box_int> &coordinates) const {
+        ordering.index_to_coordinates(index, coordinates);
+    }
+
+    uint64_t coordinates_to_index(const std::vector<box_int> &coordinates) const {
+        return ordering.coordinates_to_index(coordinates);
+    }
 
-        for (uint8_t d = 0; d < DIMENSION; d++) {
-            neighbor_cells[2 * d] = get_cell(
-                coordinates_to_index(neighbor_coordinates[2 * d])
-            );
-            neighbor_cells[2 * d + 1] = get_cell(
-                coordinates_to_index(neighbor_coordinates[2 * d + 1])
-            );
+    // neighbors are flat offsets into the ghost-padded arrays, so there is no
+    // coordinate arithmetic or wrap-around here
+    void get_neighbors(const Cell &cell, std::vector<Cell> &neighbor_cells) {
+        const uint64_t index = cell.get_index();
+        for (uint8_t d = 0; d < dimension; d++) {
+            neighbor_cells[2 * d] = Cell(fields.get(), index + stencil.get_stride(d));
+            neighbor_cells[2 * d + 1] = Cell(fields.get(), index - stencil.get_stride(d));
         }
     }
 
-    void print_neighbors(const std::shared_ptr<Cell> cell) {
-        const auto number_of_neighbors = (uint8_t)(2 * DIMENSION);
-        std::vector<std::shared_ptr<Cell>> neighbor_cells(number_of_neighbors);
-        std::vector<std::vector<box_int>> neighbor_coordinates(number_of_neighbors, std::vector<box_int>(DIMENSION));
-        get_neighbors(cell, neighbor_coordinates, neighbor_cells);
+    void print_neighbors(const Cell &cell) {
+        const auto number_of_neighbors = (uint8_t)(2 * dimension);
+        std::vector<Cell> neighbor_cells(number_of_neighbors);
+        get_neighbors(cell, neighbor_cells);
 
         std::cout << "\nCell data";
-        cell->describe();
+        cell.describe();
 
         std::cout << "\nNeighbor data";
         for (auto &neighbor_cell : neighbor_cells) {
-            neighbor_cell->describe();
+            neighbor_cell.describe();
         }
     }
 };
 
-#endif /* GRID_HPP */
\ No newline at end of file
+#endif /* GRID_HPP */
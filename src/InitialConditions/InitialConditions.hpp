@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <math.h>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+#ifndef INITIAL_CONDITIONS_HPP
+#define INITIAL_CONDITIONS_HPP
+
+#define IC_UNIFORM_FLOW 0
+#define IC_SINE_SHEAR 1
+#define IC_KELVIN_HELMHOLTZ 2
+#define IC_SOD 3
+#define IC_SEDOV 4
+#define IC_GRESHO 5
+#define IC_SNAPSHOT 6
+
+// the Sedov blast goes into the cells within this many cells of the center
+#define SEDOV_RADIUS_CELLS 3.5
+
+// Primitive state of one cell as the generators set it; the energy follows
+// from it, the scalars from the position, see InitialConditions::apply.
+struct InitialState
+{
+    real density;
+    real pressure;
+    real velocity[MAX_DIMENSION];
+};
+
+// The registry of initial conditions, set in the unit box of N_cells_1D cells
+// across. Every generator gives the state of a cell from its global
+// coordinates, so apply() fills the rows of a block in parallel, straight into
+// the field arrays. With a static schedule every thread first touches the rows
+// it will sweep, which puts their pages on its NUMA node. IC_SNAPSHOT reads
+// the fields of a snapshot of the same box instead.
+//
+// amplitude scales the flow: the velocities of the first three, the blast
+// energy of Sedov and the rotation of Gresho. A generator is a member
+// function and a line of the table in get_types.
+class InitialConditions
+{
+private:
+    typedef void (InitialConditions::*Generator)(const box_int *coordinate, InitialState &state) const;
+
+    struct Type
+    {
+        const char *name;
+        uint8_t min_dimension;
+        // null for IC_SNAPSHOT
+        Generator generate;
+    };
+
+    uint8_t type;
+    double amplitude;
+    std::string file_name;
+
+    // the box of the fields being set, see apply
+    uint8_t dimension;
+    uint32_t N_cells_1D;
+    double gamma;
+    real sedov_pressure;
+
+    static const std::vector<Type> &get_types() {
+        static const std::vector<Type> types = {
+            {"uniform_flow", 2, &InitialConditions::uniform_flow},
+            {"sine_shear", 2, &InitialConditions::sine_shear},
+            {"kelvin_helmholtz", 2, &InitialConditions::kelvin_helmholtz},
+            {"sod", 1, &InitialConditions::sod},
+            {"sedov", 1, &InitialConditions::sedov},
+            {"gresho", 2, &InitialConditions::gresho},
+            {"snapshot", 1, nullptr},
+        };
+        return types;
+    }
+
+    // cell center along d in the unit box
+    double get_position(const box_int *coordinate, const uint8_t d) const {
+        return ((double)coordinate[d] + 0.5) / (double)N_cells_1D;
+    }
+
+    // density up from 1 to 2 at the middle of dimension 1 and back, moving along it
+    void uniform_flow(const box_int *coordinate, InitialState &state) const {
+        const box_int quarter_box = (box_int)(0.25 * (real)N_cells_1D);
+        if (coordinate[1] <= 2 * quarter_box) {
+            state.velocity[1] = amplitude * 0.3;
+            state.density = 1. + (double)coordinate[1] / (double)N_cells_1D;
+        }
+
+        if (coordinate[1] > 2 * quarter_box) {
+            state.velocity[1] = amplitude * 0.3;
+            state.density = 2. - (double)coordinate[1] / (double)N_cells_1D;
+        }
+    }
+
+    // the same density, with the flow along dimension 1 a sine wave along dimension 0
+    void sine_shear(const box_int *coordinate, InitialState &state) const {
+        const box_int quarter_box = (box_int)(0.25 * (real)N_cells_1D);
+        state.velocity[1] = amplitude * 3. * sin(2. * M_PI * (double)coordinate[0] / (double)(N_cells_1D - 1));
+        if (coordinate[1] <= 2 * quarter_box) {
+            state.density = 1. + (double)coordinate[1] / (double)N_cells_1D;
+        }
+
+        if (coordinate[1] > 2 * quarter_box) {
+            state.density = 2. - (double)coordinate[1] / (double)N_cells_1D;
+        }
+    }
+
+    // a dense band in the middle of dimension 1 moving against the rest, with a
+    // seed for the instability on both interfaces
+    void kelvin_helmholtz(const box_int *coordinate, InitialState &state) const {
+        const double x = get_position(coordinate, 0);
+        const double y = get_position(coordinate, 1);
+        const double sigma = 0.05 / sqrt(2.);
+        const bool band = fabs(y - 0.5) < 0.25;
+        state.density = band ? 2. : 1.;
+        state.pressure = 2.5;
+        state.velocity[0] = amplitude * (band ? 0.5 : -0.5);
+        state.velocity[1] = amplitude * 0.1 * sin(4. * M_PI * x)
+                          * (exp(-(y - 0.25) * (y - 0.25) / (2. * sigma * sigma)) + exp(-(y - 0.75) * (y - 0.75) / (2. * sigma * sigma)));
+    }
+
+    // the Sod shock tube along dimension 0; the periodic box adds a second
+    // interface at x = 0
+    void sod(const box_int *coordinate, InitialState &state) const {
+        const bool left = get_position(coordinate, 0) < 0.5;
+        state.density = left ? 1. : 0.125;
+        state.pressure = left ? 1. : 0.1;
+    }
+
+    // a cold, uniform medium with the blast energy in the cells near the center
+    void sedov(const box_int *coordinate, InitialState &state) const {
+        state.density = 1.;
+        state.pressure = 1e-5;
+        if (get_sedov_radius_squared(coordinate) <= SEDOV_RADIUS_CELLS * SEDOV_RADIUS_CELLS) {
+            state.pressure = sedov_pressure;
+        }
+    }
+
+    // in cells, from the center of the box
+    double get_sedov_radius_squared(const box_int *coordinate) const {
+        double radius_squared = 0.;
+        for (uint8_t d = 0; d < dimension; d++) {
+            const double distance = (double)coordinate[d] + 0.5 - 0.5 * (double)N_cells_1D;
+            radius_squared += distance * distance;
+        }
+        return radius_squared;
+    }
+
+    // pressure of the blast cells, a unit of energy (times amplitude) shared out over them
+    real get_sedov_pressure() const {
+        const box_int reach = (box_int)SEDOV_RADIUS_CELLS + 1;
+        const box_int first = (box_int)(N_cells_1D / 2) - reach;
+        uint64_t N_blast_cells = 0;
+        box_int coordinate[MAX_DIMENSION] = {0, 0, 0};
+        for (coordinate[2] = (dimension > 2 ? first : 0); coordinate[2] < (dimension > 2 ? first + 2 * reach : 1); coordinate[2]++) {
+            for (coordinate[1] = (dimension > 1 ? first : 0); coordinate[1] < (dimension > 1 ? first + 2 * reach : 1); coordinate[1]++) {
+                for (coordinate[0] = first; coordinate[0] < first + 2 * reach; coordinate[0]++) {
+                    if (get_sedov_radius_squared(coordinate) <= SEDOV_RADIUS_CELLS * SEDOV_RADIUS_CELLS) {
+                        N_blast_cells++;
+                    }
+                }
+            }
+        }
+        const double cell_volume = pow(1. / (double)N_cells_1D, dimension);
+        return (gamma - 1.) * amplitude / ((double)N_blast_cells * cell_volume);
+    }
+
+    // the Gresho vortex in the plane of dimensions 0 and 1, held by its pressure
+    // gradient; the pressure rises with amplitude^2 over that at the center
+    void gresho(const box_int *coordinate, InitialState &state) const {
+        const double x = get_position(coordinate, 0) - 0.5;
+        const double y = get_position(coordinate, 1) - 0.5;
+        const double r = sqrt(x * x + y * y);
+        double v_phi = 0.;
+        double pressure = 3. + 4. * log(2.);
+        if (r < 0.2) {
+            v_phi = 5. * r;
+            pressure = 5. + 12.5 * r * r;
+        } else if (r < 0.4) {
+            v_phi = 2. - 5. * r;
+            pressure = 9. - 4. * log(0.2) + 12.5 * r * r - 20. * r + 4. * log(r);
+        }
+        state.density = 1.;
+        state.pressure = 5. + amplitude * amplitude * (pressure - 5.);
+        if (r > 0.) {
+            state.velocity[0] = -amplitude * v_phi * y / r;
+            state.velocity[1] = amplitude * v_phi * x / r;
+        }
+    }
+
+    // prev and next of every field at storage index s
+    void set_cell(FieldStore &fields, const uint64_t s, const InitialState &state, const box_int *coordinate) const {
+        real specific_kinetic_energy = 0.;
+        for (uint8_t d = 0; d < dimension; d++) {
+            specific_kinetic_energy += 0.5 * state.velocity[d] * state.velocity[d];
+        }
+
+        // rho * e = P / (gamma - 1), E = rho * e + 0.5 * rho * u^2; E is TOTAL energy
+        const real energy = state.pressure / (gamma - 1.0) + state.density * specific_kinetic_energy;
+
+        fields.get_prev_density()[s] = state.density;
+        fields.get_prev_energy()[s] = energy;
+        fields.get_prev_pressure()[s] = state.pressure;
+        fields.get_next_density()[s] = state.density;
+        fields.get_next_energy()[s] = energy;
+        fields.get_next_pressure()[s] = state.pressure;
+        for (uint8_t d = 0; d < dimension; d++) {
+            fields.get_prev_velocity(d)[s] = state.velocity[d];
+            fields.get_next_velocity(d)[s] = state.velocity[d];
+        }
+
+        // scalar k marks slab k of N_scalars + 1 equal slabs along dimension 1
+        const uint8_t N_scalars = fields.get_N_scalars();
+        const uint8_t slab_dimension = (dimension > 1) ? 1 : 0;
+        for (uint8_t k = 0; k < N_scalars; k++) {
+            const box_int slab = (box_int)(((uint64_t)coordinate[slab_dimension] * (N_scalars + 1)) / N_cells_1D);
+            const real scalar = (slab == k) ? 1. : 0.;
+            fields.get_prev_scalar(k)[s] = scalar;
+            fields.get_next_scalar(k)[s] = scalar;
+        }
+    }
+
+    // every field by name from the snapshot, row by row; the time starts at 0
+    void read_snapshot(FieldStore &fields, SweepEngine &engine) const {
+        const Stencil &stencil = fields.get_stencil();
+        const SnapshotReader reader(file_name);
+        const SnapshotHeader &header = reader.get_header();
+        if (header.dimension != dimension || header.N_cells_1D != N_cells_1D) {
+            throw std::invalid_argument("The snapshot " + file_name + " is of a " + std::to_string(header.N_cells_1D) + "^"
+                                        + std::to_string(header.dimension) + " box, the run of a "
+                                        + std::to_string(N_cells_1D) + "^" + std::to_string(dimension) + " one.");
+        }
+        std::vector<int> snapshot_fields(fields.get_N_fields());
+        for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+            snapshot_fields[f] = reader.find_field(fields.get_field_name(f));
+            if (snapshot_fields[f] < 0) {
+                throw std::invalid_argument("The snapshot " + file_name + " has no field " + fields.get_field_name(f) + ".");
+            }
+        }
+
+        const uint64_t N_cells_row = stencil.get_extent(0);
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            std::vector<real> values(N_cells_row);
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                // row-major index of the first cell of the row in the whole box
+                uint64_t first_value = 0;
+                for (int d = dimension - 1; d >= 0; d--) {
+                    first_value = first_value * N_cells_1D + (uint64_t)stencil.get_global_coordinate(start, (uint8_t)d);
+                }
+                for (uint8_t f = 0; f < fields.get_N_fields(); f++) {
+                    reader.read_converted(snapshot_fields[f], first_value, N_cells_row, values.data());
+                    std::copy(values.begin(), values.end(), fields.get_prev(f) + start);
+                    std::copy(values.begin(), values.end(), fields.get_next(f) + start);
+                }
+            }
+        });
+    }
+
+    void fill(FieldStore &fields, SweepEngine &engine) {
+        const Stencil &stencil = fields.get_stencil();
+        if (dimension < get_min_dimension(type)) {
+            throw std::invalid_argument("The " + get_name(type) + " initial conditions need at least "
+                                        + std::to_string(get_min_dimension(type)) + " dimensions.");
+        }
+
+        if (type == IC_SNAPSHOT) {
+            read_snapshot(fields, engine);
+            fields.fill_ghosts();
+            return;
+        }
+        if (type == IC_SEDOV) {
+            sedov_pressure = get_sedov_pressure();
+        }
+
+        const Generator generate = get_types()[type].generate;
+        engine.parallel_for(stencil.get_N_rows(), [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            for (uint64_t row = row_begin; row < row_end; row++) {
+                const uint64_t start = stencil.row_start(row);
+                box_int coordinate[MAX_DIMENSION] = {0, 0, 0};
+                for (uint8_t d = 0; d < dimension; d++) {
+                    coordinate[d] = stencil.get_global_coordinate(start, d);
+                }
+                const box_int first_coordinate = coordinate[0];
+                for (uint64_t i = 0; i < stencil.get_extent(0); i++) {
+                    coordinate[0] = first_coordinate + (box_int)i;
+                    InitialState state = {1., 1., {0., 0., 0.}};
+                    (this->*generate)(coordinate, state);
+                    set_cell(fields, start + i, state, coordinate);
+                }
+            }
+        });
+
+        fields.fill_ghosts();
+    }
+
+public:
+    explicit InitialConditions(const uint8_t input_type = ICS, const double input_amplitude = IC_AMPLITUDE,
+                               const std::string &input_file_name = IC_FILE)
+        : type(input_type), amplitude(input_amplitude), file_name(input_file_name), dimension(0), N_cells_1D(0), gamma(0.),
+          sedov_pressure(0.)
+    {
+        if (type >= get_N_types()) {
+            throw std::invalid_argument("Unknown initial conditions " + std::to_string(type) + ".");
+        }
+        if (type == IC_SNAPSHOT && file_name.empty()) {
+            throw std::invalid_argument("The snapshot initial conditions need ic_file.");
+        }
+    }
+
+    static uint8_t get_N_types() {
+        return (uint8_t)get_types().size();
+    }
+
+    static std::string get_name(const uint8_t type) {
+        return type < get_N_types() ? get_types()[type].name : "unknown";
+    }
+
+    // the type called name, or -1
+    static int find(const std::string &name) {
+        for (uint8_t t = 0; t < get_N_types(); t++) {
+            if (name == get_types()[t].name) {
+                return t;
+            }
+        }
+        return -1;
+    }
+
+    static uint8_t get_min_dimension(const uint8_t type) {
+        return get_types()[type].min_dimension;
+    }
+
+    uint8_t get_type() const {
+        return type;
+    }
+
+    // Both states of the interior cells of fields in a box of N_cells_1D cells
+    // across, then the periodic ghosts. engine splits the rows as the sweeps do.
+    void apply(FieldStore &fields, const uint32_t box_N_cells_1D, const double box_gamma, SweepEngine &engine) const {
+        InitialConditions box = *this;
+        box.dimension = fields.get_stencil().get_dimension();
+        box.N_cells_1D = box_N_cells_1D;
+        box.gamma = box_gamma;
+        box.fill(fields, engine);
+    }
+};
+
+#endif /* INITIAL_CONDITIONS_HPP */
@@ -0,0 +1,214 @@
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../NumaArena/NumaArena.hpp"
+#include "../FusedUpdate/FusedUpdate.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+
+#ifndef INTERLEAVED_UPDATE_HPP
+#define INTERLEAVED_UPDATE_HPP
+
+// The centered update of N_lanes runs on grids of the same shape at once, e.g.
+// the members of an ensemble that differ only in gamma or the initial
+// conditions. Their fields are interleaved: the value of lane l at cell i is
+// stored at i * N_lanes + l, so a vector of the SimdUpdate kernels holds one
+// cell of every run, with no row tails, and the strides of the stencil are
+// N_lanes times longer. Each lane has its own dt_dx and gamma. Lane by lane the
+// operations are those of SimdUpdate, so every run steps bit-identically to
+// one of its own. Without passive scalars.
+class InterleavedUpdate
+{
+private:
+    static constexpr uint8_t N_FLUX_SLOTS = FLUX_MOMENTUM + MAX_DIMENSION;
+
+    Stencil stencil;
+    uint32_t N_lanes;
+    uint8_t N_fields;
+    // length of each array, N_lanes values per cell, rounded up so every array
+    // stays aligned
+    uint64_t N_padded;
+
+    // the prev and next arrays of the fields, then the face buffers of
+    // FusedUpdate, all in one block from NumaArena
+    real *block;
+    size_t block_bytes;
+    real *prev[FIELD_VELOCITY + MAX_DIMENSION];
+    real *next[FIELD_VELOCITY + MAX_DIMENSION];
+    real *face_flux[MAX_DIMENSION][N_FLUX_SLOTS];
+
+    SimdLaneConstants lanes;
+    SimdFluxKernel flux_kernel;
+    SimdLaneKernel lane_kernel;
+
+    SimdRowFields get_row_fields() const {
+        SimdRowFields f;
+        f.rho = prev[FIELD_DENSITY];
+        f.E = prev[FIELD_ENERGY];
+        f.P = prev[FIELD_PRESSURE];
+        f.next_rho = next[FIELD_DENSITY];
+        f.next_E = next[FIELD_ENERGY];
+        f.next_P = next[FIELD_PRESSURE];
+        // per lane, see SimdLaneConstants
+        f.gamma_minus_one = 0.;
+        f.gamma = 0.;
+        for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+            f.u[d] = prev[FIELD_VELOCITY + d];
+            f.next_u[d] = next[FIELD_VELOCITY + d];
+            f.stride[d] = stencil.get_stride(d) * N_lanes;
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + stencil.get_dimension(); k++) {
+                f.face_flux[d][k] = face_flux[d][k];
+            }
+        }
+        return f;
+    }
+
+public:
+    // lanes for the vectors of isa, a resolved SimdUpdate instruction set other
+    // than SIMD_SCALAR; every lane starts idle
+    InterleavedUpdate(const Stencil &input_stencil, const uint8_t isa, const uint8_t huge_pages = HUGE_PAGES)
+    {
+        stencil = input_stencil;
+        N_lanes = SimdUpdate::get_N_lanes(isa);
+        if (N_lanes < 2) {
+            throw std::invalid_argument("The interleaved update needs a vector instruction set.");
+        }
+        N_fields = FieldStore::get_N_fields(stencil);
+        const uint64_t reals_per_line = FIELD_ALIGNMENT / sizeof(real);
+        N_padded = ((stencil.get_N_storage() * N_lanes + reals_per_line - 1) / reals_per_line) * reals_per_line;
+
+        const uint8_t D = stencil.get_dimension();
+        const uint64_t N_arrays = 2 * N_fields + D * (FLUX_MOMENTUM + D);
+        block = static_cast<real *>(NumaArena::allocate(N_arrays * N_padded * sizeof(real), huge_pages, block_bytes));
+        for (uint8_t f = 0; f < N_fields; f++) {
+            prev[f] = block + f * N_padded;
+            next[f] = block + (N_fields + f) * N_padded;
+        }
+        for (uint8_t d = 0; d < D; d++) {
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+                face_flux[d][k] = block + (2 * N_fields + d * (FLUX_MOMENTUM + D) + k) * N_padded;
+            }
+        }
+
+        switch (D) {
+            case 1:
+                flux_kernel = get_simd_flux_kernel<1>(isa);
+                lane_kernel = get_simd_lane_kernel<1>(isa);
+                break;
+            case 2:
+                flux_kernel = get_simd_flux_kernel<2>(isa);
+                lane_kernel = get_simd_lane_kernel<2>(isa);
+                break;
+            case 3:
+                flux_kernel = get_simd_flux_kernel<3>(isa);
+                lane_kernel = get_simd_lane_kernel<3>(isa);
+                break;
+        }
+
+        for (uint32_t lane = 0; lane < N_lanes; lane++) {
+            clear_lane(lane);
+        }
+    }
+
+    ~InterleavedUpdate() {
+        NumaArena::release(block, block_bytes);
+    }
+
+    InterleavedUpdate(const InterleavedUpdate &) = delete;
+    InterleavedUpdate &operator=(const InterleavedUpdate &) = delete;
+
+    uint32_t get_N_lanes() const {
+        return N_lanes;
+    }
+
+    // the run in lane from the prev values of fields, which has the shape of
+    // the stencil
+    void set_lane(const uint32_t lane, const FieldStore &fields, const double gamma, const real dt_dx) {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            const real *values = fields.get_prev(f);
+            for (uint64_t i = 0; i < stencil.get_N_storage(); i++) {
+                prev[f][i * N_lanes + lane] = values[i];
+            }
+        }
+        lanes.gamma[lane] = gamma;
+        lanes.dt_dx[lane] = dt_dx;
+    }
+
+    // the prev values of lane back into fields, e.g. to save them
+    void get_lane(const uint32_t lane, FieldStore &fields) const {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            real *values = fields.get_prev(f);
+            for (uint64_t i = 0; i < stencil.get_N_storage(); i++) {
+                values[i] = prev[f][i * N_lanes + lane];
+            }
+        }
+    }
+
+    // An idle lane: gas at rest, whose fluxes cancel on every face, and no time
+    // step, so it stays finite whatever run was in it before.
+    void clear_lane(const uint32_t lane) {
+        for (uint64_t i = 0; i < stencil.get_N_storage(); i++) {
+            prev[FIELD_DENSITY][i * N_lanes + lane] = 1.;
+            prev[FIELD_ENERGY][i * N_lanes + lane] = 1. / (GAMMA - 1.);
+            prev[FIELD_PRESSURE][i * N_lanes + lane] = 1.;
+            for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+                prev[FIELD_VELOCITY + d][i * N_lanes + lane] = 0.;
+            }
+        }
+        lanes.gamma[lane] = GAMMA;
+        lanes.dt_dx[lane] = 0.;
+    }
+
+    void set_dt_dx(const uint32_t lane, const real dt_dx) {
+        lanes.dt_dx[lane] = dt_dx;
+    }
+
+    // Both passes over the whole grid of every lane, from the prev values with
+    // their periodic ghosts filled here. Lane l of max_signal_speeds, N_lanes
+    // values, is set to the largest next signal speed of that run.
+    void update(real *max_signal_speeds) {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            for (uint8_t d = 0; d < stencil.get_dimension(); d++) {
+                stencil.fill_periodic_ghosts(prev[f], d, N_lanes);
+            }
+        }
+
+        const SimdRowFields f = get_row_fields();
+        for (uint64_t row = 0; row < stencil.get_N_rows(); row++) {
+            for (const bool inner : {true, false}) {
+                stencil.for_each_row_faces(row, inner, [&](const uint64_t start, const uint64_t count, const uint8_t d) {
+                    flux_kernel(f, start * N_lanes, count * N_lanes, d);
+                });
+            }
+        }
+
+        for (uint32_t lane = 0; lane < N_lanes; lane++) {
+            max_signal_speeds[lane] = 0.;
+        }
+        for (uint64_t row = 0; row < stencil.get_N_rows(); row++) {
+            const uint64_t start = stencil.row_start(row) * N_lanes;
+            const uint64_t end = start + stencil.get_extent(0) * N_lanes;
+#ifdef DEBUG
+            const uint64_t done = lane_kernel(f, start, end - start, lanes, max_signal_speeds);
+            if (done < end) {
+                std::cout << "Lane " << done % N_lanes << " of the interleaved update has a NaN or a pressure that is zero or "
+                          << "negative at cell " << done / N_lanes << ".\n";
+                exit(1);
+            }
+#else
+            lane_kernel(f, start, end - start, lanes, max_signal_speeds);
+#endif
+        }
+    }
+
+    // the next values become the prev ones, see Grid::evolve
+    void evolve() {
+        for (uint8_t f = 0; f < N_fields; f++) {
+            std::swap(prev[f], next[f]);
+        }
+    }
+};
+
+#endif /* INTERLEAVED_UPDATE_HPP */
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+
+#ifndef LOCAL_TIMESTEP_HPP
+#define LOCAL_TIMESTEP_HPP
+
+// Hierarchical local time steps. The grid is cut into blocks of block_planes
+// planes along the last dimension (segments of the row in 1D), and every block
+// gets a level: it steps by dt * 2^level, where dt is the global CFL step set by
+// the fastest cell, as long as its own signal speed allows it. Levels of
+// neighboring blocks differ by at most one. A cycle of 2^(largest level)
+// substeps of dt brings all blocks back to the same time; in substep n the
+// blocks with n % 2^level == 0 are updated. When a block is updated next to one
+// halfway through its step, the neighbor's boundary plane is read at the
+// midpoint in time, halfway between its prev and next values. The blocks are
+// cut along the outermost dimension so a block and its boundary planes are
+// contiguous in storage; the periodic wrap comes from the local ghost layers,
+// so this only works when a single rank owns the whole box.
+class LocalTimestep
+{
+private:
+    FieldStore *fields;
+    const Stencil *stencil;
+    const SimdUpdate *update;
+    uint8_t max_level;
+    uint32_t block_planes;
+    uint32_t N_blocks;
+    // the planes are cut along this dimension, plane_size storage values each
+    uint8_t slab_dimension;
+    uint64_t plane_size;
+
+    // storage segments (start, count) the update sweeps, those of block b are
+    // block_segments[b] to block_segments[b + 1], segment_blocks maps back
+    std::vector<std::pair<uint64_t, uint64_t>> segments;
+    std::vector<uint64_t> block_segments;
+    std::vector<uint32_t> segment_blocks;
+    std::vector<real> segment_signal_speeds;
+    // largest signal speed of the prev values of every block
+    std::vector<real> signal_speeds;
+    std::vector<uint8_t> levels;
+    uint32_t N_substeps = 1;
+
+    // prev values of the boundary planes replaced by their midpoint values
+    std::vector<uint32_t> interpolated_planes;
+    std::vector<real> saved_planes;
+
+    // cells updated, and what stepping every cell at dt would have updated
+    uint64_t N_cell_updates = 0;
+    uint64_t N_cell_updates_global = 0;
+
+    uint32_t get_first_plane(const uint32_t block) const {
+        return block * block_planes;
+    }
+
+    uint32_t get_end_plane(const uint32_t block) const {
+        return std::min((block + 1) * block_planes, stencil->get_extent(slab_dimension));
+    }
+
+    uint64_t get_plane_start(const uint32_t plane) const {
+        return (plane + stencil->get_N_ghost()) * plane_size;
+    }
+
+    void copy_next_to_prev(const uint32_t block) {
+        const uint64_t start = get_plane_start(get_first_plane(block));
+        const uint64_t count = get_plane_start(get_end_plane(block)) - start;
+        for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+            std::memcpy(fields->get_prev(f) + start, fields->get_next(f) + start, count * sizeof(real));
+        }
+    }
+
+    // the boundary planes of the blocks halfway through their step that the
+    // updated blocks read, set to their midpoint values
+    void interpolate_boundary_planes(const std::vector<bool> &active) {
+        interpolated_planes.clear();
+        for (uint32_t b = 0; b < N_blocks && N_blocks > 1; b++) {
+            if (!active[b]) {
+                continue;
+            }
+            const uint32_t lower = (b + N_blocks - 1) % N_blocks;
+            const uint32_t upper = (b + 1) % N_blocks;
+            if (!active[lower]) {
+                interpolated_planes.push_back(get_end_plane(lower) - 1);
+            }
+            if (!active[upper]) {
+                interpolated_planes.push_back(get_first_plane(upper));
+            }
+        }
+        std::sort(interpolated_planes.begin(), interpolated_planes.end());
+        interpolated_planes.erase(std::unique(interpolated_planes.begin(), interpolated_planes.end()), interpolated_planes.end());
+
+        saved_planes.resize(interpolated_planes.size() * fields->get_N_fields() * plane_size);
+        real *saved = saved_planes.data();
+        for (const uint32_t plane : interpolated_planes) {
+            const uint64_t start = get_plane_start(plane);
+            for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+                real *prev = fields->get_prev(f) + start;
+                const real *next = fields->get_next(f) + start;
+                std::memcpy(saved, prev, plane_size * sizeof(real));
+                for (uint64_t i = 0; i < plane_size; i++) {
+                    prev[i] = 0.5 * (prev[i] + next[i]);
+                }
+                saved += plane_size;
+            }
+        }
+    }
+
+    void restore_boundary_planes() {
+        const real *saved = saved_planes.data();
+        for (const uint32_t plane : interpolated_planes) {
+            const uint64_t start = get_plane_start(plane);
+            for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+                std::memcpy(fields->get_prev(f) + start, saved, plane_size * sizeof(real));
+                saved += plane_size;
+            }
+        }
+    }
+
+    // The faces of segment k the update reads: its lower faces along every
+    // dimension and the upper ones on the box faces. The upper face of a block
+    // is the lower face of the next one, so it is only taken here when that
+    // block is not updated in this substep.
+    void flux_segment(const uint64_t k, const std::vector<bool> &active) const {
+        const uint64_t start = segments[k].first;
+        const uint64_t count = segments[k].second;
+        const uint32_t b = segment_blocks[k];
+        const bool block_upper_face = b + 1 == N_blocks || !active[b + 1];
+        if (stencil->get_dimension() == 1) {
+            update->flux_faces(start, count, 0);
+            if (block_upper_face) {
+                update->flux_faces(start + count, 1, 0);
+            }
+            return;
+        }
+
+        update->flux_faces(start, count + 1, 0);
+        for (uint8_t d = 1; d < stencil->get_dimension(); d++) {
+            update->flux_faces(start, count, d);
+            const box_int coordinate = stencil->get_coordinate(start, d);
+            const bool upper_face = (d < slab_dimension) ? coordinate + 1 == (box_int)stencil->get_extent(d)
+                                                          : block_upper_face && coordinate + 1 == (box_int)get_end_plane(b);
+            if (upper_face) {
+                update->flux_faces(start + stencil->get_stride(d), count, d);
+            }
+        }
+    }
+
+    void reduce_signal_speeds() {
+        for (uint32_t b = 0; b < N_blocks; b++) {
+            signal_speeds[b] = *std::max_element(segment_signal_speeds.begin() + block_segments[b],
+                                                 segment_signal_speeds.begin() + block_segments[b + 1]);
+        }
+    }
+
+public:
+    LocalTimestep(FieldStore &input_fields, const SimdUpdate &input_update, const uint8_t input_max_level,
+                  const uint32_t input_block_planes)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), update(&input_update),
+          max_level(input_max_level), block_planes(input_block_planes)
+    {
+        if (block_planes < 1) {
+            throw std::invalid_argument("Local time steps need blocks of at least one plane.");
+        }
+
+        slab_dimension = stencil->get_dimension() - 1;
+        plane_size = stencil->get_stride(slab_dimension);
+        const uint32_t N_planes = stencil->get_extent(slab_dimension);
+        N_blocks = (N_planes + block_planes - 1) / block_planes;
+
+        const uint64_t N_rows_plane = stencil->get_N_rows() / N_planes;
+        for (uint32_t b = 0; b < N_blocks; b++) {
+            block_segments.push_back(segments.size());
+            if (stencil->get_dimension() == 1) {
+                segments.push_back({stencil->row_start(0) + get_first_plane(b), get_end_plane(b) - get_first_plane(b)});
+                continue;
+            }
+            for (uint64_t row = get_first_plane(b) * N_rows_plane; row < get_end_plane(b) * N_rows_plane; row++) {
+                segments.push_back({stencil->row_start(row), stencil->get_extent(0)});
+            }
+        }
+        block_segments.push_back(segments.size());
+        for (uint32_t b = 0; b < N_blocks; b++) {
+            segment_blocks.insert(segment_blocks.end(), block_segments[b + 1] - block_segments[b], b);
+        }
+        segment_signal_speeds.resize(segments.size(), 0.);
+        signal_speeds.resize(N_blocks, 0.);
+        levels.resize(N_blocks, 0);
+    }
+
+    uint32_t get_N_blocks() const {
+        return N_blocks;
+    }
+
+    uint64_t get_N_cell_updates() const {
+        return N_cell_updates;
+    }
+
+    uint64_t get_N_cell_updates_global() const {
+        return N_cell_updates_global;
+    }
+
+    // signal speeds of the blocks from their prev values, needed once before
+    // the first cycle; afterwards the update sweeps keep them
+    void set_signal_speeds(SweepEngine &engine) {
+        engine.parallel_for(segments.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t k = begin; k < end; k++) {
+                segment_signal_speeds[k] = update->get_max_signal_speed(segments[k].first, segments[k].second);
+            }
+        });
+        reduce_signal_speeds();
+    }
+
+    // Levels for the next cycle, with dt the global step and dt_max the
+    // largest step any block may take, limited to max_cycle_level. CFL_prefactor
+    // over a block's signal speed is the step it allows. Returns the number of
+    // substeps of dt in the cycle.
+    uint32_t plan(const real dt, const real dt_max, const real CFL_prefactor, const uint8_t max_cycle_level) {
+        const uint8_t level_limit = std::min(max_level, max_cycle_level);
+        for (uint32_t b = 0; b < N_blocks; b++) {
+            const real block_dt = std::min(CFL_prefactor / signal_speeds[b], dt_max);
+            uint8_t level = 0;
+            while (level < level_limit && dt * (real)(2u << level) <= block_dt) {
+                level++;
+            }
+            levels[b] = level;
+        }
+
+        // lowered until neighbors are at most one level apart
+        bool changed = N_blocks > 1;
+        while (changed) {
+            changed = false;
+            for (uint32_t b = 0; b < N_blocks; b++) {
+                const uint8_t neighbor_level = std::min(levels[(b + N_blocks - 1) % N_blocks], levels[(b + 1) % N_blocks]);
+                if (levels[b] > neighbor_level + 1) {
+                    levels[b] = neighbor_level + 1;
+                    changed = true;
+                }
+            }
+        }
+
+        N_substeps = 1u << *std::max_element(levels.begin(), levels.end());
+        return N_substeps;
+    }
+
+    // Advance every block through the cycle set by plan, from prev values with
+    // up to date ghosts; the result is left in the prev arrays. Returns the
+    // largest signal speed at the end of the cycle.
+    real advance(SweepEngine &engine, const real dt_dx) {
+        std::vector<bool> active(N_blocks);
+        std::vector<uint64_t> active_segments;
+        for (uint32_t n = 0; n < N_substeps; n++) {
+            active_segments.clear();
+            for (uint32_t b = 0; b < N_blocks; b++) {
+                active[b] = n % (1u << levels[b]) == 0;
+                if (active[b]) {
+                    for (uint64_t k = block_segments[b]; k < block_segments[b + 1]; k++) {
+                        active_segments.push_back(k);
+                    }
+                    const uint64_t N_cells_plane = stencil->get_N_interior() / stencil->get_extent(slab_dimension);
+                    N_cell_updates += (get_end_plane(b) - get_first_plane(b)) * N_cells_plane;
+                }
+            }
+            N_cell_updates_global += stencil->get_N_interior();
+
+            interpolate_boundary_planes(active);
+            if (n > 0) {
+                fields->fill_ghosts();
+            }
+            engine.parallel_for(active_segments.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+                for (uint64_t a = begin; a < end; a++) {
+                    flux_segment(active_segments[a], active);
+                }
+            });
+            engine.parallel_for(active_segments.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+                for (uint64_t a = begin; a < end; a++) {
+                    const uint64_t k = active_segments[a];
+                    const real block_dt_dx = dt_dx * (real)(1u << levels[segment_blocks[k]]);
+                    segment_signal_speeds[k] = update->update_row(segments[k].first, segments[k].second, block_dt_dx);
+                }
+            });
+            restore_boundary_planes();
+
+            // blocks at the end of their step
+            for (uint32_t b = 0; b < N_blocks; b++) {
+                if ((n + 1) % (1u << levels[b]) == 0) {
+                    copy_next_to_prev(b);
+                }
+            }
+        }
+
+        reduce_signal_speeds();
+        return *std::max_element(signal_speeds.begin(), signal_speeds.end());
+    }
+
+    // blocks per level in the last cycle
+    void describe_cycle() const {
+        std::vector<uint32_t> N_blocks_level(max_level + 1, 0);
+        for (const uint8_t level : levels) {
+            N_blocks_level[level]++;
+        }
+        std::cout << "\tlocal time steps: " << N_substeps << " substeps, blocks per level:";
+        for (const uint32_t N : N_blocks_level) {
+            std::cout << " " << N;
+        }
+        std::cout << "\n";
+    }
+
+    void describe() const {
+        std::cout << "Local time steps: " << N_cell_updates << " cell updates instead of " << N_cell_updates_global
+                  << " at the global dt (" << 100. * (double)N_cell_updates / (double)N_cell_updates_global << "%)\n";
+    }
+};
+
+#endif /* LOCAL_TIMESTEP_HPP */
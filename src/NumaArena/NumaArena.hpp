@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "../main.hpp"
+
+#ifndef NUMA_ARENA_HPP
+#define NUMA_ARENA_HPP
+
+// page size of the field arrays: HUGE_PAGES_NONE (0) uses the base pages,
+// HUGE_PAGES_TRANSPARENT (1) asks the kernel to back them with transparent
+// huge pages and HUGE_PAGES_EXPLICIT (2) maps them from the hugetlbfs pool,
+// falling back to transparent huge pages when the pool is empty
+#define HUGE_PAGES_NONE 0
+#define HUGE_PAGES_TRANSPARENT 1
+#define HUGE_PAGES_EXPLICIT 2
+
+// the x86-64 huge page, the alignment transparent huge pages need
+#define HUGE_PAGE_BYTES (2ul << 20)
+
+// The NUMA nodes and CPUs of the machine as Linux reports them in sysfs, and
+// the node a page of memory or a thread is on. Without sysfs the machine is a
+// single node.
+class NumaTopology
+{
+public:
+    static uint32_t get_N_nodes() {
+        uint32_t N_nodes = 0;
+        DIR *directory = opendir("/sys/devices/system/node");
+        if (directory != nullptr) {
+            while (const dirent *entry = readdir(directory)) {
+                uint32_t node;
+                if (std::sscanf(entry->d_name, "node%u", &node) == 1) {
+                    N_nodes = std::max(N_nodes, node + 1);
+                }
+            }
+            closedir(directory);
+        }
+        return std::max(N_nodes, 1u);
+    }
+
+    static uint32_t get_cpu_node(const uint32_t cpu) {
+        uint32_t node = 0;
+        DIR *directory = opendir(("/sys/devices/system/cpu/cpu" + std::to_string(cpu)).c_str());
+        if (directory != nullptr) {
+            while (const dirent *entry = readdir(directory)) {
+                if (std::sscanf(entry->d_name, "node%u", &node) == 1) {
+                    break;
+                }
+            }
+            closedir(directory);
+        }
+        return node;
+    }
+
+    // the CPUs this process may run on, e.g. after taskset or a batch scheduler
+    static std::vector<uint32_t> get_allowed_cpus() {
+        std::vector<uint32_t> cpus;
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &mask)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        return cpus;
+    }
+
+    // node of the calling thread right now, 0 if unknown
+    static uint32_t get_current_node() {
+#ifdef __linux__
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if (syscall(__NR_getcpu, &cpu, &node, nullptr) == 0) {
+            return node;
+        }
+#endif
+        return 0;
+    }
+
+    // Bytes of [begin, begin + N_bytes) on each node. Pages never touched have
+    // no node yet and are left out.
+    static std::vector<uint64_t> get_node_bytes(const void *begin, const size_t N_bytes) {
+        std::vector<uint64_t> node_bytes(get_N_nodes(), 0);
+#ifdef __linux__
+        const size_t page_bytes = sysconf(_SC_PAGESIZE);
+        const uintptr_t first = (uintptr_t)begin / page_bytes * page_bytes;
+        const uintptr_t last = (uintptr_t)begin + N_bytes;
+        // move_pages without target nodes only reports where the pages are
+        const size_t batch = 1024;
+        std::vector<void *> pages(batch);
+        std::vector<int> status(batch);
+        for (uintptr_t address = first; address < last; address += batch * page_bytes) {
+            size_t N_pages = 0;
+            for (; N_pages < batch && address + N_pages * page_bytes < last; N_pages++) {
+                pages[N_pages] = (void *)(address + N_pages * page_bytes);
+            }
+            if (syscall(__NR_move_pages, 0, N_pages, pages.data(), nullptr, status.data(), 0) != 0) {
+                // no NUMA support in the kernel, count it all on node 0
+                node_bytes.assign(node_bytes.size(), 0);
+                node_bytes[0] = N_bytes;
+                return node_bytes;
+            }
+            for (size_t p = 0; p < N_pages; p++) {
+                if (status[p] >= 0 && (size_t)status[p] < node_bytes.size()) {
+                    node_bytes[status[p]] += page_bytes;
+                }
+            }
+        }
+#else
+        node_bytes[0] = N_bytes;
+#endif
+        return node_bytes;
+    }
+};
+
+// Anonymous mappings for the field arrays. The pages are not touched here, so
+// each one lands on the NUMA node of the thread that first writes it, see
+// FieldStore::first_touch, and with huge pages the mapping starts on a huge
+// page boundary so the kernel can back all of it with them. Blocks smaller
+// than a huge page, such as the AMR blocks, always use the base pages.
+class NumaArena
+{
+public:
+    // mapped_bytes returns the length to hand back to release
+    static void *allocate(const size_t N_bytes, const uint8_t huge_pages, size_t &mapped_bytes) {
+        if (huge_pages > HUGE_PAGES_EXPLICIT) {
+            throw std::invalid_argument("Unknown huge page mode.");
+        }
+        if (huge_pages == HUGE_PAGES_NONE || N_bytes < HUGE_PAGE_BYTES) {
+            const size_t page_bytes = sysconf(_SC_PAGESIZE);
+            mapped_bytes = (N_bytes + page_bytes - 1) / page_bytes * page_bytes;
+            void *block = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return block;
+        }
+
+        mapped_bytes = (N_bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+#ifdef MAP_HUGETLB
+        if (huge_pages == HUGE_PAGES_EXPLICIT) {
+            void *block = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (block != MAP_FAILED) {
+                return block;
+            }
+            static bool warned = false;
+            if (!warned) {
+                std::cout << "No explicit huge pages available, using transparent huge pages\n";
+                warned = true;
+            }
+        }
+#endif
+
+        // map a huge page more than needed and trim both ends to the boundary
+        char *raw = static_cast<char *>(mmap(nullptr, mapped_bytes + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        char *block = reinterpret_cast<char *>(((uintptr_t)raw + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES);
+        if (block > raw) {
+            munmap(raw, block - raw);
+        }
+        if (raw + HUGE_PAGE_BYTES > block) {
+            munmap(block + mapped_bytes, raw + HUGE_PAGE_BYTES - block);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(block, mapped_bytes, MADV_HUGEPAGE);
+#endif
+        return block;
+    }
+
+    static void release(void *block, const size_t mapped_bytes) {
+        if (block != nullptr) {
+            munmap(block, mapped_bytes);
+        }
+    }
+};
+
+#endif /* NUMA_ARENA_HPP */
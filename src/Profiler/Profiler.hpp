@@ -0,0 +1,379 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "../main.hpp"
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+// Hardware counters of this process through perf_event, counted in user space
+// only. The counters are inherited by the threads started after open(), and
+// their counts only reach read() once those threads have exited, so read them
+// after the SweepEngine is gone. Events the CPU or kernel refuse are left out.
+class HardwareCounters
+{
+private:
+    std::vector<std::pair<std::string, int>> counters;
+
+public:
+    HardwareCounters() {}
+
+    ~HardwareCounters() {
+#ifdef __linux__
+        for (auto &counter : counters) {
+            close(counter.second);
+        }
+#endif
+    }
+
+    HardwareCounters(const HardwareCounters &) = delete;
+    HardwareCounters &operator=(const HardwareCounters &) = delete;
+
+    // false when none of the events could be opened, e.g. under perf_event_paranoid
+    bool open() {
+#ifdef __linux__
+        const std::pair<const char *, uint64_t> events[] = {
+            {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+            {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+            {"cache_references", PERF_COUNT_HW_CACHE_REFERENCES},
+            {"cache_misses", PERF_COUNT_HW_CACHE_MISSES},
+            {"branch_misses", PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        for (auto &event : events) {
+            struct perf_event_attr attributes;
+            std::memset(&attributes, 0, sizeof(attributes));
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.size = sizeof(attributes);
+            attributes.config = event.second;
+            attributes.inherit = 1;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            const int file = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+            if (file >= 0) {
+                counters.emplace_back(event.first, file);
+            }
+        }
+#endif
+        return !counters.empty();
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> read() const {
+        std::vector<std::pair<std::string, uint64_t>> values;
+#ifdef __linux__
+        for (auto &counter : counters) {
+            uint64_t value = 0;
+            if (::read(counter.second, &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+                values.emplace_back(counter.first, value);
+            }
+        }
+#endif
+        return values;
+    }
+};
+
+// Wall-clock time per named phase of the run, the cell updates and modelled
+// memory traffic of the steps, and the hardware counters if asked for,
+// written as a JSON report at the end of the run. The steps are kept only when
+// recording, i.e. for a report, and at most MAX_STEP_RECORDS of them: past
+// that, neighbouring records are merged in pairs and each record covers twice
+// as many steps from then on. The phases are timed by the
+// main thread around whole sweeps, never per cell, so the cost is a few clock
+// reads per step. In quiet mode the per-step prints are left out and a line of
+// throughput is printed at every dump instead, see is_quiet.
+class Profiler
+{
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Phase
+    {
+        std::string name;
+        double seconds;
+        uint64_t calls;
+    };
+
+    static constexpr uint64_t MAX_STEP_RECORDS = 1024;
+
+    // the record_stride steps up to step, or fewer for the last record; time
+    // and dt are those of its last step
+    struct StepRecord
+    {
+        uint64_t step;
+        uint64_t N_steps;
+        double time;
+        double dt;
+        double seconds;
+        uint64_t N_cell_updates;
+        uint64_t N_bytes;
+    };
+
+    struct NodeRecord
+    {
+        uint32_t node;
+        uint64_t N_field_bytes;
+        uint32_t N_threads;
+    };
+
+    bool quiet;
+    bool recording_steps;
+    uint64_t record_stride;
+    std::vector<Phase> phases;
+    std::vector<StepRecord> steps;
+    std::vector<NodeRecord> nodes;
+    std::vector<std::pair<std::string, std::string>> info;
+    clock::time_point run_start;
+    clock::time_point step_start;
+    uint64_t N_step_cell_updates;
+    uint64_t N_step_bytes;
+    uint64_t N_steps;
+    double step_seconds;
+    uint64_t N_cell_updates;
+    uint64_t N_bytes;
+    HardwareCounters hardware_counters;
+    bool counting_hardware;
+
+    static std::string quote(const std::string &text) {
+        std::string quoted = "\"";
+        for (const char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+            }
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    // halves the records, each of the merged ones covering twice the steps
+    void merge_step_records() {
+        uint64_t N_merged = 0;
+        for (uint64_t s = 0; s < steps.size(); s += 2) {
+            StepRecord record = steps[s];
+            if (s + 1 < steps.size()) {
+                const StepRecord &later = steps[s + 1];
+                record.step = later.step;
+                record.N_steps += later.N_steps;
+                record.time = later.time;
+                record.dt = later.dt;
+                record.seconds += later.seconds;
+                record.N_cell_updates += later.N_cell_updates;
+                record.N_bytes += later.N_bytes;
+            }
+            steps[N_merged++] = record;
+        }
+        steps.resize(N_merged);
+        record_stride *= 2;
+    }
+
+public:
+    // record_steps keeps the series of steps for write_report
+    explicit Profiler(const bool input_quiet = false, const bool hardware = false, const bool record_steps = false)
+        : quiet(input_quiet), recording_steps(record_steps), record_stride(1), run_start(clock::now()),
+          step_start(run_start), N_step_cell_updates(0), N_step_bytes(0), N_steps(0), step_seconds(0.), N_cell_updates(0),
+          N_bytes(0), counting_hardware(false)
+    {
+        if (hardware) {
+            counting_hardware = hardware_counters.open();
+            if (!counting_hardware) {
+                std::cout << "Hardware counters are not available, perf_event_open failed\n";
+            }
+        }
+    }
+
+    bool is_quiet() const {
+        return quiet;
+    }
+
+    // index of the phase called name, added on first use
+    uint32_t get_phase(const std::string &name) {
+        for (uint32_t p = 0; p < phases.size(); p++) {
+            if (phases[p].name == name) {
+                return p;
+            }
+        }
+        phases.push_back({name, 0., 0});
+        return (uint32_t)(phases.size() - 1);
+    }
+
+    void add_time(const uint32_t phase, const double seconds) {
+        phases[phase].seconds += seconds;
+        phases[phase].calls++;
+    }
+
+    // cell updates and bytes moved by this rank in the current step
+    void count(const uint64_t cell_updates, const uint64_t bytes) {
+        N_step_cell_updates += cell_updates;
+        N_step_bytes += bytes;
+    }
+
+    // close the step that ends at time after a step of dt
+    void end_step(const uint64_t step, const double time, const double dt) {
+        const clock::time_point now = clock::now();
+        const double seconds = std::chrono::duration<double>(now - step_start).count();
+        if (recording_steps) {
+            if (steps.empty() || steps.back().N_steps >= record_stride) {
+                if (steps.size() >= MAX_STEP_RECORDS) {
+                    merge_step_records();
+                }
+                steps.push_back({step, 0, time, dt, 0., 0, 0});
+            }
+            StepRecord &record = steps.back();
+            record.step = step;
+            record.N_steps++;
+            record.time = time;
+            record.dt = dt;
+            record.seconds += seconds;
+            record.N_cell_updates += N_step_cell_updates;
+            record.N_bytes += N_step_bytes;
+        }
+        N_steps++;
+        step_seconds += seconds;
+        N_cell_updates += N_step_cell_updates;
+        N_bytes += N_step_bytes;
+        N_step_cell_updates = 0;
+        N_step_bytes = 0;
+        step_start = now;
+    }
+
+    double get_elapsed() const {
+        return std::chrono::duration<double>(clock::now() - run_start).count();
+    }
+
+    // a line of the run so far, in place of the per-step prints
+    void print_progress(const uint64_t step, const double time) const {
+        const double elapsed = get_elapsed();
+        std::cout << "step " << step << "\ttime " << time << "\twall " << elapsed << " s\t"
+                  << (elapsed > 0. ? (double)N_cell_updates / elapsed : 0.) << " cell updates/s\n";
+    }
+
+    // key and value of the run, such as the grid size, for the report
+    void add_info(const std::string &key, const std::string &value) {
+        info.emplace_back(key, value);
+    }
+
+    // the field bytes and threads on a NUMA node, see get_node_modelled_bytes_per_second
+    void add_node(const uint32_t node, const uint64_t N_field_bytes, const uint32_t N_threads) {
+        nodes.push_back({node, N_field_bytes, N_threads});
+    }
+
+    // The modelled traffic of the steps served by the memory of a node, taken
+    // as its share of the field pages, over the wall time of the steps. With
+    // the pages on one node that node carries all of it. This is not measured:
+    // the nodes always add up to the modelled total, however the threads
+    // actually reach the pages.
+    double get_node_modelled_bytes_per_second(const NodeRecord &record) const {
+        uint64_t N_field_bytes = 0;
+        for (auto &other : nodes) {
+            N_field_bytes += other.N_field_bytes;
+        }
+        if (N_field_bytes == 0 || step_seconds <= 0.) {
+            return 0.;
+        }
+        return (double)N_bytes * ((double)record.N_field_bytes / (double)N_field_bytes) / step_seconds;
+    }
+
+    void print_nodes() const {
+        for (auto &record : nodes) {
+            std::cout << "NUMA node " << record.node << ": " << (double)record.N_field_bytes / (1 << 20) << " MiB of fields, "
+                      << record.N_threads << " threads, " << get_node_modelled_bytes_per_second(record) / 1e9
+                      << " GB/s modelled\n";
+        }
+    }
+
+    void write_report(const std::string &file_name) const {
+        const double elapsed = get_elapsed();
+        std::ostringstream report;
+        report << std::setprecision(9);
+        report << "{\n  \"info\": {";
+        for (uint64_t i = 0; i < info.size(); i++) {
+            report << (i > 0 ? "," : "") << "\n    " << quote(info[i].first) << ": " << quote(info[i].second);
+        }
+        report << "\n  },\n";
+        report << "  \"wall_seconds\": " << elapsed << ",\n";
+        report << "  \"N_steps\": " << N_steps << ",\n";
+        report << "  \"N_cell_updates\": " << N_cell_updates << ",\n";
+        report << "  \"cell_updates_per_second\": " << (elapsed > 0. ? (double)N_cell_updates / elapsed : 0.) << ",\n";
+        report << "  \"N_bytes\": " << N_bytes << ",\n";
+        report << "  \"bytes_per_second\": " << (elapsed > 0. ? (double)N_bytes / elapsed : 0.) << ",\n";
+
+        report << "  \"phases\": [";
+        for (uint64_t p = 0; p < phases.size(); p++) {
+            report << (p > 0 ? "," : "") << "\n    {\"name\": " << quote(phases[p].name) << ", \"seconds\": " << phases[p].seconds
+                   << ", \"calls\": " << phases[p].calls << "}";
+        }
+        report << "\n  ],\n";
+
+        report << "  \"hardware_counters\": {";
+        if (counting_hardware) {
+            const auto values = hardware_counters.read();
+            for (uint64_t c = 0; c < values.size(); c++) {
+                report << (c > 0 ? "," : "") << "\n    " << quote(values[c].first) << ": " << values[c].second;
+            }
+            report << "\n  ";
+        }
+        report << "},\n";
+
+        report << "  \"numa_nodes\": [";
+        for (uint64_t n = 0; n < nodes.size(); n++) {
+            report << (n > 0 ? "," : "") << "\n    {\"node\": " << nodes[n].node << ", \"N_field_bytes\": " << nodes[n].N_field_bytes
+                   << ", \"N_threads\": " << nodes[n].N_threads << ", \"modelled_bytes_per_second\": "
+                   << get_node_modelled_bytes_per_second(nodes[n]) << "}";
+        }
+        report << "\n  ],\n";
+
+        report << "  \"steps\": [";
+        for (uint64_t s = 0; s < steps.size(); s++) {
+            const StepRecord &record = steps[s];
+            report << (s > 0 ? "," : "") << "\n    {\"step\": " << record.step << ", \"N_steps\": " << record.N_steps
+                   << ", \"time\": " << record.time
+                   << ", \"dt\": " << record.dt << ", \"seconds\": " << record.seconds << ", \"N_cell_updates\": "
+                   << record.N_cell_updates << ", \"cell_updates_per_second\": "
+                   << (record.seconds > 0. ? (double)record.N_cell_updates / record.seconds : 0.) << ", \"N_bytes\": "
+                   << record.N_bytes << "}";
+        }
+        report << "\n  ]\n}\n";
+
+        std::ofstream file(file_name);
+        if (!file) {
+            throw std::runtime_error("Could not write the report " + file_name + ".");
+        }
+        file << report.str();
+    }
+};
+
+// adds the time from construction to destruction to a phase of the profiler
+class ScopedTimer
+{
+private:
+    Profiler *profiler;
+    uint32_t phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    ScopedTimer(Profiler &input_profiler, const uint32_t input_phase)
+        : profiler(&input_profiler), phase(input_phase), start(std::chrono::steady_clock::now()) {}
+
+    ScopedTimer(Profiler &input_profiler, const std::string &name)
+        : ScopedTimer(input_profiler, input_profiler.get_phase(name)) {}
+
+    ~ScopedTimer() {
+        profiler->add_time(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+#endif /* PROFILER_HPP */
@@ -0,0 +1,658 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../FusedUpdate/FusedUpdate.hpp"
+#include "../CellOrdering/CellOrdering.hpp"
+#include "../Diagnostics/Diagnostics.hpp"
+
+#ifndef SIMD_UPDATE_HPP
+#define SIMD_UPDATE_HPP
+
+#define SIMD_AUTO 0
+#define SIMD_SCALAR 1
+#define SIMD_SSE2 2
+#define SIMD_AVX2 3
+#define SIMD_AVX512 4
+
+// pointers and strides the row kernels need, gathered once per row
+struct SimdRowFields
+{
+    const real *rho;
+    const real *E;
+    const real *P;
+    const real *u[MAX_DIMENSION];
+    real *next_rho;
+    real *next_E;
+    real *next_P;
+    real *next_u[MAX_DIMENSION];
+    uint64_t stride[MAX_DIMENSION];
+    real *face_flux[MAX_DIMENSION][FLUX_MOMENTUM + MAX_DIMENSION];
+    double gamma_minus_one;
+    real gamma;
+};
+
+// the most lanes of a vector, those of an AVX-512 register
+#define SIMD_MAX_LANES (64 / sizeof(real))
+
+// dt_dx and gamma per lane of the update pass, for the interleaved fields of
+// InterleavedUpdate where every lane is a run of its own
+struct SimdLaneConstants
+{
+    real dt_dx[SIMD_MAX_LANES];
+    double gamma[SIMD_MAX_LANES];
+};
+
+// AVX-512F has fused multiply-add, which GCC would otherwise contract a * b + c
+// into and so round differently from the scalar kernel
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+// GCC vector extension types for 16, 32 and 64 byte registers, plus the double
+// vectors with the same number of lanes
+typedef real real_16b __attribute__((vector_size(16)));
+typedef real real_32b __attribute__((vector_size(32)));
+typedef real real_64b __attribute__((vector_size(64)));
+typedef double double_16b __attribute__((vector_size(16 / sizeof(real) * sizeof(double))));
+typedef double double_32b __attribute__((vector_size(32 / sizeof(real) * sizeof(double))));
+typedef double double_64b __attribute__((vector_size(64 / sizeof(real) * sizeof(double))));
+
+// the vectors of compute_real with the lanes of vec
+template <typename vec, typename dvec>
+using simd_compute_vec = typename std::conditional<sizeof(compute_real) == sizeof(real), vec, dvec>::type;
+
+// Lane-wise square root. GCC has no generic vector sqrt and, with errno set by
+// sqrt, won't vectorize a loop over the lanes, so the x86 intrinsics are used;
+// they round correctly, as sqrt does in the scalar kernel. They get inlined
+// into the kernels of their instruction set. (The masked AVX-512 form keeps
+// GCC from warning about the undefined pass-through of the plain one.)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f")))
+static inline real_64b vector_sqrt(const real_64b value) {
+#ifdef WITH_DOUBLE
+    return (real_64b)_mm512_mask_sqrt_pd((__m512d)value, 0xFF, (__m512d)value);
+#else
+    return (real_64b)_mm512_mask_sqrt_ps((__m512)value, 0xFFFF, (__m512)value);
+#endif
+}
+
+__attribute__((target("avx")))
+static inline real_32b vector_sqrt(const real_32b value) {
+#ifdef WITH_DOUBLE
+    return (real_32b)_mm256_sqrt_pd((__m256d)value);
+#else
+    return (real_32b)_mm256_sqrt_ps((__m256)value);
+#endif
+}
+
+static inline real_16b vector_sqrt(const real_16b value) {
+#ifdef WITH_DOUBLE
+    return (real_16b)_mm_sqrt_pd((__m128d)value);
+#else
+    return (real_16b)_mm_sqrt_ps((__m128)value);
+#endif
+}
+#else
+template <typename vec>
+static inline vec vector_sqrt(const vec value) {
+    vec result;
+    for (uint64_t lane = 0; lane < sizeof(vec) / sizeof(real); lane++) {
+        result[lane] = sqrt(value[lane]);
+    }
+    return result;
+}
+#endif
+
+// get_centered_flux on vectors, with the direction DIRECTION fixed
+template <typename cvec, uint8_t D, uint8_t DIRECTION>
+static inline __attribute__((always_inline))
+void simd_centered_flux(const cvec rho, const cvec E, const cvec P, const cvec *u, cvec *flux) {
+    const cvec mass_flux = rho * u[DIRECTION];
+    flux[FLUX_DENSITY] = mass_flux;
+    flux[FLUX_ENERGY] = (E + P) * u[DIRECTION];
+    #pragma GCC unroll 3
+    for (uint8_t c = 0; c < D; c++) {
+        flux[FLUX_MOMENTUM + c] = mass_flux * u[c];
+    }
+    flux[FLUX_MOMENTUM + DIRECTION] += P;
+}
+
+// The flux pass of FusedUpdate::flux_faces along DIRECTION written on vectors,
+// W faces at once, lane by lane the same operations as the scalar kernel.
+// Returns the first index that was not done, the tail for the scalar kernel.
+template <typename vec, typename dvec, uint8_t D, uint8_t DIRECTION>
+static inline __attribute__((always_inline))
+uint64_t simd_flux_faces_body(const SimdRowFields &f, const uint64_t start, const uint64_t count) {
+    typedef typename std::conditional<sizeof(compute_real) == sizeof(real), vec, dvec>::type cvec;
+    const uint64_t W = sizeof(vec) / sizeof(real);
+    const uint64_t s = f.stride[DIRECTION];
+
+    auto load = [](const real *pointer) {
+        vec value;
+        std::memcpy(&value, pointer, sizeof(vec));
+        return __builtin_convertvector(value, cvec);
+    };
+    auto store = [](real *pointer, const cvec value) {
+        const vec stored = __builtin_convertvector(value, vec);
+        std::memcpy(pointer, &stored, sizeof(vec));
+    };
+
+    uint64_t i = start;
+    for (; i + W <= start + count; i += W) {
+        cvec lower_u[D];
+        cvec upper_u[D];
+        #pragma GCC unroll 3
+        for (uint8_t c = 0; c < D; c++) {
+            lower_u[c] = load(f.u[c] + i - s);
+            upper_u[c] = load(f.u[c] + i);
+        }
+        cvec lower[FLUX_MOMENTUM + D];
+        cvec upper[FLUX_MOMENTUM + D];
+        simd_centered_flux<cvec, D, DIRECTION>(load(f.rho + i - s), load(f.E + i - s), load(f.P + i - s), lower_u, lower);
+        simd_centered_flux<cvec, D, DIRECTION>(load(f.rho + i), load(f.E + i), load(f.P + i), upper_u, upper);
+        #pragma GCC unroll 5
+        for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+            store(f.face_flux[DIRECTION][k] + i, (compute_real)0.5 * (lower[k] + upper[k]));
+        }
+    }
+    return i;
+}
+
+// the direction as a template parameter, so each gets its own loop
+template <typename vec, typename dvec, uint8_t D>
+static inline __attribute__((always_inline))
+uint64_t simd_flux_faces_direction(const SimdRowFields &f, const uint64_t start, const uint64_t count, const uint8_t d) {
+    switch (d) {
+        case 0: return simd_flux_faces_body<vec, dvec, D, 0>(f, start, count);
+        case 1: return simd_flux_faces_body<vec, dvec, D, std::min(1, D - 1)>(f, start, count);
+        case 2: return simd_flux_faces_body<vec, dvec, D, std::min(2, D - 1)>(f, start, count);
+    }
+    return start;
+}
+
+// The update pass of FusedUpdate::update_row for D dimensions written on
+// vectors, so the W lanes of vec update W contiguous cells along dimension 0
+// at once. The operations, including the promotions to double for the kinetic
+// energy and the pressure, match the scalar kernel lane by lane, so results
+// are bit-identical. The values are loaded into cvec, the vectors of
+// compute_real, and rounded back to vec when stored. dt_over_dx (in
+// compute_real), gamma_minus_one (in double) and gamma (in real) are either
+// scalars for all lanes, which GCC folds into the instructions as broadcasts,
+// or vectors with a value per lane. Returns the first index that was not
+// updated: the row tail, or the first cell that failed the DEBUG checks, which
+// the caller hands to the scalar kernel to recompute and report. Each lane of
+// max_signal_speeds is raised to the largest signal speed of the cells updated
+// in it.
+template <typename vec, typename dvec, uint8_t D, typename dt_type, typename gamma_minus_one_type, typename gamma_type>
+static inline __attribute__((always_inline))
+uint64_t simd_update_row_body(const SimdRowFields &f, const uint64_t start, const uint64_t count, const dt_type dt_over_dx,
+                              const gamma_minus_one_type gamma_minus_one, const gamma_type gamma, vec &max_signal_speeds) {
+    typedef simd_compute_vec<vec, dvec> cvec;
+    const uint64_t W = sizeof(vec) / sizeof(real);
+
+    auto load = [](const real *pointer) {
+        vec value;
+        std::memcpy(&value, pointer, sizeof(vec));
+        return __builtin_convertvector(value, cvec);
+    };
+    auto store = [](real *pointer, const cvec value) {
+        const vec stored = __builtin_convertvector(value, vec);
+        std::memcpy(pointer, &stored, sizeof(vec));
+    };
+    // as_stored lane by lane
+    auto stored = [](const cvec value) {
+        return __builtin_convertvector(__builtin_convertvector(value, vec), cvec);
+    };
+
+    uint64_t i = start;
+    for (; i + W <= start + count; i += W) {
+        cvec net_flux[FLUX_MOMENTUM + D] = {};
+        #pragma GCC unroll 3
+        for (uint8_t d = 0; d < D; d++) {
+            const uint64_t s = f.stride[d];
+            #pragma GCC unroll 5
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + D; k++) {
+                net_flux[k] += load(f.face_flux[d][k] + i + s) - load(f.face_flux[d][k] + i);
+            }
+        }
+
+        const cvec rho = load(f.rho + i);
+        cvec density = rho;
+        density -= dt_over_dx * net_flux[FLUX_DENSITY];
+
+        cvec momentum[D];
+        #pragma GCC unroll 3
+        for (uint8_t c = 0; c < D; c++) {
+            momentum[c] = load(f.u[c] + i);
+            momentum[c] *= rho;
+            momentum[c] -= dt_over_dx * net_flux[FLUX_MOMENTUM + c];
+        }
+
+        cvec energy = load(f.E + i);
+        energy -= dt_over_dx * net_flux[FLUX_ENERGY];
+
+        const cvec next_density = stored(density);
+        cvec next_u[D];
+        cvec next_specific_kinetic_energy = {};
+        #pragma GCC unroll 3
+        for (uint8_t d = 0; d < D; d++) {
+            next_u[d] = stored(momentum[d] / next_density);
+            const dvec next_u_d = __builtin_convertvector(next_u[d], dvec);
+            next_specific_kinetic_energy = __builtin_convertvector(
+                __builtin_convertvector(next_specific_kinetic_energy, dvec) + 0.5 * next_u_d * next_u_d, cvec);
+        }
+
+        // next_pressure is P = (gamma - 1) * rho * e = (gamma - 1) * (E - 0.5 * rho * u^2)
+        const cvec next_pressure = __builtin_convertvector(
+            gamma_minus_one * __builtin_convertvector(stored(energy) - next_density * next_specific_kinetic_energy, dvec), cvec);
+
+        store(f.next_rho + i, density);
+        store(f.next_E + i, energy);
+        store(f.next_P + i, next_pressure);
+        #pragma GCC unroll 3
+        for (uint8_t d = 0; d < D; d++) {
+            store(f.next_u[d] + i, next_u[d]);
+        }
+
+        // get_signal_speed lane by lane, in real from the stored values
+        vec next_u_squared = {};
+        #pragma GCC unroll 3
+        for (uint8_t d = 0; d < D; d++) {
+            const vec stored_u = __builtin_convertvector(next_u[d], vec);
+            next_u_squared += stored_u * stored_u;
+        }
+        const vec stored_pressure = __builtin_convertvector(next_pressure, vec);
+        const vec stored_density = __builtin_convertvector(next_density, vec);
+        const vec signal_speed = vector_sqrt(next_u_squared) + vector_sqrt(gamma * stored_pressure / stored_density);
+        max_signal_speeds = signal_speed > max_signal_speeds ? signal_speed : max_signal_speeds;
+    }
+
+#ifdef DEBUG
+    // checked after the row rather than per vector: the lane-wise compares on
+    // 512-bit vectors do not lower to mask instructions and would dominate
+    for (uint64_t j = start; j < i; j++) {
+        bool bad = isnan(f.next_rho[j]) || isnan(f.next_E[j]) || (f.next_P[j] <= 0.);
+#pragma GCC unroll 3
+        for (uint8_t d = 0; d < D; d++) {
+            bad |= isnan(f.next_u[d][j]);
+        }
+        if (bad) {
+            return j;
+        }
+    }
+#endif
+
+    return i;
+}
+
+// simd_update_row_body with the dt_dx and gamma of one run in every lane;
+// max_signal_speed is raised to the largest signal speed of the cells updated
+template <typename vec, typename dvec, uint8_t D>
+static inline __attribute__((always_inline))
+uint64_t simd_update_row_uniform(const SimdRowFields &f, const uint64_t start, const uint64_t count, const real dt_dx,
+                                 real &max_signal_speed) {
+    const uint64_t W = sizeof(vec) / sizeof(real);
+    const compute_real dt_over_dx = 2. * dt_dx;
+
+    vec max_signal_speeds = {};
+    const uint64_t done = simd_update_row_body<vec, dvec, D>(f, start, count, dt_over_dx, f.gamma_minus_one, f.gamma,
+                                                             max_signal_speeds);
+    for (uint64_t lane = 0; lane < W; lane++) {
+        if (max_signal_speeds[lane] > max_signal_speed) {
+            max_signal_speed = max_signal_speeds[lane];
+        }
+    }
+    return done;
+}
+
+// simd_update_row_body with the dt_dx and gamma of lanes, as the scalar
+// kernel derives them from those of its run; lane l of max_signal_speeds is
+// raised to the largest signal speed of the cells updated in that lane
+template <typename vec, typename dvec, uint8_t D>
+static inline __attribute__((always_inline))
+uint64_t simd_update_lanes_body(const SimdRowFields &f, const uint64_t start, const uint64_t count,
+                                const SimdLaneConstants &lanes, real *max_signal_speeds) {
+    typedef simd_compute_vec<vec, dvec> cvec;
+    const uint64_t W = sizeof(vec) / sizeof(real);
+
+    cvec lane_dt_over_dx;
+    dvec lane_gamma_minus_one;
+    vec lane_gamma;
+    vec lane_max_signal_speeds;
+    for (uint64_t lane = 0; lane < W; lane++) {
+        lane_dt_over_dx[lane] = 2. * lanes.dt_dx[lane];
+        lane_gamma_minus_one[lane] = lanes.gamma[lane] - 1.0;
+        lane_gamma[lane] = lanes.gamma[lane];
+        lane_max_signal_speeds[lane] = max_signal_speeds[lane];
+    }
+    const uint64_t done = simd_update_row_body<vec, dvec, D>(f, start, count, lane_dt_over_dx, lane_gamma_minus_one, lane_gamma,
+                                                             lane_max_signal_speeds);
+    for (uint64_t lane = 0; lane < W; lane++) {
+        max_signal_speeds[lane] = lane_max_signal_speeds[lane];
+    }
+    return done;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <uint8_t D>
+__attribute__((target("avx512f,avx512dq,avx512vl,avx512bw")))
+static uint64_t simd_flux_faces_avx512(const SimdRowFields &f, const uint64_t start, const uint64_t count, const uint8_t d) {
+    return simd_flux_faces_direction<real_64b, double_64b, D>(f, start, count, d);
+}
+
+template <uint8_t D>
+__attribute__((target("avx512f,avx512dq,avx512vl,avx512bw")))
+static uint64_t simd_update_row_avx512(const SimdRowFields &f, const uint64_t start, const uint64_t count, const real dt_dx,
+                                   real &max_signal_speed) {
+    return simd_update_row_uniform<real_64b, double_64b, D>(f, start, count, dt_dx, max_signal_speed);
+}
+
+template <uint8_t D>
+__attribute__((target("avx512f,avx512dq,avx512vl,avx512bw")))
+static uint64_t simd_update_lanes_avx512(const SimdRowFields &f, const uint64_t start, const uint64_t count,
+                                         const SimdLaneConstants &lanes, real *max_signal_speeds) {
+    return simd_update_lanes_body<real_64b, double_64b, D>(f, start, count, lanes, max_signal_speeds);
+}
+
+template <uint8_t D>
+__attribute__((target("avx2")))
+static uint64_t simd_flux_faces_avx2(const SimdRowFields &f, const uint64_t start, const uint64_t count, const uint8_t d) {
+    return simd_flux_faces_direction<real_32b, double_32b, D>(f, start, count, d);
+}
+
+template <uint8_t D>
+__attribute__((target("avx2")))
+static uint64_t simd_update_row_avx2(const SimdRowFields &f, const uint64_t start, const uint64_t count, const real dt_dx,
+                                   real &max_signal_speed) {
+    return simd_update_row_uniform<real_32b, double_32b, D>(f, start, count, dt_dx, max_signal_speed);
+}
+
+template <uint8_t D>
+__attribute__((target("avx2")))
+static uint64_t simd_update_lanes_avx2(const SimdRowFields &f, const uint64_t start, const uint64_t count,
+                                       const SimdLaneConstants &lanes, real *max_signal_speeds) {
+    return simd_update_lanes_body<real_32b, double_32b, D>(f, start, count, lanes, max_signal_speeds);
+}
+#endif
+
+// baseline vectors (SSE2 on x86-64), always available
+template <uint8_t D>
+static uint64_t simd_flux_faces_sse2(const SimdRowFields &f, const uint64_t start, const uint64_t count, const uint8_t d) {
+    return simd_flux_faces_direction<real_16b, double_16b, D>(f, start, count, d);
+}
+
+template <uint8_t D>
+static uint64_t simd_update_row_sse2(const SimdRowFields &f, const uint64_t start, const uint64_t count, const real dt_dx,
+                                   real &max_signal_speed) {
+    return simd_update_row_uniform<real_16b, double_16b, D>(f, start, count, dt_dx, max_signal_speed);
+}
+
+template <uint8_t D>
+static uint64_t simd_update_lanes_sse2(const SimdRowFields &f, const uint64_t start, const uint64_t count,
+                                       const SimdLaneConstants &lanes, real *max_signal_speeds) {
+    return simd_update_lanes_body<real_16b, double_16b, D>(f, start, count, lanes, max_signal_speeds);
+}
+
+#pragma GCC pop_options
+
+typedef uint64_t (*SimdFluxKernel)(const SimdRowFields &, uint64_t, uint64_t, uint8_t);
+typedef uint64_t (*SimdRowKernel)(const SimdRowFields &, uint64_t, uint64_t, real, real &);
+typedef uint64_t (*SimdLaneKernel)(const SimdRowFields &, uint64_t, uint64_t, const SimdLaneConstants &, real *);
+
+template <uint8_t D>
+static SimdFluxKernel get_simd_flux_kernel(const uint8_t isa) {
+    switch (isa) {
+        case SIMD_SSE2: return simd_flux_faces_sse2<D>;
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2: return simd_flux_faces_avx2<D>;
+        case SIMD_AVX512: return simd_flux_faces_avx512<D>;
+#endif
+    }
+    return nullptr;
+}
+
+template <uint8_t D>
+static SimdRowKernel get_simd_row_kernel(const uint8_t isa) {
+    switch (isa) {
+        case SIMD_SSE2: return simd_update_row_sse2<D>;
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2: return simd_update_row_avx2<D>;
+        case SIMD_AVX512: return simd_update_row_avx512<D>;
+#endif
+    }
+    return nullptr;
+}
+
+template <uint8_t D>
+static SimdLaneKernel get_simd_lane_kernel(const uint8_t isa) {
+    switch (isa) {
+        case SIMD_SSE2: return simd_update_lanes_sse2<D>;
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2: return simd_update_lanes_avx2<D>;
+        case SIMD_AVX512: return simd_update_lanes_avx512<D>;
+#endif
+    }
+    return nullptr;
+}
+
+// Vectorized fused update with the instruction set picked at run time, so one
+// binary uses AVX-512 or AVX2 where the CPU has it. The flux and update passes
+// and their face buffers are those of FusedUpdate, which also takes the row
+// tails and the passive scalars.
+class SimdUpdate
+{
+private:
+    FieldStore *fields;
+    const Stencil *stencil;
+    FusedUpdate scalar_update;
+    uint8_t isa;
+    double gamma;
+    SimdFluxKernel flux_kernel;
+    SimdRowKernel row_kernel;
+
+    SimdRowFields get_row_fields() const {
+        SimdRowFields f;
+        f.rho = fields->get_prev_density();
+        f.E = fields->get_prev_energy();
+        f.P = fields->get_prev_pressure();
+        f.next_rho = fields->get_next_density();
+        f.next_E = fields->get_next_energy();
+        f.next_P = fields->get_next_pressure();
+        f.gamma_minus_one = gamma - 1.0;
+        f.gamma = gamma;
+        for (uint8_t d = 0; d < stencil->get_dimension(); d++) {
+            f.u[d] = fields->get_prev_velocity(d);
+            f.next_u[d] = fields->get_next_velocity(d);
+            f.stride[d] = stencil->get_stride(d);
+            for (uint8_t k = 0; k < FLUX_MOMENTUM + stencil->get_dimension(); k++) {
+                f.face_flux[d][k] = scalar_update.get_face_flux(d, k);
+            }
+        }
+        return f;
+    }
+
+public:
+    SimdUpdate(FieldStore &input_fields, const uint8_t input_isa, const double input_gamma, const uint8_t huge_pages = HUGE_PAGES)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), scalar_update(input_fields, input_gamma, huge_pages)
+    {
+        isa = input_isa;
+        gamma = input_gamma;
+        if (isa == SIMD_AUTO) {
+            isa = detect_isa();
+        }
+
+        switch (isa) {
+            case SIMD_SCALAR:
+            case SIMD_SSE2:
+                break;
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMD_AVX2:
+                if (!__builtin_cpu_supports("avx2")) {
+                    throw std::invalid_argument("AVX2 requested but not supported by this CPU.");
+                }
+                break;
+            case SIMD_AVX512:
+                if (!__builtin_cpu_supports("avx512f")) {
+                    throw std::invalid_argument("AVX-512 requested but not supported by this CPU.");
+                }
+                break;
+#endif
+            default:
+                throw std::invalid_argument("Unknown SIMD instruction set.");
+        }
+
+        switch (stencil->get_dimension()) {
+            case 1:
+                flux_kernel = get_simd_flux_kernel<1>(isa);
+                row_kernel = get_simd_row_kernel<1>(isa);
+                break;
+            case 2:
+                flux_kernel = get_simd_flux_kernel<2>(isa);
+                row_kernel = get_simd_row_kernel<2>(isa);
+                break;
+            case 3:
+                flux_kernel = get_simd_flux_kernel<3>(isa);
+                row_kernel = get_simd_row_kernel<3>(isa);
+                break;
+        }
+    }
+
+    static uint8_t detect_isa() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return SIMD_AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SIMD_AVX2;
+        }
+#endif
+        return SIMD_SSE2;
+    }
+
+    uint8_t get_isa() const {
+        return isa;
+    }
+
+    // the lanes of real in a vector of isa, 1 for SIMD_SCALAR
+    static uint32_t get_N_lanes(const uint8_t isa) {
+        switch (isa) {
+            case SIMD_SSE2: return 16 / sizeof(real);
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMD_AVX2: return 32 / sizeof(real);
+            case SIMD_AVX512: return 64 / sizeof(real);
+#endif
+        }
+        return 1;
+    }
+
+    std::string get_isa_name() const {
+        switch (isa) {
+            case SIMD_SCALAR: return "scalar";
+            case SIMD_SSE2: return "sse2";
+            case SIMD_AVX2: return "avx2";
+            case SIMD_AVX512: return "avx512";
+        }
+        return "unknown";
+    }
+
+    // the flux pass, see FusedUpdate::flux_faces
+    void flux_faces(const uint64_t start, const uint64_t count, const uint8_t d) const {
+        uint64_t done = start;
+        if (flux_kernel != nullptr) {
+            done = flux_kernel(get_row_fields(), start, count, d);
+        }
+        scalar_update.flux_faces(done, start + count - done, d);
+    }
+
+    // the faces of an interior row that read no ghosts (inner) or the others,
+    // see Stencil::for_each_row_faces
+    void flux_row(const uint64_t row, const bool inner) const {
+        stencil->for_each_row_faces(row, inner, [&](const uint64_t start, const uint64_t count, const uint8_t d) {
+            flux_faces(start, count, d);
+        });
+    }
+
+    void flux_rows(const uint64_t row_begin, const uint64_t row_end) const {
+        for (uint64_t row = row_begin; row < row_end; row++) {
+            flux_row(row, true);
+            flux_row(row, false);
+        }
+    }
+
+    // as flux_row for the rows k_begin to k_end of a traversal order; with the
+    // halos in flight the inner faces can go first
+    void flux_rows(const RowTraversal &traversal, const uint64_t k_begin, const uint64_t k_end, const bool inner) const {
+        for (uint64_t k = k_begin; k < k_end; k++) {
+            flux_row(traversal.get_row(k), inner);
+        }
+    }
+
+    // all of these update from the face buffers, once the flux pass has been
+    // through all faces of the cells, and return the largest next signal
+    // speed of the cells they updated, see FusedUpdate
+    real update_row(const uint64_t start, const uint64_t count, const real dt_dx) const {
+        real max_signal_speed = 0.;
+        uint64_t done = start;
+        if (row_kernel != nullptr) {
+            done = row_kernel(get_row_fields(), start, count, dt_dx, max_signal_speed);
+        }
+        scalar_update.update_scalars_row(start, count, dt_dx);
+        return std::max(max_signal_speed, scalar_update.update_row(done, start + count - done, dt_dx));
+    }
+
+    real update_rows(const uint64_t row_begin, const uint64_t row_end, const real dt_dx) const {
+        const SimdRowFields f = get_row_fields();
+        real max_signal_speed = 0.;
+        for (uint64_t row = row_begin; row < row_end; row++) {
+            const uint64_t start = stencil->row_start(row);
+            const uint64_t count = stencil->get_extent(0);
+            uint64_t done = start;
+            if (row_kernel != nullptr) {
+                done = row_kernel(f, start, count, dt_dx, max_signal_speed);
+            }
+            max_signal_speed = std::max(max_signal_speed, scalar_update.update_row(done, start + count - done, dt_dx));
+            scalar_update.update_scalars_row(start, count, dt_dx);
+        }
+        return max_signal_speed;
+    }
+
+    // as above for the rows k_begin to k_end of a traversal order; with totals
+    // each row is added to them once written, see Diagnostics
+    real update_rows(const RowTraversal &traversal, const uint64_t k_begin, const uint64_t k_end, const real dt_dx,
+                     DiagnosticTotals *totals = nullptr) const {
+        real max_signal_speed = 0.;
+        for (uint64_t k = k_begin; k < k_end; k++) {
+            const uint64_t start = stencil->row_start(traversal.get_row(k));
+            max_signal_speed = std::max(max_signal_speed, update_row(start, stencil->get_extent(0), dt_dx));
+            if (totals != nullptr) {
+                totals->add_cells(*fields, true, start, stencil->get_extent(0));
+            }
+        }
+        return max_signal_speed;
+    }
+
+    // both passes over the whole grid on the calling thread
+    real update(const real dt_dx) const {
+        flux_rows(0, stencil->get_N_rows());
+        return update_rows(0, stencil->get_N_rows(), dt_dx);
+    }
+
+    real get_max_signal_speed(const uint64_t start, const uint64_t count) const {
+        return scalar_update.get_max_signal_speed(start, count);
+    }
+
+    // the face buffers of the last flux pass, see FusedUpdate::get_face_flux
+    real *get_face_flux(const uint8_t d, const uint8_t k) const {
+        return scalar_update.get_face_flux(d, k);
+    }
+};
+
+#endif /* SIMD_UPDATE_HPP */
@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
+#ifdef WITH_HDF5
+#include <hdf5.h>
+#endif
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../Domain/Domain.hpp"
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#if defined(WITH_HDF5) && defined(WITH_MPI)
+#error "HDF5 snapshots are written serially; build without WITH_MPI or without WITH_HDF5."
+#endif
+
+#define SNAPSHOT_MAGIC "HYDROSNP"
+#define AMR_SNAPSHOT_MAGIC "HYDROAMR"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_FIELDS 16
+#define SNAPSHOT_FIELD_NAME_BYTES 16
+// the field arrays start on a page boundary
+#define SNAPSHOT_DATA_ALIGNMENT 4096
+// rows are gathered into a buffer of this size before each pwrite
+#define SNAPSHOT_BUFFER_BYTES (16 << 20)
+
+#define SNAPSHOT_FLOAT32 0
+#define SNAPSHOT_FLOAT64 1
+// IEEE half precision and bfloat16 (the upper half of a float), for dumps
+// where the file size matters more than the last digits
+#define SNAPSHOT_FLOAT16 2
+#define SNAPSHOT_BFLOAT16 3
+#ifdef WITH_DOUBLE
+#define SNAPSHOT_REAL SNAPSHOT_FLOAT64
+#else
+#define SNAPSHOT_REAL SNAPSHOT_FLOAT32
+#endif
+
+// Conversions between real and the value types of a snapshot. The 16-bit ones
+// round to nearest even in software, so they need no hardware support; a
+// double goes through float on the way, which can round twice.
+class SnapshotValues
+{
+public:
+    static uint32_t get_bytes(const uint32_t type) {
+        switch (type) {
+            case SNAPSHOT_FLOAT32:
+                return sizeof(float);
+            case SNAPSHOT_FLOAT64:
+                return sizeof(double);
+            case SNAPSHOT_FLOAT16:
+            case SNAPSHOT_BFLOAT16:
+                return sizeof(uint16_t);
+        }
+        throw std::invalid_argument("Unknown snapshot value type " + std::to_string(type) + ".");
+    }
+
+    static uint16_t float_to_half(const float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const uint16_t sign = (bits >> 16) & 0x8000;
+        const uint32_t magnitude = bits & 0x7fffffff;
+        if (magnitude >= 0x7f800000) {
+            // infinity stays one, a NaN stays quiet
+            return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+        }
+        if (magnitude >= 0x477ff000) {
+            // rounds past 65504, the largest half
+            return sign | 0x7c00;
+        }
+        if (magnitude <= 0x33000000) {
+            // at most half the smallest subnormal, 2^-25
+            return sign;
+        }
+        // below 2^-14 the half is subnormal, in units of 2^-24, above it the
+        // exponent is rebiased and the mantissa loses 13 bits
+        const bool subnormal = magnitude < 0x38800000;
+        const uint32_t shift = subnormal ? 126 - (magnitude >> 23) : 13;
+        const uint32_t rebiased = subnormal ? (magnitude & 0x7fffff) | 0x800000 : magnitude - ((127 - 15) << 23);
+        uint32_t half = rebiased >> shift;
+        const uint32_t remainder = rebiased & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) {
+            // a carry out of the mantissa correctly steps the exponent
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+
+    static float half_to_float(const uint16_t half) {
+        const uint32_t exponent = (half >> 10) & 0x1f;
+        const uint32_t mantissa = half & 0x3ff;
+        if (exponent == 0) {
+            const float value = std::ldexp((float)mantissa, -24);
+            return (half & 0x8000) ? -value : value;
+        }
+        uint32_t bits = (uint32_t)(half & 0x8000) << 16;
+        if (exponent == 0x1f) {
+            bits |= 0x7f800000 | (mantissa << 13);
+        } else {
+            bits |= ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static uint16_t float_to_bfloat16(const float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        if ((bits & 0x7fffffff) > 0x7f800000) {
+            return (bits >> 16) | 0x40;
+        }
+        bits += 0x7fff + ((bits >> 16) & 1);
+        return bits >> 16;
+    }
+
+    static float bfloat16_to_float(const uint16_t bfloat16) {
+        const uint32_t bits = (uint32_t)bfloat16 << 16;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // N_values values of real into get_bytes(type) bytes each at destination
+    static void encode(const real *values, const uint64_t N_values, const uint32_t type, void *destination) {
+        switch (type) {
+            case SNAPSHOT_FLOAT32:
+                std::copy(values, values + N_values, static_cast<float *>(destination));
+                return;
+            case SNAPSHOT_FLOAT64:
+                std::copy(values, values + N_values, static_cast<double *>(destination));
+                return;
+            case SNAPSHOT_FLOAT16:
+                for (uint64_t i = 0; i < N_values; i++) {
+                    static_cast<uint16_t *>(destination)[i] = float_to_half((float)values[i]);
+                }
+                return;
+            case SNAPSHOT_BFLOAT16:
+                for (uint64_t i = 0; i < N_values; i++) {
+                    static_cast<uint16_t *>(destination)[i] = float_to_bfloat16((float)values[i]);
+                }
+                return;
+        }
+        throw std::invalid_argument("Unknown snapshot value type " + std::to_string(type) + ".");
+    }
+
+    // the inverse of encode, into any arithmetic type
+    template <typename T>
+    static void decode(const void *source, const uint64_t N_values, const uint32_t type, T *values) {
+        for (uint64_t i = 0; i < N_values; i++) {
+            switch (type) {
+                case SNAPSHOT_FLOAT32:
+                    values[i] = (T)static_cast<const float *>(source)[i];
+                    break;
+                case SNAPSHOT_FLOAT64:
+                    values[i] = (T)static_cast<const double *>(source)[i];
+                    break;
+                case SNAPSHOT_FLOAT16:
+                    values[i] = (T)half_to_float(static_cast<const uint16_t *>(source)[i]);
+                    break;
+                case SNAPSHOT_BFLOAT16:
+                    values[i] = (T)bfloat16_to_float(static_cast<const uint16_t *>(source)[i]);
+                    break;
+                default:
+                    throw std::invalid_argument("Unknown snapshot value type " + std::to_string(type) + ".");
+            }
+        }
+    }
+};
+
+// Fixed-size header at the start of every snapshot file. It is followed, at
+// data_offset, by one contiguous array per field holding the N_cells_1D^dimension
+// values in row-major order (dimension 0 fastest), in the host byte order, of
+// the type real_type.
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dimension;
+    uint32_t N_cells_1D;
+    uint32_t real_type;
+    uint32_t real_bytes;
+    uint32_t N_fields;
+    uint64_t data_offset;
+    uint64_t dump_counter;
+    double time;
+    char field_names[SNAPSHOT_MAX_FIELDS][SNAPSHOT_FIELD_NAME_BYTES];
+
+    uint64_t get_N_cells() const {
+        uint64_t N_cells = 1;
+        for (uint32_t d = 0; d < dimension; d++) {
+            N_cells *= N_cells_1D;
+        }
+        return N_cells;
+    }
+
+    uint64_t get_field_offset(const uint32_t field) const {
+        return data_offset + field * get_N_cells() * real_bytes;
+    }
+
+    std::string get_field_name(const uint32_t field) const {
+        return std::string(field_names[field], strnlen(field_names[field], SNAPSHOT_FIELD_NAME_BYTES));
+    }
+};
+
+// Fixed-size header of the leaf block files of an AMR run, amr_snapshot_N.bin.
+// The snapshot part has the magic AMR_SNAPSHOT_MAGIC and N_cells_1D of level
+// 0; it is followed at block_table_offset by N_blocks AmrSnapshotBlock entries
+// and at snapshot.data_offset by the blocks in the same order, each N_fields
+// arrays of block_size^dimension values in row-major order. Block b of level l
+// at position p covers the cells p * block_size on that level, where the box
+// is N_cells_1D * 2^l cells across.
+struct AmrSnapshotHeader
+{
+    SnapshotHeader snapshot;
+    uint32_t block_size;
+    uint32_t N_levels;
+    uint64_t N_blocks;
+    uint64_t block_table_offset;
+
+    uint64_t get_N_block_cells() const {
+        uint64_t N_block_cells = 1;
+        for (uint32_t d = 0; d < snapshot.dimension; d++) {
+            N_block_cells *= block_size;
+        }
+        return N_block_cells;
+    }
+
+    uint64_t get_field_offset(const uint64_t block, const uint32_t field) const {
+        return snapshot.data_offset + (block * snapshot.N_fields + field) * get_N_block_cells() * snapshot.real_bytes;
+    }
+};
+
+struct AmrSnapshotBlock
+{
+    uint32_t level;
+    uint32_t position[MAX_DIMENSION];
+};
+
+// Writes the prev state of every field as a binary snapshot of the
+// N_cells_1D^dimension box; each rank writes its own block. The staging
+// buffers are kept between dumps.
+class SnapshotWriter
+{
+private:
+    std::vector<real> buffer;
+    // the buffer in the value type of the snapshot, when it is not real
+    std::vector<char> encoded;
+
+    const void *encode_buffer(const uint32_t type) {
+        if (type == SNAPSHOT_REAL) {
+            return buffer.data();
+        }
+        encoded.resize(buffer.size() * SnapshotValues::get_bytes(type));
+        SnapshotValues::encode(buffer.data(), buffer.size(), type, encoded.data());
+        return encoded.data();
+    }
+
+    // copy the interior cells of rows [row_begin, row_end) of a field into the buffer
+    void pack_rows(const Stencil &stencil, const real *field, const uint64_t row_begin, const uint64_t row_end) {
+        const uint64_t N_cells_row = stencil.get_extent(0);
+        buffer.resize((row_end - row_begin) * N_cells_row);
+        for (uint64_t row = row_begin; row < row_end; row++) {
+            std::memcpy(buffer.data() + (row - row_begin) * N_cells_row, field + stencil.row_start(row), N_cells_row * sizeof(real));
+        }
+    }
+
+public:
+    SnapshotWriter() {}
+
+    static SnapshotHeader make_header(const FieldStore &fields, const uint32_t N_cells_1D, const real time, const uint64_t dump_counter,
+                                      const uint32_t type = SNAPSHOT_REAL) {
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.dimension = fields.get_stencil().get_dimension();
+        header.N_cells_1D = N_cells_1D;
+        header.real_type = type;
+        header.real_bytes = SnapshotValues::get_bytes(type);
+        header.N_fields = fields.get_N_fields();
+        header.data_offset = ((sizeof(SnapshotHeader) + SNAPSHOT_DATA_ALIGNMENT - 1) / SNAPSHOT_DATA_ALIGNMENT) * SNAPSHOT_DATA_ALIGNMENT;
+        header.dump_counter = dump_counter;
+        header.time = time;
+        for (uint8_t f = 0; f < header.N_fields; f++) {
+            std::strncpy(header.field_names[f], fields.get_field_name(f).c_str(), SNAPSHOT_FIELD_NAME_BYTES);
+        }
+        return header;
+    }
+
+    static void write_all(const int file, const void *data, const uint64_t N_bytes, const uint64_t offset, const std::string &file_name) {
+        const char *bytes = static_cast<const char *>(data);
+        uint64_t written = 0;
+        while (written < N_bytes) {
+            const ssize_t result = pwrite(file, bytes + written, N_bytes - written, offset + written);
+            if (result < 0) {
+                throw std::runtime_error("Could not write snapshot " + file_name + ".");
+            }
+            written += result;
+        }
+    }
+
+    // Write a local block packed field after field, each holding the interior
+    // cells of the stencil row-major, at its place in the global arrays. Rows
+    // that are adjacent in the file go out in a single pwrite, converted to the
+    // value type of the header first.
+    static void write_block(const int file, const SnapshotHeader &header, const Stencil &stencil,
+                            const real *block, const std::string &file_name) {
+        const uint64_t N_cells_row = stencil.get_extent(0);
+        std::vector<char> encoded;
+        auto global_row_index = [&](const uint64_t row) {
+            uint64_t index = stencil.get_offset(0);
+            uint64_t scaled_row = row;
+            uint64_t dimension_factor = header.N_cells_1D;
+            for (uint8_t d = 1; d < header.dimension; d++) {
+                index += (scaled_row % stencil.get_extent(d) + stencil.get_offset(d)) * dimension_factor;
+                scaled_row /= stencil.get_extent(d);
+                dimension_factor *= header.N_cells_1D;
+            }
+            return index;
+        };
+
+        for (uint32_t f = 0; f < header.N_fields; f++) {
+            const real *values = block + f * stencil.get_N_interior();
+            uint64_t row = 0;
+            while (row < stencil.get_N_rows()) {
+                const uint64_t first_index = global_row_index(row);
+                uint64_t row_end = row + 1;
+                while (row_end < stencil.get_N_rows() &&
+                       global_row_index(row_end) == first_index + (row_end - row) * N_cells_row) {
+                    row_end++;
+                }
+                const uint64_t N_values = (row_end - row) * N_cells_row;
+                const void *data = values + row * N_cells_row;
+                if (header.real_type != SNAPSHOT_REAL) {
+                    encoded.resize(N_values * header.real_bytes);
+                    SnapshotValues::encode(values + row * N_cells_row, N_values, header.real_type, encoded.data());
+                    data = encoded.data();
+                }
+                write_all(file, data, N_values * header.real_bytes,
+                          header.get_field_offset(f) + first_index * header.real_bytes, file_name);
+                row = row_end;
+            }
+        }
+    }
+
+    void write(const FieldStore &fields, const uint32_t N_cells_1D, const Domain &domain,
+               const std::string &file_name, const real time, const uint64_t dump_counter,
+               const uint32_t type = SNAPSHOT_REAL) {
+        const SnapshotHeader header = make_header(fields, N_cells_1D, time, dump_counter, type);
+        const Stencil &stencil = fields.get_stencil();
+
+#ifdef WITH_MPI
+        // every rank writes its block through a subarray view of each field array
+        MPI_File file;
+        MPI_File_open(domain.get_comm(), file_name.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+        MPI_File_set_size(file, 0);
+        if (domain.is_root()) {
+            MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+        }
+
+        int sizes[MAX_DIMENSION];
+        int subsizes[MAX_DIMENSION];
+        int starts[MAX_DIMENSION];
+        for (uint8_t d = 0; d < header.dimension; d++) {
+            const int m = header.dimension - 1 - d;
+            sizes[m] = (int)header.N_cells_1D;
+            subsizes[m] = (int)stencil.get_extent(d);
+            starts[m] = (int)stencil.get_offset(d);
+        }
+        MPI_Datatype value_type = MPI_UINT16_T;
+        if (header.real_type == SNAPSHOT_FLOAT32) {
+            value_type = MPI_FLOAT;
+        } else if (header.real_type == SNAPSHOT_FLOAT64) {
+            value_type = MPI_DOUBLE;
+        }
+        MPI_Datatype block_type;
+        MPI_Type_create_subarray(header.dimension, sizes, subsizes, starts, MPI_ORDER_C, value_type, &block_type);
+        MPI_Type_commit(&block_type);
+
+        for (uint8_t f = 0; f < header.N_fields; f++) {
+            pack_rows(stencil, fields.get_prev(f), 0, stencil.get_N_rows());
+            MPI_File_set_view(file, header.get_field_offset(f), value_type, block_type, "native", MPI_INFO_NULL);
+            MPI_File_write_all(file, encode_buffer(header.real_type), (int)buffer.size(), value_type, MPI_STATUS_IGNORE);
+        }
+
+        MPI_Type_free(&block_type);
+        MPI_File_close(&file);
+#else
+        const int file = open(file_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (file < 0) {
+            throw std::runtime_error("Could not open snapshot " + file_name + ".");
+        }
+        write_all(file, &header, sizeof(header), 0, file_name);
+
+        // a single block covers the whole box, so each field is one contiguous run in the file
+        const uint64_t rows_per_write = std::max((uint64_t)1, (uint64_t)SNAPSHOT_BUFFER_BYTES / (stencil.get_extent(0) * sizeof(real)));
+        for (uint8_t f = 0; f < header.N_fields; f++) {
+            uint64_t offset = header.get_field_offset(f);
+            for (uint64_t row = 0; row < stencil.get_N_rows(); row += rows_per_write) {
+                const uint64_t row_end = std::min(row + rows_per_write, stencil.get_N_rows());
+                pack_rows(stencil, fields.get_prev(f), row, row_end);
+                write_all(file, encode_buffer(header.real_type), buffer.size() * header.real_bytes, offset, file_name);
+                offset += buffer.size() * header.real_bytes;
+            }
+        }
+        close(file);
+#endif
+    }
+
+#ifdef WITH_HDF5
+    // One dataset per field plus the header values as file attributes. HDF5
+    // converts the values to the type of the dataset; the 16-bit types have no
+    // portable HDF5 equivalent and are stored as float.
+    void write_hdf5(const FieldStore &fields, const uint32_t N_cells_1D, const std::string &file_name,
+                    const real time, const uint64_t dump_counter, const uint32_t type = SNAPSHOT_REAL) {
+        const SnapshotHeader header = make_header(fields, N_cells_1D, time, dump_counter, type);
+        const Stencil &stencil = fields.get_stencil();
+        const hid_t real_type = (sizeof(real) == sizeof(double)) ? H5T_NATIVE_DOUBLE : H5T_NATIVE_FLOAT;
+        const hid_t file_type = (type == SNAPSHOT_FLOAT64) ? H5T_NATIVE_DOUBLE : H5T_NATIVE_FLOAT;
+
+        const hid_t file = H5Fcreate(file_name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        if (file < 0) {
+            throw std::runtime_error("Could not create HDF5 snapshot " + file_name + ".");
+        }
+
+        const hsize_t scalar_dims[1] = {1};
+        const hid_t scalar_space = H5Screate_simple(1, scalar_dims, nullptr);
+        auto write_attribute = [&](const char *name, const hid_t type, const void *value) {
+            const hid_t attribute = H5Acreate2(file, name, type, scalar_space, H5P_DEFAULT, H5P_DEFAULT);
+            H5Awrite(attribute, type, value);
+            H5Aclose(attribute);
+        };
+        write_attribute("dimension", H5T_NATIVE_UINT32, &header.dimension);
+        write_attribute("N_cells_1D", H5T_NATIVE_UINT32, &header.N_cells_1D);
+        write_attribute("dump_counter", H5T_NATIVE_UINT64, &header.dump_counter);
+        write_attribute("time", H5T_NATIVE_DOUBLE, &header.time);
+        H5Sclose(scalar_space);
+
+        hsize_t dims[MAX_DIMENSION];
+        for (uint8_t d = 0; d < header.dimension; d++) {
+            dims[header.dimension - 1 - d] = header.N_cells_1D;
+        }
+        const hid_t space = H5Screate_simple(header.dimension, dims, nullptr);
+        for (uint8_t f = 0; f < header.N_fields; f++) {
+            pack_rows(stencil, fields.get_prev(f), 0, stencil.get_N_rows());
+            const hid_t dataset = H5Dcreate2(file, header.get_field_name(f).c_str(), file_type, space,
+                                             H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+            H5Dwrite(dataset, real_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data());
+            H5Dclose(dataset);
+        }
+        H5Sclose(space);
+        H5Fclose(file);
+    }
+#endif
+};
+
+// Reads snapshot headers and field arrays back, for the converter and for
+// starting from a snapshot, see InitialConditions.
+class SnapshotReader
+{
+private:
+    int file;
+    std::string file_name;
+    SnapshotHeader header;
+
+public:
+    explicit SnapshotReader(const std::string &input_file_name)
+    {
+        file_name = input_file_name;
+        file = open(file_name.c_str(), O_RDONLY);
+        if (file < 0) {
+            throw std::runtime_error("Could not open snapshot " + file_name + ".");
+        }
+
+        if (pread(file, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            close(file);
+            throw std::runtime_error(file_name + " is not a snapshot file.");
+        }
+        if (header.version != SNAPSHOT_VERSION) {
+            close(file);
+            throw std::runtime_error(file_name + " has unsupported snapshot version " + std::to_string(header.version) + ".");
+        }
+        if (header.real_type > SNAPSHOT_BFLOAT16 || header.real_bytes != SnapshotValues::get_bytes(header.real_type)) {
+            close(file);
+            throw std::runtime_error(file_name + " has unknown value type " + std::to_string(header.real_type) + ".");
+        }
+    }
+
+    ~SnapshotReader() {
+        close(file);
+    }
+
+    SnapshotReader(const SnapshotReader &) = delete;
+    SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+    const SnapshotHeader &get_header() const {
+        return header;
+    }
+
+    int find_field(const std::string &name) const {
+        for (uint32_t f = 0; f < header.N_fields; f++) {
+            if (header.get_field_name(f) == name) {
+                return (int)f;
+            }
+        }
+        return -1;
+    }
+
+    // raw bytes of a whole field, header.real_bytes per value
+    void read_field(const uint32_t field, void *destination) const {
+        read_values(field, 0, header.get_N_cells(), destination);
+    }
+
+    // raw bytes of N_values values of a field from row-major index first_value
+    // on; safe to call from several threads at once
+    void read_values(const uint32_t field, const uint64_t first_value, const uint64_t N_values, void *destination) const {
+        const uint64_t N_bytes = N_values * header.real_bytes;
+        const uint64_t offset = header.get_field_offset(field) + first_value * header.real_bytes;
+        char *bytes = static_cast<char *>(destination);
+        uint64_t done = 0;
+        while (done < N_bytes) {
+            const ssize_t result = pread(file, bytes + done, N_bytes - done, offset + done);
+            if (result <= 0) {
+                throw std::runtime_error("Could not read field " + header.get_field_name(field) + " from " + file_name + ".");
+            }
+            done += result;
+        }
+    }
+
+    // N_values values of a field from first_value on, converted to T
+    template <typename T>
+    void read_converted(const uint32_t field, const uint64_t first_value, const uint64_t N_values, T *destination) const {
+        std::vector<char> bytes(N_values * header.real_bytes);
+        read_values(field, first_value, N_values, bytes.data());
+        SnapshotValues::decode(bytes.data(), N_values, header.real_type, destination);
+    }
+};
+
+#endif /* SNAPSHOT_HPP */
@@ -0,0 +1,240 @@
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include "../main.hpp"
+
+#ifndef STENCIL_HPP
+#define STENCIL_HPP
+
+#define MAX_DIMENSION 3
+// one layer of ghost cells on each face is enough for the nearest-neighbor
+// stencil; the default ghost width of a Stencil
+#define N_GHOST 1
+
+// Geometry of a ghost-padded field array. The interior cells are stored
+// row-major inside N_ghost layers of ghost cells on every face, so the
+// neighbors of the cell at storage index s along dimension d are always at
+// s + stride[d] and s - stride[d]; the periodic wrap lives in the ghost layer
+// (see fill_periodic_ghosts) instead of in every neighbor lookup.
+class Stencil
+{
+private:
+    uint8_t dimension;
+    // ghost layers on every face, the reach of the widest stencil read
+    uint32_t N_ghost;
+    // interior cells along each dimension, 1 for the unused dimensions
+    std::array<uint32_t, MAX_DIMENSION> extent;
+    // extent plus the ghost layers
+    std::array<uint32_t, MAX_DIMENSION> padded_extent;
+    std::array<uint64_t, MAX_DIMENSION> stride;
+    // global coordinate of the first interior cell, non-zero for a subdomain
+    std::array<uint32_t, MAX_DIMENSION> offset;
+    // cells along each dimension of the whole box
+    uint32_t N_cells_1D;
+    uint64_t N_interior;
+    uint64_t N_storage;
+    // number of interior rows along dimension 0
+    uint64_t N_rows;
+
+public:
+    Stencil() : dimension(0), N_ghost(N_GHOST), extent{}, padded_extent{}, stride{}, offset{}, N_cells_1D(0), N_interior(0), N_storage(0), N_rows(0) {}
+
+    // input_N_cells_1D of 0 means the stencil covers the whole box
+    Stencil(const uint8_t input_dimension, const std::array<uint32_t, MAX_DIMENSION> &input_extent,
+            const std::array<uint32_t, MAX_DIMENSION> &input_offset = {0, 0, 0}, const uint32_t input_N_cells_1D = 0,
+            const uint32_t input_N_ghost = N_GHOST)
+    {
+        if (input_dimension <= 0 || input_dimension > MAX_DIMENSION) {
+            throw std::invalid_argument("Stencil dimension must be 1, 2 or 3.");
+        }
+        if (input_N_ghost < 1) {
+            throw std::invalid_argument("Stencil needs at least one ghost layer.");
+        }
+        for (uint8_t d = 0; d < input_dimension; d++) {
+            // the periodic fill copies the ghosts from the interior layers
+            if (input_extent[d] < input_N_ghost) {
+                throw std::invalid_argument("Stencil extent must be at least the ghost width.");
+            }
+        }
+
+        dimension = input_dimension;
+        N_ghost = input_N_ghost;
+        N_interior = 1;
+        N_storage = 1;
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            extent[d] = (d < dimension) ? input_extent[d] : 1;
+            offset[d] = (d < dimension) ? input_offset[d] : 0;
+            padded_extent[d] = (d < dimension) ? extent[d] + 2 * N_ghost : 1;
+            stride[d] = N_storage;
+            N_interior *= extent[d];
+            N_storage *= padded_extent[d];
+        }
+        N_rows = N_interior / extent[0];
+        N_cells_1D = (input_N_cells_1D > 0) ? input_N_cells_1D : extent[0];
+    }
+
+    uint8_t get_dimension() const {
+        return dimension;
+    }
+
+    uint32_t get_N_ghost() const {
+        return N_ghost;
+    }
+
+    uint32_t get_extent(const uint8_t d) const {
+        return extent[d];
+    }
+
+    uint32_t get_padded_extent(const uint8_t d) const {
+        return padded_extent[d];
+    }
+
+    uint32_t get_offset(const uint8_t d) const {
+        return offset[d];
+    }
+
+    uint32_t get_N_cells_1D() const {
+        return N_cells_1D;
+    }
+
+    // flat offset between a cell and its neighbor along dimension d
+    uint64_t get_stride(const uint8_t d) const {
+        return stride[d];
+    }
+
+    uint64_t get_N_interior() const {
+        return N_interior;
+    }
+
+    uint64_t get_N_storage() const {
+        return N_storage;
+    }
+
+    uint64_t get_N_rows() const {
+        return N_rows;
+    }
+
+    // storage index of the first interior cell of an interior row
+    uint64_t row_start(const uint64_t row) const {
+        uint64_t index = N_ghost;
+        uint64_t scaled_row = row;
+        for (uint8_t d = 1; d < dimension; d++) {
+            index += (scaled_row % extent[d] + N_ghost) * stride[d];
+            scaled_row /= extent[d];
+        }
+        return index;
+    }
+
+    // row-major interior index -> storage index
+    uint64_t interior_to_storage(const uint64_t interior_index) const {
+        return row_start(interior_index / extent[0]) + interior_index % extent[0];
+    }
+
+    // interior coordinate of a storage index along dimension d; ghosts give -N_ghost to -1 and extent up
+    box_int get_coordinate(const uint64_t storage_index, const uint8_t d) const {
+        return (box_int)((storage_index / stride[d]) % padded_extent[d]) - N_ghost;
+    }
+
+    box_int get_global_coordinate(const uint64_t storage_index, const uint8_t d) const {
+        return get_coordinate(storage_index, d) + (box_int)offset[d];
+    }
+
+    // True when no cell of the row sits on a face along dimensions 1 and up, so
+    // only its first and last cells read ghost values.
+    bool row_is_inner(const uint64_t row) const {
+        uint64_t scaled_row = row;
+        for (uint8_t d = 1; d < dimension; d++) {
+            const uint64_t coordinate = scaled_row % extent[d];
+            if (coordinate < N_ghost || coordinate + N_ghost >= extent[d]) {
+                return false;
+            }
+            scaled_row /= extent[d];
+        }
+        return true;
+    }
+
+    // Split a row into the cells whose whole stencil is interior (inner) and the
+    // ones that read ghosts, calling segment(start, count) for the requested part.
+    // With the ghosts in flight, the inner part can be updated first.
+    template <typename Function>
+    void for_each_row_segment(const uint64_t row, const bool inner, Function segment) const {
+        const uint64_t start = row_start(row);
+        const bool inner_row = row_is_inner(row);
+        const bool has_inner_cells = inner_row && extent[0] > 2 * N_ghost;
+
+        if (inner) {
+            if (has_inner_cells) {
+                segment(start + N_ghost, extent[0] - 2 * N_ghost);
+            }
+            return;
+        }
+
+        if (!has_inner_cells) {
+            segment(start, extent[0]);
+            return;
+        }
+        segment(start, N_ghost);
+        segment(start + extent[0] - N_ghost, N_ghost);
+    }
+
+    // Split the faces of a row's cells into those between two interior cells
+    // (inner) and those with a ghost on one side, calling faces(start, count, d)
+    // for the lower faces along d of count cells from storage index start. The
+    // faces on the upper side of the box are the lower faces of the ghosts
+    // above it, so over all rows every face comes up exactly once.
+    template <typename Function>
+    void for_each_row_faces(const uint64_t row, const bool inner, Function faces) const {
+        const uint64_t start = row_start(row);
+        if (inner) {
+            if (extent[0] > 1) {
+                faces(start + 1, extent[0] - 1, 0);
+            }
+            for (uint8_t d = 1; d < dimension; d++) {
+                if (get_coordinate(start, d) > 0) {
+                    faces(start, extent[0], d);
+                }
+            }
+            return;
+        }
+
+        faces(start, 1, 0);
+        faces(start + extent[0], 1, 0);
+        for (uint8_t d = 1; d < dimension; d++) {
+            if (get_coordinate(start, d) == 0) {
+                faces(start, extent[0], d);
+            }
+            if (get_coordinate(start, d) + 1 == (box_int)extent[d]) {
+                faces(start + stride[d], extent[0], d);
+            }
+        }
+    }
+
+    // Copy the opposite interior faces into the ghost layers so that reads at
+    // +/- stride wrap around the box. Dimensions are filled in order and each
+    // copies whole padded planes, so the edge and corner ghosts come out right too.
+    void fill_periodic_ghosts(real *field) const {
+        for (uint8_t d = 0; d < dimension; d++) {
+            fill_periodic_ghosts(field, d);
+        }
+    }
+
+    // only the ghost layers on the two faces along dimension d; N_lanes values
+    // per cell for the interleaved fields of InterleavedUpdate
+    void fill_periodic_ghosts(real *field, const uint8_t d, const uint32_t N_lanes = 1) const {
+        // a plane of constant coordinate along d is N_outer blocks of stride[d] cells
+        const uint64_t block = stride[d] * N_lanes;
+        const uint64_t N_outer = N_storage / (stride[d] * padded_extent[d]);
+        const uint64_t jump = block * padded_extent[d];
+
+        for (uint64_t outer = 0; outer < N_outer; outer++) {
+            real *base = field + outer * jump;
+            for (uint32_t g = 0; g < N_ghost; g++) {
+                // low ghost <- last interior layers, high ghost <- first interior layers
+                std::memcpy(base + g * block, base + (extent[d] + g) * block, block * sizeof(real));
+                std::memcpy(base + (extent[d] + N_ghost + g) * block, base + (N_ghost + g) * block, block * sizeof(real));
+            }
+        }
+    }
+};
+
+#endif /* STENCIL_HPP */
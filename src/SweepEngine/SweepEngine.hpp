@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include "../main.hpp"
+#include "../NumaArena/NumaArena.hpp"
+
+#ifndef SWEEP_ENGINE_HPP
+#define SWEEP_ENGINE_HPP
+
+#define SCHEDULE_STATIC 0
+#define SCHEDULE_DYNAMIC 1
+
+// where the threads run: PINNING_NONE (0) leaves them to the scheduler,
+// PINNING_COMPACT (1) puts thread t on the t-th allowed CPU, filling one NUMA
+// node before the next, and PINNING_SPREAD (2) deals them out over the nodes
+// in turn so every node's memory is swept by threads of its own
+#define PINNING_NONE 0
+#define PINNING_COMPACT 1
+#define PINNING_SPREAD 2
+
+// Persistent pool of worker threads that runs a loop body over [0, N_items).
+// The calling thread takes part as thread 0, so a pool of one thread runs the
+// loop inline. With static scheduling thread t always gets the same contiguous
+// slice; with dynamic scheduling threads grab chunk_size items at a time.
+// Pinned threads stay on one CPU each for the life of the pool.
+class SweepEngine
+{
+private:
+    uint32_t N_threads;
+    uint8_t schedule;
+    uint64_t chunk_size;
+    // CPU of every thread, empty without pinning
+    std::vector<uint32_t> thread_cpus;
+    // the affinity of the calling thread before it was pinned
+    cpu_set_t original_mask;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    uint64_t generation;
+    uint32_t N_running;
+    bool stopping;
+
+    // the current job
+    std::function<void(uint64_t, uint64_t, uint32_t)> body;
+    uint64_t N_items;
+    std::atomic<uint64_t> next_item;
+    // the static slices whatever the schedule, see parallel_for_static
+    bool static_job;
+
+    void run_share(const uint32_t thread) {
+        if (schedule == SCHEDULE_STATIC || static_job) {
+            const uint64_t begin = N_items * thread / N_threads;
+            const uint64_t end = N_items * (thread + 1) / N_threads;
+            if (begin < end) {
+                body(begin, end, thread);
+            }
+            return;
+        }
+
+        while (true) {
+            const uint64_t begin = next_item.fetch_add(chunk_size);
+            if (begin >= N_items) {
+                break;
+            }
+            body(begin, std::min(begin + chunk_size, N_items), thread);
+        }
+    }
+
+    void pin(const uint32_t thread) {
+        if (thread_cpus.empty()) {
+            return;
+        }
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(thread_cpus[thread], &mask);
+        pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    }
+
+    // the CPU of each of the N_threads threads under pinning
+    static std::vector<uint32_t> get_pinned_cpus(const uint8_t pinning, const uint32_t N_threads) {
+        const std::vector<uint32_t> allowed = NumaTopology::get_allowed_cpus();
+        if (pinning == PINNING_NONE || allowed.empty()) {
+            return {};
+        }
+
+        // the allowed CPUs of every node, in CPU order
+        std::vector<std::vector<uint32_t>> node_cpus(NumaTopology::get_N_nodes());
+        for (const uint32_t cpu : allowed) {
+            const uint32_t node = NumaTopology::get_cpu_node(cpu);
+            node_cpus[node < node_cpus.size() ? node : 0].push_back(cpu);
+        }
+
+        std::vector<uint32_t> order;
+        if (pinning == PINNING_COMPACT) {
+            for (const auto &cpus : node_cpus) {
+                order.insert(order.end(), cpus.begin(), cpus.end());
+            }
+        } else {
+            for (uint64_t i = 0; order.size() < allowed.size(); i++) {
+                for (const auto &cpus : node_cpus) {
+                    if (i < cpus.size()) {
+                        order.push_back(cpus[i]);
+                    }
+                }
+            }
+        }
+
+        // more threads than CPUs wrap around
+        std::vector<uint32_t> cpus(N_threads);
+        for (uint32_t t = 0; t < N_threads; t++) {
+            cpus[t] = order[t % order.size()];
+        }
+        return cpus;
+    }
+
+    void worker_loop(const uint32_t thread) {
+        pin(thread);
+        uint64_t seen_generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_condition.wait(lock, [&]() { return stopping || generation != seen_generation; });
+                if (stopping) {
+                    return;
+                }
+                seen_generation = generation;
+            }
+
+            run_share(thread);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--N_running == 0) {
+                done_condition.notify_one();
+            }
+        }
+    }
+
+public:
+    // input_N_threads = 0 uses every hardware thread; the calling thread is
+    // pinned as thread 0 until the pool is destroyed
+    SweepEngine(const uint32_t input_N_threads, const uint8_t input_schedule, const uint64_t input_chunk_size,
+                const uint8_t pinning = PINNING_NONE)
+    {
+        N_threads = input_N_threads;
+        if (N_threads == 0) {
+            N_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (input_schedule != SCHEDULE_STATIC && input_schedule != SCHEDULE_DYNAMIC) {
+            throw std::invalid_argument("Unknown sweep schedule.");
+        }
+        if (input_chunk_size <= 0) {
+            throw std::invalid_argument("Zero chunk size.");
+        }
+        if (pinning > PINNING_SPREAD) {
+            throw std::invalid_argument("Unknown thread pinning.");
+        }
+
+        schedule = input_schedule;
+        chunk_size = input_chunk_size;
+        generation = 0;
+        N_running = 0;
+        stopping = false;
+        N_items = 0;
+        static_job = false;
+
+        thread_cpus = get_pinned_cpus(pinning, N_threads);
+        CPU_ZERO(&original_mask);
+        if (!thread_cpus.empty()) {
+            pthread_getaffinity_np(pthread_self(), sizeof(original_mask), &original_mask);
+            pin(0);
+        }
+
+        for (uint32_t t = 1; t < N_threads; t++) {
+            workers.emplace_back(&SweepEngine::worker_loop, this, t);
+        }
+    }
+
+    ~SweepEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start_condition.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        if (!thread_cpus.empty()) {
+            pthread_setaffinity_np(pthread_self(), sizeof(original_mask), &original_mask);
+        }
+    }
+
+    SweepEngine(const SweepEngine &) = delete;
+    SweepEngine &operator=(const SweepEngine &) = delete;
+
+    uint32_t get_N_threads() const {
+        return N_threads;
+    }
+
+    uint8_t get_schedule() const {
+        return schedule;
+    }
+
+    bool is_pinned() const {
+        return !thread_cpus.empty();
+    }
+
+    // NUMA node each thread runs on, as it reports it now
+    std::vector<uint32_t> get_thread_nodes() {
+        std::vector<uint32_t> nodes(N_threads, 0);
+        parallel_for_static(N_threads, [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            nodes[thread] = NumaTopology::get_current_node();
+        });
+        return nodes;
+    }
+
+    // run input_body(begin, end, thread) over [0, input_N_items) and wait for it to finish
+    void parallel_for(const uint64_t input_N_items, const std::function<void(uint64_t, uint64_t, uint32_t)> &input_body) {
+        run_job(input_N_items, input_body, false);
+    }
+
+    // parallel_for with the static slices under any schedule, so thread t
+    // always gets the same items, see FieldStore::first_touch
+    void parallel_for_static(const uint64_t input_N_items, const std::function<void(uint64_t, uint64_t, uint32_t)> &input_body) {
+        run_job(input_N_items, input_body, true);
+    }
+
+private:
+    void run_job(const uint64_t input_N_items, const std::function<void(uint64_t, uint64_t, uint32_t)> &input_body,
+                 const bool input_static_job) {
+        if (N_threads == 1) {
+            if (input_N_items > 0) {
+                input_body(0, input_N_items, 0);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            body = input_body;
+            N_items = input_N_items;
+            static_job = input_static_job;
+            next_item = 0;
+            N_running = N_threads - 1;
+            generation++;
+        }
+        start_condition.notify_all();
+
+        run_share(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [&]() { return N_running == 0; });
+    }
+
+public:
+    // Maximum of block_max(begin, end) over fixed blocks of block_size items. The
+    // blocks do not depend on the thread count or the schedule, and the partial
+    // results are combined in block order, so the result is the same for any run.
+    real parallel_max(const uint64_t input_N_items, const uint64_t block_size,
+                      const std::function<real(uint64_t, uint64_t)> &block_max) {
+        const uint64_t N_blocks = (input_N_items + block_size - 1) / block_size;
+        std::vector<real> partial_max(N_blocks);
+        parallel_for(N_blocks, [&](const uint64_t begin, const uint64_t end, const uint32_t thread) {
+            for (uint64_t b = begin; b < end; b++) {
+                partial_max[b] = block_max(b * block_size, std::min((b + 1) * block_size, input_N_items));
+            }
+        });
+
+        real max_value = 0.;
+        for (auto value : partial_max) {
+            if (value > max_value) {
+                max_value = value;
+            }
+        }
+        return max_value;
+    }
+};
+
+#endif /* SWEEP_ENGINE_HPP */
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "../main.hpp"
+#include "../Stencil/Stencil.hpp"
+#include "../FieldStore/FieldStore.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+
+#ifndef TIME_BLOCKING_HPP
+#define TIME_BLOCKING_HPP
+
+// Temporal blocking with overlapped (trapezoidal) tiles: advance depth steps
+// at a fixed dt_dx while reading and writing the full grid only once. The grid
+// is cut into tiles of tile_width cells along every dimension but 0 (along
+// dimension 0 too in 1D, otherwise whole rows are kept for the SIMD kernels).
+// Each tile is copied with depth cells of halo into a small per-thread
+// FieldStore, which is stepped depth times, updating one halo cell less on
+// every side after each step, until only the tile itself is left and goes to
+// the next arrays of the grid. The cells are updated by the same kernel and
+// from the same values as in plain stepping, so the result is bit-identical.
+// The halo is taken from the periodic wrap of the local block, so this only
+// works when a single rank owns the whole box.
+class TimeBlocking
+{
+private:
+    FieldStore *fields;
+    const Stencil *stencil;
+    uint32_t depth;
+    // dimensions cut into tiles, the others are periodic inside every tile
+    std::array<bool, MAX_DIMENSION> tiled;
+    // cells of a tile, the whole extent along the dimensions that are not tiled
+    std::array<uint32_t, MAX_DIMENSION> tile_extent;
+    std::array<uint64_t, MAX_DIMENSION> N_tiles_per_dimension;
+    uint64_t N_tiles;
+
+    // one tile with its halo per thread
+    Stencil tile_stencil;
+    std::vector<std::unique_ptr<FieldStore>> tile_fields;
+    std::vector<std::unique_ptr<SimdUpdate>> tile_updates;
+
+    // storage coordinate in the grid of storage coordinate c of the tile along d
+    uint64_t to_grid_storage(const uint8_t d, const uint64_t origin, const uint64_t c) const {
+        if (!tiled[d]) {
+            return c;
+        }
+        const int64_t N = stencil->get_extent(d);
+        const int64_t interior = (int64_t)origin - (int64_t)depth + (int64_t)c;
+        return (uint64_t)(((interior % N) + N) % N) + stencil->get_N_ghost();
+    }
+
+    void load_tile(const std::array<uint64_t, MAX_DIMENSION> &origin, FieldStore &tile) const {
+        const uint32_t N_padded_row = tile_stencil.get_padded_extent(0);
+        for (uint32_t z = 0; z < tile_stencil.get_padded_extent(2); z++) {
+            for (uint32_t y = 0; y < tile_stencil.get_padded_extent(1); y++) {
+                const uint64_t tile_row = y * tile_stencil.get_stride(1) + z * tile_stencil.get_stride(2);
+                const uint64_t grid_row = to_grid_storage(1, origin[1], y) * stencil->get_stride(1) +
+                                          to_grid_storage(2, origin[2], z) * stencil->get_stride(2);
+                for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+                    const real *source = fields->get_prev(f) + grid_row;
+                    real *destination = tile.get_prev(f) + tile_row;
+                    if (!tiled[0]) {
+                        std::memcpy(destination, source, N_padded_row * sizeof(real));
+                        continue;
+                    }
+                    for (uint32_t x = 0; x < N_padded_row; x++) {
+                        destination[x] = source[to_grid_storage(0, origin[0], x)];
+                    }
+                }
+            }
+        }
+    }
+
+    // the interior cells of the tile, without its halo, into the next arrays of the grid
+    void store_tile(const std::array<uint64_t, MAX_DIMENSION> &origin, const FieldStore &tile) const {
+        std::array<uint64_t, MAX_DIMENSION> count;
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            count[d] = tiled[d] ? std::min<uint64_t>(tile_extent[d], stencil->get_extent(d) - origin[d]) : stencil->get_extent(d);
+        }
+
+        for (uint64_t z = 0; z < count[2]; z++) {
+            for (uint64_t y = 0; y < count[1]; y++) {
+                const uint64_t c[MAX_DIMENSION] = {0, y, z};
+                uint64_t tile_index = tile_stencil.get_N_ghost() + (tiled[0] ? depth - 1 : 0);
+                uint64_t grid_index = stencil->get_N_ghost() + origin[0];
+                for (uint8_t d = 1; d < stencil->get_dimension(); d++) {
+                    tile_index += (c[d] + (tiled[d] ? depth - 1 : 0) + tile_stencil.get_N_ghost()) * tile_stencil.get_stride(d);
+                    grid_index += (origin[d] + c[d] + stencil->get_N_ghost()) * stencil->get_stride(d);
+                }
+                for (uint8_t f = 0; f < fields->get_N_fields(); f++) {
+                    std::memcpy(fields->get_next(f) + grid_index, tile.get_next(f) + tile_index, count[0] * sizeof(real));
+                }
+            }
+        }
+    }
+
+    // returns the largest signal speed of the tile after the last step
+    real advance_tile(const uint64_t tile_index, const uint32_t thread, const real dt_dx) const {
+        FieldStore &tile = *tile_fields[thread];
+        const SimdUpdate &update = *tile_updates[thread];
+
+        std::array<uint64_t, MAX_DIMENSION> origin;
+        uint64_t scaled_index = tile_index;
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            origin[d] = (scaled_index % N_tiles_per_dimension[d]) * tile_extent[d];
+            scaled_index /= N_tiles_per_dimension[d];
+        }
+        load_tile(origin, tile);
+
+        real max_signal_speed = 0.;
+        for (uint32_t step = 0; step < depth; step++) {
+            for (uint8_t d = 0; d < stencil->get_dimension(); d++) {
+                if (!tiled[d]) {
+                    for (uint8_t f = 0; f < tile.get_N_fields(); f++) {
+                        tile_stencil.fill_periodic_ghosts(tile.get_prev(f), d);
+                    }
+                }
+            }
+
+            // the cells within step of the halo edge only have stale neighbors left
+            std::array<uint64_t, MAX_DIMENSION> low;
+            std::array<uint64_t, MAX_DIMENSION> high;
+            for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+                low[d] = tiled[d] ? step : 0;
+                high[d] = tile_stencil.get_extent(d) - low[d];
+            }
+            // every face of the update region, including its upper faces
+            for (uint64_t z = low[2]; z < high[2]; z++) {
+                for (uint64_t y = low[1]; y < high[1]; y++) {
+                    const uint64_t c[MAX_DIMENSION] = {0, y, z};
+                    const uint64_t start = tile_stencil.row_start(y + z * tile_stencil.get_extent(1)) + low[0];
+                    update.flux_faces(start, high[0] - low[0] + 1, 0);
+                    for (uint8_t d = 1; d < tile_stencil.get_dimension(); d++) {
+                        update.flux_faces(start, high[0] - low[0], d);
+                        if (c[d] + 1 == high[d]) {
+                            update.flux_faces(start + tile_stencil.get_stride(d), high[0] - low[0], d);
+                        }
+                    }
+                }
+            }
+            for (uint64_t z = low[2]; z < high[2]; z++) {
+                for (uint64_t y = low[1]; y < high[1]; y++) {
+                    const uint64_t row = y + z * tile_stencil.get_extent(1);
+                    const real row_max_signal_speed = update.update_row(tile_stencil.row_start(row) + low[0], high[0] - low[0], dt_dx);
+                    // the last step only updates the tile itself
+                    if (step + 1 == depth) {
+                        max_signal_speed = std::max(max_signal_speed, row_max_signal_speed);
+                    }
+                }
+            }
+
+            if (step + 1 < depth) {
+                tile.evolve();
+            }
+        }
+
+        store_tile(origin, tile);
+        return max_signal_speed;
+    }
+
+public:
+    TimeBlocking(FieldStore &input_fields, const uint32_t input_depth, const uint32_t tile_width, const uint32_t N_threads,
+                 const uint8_t isa, const double gamma, const uint8_t huge_pages = HUGE_PAGES)
+        : fields(&input_fields), stencil(&input_fields.get_stencil()), depth(input_depth)
+    {
+        if (depth < 1 || tile_width < 1) {
+            throw std::invalid_argument("Temporal blocking needs a depth and tile width of at least 1.");
+        }
+
+        std::array<uint32_t, MAX_DIMENSION> halo_extent;
+        N_tiles = 1;
+        for (uint8_t d = 0; d < MAX_DIMENSION; d++) {
+            tiled[d] = d < stencil->get_dimension() && (d > 0 || stencil->get_dimension() == 1);
+            tile_extent[d] = tiled[d] ? std::min(tile_width, stencil->get_extent(d)) : stencil->get_extent(d);
+            N_tiles_per_dimension[d] = (stencil->get_extent(d) + tile_extent[d] - 1) / tile_extent[d];
+            N_tiles *= N_tiles_per_dimension[d];
+            halo_extent[d] = tiled[d] ? tile_extent[d] + 2 * (depth - 1) : tile_extent[d];
+        }
+        tile_stencil = Stencil(stencil->get_dimension(), halo_extent, {0, 0, 0}, stencil->get_N_cells_1D());
+
+        for (uint32_t t = 0; t < N_threads; t++) {
+            tile_fields.push_back(std::make_unique<FieldStore>(tile_stencil, fields->get_N_scalars(), huge_pages));
+            // the cells outside the shrinking update region are copied around but never used
+            const uint64_t N_values = tile_fields[t]->get_N_fields() * FieldStore::get_N_padded(tile_stencil);
+            std::memset(tile_fields[t]->get_prev(0), 0, N_values * sizeof(real));
+            std::memset(tile_fields[t]->get_next(0), 0, N_values * sizeof(real));
+            tile_updates.push_back(std::make_unique<SimdUpdate>(*tile_fields[t], isa, gamma, huge_pages));
+        }
+    }
+
+    uint32_t get_depth() const {
+        return depth;
+    }
+
+    uint64_t get_N_tiles() const {
+        return N_tiles;
+    }
+
+    const Stencil &get_tile_stencil() const {
+        return tile_stencil;
+    }
+
+    // Fill the next arrays with the state depth steps after the prev arrays,
+    // whose ghost layers must be up to date. The caller evolves the grid.
+    // Returns the largest signal speed of the next values, see SimdUpdate.
+    real advance(SweepEngine &engine, const real dt_dx) const {
+        std::vector<real> thread_max_signal_speeds(tile_fields.size(), 0.);
+        engine.parallel_for(N_tiles, [&](const uint64_t tile_begin, const uint64_t tile_end, const uint32_t thread) {
+            for (uint64_t t = tile_begin; t < tile_end; t++) {
+                thread_max_signal_speeds[thread] = std::max(thread_max_signal_speeds[thread], advance_tile(t, thread, dt_dx));
+            }
+        });
+        return *std::max_element(thread_max_signal_speeds.begin(), thread_max_signal_speeds.end());
+    }
+};
+
+#endif /* TIME_BLOCKING_HPP */
@@ -0,0 +1,152 @@
+// Compares the row-major, tiled, Morton and Hilbert row traversals of the SIMD sweep, and
+// the coordinate-path neighbor gather over a row-major and a Morton indexed
+// array. Cache misses are read from the hardware counters where perf_event is
+// available.
+//
+//     g++ -O2 -std=c++17 -Wno-psabi -DDIMENSION=3 -DN_CELLS_1D=192 benchmarks/cell_ordering.cpp -o cell_ordering -lpthread
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../main.hpp"
+#include "../Grid/Grid.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../CellOrdering/CellOrdering.hpp"
+
+#define N_REPEATS 5
+
+// last level cache misses of this thread, -1 when the counter can't be opened
+class CacheMissCounter
+{
+private:
+    int file;
+
+public:
+    CacheMissCounter()
+    {
+        struct perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        file = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter() {
+        if (file >= 0) {
+            close(file);
+        }
+    }
+
+    void start() {
+        if (file >= 0) {
+            ioctl(file, PERF_EVENT_IOC_RESET, 0);
+            ioctl(file, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    int64_t stop() {
+        if (file < 0) {
+            return -1;
+        }
+        ioctl(file, PERF_EVENT_IOC_DISABLE, 0);
+        int64_t count = 0;
+        if (read(file, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+            return -1;
+        }
+        return count;
+    }
+};
+
+template <typename Function>
+static void run(const std::string &name, const uint64_t N_cells, CacheMissCounter &counter, Function function) {
+    function();
+    counter.start();
+    const auto start = std::chrono::steady_clock::now();
+    real checksum = 0.;
+    for (uint32_t r = 0; r < N_REPEATS; r++) {
+        checksum += function();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const int64_t N_misses = counter.stop();
+
+    std::cout << name << ": " << (double)(N_REPEATS * N_cells) / elapsed.count() << " cells/s, ";
+    if (N_misses < 0) {
+        std::cout << "cache misses n/a";
+    } else {
+        std::cout << (double)N_misses / (double)(N_REPEATS * N_cells) << " cache misses/cell";
+    }
+    std::cout << " (checksum " << checksum << ")\n";
+}
+
+// the coordinate-arithmetic neighbor gather of benchmarks/neighbor_lookup.cpp,
+// visiting the cells and indexing the values in the given ordering
+static real gather_neighbors(const CellOrdering &ordering, const std::vector<real> &values) {
+    std::vector<box_int> coordinates(DIMENSION);
+    std::vector<box_int> neighbor_coordinates(DIMENSION);
+    real sum = 0.;
+    for (uint64_t i = 0; i < ordering.get_N_indices(); i++) {
+        ordering.index_to_coordinates(i, coordinates);
+        bool inside = true;
+        for (uint8_t d = 0; d < DIMENSION; d++) {
+            inside = inside && coordinates[d] < N_CELLS_1D;
+        }
+        if (!inside) {
+            continue;
+        }
+        for (uint8_t d = 0; d < DIMENSION; d++) {
+            neighbor_coordinates = coordinates;
+            neighbor_coordinates[d] = (coordinates[d] + 1) % N_CELLS_1D;
+            sum += values[ordering.coordinates_to_index(neighbor_coordinates)];
+            neighbor_coordinates[d] = (coordinates[d] - 1 + N_CELLS_1D) % N_CELLS_1D;
+            sum += values[ordering.coordinates_to_index(neighbor_coordinates)];
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    std::cout << std::scientific;
+    Grid grid(DIMENSION, N_CELLS_1D);
+    FieldStore &fields = grid.get_fields();
+    const Stencil &stencil = grid.get_stencil();
+    const uint64_t N_cells = grid.get_N_cells_Nd();
+    fields.fill_ghosts();
+
+    std::cout << "DIMENSION = " << DIMENSION << ", N_CELLS_1D = " << N_CELLS_1D << ", TILE_SIZE = " << TILE_SIZE << "\n";
+
+    CacheMissCounter counter;
+    const SimdUpdate update(fields, SIMD_ISA, GAMMA);
+    const real dt_dx = 1.e-4;
+
+    const char *traversal_names[4] = {"row-major sweep", "tiled sweep", "Morton sweep", "Hilbert sweep"};
+    for (uint8_t type = ORDERING_ROW_MAJOR; type <= ORDERING_HILBERT; type++) {
+        const RowTraversal traversal(stencil, type, TILE_SIZE);
+        run(traversal_names[type], N_cells, counter, [&]() {
+            update.flux_rows(traversal, 0, traversal.get_N_rows(), true);
+            update.flux_rows(traversal, 0, traversal.get_N_rows(), false);
+            update.update_rows(traversal, 0, traversal.get_N_rows(), dt_dx);
+            return fields.get_next_density()[stencil.row_start(0)];
+        });
+    }
+
+    const real *density = fields.get_prev_density();
+    const char *ordering_names[3] = {"row-major gather", "", "Morton gather"};
+    for (uint8_t type : {ORDERING_ROW_MAJOR, ORDERING_MORTON}) {
+        const CellOrdering ordering(type, DIMENSION, N_CELLS_1D);
+        std::vector<real> values(ordering.get_N_indices(), 0.);
+        std::vector<box_int> coordinates(DIMENSION);
+        for (uint64_t i = 0; i < N_cells; i++) {
+            grid.index_to_coordinates(i, coordinates);
+            values[ordering.coordinates_to_index(coordinates)] = density[stencil.interior_to_storage(i)];
+        }
+        run(ordering_names[type], N_cells, counter, [&]() { return gather_neighbors(ordering, values); });
+    }
+}
@@ -0,0 +1,103 @@
+// Checks that the flux form keeps the mass, momentum and energy of the box:
+// N_STEPS steps of the centered update on a uniform grid, with
+// ConservationCheck after every one, then on an AmrHierarchy of up to
+// AMR_MAX_LEVEL levels (2 when that is 0), where the coarse cells next to a
+// finer block are refluxed. Exits with 1 when a total drifts by more than
+// rounding.
+//
+//     g++ -O2 -std=c++17 -Wno-psabi -DDIMENSION=2 -DN_CELLS_1D=64 benchmarks/conservation.cpp -o conservation -lpthread
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include "../main.hpp"
+#include "../Domain/Domain.hpp"
+#include "../Grid/Grid.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../ConservationCheck/ConservationCheck.hpp"
+#include "../AmrHierarchy/AmrHierarchy.hpp"
+
+#define N_STEPS 200
+// the centered differences need the small CFL number of main
+#define CFL 0.01
+
+// the uniform grid, every step checked against the last
+static bool check_uniform(const Domain &domain, SweepEngine &engine) {
+    Grid grid(DIMENSION, N_CELLS_1D);
+    FieldStore &fields = grid.get_fields();
+    const SimdUpdate update(fields, SIMD_ISA, GAMMA);
+    ConservationCheck check(domain, fields, engine, 1, 0);
+
+    const real dx = 1. / (real)N_CELLS_1D;
+    bool conserved = true;
+    for (uint64_t step = 0; step < N_STEPS && conserved; step++) {
+        const real dt_dx = CFL * dx / grid.get_max_signal_speed(engine) / (2. * dx);
+        fields.fill_ghosts();
+        update.update(dt_dx);
+        fields.evolve();
+        conserved = check.check(fields, engine, step + 1);
+    }
+    std::cout << "uniform " << N_CELLS_1D << "^" << DIMENSION << ", " << update.get_isa_name() << ": "
+              << (conserved ? "conserved" : "drifted") << " over " << N_STEPS << " steps\n";
+    return conserved;
+}
+
+// The hierarchy, regridded every AMR_REGRID_STEPS steps. A cell of the finest
+// level takes 2^max_level steps per step of level 0, and a coarse cell is
+// refluxed after those of its finer neighbors, so the rounding bound of
+// ConservationCheck is scaled by the updates of all levels, 2^(max_level + 1) - 1.
+static bool check_amr(SweepEngine &engine) {
+    const uint8_t max_level = (AMR_MAX_LEVEL > 0) ? AMR_MAX_LEVEL : 2;
+    const uint32_t block_size = std::min((uint32_t)AMR_BLOCK_SIZE, (uint32_t)N_CELLS_1D / 2);
+    AmrHierarchy hierarchy(DIMENSION, N_CELLS_1D, block_size, max_level, AMR_REFINE_THRESHOLD, AMR_DEREFINE_THRESHOLD,
+                           InitialConditions(), GAMMA, SIMD_ISA);
+    hierarchy.describe();
+
+    double first_totals[AMR_N_CONSERVED];
+    double totals[AMR_N_CONSERVED];
+    double magnitudes[AMR_N_CONSERVED];
+    hierarchy.get_conserved_totals(first_totals, magnitudes);
+
+    const real dx = 1. / (real)N_CELLS_1D;
+    for (uint64_t step = 0; step < N_STEPS; step++) {
+        const real dt_dx = CFL * dx / hierarchy.get_max_signal_speed(engine) / (2. * dx);
+        hierarchy.advance(engine, dt_dx);
+        if ((step + 1) % AMR_REGRID_STEPS == 0) {
+            hierarchy.regrid(engine);
+        }
+    }
+    hierarchy.get_conserved_totals(totals, magnitudes);
+    hierarchy.describe();
+
+    static const char *names[AMR_N_CONSERVED] = {"mass", "energy", "momentum x", "momentum y", "momentum z"};
+    const double N_updates = (double)N_STEPS * (double)((2u << max_level) - 1);
+    bool conserved = true;
+    for (uint8_t c = 0; c < 2 + DIMENSION; c++) {
+        // the momentum fluxes carry the pressure, at most (gamma - 1) E, which
+        // the reflux corrections round against even where the momentum is zero
+        const double scale = magnitudes[c] + ((c >= 2) ? (GAMMA - 1.) * magnitudes[1] : 0.);
+        const double drift = fabs(totals[c] - first_totals[c]);
+        const double bound = 16. * std::numeric_limits<real>::epsilon() * N_updates * scale;
+        std::cout << "AMR " << names[c] << " drifted by " << drift << ", rounding bound " << bound << "\n";
+        conserved = conserved && drift <= bound;
+    }
+    std::cout << "AMR up to level " << (int)max_level << ": " << (conserved ? "conserved" : "drifted") << " over "
+              << N_STEPS << " steps\n";
+    return conserved;
+}
+
+int main(int argc, char **argv) {
+    std::cout << std::scientific;
+    Domain domain(&argc, &argv, DIMENSION, N_CELLS_1D);
+    if (domain.get_N_ranks() > 1) {
+        std::cout << "The conservation check runs on a single rank.\n";
+        return 1;
+    }
+    SweepEngine engine(N_THREADS, SCHEDULE, CHUNK_SIZE);
+    std::cout << "DIMENSION = " << DIMENSION << ", N_CELLS_1D = " << N_CELLS_1D << ", " << engine.get_N_threads()
+              << " threads\n";
+
+    const bool uniform_conserved = check_uniform(domain, engine);
+    const bool amr_conserved = check_amr(engine);
+    return (uniform_conserved && amr_conserved) ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+// Google Benchmark suite of the building blocks of a step: Grid construction,
+// Grid::get_neighbors, the sweep of every ConservedQuantity, the fused SIMD
+// update, the per-cell copy of Cell::evolve against the FieldStore::evolve
+// swap, and Grid::save_cells, in 1D, 2D and 3D at several grid sizes. Every
+// benchmark reports cells_per_second, the bandwidth of the memory traffic it
+// has to do at the least (bytes_per_second) and stream_fraction, that
+// bandwidth over the STREAM triad bandwidth measured at start-up. The build
+// makes one binary per real type, and microbenchmarks_mixed with float fields
+// and double arithmetic (WITH_DOUBLE_COMPUTE):
+//
+//     cmake -S . -B build && cmake --build build --target microbenchmarks_float microbenchmarks_double
+//     ./build/microbenchmarks_double --benchmark_filter=3D
+//
+// The initial conditions need 2 dimensions, so the benchmarks of Grid start at
+// 2D; the kernels run on a FieldStore holding a smooth state in any dimension.
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <benchmark/benchmark.h>
+#include "../main.hpp"
+#include "../Grid/Grid.hpp"
+#include "../ConservedQuantity/ConservedQuantity.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+#include "../Profiler/Profiler.hpp"
+#include "../Domain/Domain.hpp"
+
+// reals per STREAM array, large enough to spill any cache
+#define STREAM_N_VALUES (1 << 24)
+#define STREAM_N_REPEATS 5
+#define BENCHMARK_DT_DX 1e-3
+
+// the STREAM triad bandwidth of this machine, see measure_stream
+static double stream_bytes_per_second = 0.;
+
+struct StreamArrays
+{
+    std::vector<real> a;
+    std::vector<real> b;
+    std::vector<real> c;
+
+    StreamArrays() : a(STREAM_N_VALUES, 1.), b(STREAM_N_VALUES, 2.), c(STREAM_N_VALUES, 0.) {}
+
+    void copy() {
+        for (uint64_t i = 0; i < STREAM_N_VALUES; i++) {
+            c[i] = a[i];
+        }
+    }
+
+    void triad(const real scalar) {
+        for (uint64_t i = 0; i < STREAM_N_VALUES; i++) {
+            a[i] = b[i] + scalar * c[i];
+        }
+    }
+};
+
+// best of STREAM_N_REPEATS triads, the rate the memory system can sustain
+static double measure_stream(StreamArrays &arrays) {
+    double best_seconds = 0.;
+    for (uint32_t r = 0; r < STREAM_N_REPEATS; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        arrays.triad(3.);
+        benchmark::ClobberMemory();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (r == 0 || elapsed.count() < best_seconds) {
+            best_seconds = elapsed.count();
+        }
+    }
+    return 3. * STREAM_N_VALUES * sizeof(real) / best_seconds;
+}
+
+// stream_fraction is a rate too, so it is printed per second
+static void set_counters(benchmark::State &state, const uint64_t N_cells, const uint64_t N_bytes) {
+    if (N_cells > 0) {
+        state.counters["cells_per_second"] = benchmark::Counter((double)state.iterations() * N_cells, benchmark::Counter::kIsRate);
+    }
+    state.SetBytesProcessed(state.iterations() * N_bytes);
+    state.counters["stream_fraction"] = benchmark::Counter((double)state.iterations() * N_bytes / stream_bytes_per_second,
+                                                           benchmark::Counter::kIsRate);
+}
+
+static uint64_t get_N_cells(const uint8_t dimension, const uint32_t N) {
+    uint64_t N_cells = 1;
+    for (uint8_t d = 0; d < dimension; d++) {
+        N_cells *= N;
+    }
+    return N_cells;
+}
+
+// a smooth wave along dimension 0 with the scalars as a ramp, without a Grid
+template <uint8_t D>
+static std::unique_ptr<FieldStore> make_fields(const uint32_t N, const uint8_t N_scalars) {
+    auto fields = std::make_unique<FieldStore>(Stencil(D, {N, N, N}, {0, 0, 0}, N), N_scalars);
+    const Stencil &stencil = fields->get_stencil();
+    for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+        const uint64_t s = stencil.interior_to_storage(i);
+        const real x = (real)stencil.get_global_coordinate(s, 0) / (real)N;
+        const real density = 1. + 0.1 * sin(2. * M_PI * x);
+        const real pressure = 1.;
+        real specific_kinetic_energy = 0.;
+        for (uint8_t d = 0; d < D; d++) {
+            const real velocity = 0.1 * (d + 1);
+            fields->get_prev_velocity(d)[s] = velocity;
+            fields->get_next_velocity(d)[s] = velocity;
+            specific_kinetic_energy += 0.5 * velocity * velocity;
+        }
+        const real energy = pressure / (GAMMA - 1.0) + density * specific_kinetic_energy;
+        fields->get_prev_density()[s] = density;
+        fields->get_next_density()[s] = density;
+        fields->get_prev_energy()[s] = energy;
+        fields->get_next_energy()[s] = energy;
+        fields->get_prev_pressure()[s] = pressure;
+        fields->get_next_pressure()[s] = pressure;
+        for (uint8_t k = 0; k < N_scalars; k++) {
+            fields->get_prev_scalar(k)[s] = x;
+            fields->get_next_scalar(k)[s] = x;
+        }
+    }
+    fields->fill_ghosts();
+    return fields;
+}
+
+template <uint8_t D>
+static void grid_construction(benchmark::State &state, const uint32_t N) {
+    uint64_t N_bytes = 0;
+    for (auto _ : state) {
+        Grid grid(D, N);
+        benchmark::DoNotOptimize(grid.get_fields().get_prev_density());
+        N_bytes = grid.get_fields().get_N_cells() * grid.get_fields().get_bytes_per_cell();
+    }
+    set_counters(state, get_N_cells(D, N), N_bytes);
+}
+
+template <uint8_t D>
+static void get_neighbors(benchmark::State &state, const uint32_t N) {
+    Grid grid(D, N);
+    std::vector<Cell> neighbor_cells(2 * D);
+    for (auto _ : state) {
+        real sum = 0.;
+        for (uint64_t i = 0; i < grid.get_N_cells_Nd(); i++) {
+            grid.get_neighbors(grid.get_cell(i), neighbor_cells);
+            for (auto &neighbor_cell : neighbor_cells) {
+                sum += neighbor_cell.get_density();
+            }
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    set_counters(state, get_N_cells(D, N), get_N_cells(D, N) * sizeof(real));
+}
+
+// one sweep of the quantity as EquationSet does it, on a single thread;
+// N_arrays is the number of field arrays the update reads or writes
+template <uint8_t D, typename Quantity>
+static void conserved_update(benchmark::State &state, const uint32_t N, const Quantity &quantity, const uint32_t N_arrays) {
+    auto fields = make_fields<D>(N, 1);
+    SweepEngine engine(1, SCHEDULE, CHUNK_SIZE);
+    Profiler profiler(true);
+    EquationSet<D, Quantity> equations(1, quantity);
+    for (auto _ : state) {
+        equations.update(*fields, engine, BENCHMARK_DT_DX, profiler);
+        benchmark::ClobberMemory();
+    }
+    set_counters(state, get_N_cells(D, N), get_N_cells(D, N) * N_arrays * sizeof(real));
+}
+
+template <uint8_t D>
+static void fused_update(benchmark::State &state, const uint32_t N) {
+    auto fields = make_fields<D>(N, 0);
+    const SimdUpdate update(*fields, SIMD_AUTO, GAMMA);
+    state.SetLabel(update.get_isa_name());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(update.update(BENCHMARK_DT_DX));
+        benchmark::ClobberMemory();
+    }
+    set_counters(state, get_N_cells(D, N), get_N_cells(D, N) * fields->get_bytes_per_cell());
+}
+
+template <uint8_t D>
+static void cell_evolve(benchmark::State &state, const uint32_t N) {
+    auto fields = make_fields<D>(N, 0);
+    const Stencil &stencil = fields->get_stencil();
+    for (auto _ : state) {
+        for (uint64_t i = 0; i < stencil.get_N_interior(); i++) {
+            Cell(fields.get(), stencil.interior_to_storage(i)).evolve();
+        }
+        benchmark::ClobberMemory();
+    }
+    set_counters(state, get_N_cells(D, N), get_N_cells(D, N) * fields->get_bytes_per_cell());
+}
+
+// the swap of the prev and next arrays that replaced the copy, no traffic
+template <uint8_t D>
+static void fields_evolve(benchmark::State &state, const uint32_t N) {
+    auto fields = make_fields<D>(N, 0);
+    for (auto _ : state) {
+        fields->evolve();
+        benchmark::DoNotOptimize(fields->get_prev_density());
+    }
+    set_counters(state, get_N_cells(D, N), 0);
+}
+
+// synchronous, so the time includes the write to the file system
+template <uint8_t D>
+static void save_cells(benchmark::State &state, const uint32_t N) {
+    Grid grid(D, N);
+    grid.set_N_dump_buffers(0);
+    const Domain domain(nullptr, nullptr, D, N);
+    for (auto _ : state) {
+        grid.save_cells(0, 0., domain);
+    }
+    std::remove("snapshot_0.bin");
+    set_counters(state, get_N_cells(D, N), get_N_cells(D, N) * grid.get_fields().get_N_fields() * sizeof(real));
+}
+
+template <uint8_t D>
+static void register_dimension(const std::vector<uint32_t> &sizes) {
+    for (const uint32_t N : sizes) {
+        const std::string suffix = "/" + std::to_string(D) + "D/N:" + std::to_string(N);
+        if (D >= 2) {
+            benchmark::RegisterBenchmark(("grid_construction" + suffix).c_str(), grid_construction<D>, N);
+            benchmark::RegisterBenchmark(("get_neighbors" + suffix).c_str(), get_neighbors<D>, N);
+        }
+        // the arrays read or written by each of the updates, with the face
+        // flux arrays of the ones in flux form
+        benchmark::RegisterBenchmark(("ConservedDensity" + suffix).c_str(), conserved_update<D, ConservedDensity<D>>, N,
+                                     ConservedDensity<D>(), 2 + 2 * D);
+        benchmark::RegisterBenchmark(("ConservedMomentum" + suffix).c_str(), conserved_update<D, ConservedMomentum<D>>, N,
+                                     ConservedMomentum<D>(), 3 + 2 * D + D * D);
+        benchmark::RegisterBenchmark(("ConservedEnergy" + suffix).c_str(), conserved_update<D, ConservedEnergy<D>>, N,
+                                     ConservedEnergy<D>(GAMMA), 5 + 3 * D);
+        benchmark::RegisterBenchmark(("PassiveScalars" + suffix).c_str(), conserved_update<D, PassiveScalars<D>>, N,
+                                     PassiveScalars<D>(1), 2 + D);
+        benchmark::RegisterBenchmark(("fused_update" + suffix).c_str(), fused_update<D>, N);
+        benchmark::RegisterBenchmark(("Cell::evolve" + suffix).c_str(), cell_evolve<D>, N);
+        benchmark::RegisterBenchmark(("FieldStore::evolve" + suffix).c_str(), fields_evolve<D>, N);
+        if (D >= 2) {
+            benchmark::RegisterBenchmark(("save_cells" + suffix).c_str(), save_cells<D>, N)->Unit(benchmark::kMillisecond);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+
+    StreamArrays stream;
+    stream_bytes_per_second = measure_stream(stream);
+    std::cout << "STREAM triad: " << stream_bytes_per_second / 1e9 << " GB/s with " << sizeof(real) << "-byte reals\n";
+
+    benchmark::RegisterBenchmark("STREAM/copy", [&](benchmark::State &state) {
+        for (auto _ : state) {
+            stream.copy();
+            benchmark::ClobberMemory();
+        }
+        set_counters(state, 0, 2 * STREAM_N_VALUES * sizeof(real));
+    });
+    benchmark::RegisterBenchmark("STREAM/triad", [&](benchmark::State &state) {
+        for (auto _ : state) {
+            stream.triad(3.);
+            benchmark::ClobberMemory();
+        }
+        set_counters(state, 0, 3 * STREAM_N_VALUES * sizeof(real));
+    });
+
+    register_dimension<1>({1 << 16, 1 << 20});
+    register_dimension<2>({64, 256, 1024});
+    register_dimension<3>({16, 64, 128});
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Compares the neighbor lookup that Grid::get_neighbors used to do (copy the
+// coordinates, wrap with a modulo, convert back to an index) against the
+// flat-offset lookup into the ghost-padded arrays.
+//
+//     g++ -O2 -std=c++17 -DN_CELLS_1D=1024 benchmarks/neighbor_lookup.cpp -o neighbor_lookup
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "../main.hpp"
+#include "../Grid/Grid.hpp"
+
+// the coordinate-arithmetic path, as it was before the stencil offsets
+static void legacy_neighbor_indices(Grid &grid, const uint64_t index, std::vector<box_int> &coordinates,
+                                    std::vector<std::vector<box_int>> &neighbor_coordinates,
+                                    std::vector<uint64_t> &neighbor_indices) {
+    grid.index_to_coordinates(index, coordinates);
+    for (uint8_t n = 0; n < (uint8_t)(2 * DIMENSION); n++) {
+        neighbor_coordinates[n] = coordinates;
+    }
+
+    for (uint8_t d = 0; d < DIMENSION; d++) {
+        neighbor_coordinates[2 * d][d] = (coordinates[d] + 1) % N_CELLS_1D;
+        neighbor_coordinates[2 * d + 1][d] = (coordinates[d] - 1 + N_CELLS_1D) % N_CELLS_1D;
+    }
+
+    for (uint8_t n = 0; n < (uint8_t)(2 * DIMENSION); n++) {
+        neighbor_indices[n] = grid.coordinates_to_index(neighbor_coordinates[n]);
+    }
+}
+
+template <typename Function>
+static void run(const std::string &name, const uint64_t N_cells, Function function) {
+    const auto start = std::chrono::steady_clock::now();
+    const real checksum = function();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << elapsed.count() << " s, "
+              << (double)N_cells / elapsed.count() << " cells/s (checksum " << checksum << ")\n";
+}
+
+int main(int argc, char **argv) {
+    std::cout << std::scientific;
+    Grid grid(DIMENSION, N_CELLS_1D);
+    const Stencil &stencil = grid.get_stencil();
+    const real *density = grid.get_fields().get_prev_density();
+    const uint64_t N_cells = grid.get_N_cells_Nd();
+
+    std::cout << "DIMENSION = " << DIMENSION << ", N_CELLS_1D = " << N_CELLS_1D << "\n";
+
+    // legacy density reads are done on an unpadded copy, as the old Cell vector was
+    std::vector<real> unpadded_density(N_cells);
+    for (uint64_t i = 0; i < N_cells; i++) {
+        unpadded_density[i] = density[stencil.interior_to_storage(i)];
+    }
+
+    run("coordinate arithmetic", N_cells, [&]() {
+        std::vector<box_int> coordinates(DIMENSION);
+        std::vector<std::vector<box_int>> neighbor_coordinates(2 * DIMENSION, std::vector<box_int>(DIMENSION));
+        std::vector<uint64_t> neighbor_indices(2 * DIMENSION);
+        real sum = 0.;
+        for (uint64_t i = 0; i < N_cells; i++) {
+            legacy_neighbor_indices(grid, i, coordinates, neighbor_coordinates, neighbor_indices);
+            for (auto neighbor_index : neighbor_indices) {
+                sum += unpadded_density[neighbor_index];
+            }
+        }
+        return sum;
+    });
+
+    run("Grid::get_neighbors", N_cells, [&]() {
+        std::vector<Cell> neighbor_cells(2 * DIMENSION);
+        real sum = 0.;
+        for (uint64_t i = 0; i < N_cells; i++) {
+            grid.get_neighbors(grid.get_cell(i), neighbor_cells);
+            for (auto &neighbor_cell : neighbor_cells) {
+                sum += neighbor_cell.get_density();
+            }
+        }
+        return sum;
+    });
+
+    run("stencil offsets by row", N_cells, [&]() {
+        real sum = 0.;
+        for (uint64_t row = 0; row < stencil.get_N_rows(); row++) {
+            const uint64_t start = stencil.row_start(row);
+            for (uint64_t s = start; s < start + stencil.get_extent(0); s++) {
+                for (uint8_t d = 0; d < DIMENSION; d++) {
+                    sum += density[s + stencil.get_stride(d)];
+                    sum += density[s - stencil.get_stride(d)];
+                }
+            }
+        }
+        return sum;
+    });
+}
@@ -0,0 +1,67 @@
+// Compares the time step reduction as a separate pass over the grid after the
+// update sweep with the one fused into the sweep, see SimdUpdate. Both give the
+// same largest |u| + c_s.
+//
+//     g++ -O2 -std=c++17 -Wno-psabi -DDIMENSION=3 -DN_CELLS_1D=192 benchmarks/signal_speed.cpp -o signal_speed -lpthread
+#include <chrono>
+#include <iostream>
+#include "../main.hpp"
+#include "../Grid/Grid.hpp"
+#include "../SimdUpdate/SimdUpdate.hpp"
+#include "../SweepEngine/SweepEngine.hpp"
+
+#define N_REPEATS 5
+
+template <typename Function>
+static void run(const std::string &name, const uint64_t N_cells, Function function) {
+    function();
+    const auto start = std::chrono::steady_clock::now();
+    real max_signal_speed = 0.;
+    for (uint32_t r = 0; r < N_REPEATS; r++) {
+        max_signal_speed = function();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << (double)(N_REPEATS * N_cells) / elapsed.count() << " cells/s (max signal speed "
+              << max_signal_speed << ")\n";
+}
+
+int main(int argc, char **argv) {
+    std::cout << std::scientific;
+    Grid grid(DIMENSION, N_CELLS_1D);
+    FieldStore &fields = grid.get_fields();
+    const uint64_t N_rows = grid.get_stencil().get_N_rows();
+    const uint64_t N_cells = grid.get_N_cells_Nd();
+    fields.fill_ghosts();
+
+    SweepEngine engine(N_THREADS, SCHEDULE, CHUNK_SIZE);
+    const SimdUpdate update(fields, SIMD_ISA, GAMMA);
+    const real dt_dx = 1.e-4;
+    std::cout << "DIMENSION = " << DIMENSION << ", N_CELLS_1D = " << N_CELLS_1D << ", " << engine.get_N_threads()
+              << " threads, " << update.get_isa_name() << "\n";
+
+    // the next values are swapped in, so the pass reads what the sweep wrote
+    run("sweep, then separate pass", N_cells, [&]() {
+        engine.parallel_for(N_rows, [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            update.flux_rows(row_begin, row_end);
+        });
+        engine.parallel_for(N_rows, [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            update.update_rows(row_begin, row_end, dt_dx);
+        });
+        fields.evolve();
+        return grid.get_max_signal_speed(engine);
+    });
+
+    std::vector<real> thread_max_signal_speeds(engine.get_N_threads());
+    run("fused sweep", N_cells, [&]() {
+        std::fill(thread_max_signal_speeds.begin(), thread_max_signal_speeds.end(), 0.);
+        engine.parallel_for(N_rows, [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            update.flux_rows(row_begin, row_end);
+        });
+        engine.parallel_for(N_rows, [&](const uint64_t row_begin, const uint64_t row_end, const uint32_t thread) {
+            thread_max_signal_speeds[thread] = std::max(thread_max_signal_speeds[thread],
+                                                        update.update_rows(row_begin, row_end, dt_dx));
+        });
+        fields.evolve();
+        return *std::max_element(thread_max_signal_speeds.begin(), thread_max_signal_speeds.end());
+    });
+}
@@ -1,118 +1,630 @@
+#include <algorithm>
 #include <iostream>
 #include <variant>
 #include <memory>
 #include <cstddef>
 #include <stdexcept>
+#include <string>
+#include <csignal>
 #include "main.hpp"
 #include "Grid/Grid.hpp"
 #include "ConservedQuantity/ConservedQuantity.hpp"
+#include "SimdUpdate/SimdUpdate.hpp"
+#include "GodunovUpdate/GodunovUpdate.hpp"
+#include "SweepEngine/SweepEngine.hpp"
+#include "Domain/Domain.hpp"
+#include "Checkpoint/Checkpoint.hpp"
+#include "Config/Config.hpp"
+#include "TimeBlocking/TimeBlocking.hpp"
+#include "LocalTimestep/LocalTimestep.hpp"
+#include "AmrHierarchy/AmrHierarchy.hpp"
+#include "Profiler/Profiler.hpp"
+#include "Ensemble/Ensemble.hpp"
+#include "Diagnostics/Diagnostics.hpp"
+
+// set by SIGTERM/SIGUSR1, the run checkpoints and stops at the end of the step
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+// the run report of the root rank, see Profiler
+static void write_report(Profiler &profiler, const Config &config, const Domain &domain) {
+    if (!domain.is_root() || config.report_name.empty()) {
+        return;
+    }
+    profiler.add_info("dimension", std::to_string(config.dimension));
+    profiler.add_info("N_cells_1D", std::to_string(config.N_cells_1D));
+    profiler.add_info("N_ranks", std::to_string(domain.get_N_ranks()));
+    profiler.add_info("N_threads", std::to_string(config.N_threads));
+    profiler.add_info("thread_pinning", std::to_string(config.thread_pinning));
+    profiler.add_info("huge_pages", std::to_string(config.huge_pages));
+    profiler.add_info("scheme", std::to_string(config.scheme));
+    profiler.add_info("real_bytes", std::to_string(sizeof(real)));
+    profiler.add_info("compute_real_bytes", std::to_string(sizeof(compute_real)));
+    profiler.add_info("dump_type", std::to_string(config.dump_type));
+    profiler.write_report(config.report_name);
+    std::cout << "Run report written to " << config.report_name << "\n";
+}
+
+// the field pages and threads on every NUMA node of this rank, for the report
+static void add_numa_nodes(Profiler &profiler, const FieldStore &fields, SweepEngine &engine) {
+    const std::vector<uint64_t> node_bytes = fields.get_node_bytes();
+    const std::vector<uint32_t> thread_nodes = engine.get_thread_nodes();
+    for (uint32_t node = 0; node < node_bytes.size(); node++) {
+        const uint32_t N_threads = (uint32_t)std::count(thread_nodes.begin(), thread_nodes.end(), node);
+        profiler.add_node(node, node_bytes[node], N_threads);
+    }
+    profiler.print_nodes();
+}
+
+#ifdef WITH_SEPARATE_SWEEPS
+// the equations compiled for every dimension, the run picks one
+using SeparateSweeps = std::variant<HydroEquations<1>, HydroEquations<2>, HydroEquations<3>>;
+
+static SeparateSweeps make_separate_sweeps(const Config &config, const uint32_t N_threads) {
+    switch (config.dimension) {
+        case 1: return make_hydro_equations<1>(N_threads, config.gamma, config.N_scalars);
+        case 2: return make_hydro_equations<2>(N_threads, config.gamma, config.N_scalars);
+    }
+    return make_hydro_equations<3>(N_threads, config.gamma, config.N_scalars);
+}
+#endif
+
+// The main loop on an AmrHierarchy instead of a uniform Grid: the same time
+// step and dump logic, with a regrid every amr_regrid_steps steps.
+static void run_amr(const Config &config, Domain &domain, Profiler &profiler) {
+    if (domain.get_N_ranks() > 1) {
+        throw std::invalid_argument("AMR runs on a single rank.");
+    }
+
+    auto engine_owner = std::make_unique<SweepEngine>(config.N_threads, config.schedule, config.chunk_size, config.thread_pinning);
+    SweepEngine &engine = *engine_owner;
+    AmrHierarchy hierarchy(config.dimension, config.N_cells_1D, config.amr_block_size, config.amr_max_level,
+                           config.amr_refine_threshold, config.amr_derefine_threshold,
+                           InitialConditions(config.initial_conditions, config.ic_amplitude, config.ic_file), config.gamma,
+                           config.simd_isa, config.huge_pages);
+    hierarchy.set_dump_type(config.dump_type);
+    hierarchy.describe();
+
+    // dt is set by the level 0 cells, level l takes 2^l steps of dt / 2^l
+    const real dt_max = (real)config.dump_interval / 2.;
+    const real dx = 1. / (real)config.N_cells_1D;
+    // the centered differences, the only scheme with AMR, as in main
+    const real CFL_number = (config.cfl_number == 0.) ? 0.01 : config.cfl_number;
+    const real CFL_prefactor = CFL_number * dx;
+    const real dt_minimum = CFL_prefactor / 100.;
+    real dt = std::min(CFL_prefactor / hierarchy.get_max_signal_speed(engine), dt_max);
+    real dt_dx = dt / (2.0 * dx);
+    real current_time = 0.;
+    uint64_t dump_counter = 0;
+    real dump_timer = 0.;
+    uint64_t step = 0;
+    std::cout << std::endl;
+
+    while (true) {
+        if (!profiler.is_quiet()) {
+            std::cout << "current time: " << current_time << "\ttimestep: " << dt << "\n";
+        }
+        {
+            ScopedTimer timer(profiler, "AMR advance");
+            hierarchy.advance(engine, dt_dx);
+        }
+        const uint64_t N_cell_updates = hierarchy.get_N_cell_updates_per_step();
+        profiler.count(N_cell_updates, N_cell_updates * (2 * (FIELD_VELOCITY + config.dimension) * sizeof(real)
+                                                         + FusedUpdate::get_face_flux_bytes_per_cell(config.dimension)));
+
+        current_time += dt;
+        profiler.end_step(step + 1, current_time, dt);
+        if (current_time > config.max_time) {
+            break;
+        }
+
+        dump_timer += dt;
+        if (dump_timer > config.dump_interval) {
+            ScopedTimer timer(profiler, "dump");
+            std::cout << "DUMP" << "\n";
+            std::cout << std::to_string(dump_counter) << "\n";
+            hierarchy.describe();
+            if (profiler.is_quiet()) {
+                profiler.print_progress(step + 1, current_time);
+            }
+            std::cout << "\n";
+            hierarchy.save_cells(dump_counter, current_time, domain);
+            dump_timer = 0.;
+            dump_counter++;
+        }
+
+        step++;
+        if (step % config.amr_regrid_steps == 0) {
+            ScopedTimer timer(profiler, "regrid");
+            hierarchy.regrid(engine);
+        }
+
+        {
+            ScopedTimer timer(profiler, "CFL reduction");
+            dt = std::min(CFL_prefactor / hierarchy.get_max_signal_speed(engine), dt_max);
+        }
+        if (!(dt >= dt_minimum)) {
+            std::cout << "Time step " << dt << " is below dt_minimum of " << dt_minimum << ", stopping\n";
+            break;
+        }
+        dt_dx = dt * (real)config.N_cells_1D / 2.0;
+
+        if (stop_requested != 0) {
+            break;
+        }
+    }
+
+    hierarchy.describe();
+    // the worker threads hand their hardware counts over when they exit
+    engine_owner.reset();
+    write_report(profiler, config, domain);
+}
+
+// The members of config.ensemble_file instead of a single run, see Ensemble.
+static int run_ensemble(const Config &config, Domain &domain, Profiler &profiler) {
+    // one member per grab, they differ in size
+    auto engine_owner = std::make_unique<SweepEngine>(config.N_threads, SCHEDULE_DYNAMIC, 1, config.thread_pinning);
+    std::unique_ptr<Ensemble> ensemble;
+    {
+        ScopedTimer timer(profiler, "ensemble setup");
+        ensemble = std::make_unique<Ensemble>(config, *engine_owner);
+    }
+    std::cout << "Ensemble of " << ensemble->get_N_members() << " members from " << config.ensemble_file << "\n";
+    const bool stable = ensemble->run(*engine_owner, profiler, stop_requested);
+
+    // the worker threads hand their hardware counts over when they exit
+    engine_owner.reset();
+    write_report(profiler, config, domain);
+    return stable ? 0 : 1;
+}
 
 int main(int argc, char **argv) {
     std::cout << std::scientific;
 
-    auto grid = std::make_unique<Grid>(DIMENSION, N_CELLS_1D);
+    // parameter file and command line, see Config
+    const Config config(argc, argv);
 
+    // every rank owns a block of the grid, a single block without WITH_MPI
+    auto domain = std::make_unique<Domain>(&argc, &argv, config.dimension, config.N_cells_1D);
 
-    auto coordinates_conservation = std::make_unique<ConservedCoordinates>();
-    auto mass_conservation = std::make_unique<ConservedDensity>();
-    auto momentum_conservation = std::make_unique<ConservedMomentum>();
-    auto energy_conservation = std::make_unique<ConservedEnergy>();
-    
-    const real dt_max = (real)DUMP_INTERVAL / 2.;
-    const real dx = 1. / (real)N_CELLS_1D;
-    // use 10% the calculated value, just in case
-    const real CFL_buffer = 0.01;
-    const real CFL_prefactor = CFL_buffer * dx;
+    std::signal(SIGTERM, request_stop);
+    std::signal(SIGUSR1, request_stop);
+
+    // before the SweepEngine, so the hardware counters follow its threads
+    Profiler profiler(config.quiet, config.hardware_counters && domain->is_root(),
+                      !config.report_name.empty() && domain->is_root());
 
-    real dt = CFL_prefactor / grid->get_max_velocity();
-    if (dt > dt_max) {
-        std::cout << "Resetting dt to dt_max of " << dt_max << "\n";
-        dt = dt_max;
+    if (config.amr_max_level > 0) {
+        run_amr(config, *domain, profiler);
+        return 0;
+    }
+    if (!config.ensemble_file.empty()) {
+        return run_ensemble(config, *domain, profiler);
     }
 
-    real current_time = 0.;
-    const real dt_minimum = CFL_prefactor / 100.;
+    // before the grid, whose initial conditions are set on its threads
+    auto engine = std::make_unique<SweepEngine>(config.N_threads, config.schedule, config.chunk_size, config.thread_pinning);
 
-    real dt_dx = dt / (2.0 * dx);
+    // --restart [name] resumes from the checkpoint files name_<rank>.chk
+    IntegrationState state = {};
+    std::unique_ptr<Grid> grid;
+    const uint32_t N_ghost = (config.scheme == SCHEME_GODUNOV) ? N_GHOST_GODUNOV : N_GHOST;
+    if (config.restart) {
+        grid = std::make_unique<Grid>(config.dimension, config.N_cells_1D, domain->get_local_extent(), domain->get_offset(),
+                                      config.checkpoint_name, *domain, state, config.gamma, N_ghost, config.N_scalars,
+                                      config.huge_pages);
+        grid->get_fields().first_touch(*engine);
+        if (domain->is_root()) {
+            std::cout << "Restarting from " << config.checkpoint_name << " at time " << state.current_time << "\n";
+        }
+    } else {
+        ScopedTimer timer(profiler, "initial conditions");
+        const InitialConditions initial_conditions(config.initial_conditions, config.ic_amplitude, config.ic_file);
+        grid = std::make_unique<Grid>(config.dimension, config.N_cells_1D, domain->get_local_extent(), domain->get_offset(),
+                                      initial_conditions, config.gamma, N_ghost, config.N_scalars, engine.get(),
+                                      config.huge_pages);
+    }
+    grid->set_N_dump_buffers(config.N_dump_buffers);
+    grid->set_dump_type(config.dump_type);
 
-    const auto number_of_neighbors = (uint8_t)(2 * DIMENSION);
-    std::vector<std::shared_ptr<Cell>> neighbor_cells(number_of_neighbors);
-    std::vector<std::vector<box_int>> neighbor_coordinates(number_of_neighbors, std::vector<box_int>(DIMENSION));
+#ifdef WITH_SEPARATE_SWEEPS
+    // one sweep per conserved quantity, see EquationSet
+    SeparateSweeps separate_sweeps = make_separate_sweeps(config, engine->get_N_threads());
+    if (config.scheme != SCHEME_CENTERED) {
+        throw std::invalid_argument("The separate sweeps only do the centered scheme.");
+    }
+#else
+    auto fused_update = std::make_unique<SimdUpdate>(grid->get_fields(), config.simd_isa, config.gamma, config.huge_pages);
+    // which rows are swept together, the cells of each row are still updated in order
+    const RowTraversal traversal(grid->get_stencil(), config.traversal, config.tile_size);
+    const uint64_t N_rows = grid->get_stencil().get_N_rows();
+    if (domain->is_root()) {
+        std::cout << "SIMD instruction set: " << fused_update->get_isa_name() << "\n";
+    }
 
-    std::cout << std::endl;
+    // the finite-volume update instead of the centered one, see GodunovUpdate
+    std::unique_ptr<GodunovUpdate> godunov_update;
+    if (config.scheme == SCHEME_GODUNOV) {
+        godunov_update = std::make_unique<GodunovUpdate>(grid->get_fields(), config.gamma, config.integrator,
+                                                         config.slope_limiter, config.riemann_solver);
+        domain->set_exchange_corners(godunov_update->needs_corners());
+        if (domain->is_root()) {
+            std::cout << "Godunov scheme: " << godunov_update->get_name() << "\n";
+        }
+    }
+#endif
 
+    // several steps per pass over the grid while dt is held fixed, see TimeBlocking
+    std::unique_ptr<TimeBlocking> time_blocking;
+#ifndef WITH_SEPARATE_SWEEPS
+    if (config.time_block_depth > 1) {
+        if (domain->get_N_ranks() > 1) {
+            if (domain->is_root()) {
+                std::cout << "Temporal blocking needs a single rank, stepping one step at a time\n";
+            }
+        } else {
+            time_blocking = std::make_unique<TimeBlocking>(grid->get_fields(), config.time_block_depth, config.time_block_width,
+                                                           engine->get_N_threads(), config.simd_isa, config.gamma,
+                                                           config.huge_pages);
+            std::cout << "Temporal blocking: " << config.time_block_depth << " steps in " << time_blocking->get_N_tiles()
+                      << " tiles\n";
+        }
+    }
+#endif
+
+    // quiet blocks step less often, see LocalTimestep
+    std::unique_ptr<LocalTimestep> local_timestep;
+#ifndef WITH_SEPARATE_SWEEPS
+    if (config.local_dt_levels > 0) {
+        if (domain->get_N_ranks() > 1) {
+            if (domain->is_root()) {
+                std::cout << "Local time steps need a single rank, stepping every cell at the global dt\n";
+            }
+        } else {
+            local_timestep = std::make_unique<LocalTimestep>(grid->get_fields(), *fused_update, config.local_dt_levels,
+                                                             config.local_dt_block);
+            local_timestep->set_signal_speeds(*engine);
+            std::cout << "Local time steps: up to " << (1u << config.local_dt_levels) << " times dt in "
+                      << local_timestep->get_N_blocks() << " blocks\n";
+        }
+    }
+#endif
+    
+    const real dt_max = (real)config.dump_interval / 2.;
+    const real dx = 1. / (real)config.N_cells_1D;
+    // the centered differences only stay stable far below the CFL limit, the
+    // Godunov update up to about 1 / dimension of it
+    real CFL_number = config.cfl_number;
+    if (CFL_number == 0.) {
+        CFL_number = (config.scheme == SCHEME_GODUNOV) ? 0.8 / (real)config.dimension : 0.01;
+    }
+    const real CFL_prefactor = CFL_number * dx;
+
+    real dt;
+    real current_time = 0.;
+    // a step this short means the signal speed ran away, the run stops instead
+    const real dt_minimum = CFL_prefactor / 100.;
+    real dt_dx;
+    // largest |u| + c_s of the state about to be stepped, from the last sweep
+    real max_signal_speed;
+    bool unstable = false;
     uint64_t dump_counter = 0;
     real dump_timer = 0.;
-    while (true) {
-        std::cout << "current time: " << current_time << "\ttimestep: " << dt << "\n";
-        std::cout << "\tdensity computation\n";
-        for (auto i = 0; i < grid->get_N_cells_Nd(); i++) {
-            auto current_cell = grid->get_cell(i);
+    uint64_t step = 0;
 
-            grid->get_neighbors(current_cell, neighbor_coordinates, neighbor_cells);
+    if (config.restart) {
+        dt = state.dt;
+        current_time = state.current_time;
+        dump_counter = state.dump_counter;
+        dump_timer = state.dump_timer;
+        step = state.step;
+        // as at the end of a step, so the resumed run matches the original bit for bit
+        dt_dx = dt * (real)config.N_cells_1D / 2.0;
+    } else {
+        ScopedTimer timer(profiler, "CFL reduction");
+        dt = CFL_prefactor / domain->global_max(grid->get_max_signal_speed(*engine));
+        if (dt > dt_max) {
+            if (domain->is_root()) {
+                std::cout << "Resetting dt to dt_max of " << dt_max << "\n";
+            }
+            dt = dt_max;
+        }
+        dt_dx = dt / (2.0 * dx);
+    }
+    if (!(dt >= dt_minimum)) {
+        if (domain->is_root()) {
+            std::cout << "Time step " << dt << " is below dt_minimum of " << dt_minimum << ", stopping\n";
+        }
+        unstable = true;
+    }
+
+    // conservation totals and analyses as the run goes, see Diagnostics
+    std::unique_ptr<Diagnostics> diagnostics;
+    if (config.diagnostics_steps > 0 || config.analysis_steps > 0) {
+        diagnostics = std::make_unique<Diagnostics>(*domain, engine->get_N_threads(), config.dimension, config.N_cells_1D,
+                                                    config.diagnostics_name, config.diagnostics_steps,
+                                                    config.analysis_steps, config.histogram_bins, step);
+    }
 
-            coordinates_conservation->set_initial_state(current_cell);
-            coordinates_conservation->update(current_cell, neighbor_cells, dt_dx);
-            coordinates_conservation->set_final_state(current_cell);
+    if (domain->is_root()) {
+        std::cout << std::endl;
+    }
 
-            mass_conservation->set_initial_state(current_cell);
-            mass_conservation->update(current_cell, neighbor_cells, dt_dx);
-            mass_conservation->set_final_state(current_cell);
+    // Steps of dt, up to N_limit, that can be taken as one: they end with the
+    // last one, so none of the steps before it may reach a dump, a checkpoint
+    // or the end of the run.
+    auto get_N_free_steps = [&](const uint32_t N_limit) {
+        real free_time = current_time;
+        real free_dump_timer = dump_timer;
+        for (uint32_t s = 1; s < N_limit; s++) {
+            free_time += dt;
+            free_dump_timer += dt;
+            if (free_time > config.max_time || free_dump_timer > config.dump_interval ||
+                (config.checkpoint_steps > 0 && (step + s) % config.checkpoint_steps == 0)) {
+                return s;
+            }
         }
+        return N_limit;
+    };
 
-        std::cout << "\tmomentum computation\n";
-        for (auto i = 0; i < grid->get_N_cells_Nd(); i++) {
-            auto current_cell = grid->get_cell(i);
-            grid->get_neighbors(current_cell, neighbor_coordinates, neighbor_cells);
+    // modelled traffic: a pass of the update reads and writes every field of
+    // every cell once, an evolve only swaps the prev and next arrays
+    const uint64_t N_cells = grid->get_stencil().get_N_interior();
+    const uint64_t N_update_bytes = N_cells * grid->get_fields().get_bytes_per_cell();
+    // the centered update also writes the flux of every face, slot and
+    // dimension and reads it back
+    const uint64_t N_face_flux_bytes = N_cells * FusedUpdate::get_face_flux_bytes_per_cell(config.dimension);
 
-            momentum_conservation->set_initial_state(current_cell);
-            momentum_conservation->update(current_cell, neighbor_cells, dt_dx);
-            momentum_conservation->set_final_state(current_cell);
+    while (!unstable) {
+        // a time block holds dt fixed for all of its steps
+        uint32_t N_block_steps = 1;
+        if (time_blocking && get_N_free_steps(time_blocking->get_depth()) == time_blocking->get_depth()) {
+            N_block_steps = time_blocking->get_depth();
         }
 
-        std::cout << "\tenergy and pressure computation\n";
-        for (auto i = 0; i < grid->get_N_cells_Nd(); i++) {
-            auto current_cell = grid->get_cell(i);
-            grid->get_neighbors(current_cell, neighbor_coordinates, neighbor_cells);
-
-            energy_conservation->set_initial_state(current_cell);
-            energy_conservation->update(current_cell, neighbor_cells, dt_dx);
-            energy_conservation->set_final_state(current_cell);
+        const bool verbose = domain->is_root() && !profiler.is_quiet();
+        if (verbose) {
+            std::cout << "current time: " << current_time << "\ttimestep: " << dt << "\n";
         }
+        // one per thread when the sweep of this step adds the diagnostic totals
+        DiagnosticTotals *diagnostic_totals = nullptr;
+        if (N_block_steps > 1) {
+            if (verbose) {
+                std::cout << "\ttime block of " << N_block_steps << " steps\n";
+            }
+            {
+                ScopedTimer timer(profiler, "halo exchange");
+                domain->exchange_halos(grid->get_fields());
+            }
+            {
+                ScopedTimer timer(profiler, "time block");
+                max_signal_speed = time_blocking->advance(*engine, dt_dx);
+            }
+            {
+                ScopedTimer timer(profiler, "evolve");
+                grid->evolve();
+            }
+            // all the steps of the block in one pass over the grid
+            profiler.count(N_block_steps * N_cells, N_update_bytes);
+            // the steps before the last one, which is accounted for below
+            for (uint32_t s = 1; s < N_block_steps; s++) {
+                current_time += dt;
+                dump_timer += dt;
+                step++;
+            }
+        } else if (local_timestep) {
+            // a cycle of 2^level steps of dt for the largest level allowed
+            const uint32_t N_free_steps = get_N_free_steps(1u << config.local_dt_levels);
+            uint8_t max_cycle_level = 0;
+            while ((2u << max_cycle_level) <= N_free_steps) {
+                max_cycle_level++;
+            }
+            const uint32_t N_substeps = local_timestep->plan(dt, dt_max, CFL_prefactor, max_cycle_level);
+            if (!profiler.is_quiet()) {
+                local_timestep->describe_cycle();
+            }
+            {
+                ScopedTimer timer(profiler, "halo exchange");
+                domain->exchange_halos(grid->get_fields());
+            }
+            const uint64_t N_cell_updates_before = local_timestep->get_N_cell_updates();
+            {
+                ScopedTimer timer(profiler, "local time steps");
+                max_signal_speed = local_timestep->advance(*engine, dt_dx);
+            }
+            const uint64_t N_cycle_cell_updates = local_timestep->get_N_cell_updates() - N_cell_updates_before;
+            profiler.count(N_cycle_cell_updates, N_cycle_cell_updates * (grid->get_fields().get_bytes_per_cell()
+                                                                         + FusedUpdate::get_face_flux_bytes_per_cell(config.dimension)));
+            for (uint32_t s = 1; s < N_substeps; s++) {
+                current_time += dt;
+                dump_timer += dt;
+                step++;
+            }
+        } else {
+#ifdef WITH_SEPARATE_SWEEPS
+            {
+                ScopedTimer timer(profiler, "halo exchange");
+                domain->exchange_halos(grid->get_fields());
+            }
+
+            // the neighbor gather is part of every quantity's sweep
+            std::visit([&](auto &equations) {
+                equations.update(grid->get_fields(), *engine, dt_dx, profiler);
+            }, separate_sweeps);
+            profiler.count(N_cells, (config.N_scalars > 0 ? 4 : 3) * N_update_bytes + N_face_flux_bytes);
+#else
+            if (diagnostics) {
+                diagnostic_totals = diagnostics->begin_step(step + 1);
+            }
+            if (godunov_update) {
+                if (verbose) {
+                    std::cout << "\tGodunov flux computation\n";
+                }
+                // every stage after the first starts from the one before it; the
+                // flux sweeps need all the ghosts first
+                for (uint8_t stage = 0; stage < godunov_update->get_N_stages(); stage++) {
+                    if (stage > 0) {
+                        ScopedTimer timer(profiler, "evolve");
+                        grid->evolve();
+                    }
+                    godunov_update->set_stage(stage);
+                    {
+                        ScopedTimer timer(profiler, "halo exchange");
+                        domain->exchange_halos(grid->get_fields());
+                    }
+                    ScopedTimer timer(profiler, "Godunov update");
+                    const bool last_stage = stage + 1 == godunov_update->get_N_stages();
+                    max_signal_speed = godunov_update->update(*engine, traversal, dt_dx, last_stage ? diagnostic_totals : nullptr);
+                }
+                profiler.count(N_cells, godunov_update->get_N_stages() * N_update_bytes);
+            } else {
+                if (verbose) {
+                    std::cout << "\tfused density, momentum, energy and pressure computation\n";
+                }
+                // the fluxes through the faces that read no ghosts are solved while
+                // the halos are in flight, the others once they are in, then the
+                // cells are updated from them; the update sweep also reduces the
+                // signal speed of the next values, per thread
+                std::vector<real> thread_max_signal_speeds(engine->get_N_threads(), 0.);
+                const uint32_t halo_phase = profiler.get_phase("halo exchange");
+                const uint32_t update_phase = profiler.get_phase("fused update");
+                {
+                    ScopedTimer timer(profiler, halo_phase);
+                    domain->begin_halo_exchange(grid->get_fields());
+                }
+                {
+                    ScopedTimer timer(profiler, update_phase);
+                    engine->parallel_for(N_rows, [&](const uint64_t k_begin, const uint64_t k_end, const uint32_t thread) {
+                        fused_update->flux_rows(traversal, k_begin, k_end, true);
+                    });
+                }
+                {
+                    ScopedTimer timer(profiler, halo_phase);
+                    domain->finish_halo_exchange(grid->get_fields());
+                }
+                {
+                    ScopedTimer timer(profiler, update_phase);
+                    engine->parallel_for(N_rows, [&](const uint64_t k_begin, const uint64_t k_end, const uint32_t thread) {
+                        fused_update->flux_rows(traversal, k_begin, k_end, false);
+                    });
+                    engine->parallel_for(N_rows, [&](const uint64_t k_begin, const uint64_t k_end, const uint32_t thread) {
+                        thread_max_signal_speeds[thread] = std::max(thread_max_signal_speeds[thread],
+                            fused_update->update_rows(traversal, k_begin, k_end, dt_dx,
+                                                      diagnostic_totals ? diagnostic_totals + thread : nullptr));
+                    });
+                }
+                max_signal_speed = *std::max_element(thread_max_signal_speeds.begin(), thread_max_signal_speeds.end());
+                profiler.count(N_cells, N_update_bytes + N_face_flux_bytes);
+            }
+#endif
 
-        std::cout << "\tevolve values to the next step\n";
-        // after entire initial pass, we update the previous values with the next values
-        for (auto i = 0; i < grid->get_N_cells_Nd(); i++) {
-            grid->get_cell(i)->evolve();
+            if (verbose) {
+                std::cout << "\tevolve values to the next step\n";
+            }
+            // after entire initial pass, we update the previous values with the next values
+            {
+                ScopedTimer timer(profiler, "evolve");
+                grid->evolve();
+            }
+#ifdef WITH_SEPARATE_SWEEPS
+            {
+                ScopedTimer timer(profiler, "CFL reduction");
+                max_signal_speed = grid->get_max_signal_speed(*engine);
+            }
+#endif
         }
 
         current_time += dt;
-        if (current_time > MAX_TIME) {
+        if (diagnostics) {
+            ScopedTimer timer(profiler, "diagnostics");
+            diagnostics->end_step(grid->get_fields(), *engine, step + 1, current_time, diagnostic_totals != nullptr);
+        }
+        profiler.end_step(step + 1, current_time, dt);
+        if (unstable) {
+            break;
+        }
+        if (current_time > config.max_time) {
             break;
         }
 
         dump_timer += dt;
-        if (dump_timer > DUMP_INTERVAL) {
-            std::cout << "DUMP" << "\n";
-            std::cout << std::to_string(dump_counter) << "\n\n";
-            grid->save_cells(dump_counter);
+        if (dump_timer > config.dump_interval) {
+            ScopedTimer timer(profiler, "dump");
+            if (domain->is_root()) {
+                std::cout << "DUMP" << "\n";
+                std::cout << std::to_string(dump_counter) << "\n";
+                if (profiler.is_quiet()) {
+                    profiler.print_progress(step + 1, current_time);
+                }
+                std::cout << "\n";
+            }
+            grid->save_cells(dump_counter, current_time, *domain);
             dump_timer = 0.;
             dump_counter++;
         }
 
-        dt = CFL_prefactor / grid->get_max_velocity();
+        {
+            ScopedTimer timer(profiler, "CFL reduction");
+            dt = CFL_prefactor / domain->global_max(max_signal_speed);
+        }
         if (dt > dt_max) {
             dt = dt_max;
         }
 
-        if (dt < dt_minimum) {
-            dt = dt_minimum;
+        // refused rather than clamped, a clamped step would be unstable
+        if (!(dt >= dt_minimum)) {
+            if (domain->is_root()) {
+                std::cout << "Time step " << dt << " is below dt_minimum of " << dt_minimum << ", stopping\n";
+            }
+            unstable = true;
+            break;
+        }
+
+        dt_dx = dt * (real)config.N_cells_1D / 2.0;
+        step++;
+
+        const bool stopping = domain->any(stop_requested != 0);
+        if (stopping || (config.checkpoint_steps > 0 && step % config.checkpoint_steps == 0)) {
+            ScopedTimer timer(profiler, "checkpoint");
+            grid->save_checkpoint(config.checkpoint_name, *domain, {current_time, dt, dump_counter, dump_timer, step});
+            if (domain->is_root()) {
+                std::cout << "CHECKPOINT at step " << step << "\n";
+            }
         }
+        if (stopping) {
+            break;
+        }
+    }
 
-        dt_dx = dt * (real)N_CELLS_1D / 2.0;
+    if (local_timestep) {
+        local_timestep->describe();
     }
 
+    // the last snapshots may still be in the background writer
+    {
+        ScopedTimer timer(profiler, "dump");
+        grid->flush_cells();
+    }
+    if (domain->is_root()) {
+        add_numa_nodes(profiler, grid->get_fields(), *engine);
+    }
+    // the worker threads hand their hardware counts over when they exit
+    engine.reset();
+    write_report(profiler, config, *domain);
+
 #ifdef DEBUG
-    grid->print_cells();
+    // one rank at a time
+    for (int r = 0; r < domain->get_N_ranks(); r++) {
+        if (r == domain->get_rank()) {
+            grid->print_cells();
+            std::cout << std::flush;
+        }
+        domain->barrier();
+    }
 #endif
-}
\ No newline at end of file
+
+    return unstable ? 1 : 0;
+}
@@ -1,21 +1,59 @@
 #ifndef MAIN_HPP
 #define MAIN_HPP
 
+// real is the type the fields are stored in, compute_real the type the
+// kernels do their arithmetic in: double with WITH_DOUBLE, float fields with
+// double arithmetic with WITH_DOUBLE_COMPUTE, float otherwise
 #ifdef WITH_DOUBLE
 typedef double real;
 #else
 typedef float real;
 #endif
 
+#if defined(WITH_DOUBLE) || defined(WITH_DOUBLE_COMPUTE)
+typedef double compute_real;
+#else
+typedef float compute_real;
+#endif
+
+// value as it reads back once stored in a field, value itself unless
+// WITH_DOUBLE_COMPUTE
+static inline compute_real as_stored(const compute_real value) {
+    return (real)value;
+}
+
 #ifdef WITH_BOX_INT32
 typedef int32_t box_int;
 #else
 typedef int64_t box_int;
 #endif
 
+// The macros below are the defaults of the run parameters; every one of them
+// can be changed at run time, see Config.
+
+// initial conditions, by number or name: IC_UNIFORM_FLOW (0), IC_SINE_SHEAR
+// (1), IC_KELVIN_HELMHOLTZ (2), IC_SOD (3), IC_SEDOV (4), IC_GRESHO (5) or
+// IC_SNAPSHOT (6), the fields of the snapshot IC_FILE. IC_AMPLITUDE scales the
+// flow of the setup. See InitialConditions.hpp
+#ifndef ICS
 #define ICS 1
+#endif
+
+#ifndef IC_AMPLITUDE
+#define IC_AMPLITUDE 1.0
+#endif
+
+#ifndef IC_FILE
+#define IC_FILE ""
+#endif
+
+#ifndef MAX_TIME
 #define MAX_TIME 1.0
+#endif
+
+#ifndef DUMP_INTERVAL
 #define DUMP_INTERVAL 0.1
+#endif
 
 #ifndef DIMENSION
 #define DIMENSION 2
@@ -25,7 +63,204 @@ typedef int64_t box_int;
 #define N_CELLS_1D 64
 #endif
 
+// 0 uses every hardware thread
+#ifndef N_THREADS
+#define N_THREADS 0
+#endif
+
+// SCHEDULE_STATIC (0) or SCHEDULE_DYNAMIC (1), CHUNK_SIZE is in rows
+#ifndef SCHEDULE
+#define SCHEDULE 0
+#endif
+
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE 4
+#endif
+
+// PINNING_NONE (0), PINNING_COMPACT (1) or PINNING_SPREAD (2) over the NUMA
+// nodes, see SweepEngine.hpp
+#ifndef THREAD_PINNING
+#define THREAD_PINNING 0
+#endif
+
+// pages of the field arrays: HUGE_PAGES_NONE (0), HUGE_PAGES_TRANSPARENT (1)
+// or HUGE_PAGES_EXPLICIT (2), see NumaArena.hpp
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 1
+#endif
+
+// SIMD_AUTO (0) picks the widest instruction set the CPU supports at run time,
+// see SimdUpdate.hpp for the others
+#ifndef SIMD_ISA
+#define SIMD_ISA 0
+#endif
+
+// order of the rows in the sweeps: ORDERING_ROW_MAJOR (0), ORDERING_TILED (1)
+// with bands of TILE_SIZE rows, ORDERING_MORTON (2) or ORDERING_HILBERT (3),
+// see CellOrdering.hpp
+#ifndef TRAVERSAL
+#define TRAVERSAL 0
+#endif
+
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+
+// SCHEME_CENTERED (0), the centered fluxes, or SCHEME_GODUNOV (1), the
+// finite-volume update with INTEGRATOR_MUSCL_HANCOCK (0) or INTEGRATOR_SSP_RK2
+// (1), slopes limited by LIMITER_MINMOD (0), LIMITER_MC (1) or LIMITER_VAN_LEER
+// (2) and RIEMANN_HLL (0) or RIEMANN_HLLC (1) fluxes, see GodunovUpdate.hpp.
+// dt is CFL_NUMBER * dx over the largest |u| + c_s; 0 takes the scheme's
+// default, 0.01 for the centered differences and 0.8 / dimension for Godunov.
+#ifndef SCHEME
+#define SCHEME 0
+#endif
+
+#ifndef INTEGRATOR
+#define INTEGRATOR 0
+#endif
+
+#ifndef SLOPE_LIMITER
+#define SLOPE_LIMITER 1
+#endif
+
+#ifndef RIEMANN_SOLVER
+#define RIEMANN_SOLVER 1
+#endif
+
+#ifndef CFL_NUMBER
+#define CFL_NUMBER 0
+#endif
+
+// passive scalars advected with the flow by the centered update, scalar k
+// starts as 1 in slab k of N_SCALARS + 1 slabs along dimension 1. See
+// PassiveScalars in ConservedQuantity.hpp
+#ifndef N_SCALARS
+#define N_SCALARS 0
+#endif
+
+// steps advanced per pass over the grid by temporal blocking, in tiles of
+// TIME_BLOCK_WIDTH cells along every dimension but the first; 1 = plain
+// stepping. See TimeBlocking.hpp
+#ifndef TIME_BLOCK_DEPTH
+#define TIME_BLOCK_DEPTH 1
+#endif
+
+#ifndef TIME_BLOCK_WIDTH
+#define TIME_BLOCK_WIDTH 32
+#endif
+
+// hierarchical local time steps: blocks of LOCAL_DT_BLOCK planes along the
+// last dimension step by up to 2^LOCAL_DT_LEVELS times the global dt where
+// their signal speed allows it; 0 = every cell steps at the global dt. See
+// LocalTimestep.hpp
+#ifndef LOCAL_DT_LEVELS
+#define LOCAL_DT_LEVELS 0
+#endif
+
+#ifndef LOCAL_DT_BLOCK
+#define LOCAL_DT_BLOCK 8
+#endif
+
+// block-structured AMR with up to AMR_MAX_LEVEL levels of refinement over the
+// N_CELLS_1D base grid, in blocks of AMR_BLOCK_SIZE cells across; 0 = uniform
+// grid. Blocks are refined above AMR_REFINE_THRESHOLD and merged below
+// AMR_DEREFINE_THRESHOLD every AMR_REGRID_STEPS steps, see AmrHierarchy.hpp
+#ifndef AMR_MAX_LEVEL
+#define AMR_MAX_LEVEL 0
+#endif
+
+#ifndef AMR_BLOCK_SIZE
+#define AMR_BLOCK_SIZE 16
+#endif
+
+#ifndef AMR_REFINE_THRESHOLD
+#define AMR_REFINE_THRESHOLD 0.8
+#endif
+
+#ifndef AMR_DEREFINE_THRESHOLD
+#define AMR_DEREFINE_THRESHOLD 0.2
+#endif
+
+#ifndef AMR_REGRID_STEPS
+#define AMR_REGRID_STEPS 4
+#endif
+
+// snapshots waiting for the background writer, each a copy of every field;
+// 0 writes them synchronously
+#ifndef N_DUMP_BUFFERS
+#define N_DUMP_BUFFERS 2
+#endif
+
+// type of the values in the snapshots: SNAPSHOT_FLOAT32 (0), SNAPSHOT_FLOAT64
+// (1), SNAPSHOT_FLOAT16 (2) or SNAPSHOT_BFLOAT16 (3), by default that of real,
+// see Snapshot.hpp
+#ifndef DUMP_TYPE
+#define DUMP_TYPE SNAPSHOT_REAL
+#endif
+
+// write a checkpoint every CHECKPOINT_STEPS steps; 0 writes one only when the
+// job is told to stop (SIGTERM or SIGUSR1). Resume with --restart.
+#ifndef CHECKPOINT_STEPS
+#define CHECKPOINT_STEPS 0
+#endif
+
+#ifndef CHECKPOINT_NAME
+#define CHECKPOINT_NAME "checkpoint"
+#endif
+
+// QUIET = 1 leaves out the per-step prints and prints the throughput at every
+// dump instead. The phase timings and per-step counters go to REPORT_NAME at
+// the end of the run, with the cycle, instruction and cache counters of
+// perf_event if HARDWARE_COUNTERS = 1; empty, the default, writes no report.
+// See Profiler.hpp
+#ifndef QUIET
+#define QUIET 0
+#endif
+
+#ifndef REPORT_NAME
+#define REPORT_NAME ""
+#endif
+
+#ifndef HARDWARE_COUNTERS
+#define HARDWARE_COUNTERS 0
+#endif
+
+// in-situ diagnostics to DIAGNOSTICS_NAME: the conservation totals and extrema
+// every DIAGNOSTICS_STEPS steps, the kinetic energy spectrum and a density
+// histogram of HISTOGRAM_BINS bins every ANALYSIS_STEPS steps; 0 = never. See
+// Diagnostics.hpp
+#ifndef DIAGNOSTICS_STEPS
+#define DIAGNOSTICS_STEPS 0
+#endif
+
+#ifndef ANALYSIS_STEPS
+#define ANALYSIS_STEPS 0
+#endif
+
+#ifndef HISTOGRAM_BINS
+#define HISTOGRAM_BINS 64
+#endif
+
+#ifndef DIAGNOSTICS_NAME
+#define DIAGNOSTICS_NAME "diagnostics.dat"
+#endif
+
+// a file of runs to advance together in this process, one per line with the
+// parameters it changes; empty = a single run. See Ensemble.hpp
+#ifndef ENSEMBLE_FILE
+#define ENSEMBLE_FILE ""
+#endif
+
+// step the centered members of an ensemble that share a grid shape together,
+// one per vector lane, see InterleavedUpdate; 0 = each member on its own
+#ifndef ENSEMBLE_INTERLEAVE
+#define ENSEMBLE_INTERLEAVE 1
+#endif
+
 #define DEBUG
 
+#ifndef GAMMA
 #define GAMMA 5.0 / 3.0
+#endif
 #endif /* MAIN_HPP */
@@ -0,0 +1,92 @@
+// Compares a snapshot against a reference run of the same setup, field by
+// field, and the throughput of the two runs from their run reports. Meant for
+// the precision builds: the reference in double, the test with float fields
+// and double arithmetic (WITH_DOUBLE_COMPUTE) or all float.
+//
+//     cmake -S . -B build_double -DWITH_DOUBLE=ON && cmake --build build_double
+//     cmake -S . -B build_mixed -DWITH_DOUBLE_COMPUTE=ON && cmake --build build_mixed
+//     (cd reference && ../build_double/hydro --max_time 0.1 --report_name run_report.json)
+//     (cd mixed && ../build_mixed/hydro --max_time 0.1 --report_name run_report.json)
+//     ./compare_snapshots reference/snapshot_9.bin mixed/snapshot_9.bin reference/run_report.json mixed/run_report.json
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../main.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+// the run-wide "cell_updates_per_second" of a run report, 0 if there is none
+static double read_cell_updates_per_second(const std::string &report_name) {
+    std::ifstream report(report_name);
+    std::stringstream contents;
+    contents << report.rdbuf();
+    const std::string key = "\"cell_updates_per_second\":";
+    const size_t position = contents.str().find(key);
+    if (position == std::string::npos) {
+        return 0.;
+    }
+    return std::stod(contents.str().substr(position + key.size()));
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 5) {
+        std::cout << "usage: " << argv[0] << " reference.bin test.bin [reference_report.json test_report.json]\n";
+        return 1;
+    }
+
+    const SnapshotReader reference(argv[1]);
+    const SnapshotReader test(argv[2]);
+    const SnapshotHeader &reference_header = reference.get_header();
+    const SnapshotHeader &test_header = test.get_header();
+    if (reference_header.dimension != test_header.dimension || reference_header.N_cells_1D != test_header.N_cells_1D) {
+        std::cout << argv[1] << " and " << argv[2] << " are not of the same box\n";
+        return 1;
+    }
+    if (reference_header.time != test_header.time) {
+        std::cout << "warning: the snapshots are at time " << reference_header.time << " and " << test_header.time << "\n";
+    }
+
+    // the relative L1 error is sum |test - reference| / sum |reference|
+    const uint64_t N_cells = reference_header.get_N_cells();
+    std::vector<double> reference_values(N_cells);
+    std::vector<double> test_values(N_cells);
+    std::cout << "field            max abs error    relative L1 error\n";
+    for (uint32_t f = 0; f < reference_header.N_fields; f++) {
+        const std::string name = reference_header.get_field_name(f);
+        const int test_field = test.find_field(name);
+        if (test_field < 0) {
+            std::cout << "no field " << name << " in " << argv[2] << "\n";
+            continue;
+        }
+        reference.read_converted(f, 0, N_cells, reference_values.data());
+        test.read_converted((uint32_t)test_field, 0, N_cells, test_values.data());
+
+        double max_error = 0.;
+        double sum_error = 0.;
+        double sum_reference = 0.;
+        for (uint64_t i = 0; i < N_cells; i++) {
+            const double error = std::fabs(test_values[i] - reference_values[i]);
+            max_error = std::max(max_error, error);
+            sum_error += error;
+            sum_reference += std::fabs(reference_values[i]);
+        }
+        std::cout << std::left << std::setw(17) << name << std::scientific << max_error << "     "
+                  << (sum_reference > 0. ? sum_error / sum_reference : 0.) << std::defaultfloat << "\n";
+    }
+
+    if (argc == 5) {
+        const double reference_rate = read_cell_updates_per_second(argv[3]);
+        const double test_rate = read_cell_updates_per_second(argv[4]);
+        std::cout << "cell updates per second: " << reference_rate << " reference, " << test_rate << " test";
+        if (reference_rate > 0.) {
+            std::cout << ", " << test_rate / reference_rate << "x";
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+// Converts binary snapshots back to the text dumps the code used to write, one
+// <field>_grid_<dump_counter>.dat per field with lines of x,y,...,value. The
+// leaf blocks of an AMR run, amr_snapshot_N.bin, go to <field>_amr_<dump_counter>.dat
+// with lines of x,y,...,level,value, x the lower corner of the cell.
+//
+//     g++ -O2 -std=c++17 tools/snapshot_to_text.cpp -o snapshot_to_text
+//     ./snapshot_to_text snapshot_3.bin [field ...]
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../main.hpp"
+#include "../Snapshot/Snapshot.hpp"
+
+template <typename T>
+static void write_text_field(const SnapshotReader &reader, const uint32_t field) {
+    const SnapshotHeader &header = reader.get_header();
+    const uint64_t N_cells = header.get_N_cells();
+    std::vector<T> values(N_cells);
+    reader.read_converted(field, 0, N_cells, values.data());
+
+    const std::string file_name = header.get_field_name(field) + "_grid_" + std::to_string(header.dump_counter) + ".dat";
+    std::ofstream file(file_name);
+    for (uint64_t i = 0; i < N_cells; i++) {
+        uint64_t next = i;
+        for (uint32_t d = 0; d < header.dimension; d++) {
+            file << (T)(next % header.N_cells_1D) / (T)header.N_cells_1D << ",";
+            next /= header.N_cells_1D;
+        }
+        file << values[i] << "\n";
+    }
+    file.close();
+
+    std::cout << "wrote " << file_name << "\n";
+}
+
+template <typename T>
+static void write_amr_text_field(const int file, const AmrSnapshotHeader &header,
+                                 const std::vector<AmrSnapshotBlock> &table, const uint32_t field) {
+    const SnapshotHeader &snapshot = header.snapshot;
+    const uint64_t N_block_cells = header.get_N_block_cells();
+    std::vector<char> bytes(N_block_cells * snapshot.real_bytes);
+    std::vector<T> values(N_block_cells);
+
+    const std::string file_name = snapshot.get_field_name(field) + "_amr_" + std::to_string(snapshot.dump_counter) + ".dat";
+    std::ofstream text(file_name);
+    for (uint64_t b = 0; b < header.N_blocks; b++) {
+        if (pread(file, bytes.data(), bytes.size(), header.get_field_offset(b, field)) != (ssize_t)bytes.size()) {
+            throw std::runtime_error("Could not read block " + std::to_string(b) + " of " + snapshot.get_field_name(field) + ".");
+        }
+        SnapshotValues::decode(bytes.data(), N_block_cells, snapshot.real_type, values.data());
+        const T N_cells_level = (T)((uint64_t)snapshot.N_cells_1D << table[b].level);
+        for (uint64_t i = 0; i < N_block_cells; i++) {
+            uint64_t next = i;
+            for (uint32_t d = 0; d < snapshot.dimension; d++) {
+                text << (T)(table[b].position[d] * header.block_size + next % header.block_size) / N_cells_level << ",";
+                next /= header.block_size;
+            }
+            text << table[b].level << "," << values[i] << "\n";
+        }
+    }
+    text.close();
+
+    std::cout << "wrote " << file_name << "\n";
+}
+
+// the leaf blocks of an AMR run, see AmrSnapshotHeader
+static int write_amr_text(const char *file_name, const std::vector<std::string> &names) {
+    const int file = open(file_name, O_RDONLY);
+    AmrSnapshotHeader header;
+    if (file < 0 || pread(file, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.snapshot.version != SNAPSHOT_VERSION) {
+        std::cout << "could not read " << file_name << "\n";
+        return 1;
+    }
+    std::vector<AmrSnapshotBlock> table(header.N_blocks);
+    if (pread(file, table.data(), table.size() * sizeof(AmrSnapshotBlock), header.block_table_offset)
+        != (ssize_t)(table.size() * sizeof(AmrSnapshotBlock))) {
+        std::cout << "could not read the block table of " << file_name << "\n";
+        return 1;
+    }
+    std::cout << "dimension " << header.snapshot.dimension << ", N_cells_1D " << header.snapshot.N_cells_1D
+              << ", " << header.N_blocks << " blocks of " << header.block_size << " cells on " << header.N_levels
+              << " levels, time " << header.snapshot.time << ", dump " << header.snapshot.dump_counter << "\n";
+
+    for (uint32_t f = 0; f < header.snapshot.N_fields; f++) {
+        bool selected = names.empty();
+        for (const std::string &name : names) {
+            selected = selected || name == header.snapshot.get_field_name(f);
+        }
+        if (!selected) {
+            continue;
+        }
+        if (header.snapshot.real_type == SNAPSHOT_FLOAT64) {
+            write_amr_text_field<double>(file, header, table, f);
+        } else {
+            write_amr_text_field<float>(file, header, table, f);
+        }
+    }
+    close(file);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "usage: " << argv[0] << " snapshot.bin [field ...]\n";
+        return 1;
+    }
+
+    char magic[8] = {};
+    std::ifstream probe(argv[1], std::ios::binary);
+    probe.read(magic, sizeof(magic));
+    if (std::memcmp(magic, AMR_SNAPSHOT_MAGIC, sizeof(magic)) == 0) {
+        return write_amr_text(argv[1], std::vector<std::string>(argv + 2, argv + argc));
+    }
+
+    SnapshotReader reader(argv[1]);
+    const SnapshotHeader &header = reader.get_header();
+    std::cout << "dimension " << header.dimension << ", N_cells_1D " << header.N_cells_1D
+              << ", time " << header.time << ", dump " << header.dump_counter << "\n";
+
+    std::vector<uint32_t> selected;
+    for (int a = 2; a < argc; a++) {
+        const int field = reader.find_field(argv[a]);
+        if (field < 0) {
+            std::cout << "no field " << argv[a] << " in " << argv[1] << "\n";
+            return 1;
+        }
+        selected.push_back((uint32_t)field);
+    }
+    if (selected.empty()) {
+        for (uint32_t f = 0; f < header.N_fields; f++) {
+            selected.push_back(f);
+        }
+    }
+
+    // the 16-bit types print as float
+    for (const uint32_t field : selected) {
+        if (header.real_type == SNAPSHOT_FLOAT64) {
+            write_text_field<double>(reader, field);
+        } else {
+            write_text_field<float>(reader, field);
+        }
+    }
+
+    return 0;
+}